@@ -0,0 +1,234 @@
+/*
+ * The MIT License
+ *
+ * Copyright 2017 Nick Ong <onichola@gmail.com>.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+/*
+ * File:   adcstream.c
+ * Author: Nick Ong <onichola@gmail.com>
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "adcstream.h"
+#include "debug.h"
+#include "metrics.h"
+#include "mqtt.h"
+
+typedef struct {
+    int active; // thread running
+    int stop; // set to end the thread
+    pthread_t thread;
+    char id[64];
+    char topic[MQTT_MAXTOPIC];
+    ADS1X15_channel_t ch;
+    double lsb;
+    int rate;
+    int block;
+    void *context;
+    metric_t *errors; // per-stream metrics, resolved once at start
+    metric_t *overruns;
+    metric_t *dropped;
+    metric_t *frames;
+    uint32_t blocks; // blocks completed, dropped ones included
+    int16_t buf[ADCSTREAM_BUFFERS][ADCSTREAM_MAXBLOCK];
+    int64_t start[ADCSTREAM_BUFFERS]; // wall clock microseconds of the first sample
+    uint32_t seq[ADCSTREAM_BUFFERS]; // sequence number of the block
+    int full[ADCSTREAM_BUFFERS]; // 1 from the block completing until it is published
+} stream_t;
+
+static stream_t streams[ADCSTREAM_MAX];
+
+static void
+sleepUntil(double t) {
+    struct timespec ts;
+    double d = t - metrics_now();
+
+    if (d <= 0) return;
+    ts.tv_sec = (time_t) d;
+    ts.tv_nsec = (long) ((d - ts.tv_sec) * 1e9);
+    nanosleep(&ts, NULL);
+}
+
+/**
+ * Sample a channel at its rate into the buffer being filled, handing each
+ * full block over to adcstream_publish.  A block is dropped if the other
+ * buffer has not been published yet, or if a sample was missed.
+ */
+static void *
+sampler(void *arg) {
+    stream_t *s = (stream_t *) arg;
+    double period = 1.0 / s->rate;
+    double next = metrics_now();
+    int w = 0;
+    int n = 0;
+
+    while (!__atomic_load_n(&s->stop, __ATOMIC_ACQUIRE)) {
+	sleepUntil(next);
+	if (n == 0) s->start[w] = mqttTimeUs();
+	if (ADS1X15_burst(&s->ch, &s->buf[w][n], 1) != 1) {
+	    metrics_add(s->errors, 1);
+	    n = 0;
+	    next = metrics_now() + period;
+	    continue;
+	}
+	next += period;
+	if (metrics_now() > next + period) {
+	    // a sample time went by unread, the block is no longer contiguous
+	    metrics_add(s->overruns, 1);
+	    n = 0;
+	    next = metrics_now();
+	    continue;
+	}
+	if (++n < s->block) continue;
+	n = 0;
+	s->seq[w] = s->blocks++;
+	if (__atomic_load_n(&s->full[(w + 1) % ADCSTREAM_BUFFERS], __ATOMIC_ACQUIRE)) {
+	    metrics_add(s->dropped, 1);
+	    continue;
+	}
+	__atomic_store_n(&s->full[w], 1, __ATOMIC_RELEASE);
+	w = (w + 1) % ADCSTREAM_BUFFERS;
+	mqttWake(s->context);
+    }
+    return NULL;
+}
+
+int
+adcstream_start(const char *id, const char *topic, const ADS1X15_channel_t *ch,
+	double lsb, int rate, int block, void *context) {
+    stream_t *s = NULL;
+    int i;
+
+    for (i = 0; i < ADCSTREAM_MAX && s == NULL; i++) {
+	if (!streams[i].active) s = &streams[i];
+    }
+    if (s == NULL || rate <= 0 || block <= 0) {
+	DBGLOG(DBG_TEMPSENSOR, DBG_ERROR, "adcstream: Cannot stream %s", id);
+	return ADCSTREAM_FAILURE;
+    }
+    memset(s, 0, sizeof (stream_t));
+    strncpy(s->id, id, sizeof (s->id) - 1);
+    strncpy(s->topic, topic, sizeof (s->topic) - 1);
+    s->ch = *ch;
+    s->lsb = lsb;
+    s->rate = rate;
+    s->block = block > ADCSTREAM_MAXBLOCK ? ADCSTREAM_MAXBLOCK : block;
+    s->context = context;
+    s->errors = metrics_counter("adc_stream_errors_total", s->id);
+    s->overruns = metrics_counter("adc_stream_overruns_total", s->id);
+    s->dropped = metrics_counter("adc_stream_dropped_total", s->id);
+    s->frames = metrics_counter("adc_stream_frames_total", s->id);
+    if (pthread_create(&s->thread, NULL, sampler, s) != 0) {
+	DBGLOG(DBG_TEMPSENSOR, DBG_ERROR, "adcstream: Cannot start the thread of %s", id);
+	return ADCSTREAM_FAILURE;
+    }
+    s->active = 1;
+    DBGLOG(DBG_TEMPSENSOR, DBG_INFO, "adcstream: Streaming %s at %d samples a second in blocks of %d",
+	    id, rate, s->block);
+    return ADCSTREAM_SUCCESS;
+}
+
+void
+adcstream_stopAll(void) {
+    int i;
+
+    for (i = 0; i < ADCSTREAM_MAX; i++) {
+	if (!streams[i].active) continue;
+	__atomic_store_n(&streams[i].stop, 1, __ATOMIC_RELEASE);
+	pthread_join(streams[i].thread, NULL);
+	streams[i].active = 0;
+    }
+}
+
+static uint8_t *
+put(uint8_t *p, uint64_t v, int bytes) {
+    int i;
+
+    for (i = 0; i < bytes; i++) *p++ = (uint8_t) (v >> (8 * i));
+    return p;
+}
+
+/**
+ * Lay a block out as a frame.
+ * @return bytes of the frame
+ */
+static int
+pack(const stream_t *s, int k, uint8_t *frame) {
+    float lsb = (float) s->lsb;
+    uint32_t bits;
+    uint8_t *p = frame;
+    int i;
+
+    memcpy(&bits, &lsb, sizeof (bits));
+    p = put(p, s->seq[k], 4);
+    p = put(p, (uint64_t) s->start[k], 8);
+    p = put(p, (uint64_t) s->rate, 2);
+    p = put(p, (uint64_t) s->block, 2);
+    p = put(p, bits, 4);
+    for (i = 0; i < s->block; i++) p = put(p, (uint16_t) s->buf[k][i], 2);
+    return (int) (p - frame);
+}
+
+int
+adcstream_publish(void *context) {
+    static uint8_t frame[ADCSTREAM_HEADER + 2 * ADCSTREAM_MAXBLOCK];
+    static mqtt_data_t message;
+    my_context_t *c = (my_context_t *) context;
+    stream_t *s;
+    int published = 0;
+    int i, k, oldest;
+
+    for (i = 0; i < ADCSTREAM_MAX; i++) {
+	s = &streams[i];
+	if (!s->active) continue;
+	for (;;) {
+	    for (k = 0, oldest = -1; k < ADCSTREAM_BUFFERS; k++) {
+		if (!__atomic_load_n(&s->full[k], __ATOMIC_ACQUIRE)) continue;
+		if (oldest < 0 || (int32_t) (s->seq[k] - s->seq[oldest]) < 0) oldest = k;
+	    }
+	    if (oldest < 0) break;
+	    // a broker that is behind holds the blocks back, and the sampler
+	    // drops new ones until it catches up
+	    if (c->connected && metrics_value(METRICS_ONCE(gauge, "mqtt_inflight")) >= ADCSTREAM_MAXINFLIGHT) break;
+	    if (c->connected) {
+		memset(&message, 0, sizeof (message));
+		snprintf(message.topic, sizeof (message.topic), "%s", s->topic);
+		strncpy(message.sensor, s->id, sizeof (message.sensor) - 1);
+		message.sampled = s->start[oldest];
+		if (mqttPublishBinary(context, &message, frame, pack(s, oldest, frame)) == MQTT_SUCCESS) {
+		    metrics_add(s->frames, 1);
+		    published++;
+		}
+	    } else {
+		metrics_add(s->dropped, 1);
+	    }
+	    __atomic_store_n(&s->full[oldest], 0, __ATOMIC_RELEASE);
+	}
+    }
+    return published;
+}
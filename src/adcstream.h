@@ -0,0 +1,107 @@
+/*
+ * The MIT License
+ *
+ * Copyright 2017 Nick Ong <onichola@gmail.com>.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+/*
+ * File:   adcstream.h
+ * Author: Nick Ong <onichola@gmail.com>
+ *
+ * Streaming of ADS1115 channels as blocks of contiguous samples.  Each
+ * streamed channel is sampled on a thread of its own into a double buffer,
+ * and the main loop publishes the full blocks as binary frames.  A frame is
+ * little endian:
+ *
+ *   offset  size  field
+ *        0     4  block sequence number, a gap means blocks were dropped
+ *        4     8  wall clock microseconds of the first sample
+ *       12     2  samples a second
+ *       14     2  number of samples
+ *       16     4  volts of one code, IEEE 754 single precision
+ *       20   2*n  signed 16 bit codes
+ */
+
+#ifndef ADCSTREAM_H
+#define ADCSTREAM_H
+
+#include "ads1x15.h"
+
+#ifndef ADCSTREAM_SUCCESS
+#define ADCSTREAM_SUCCESS 0 ///< success indicator
+#endif
+
+#ifndef ADCSTREAM_FAILURE
+#define ADCSTREAM_FAILURE -1 ///< failure indicator
+#endif
+
+#define ADCSTREAM_MAX 4 ///< channels streamed at once, one per chip
+#define ADCSTREAM_MAXBLOCK 1024 ///< most samples in a frame
+#define ADCSTREAM_BUFFERS 2 ///< blocks per channel, one filling while the other waits
+#define ADCSTREAM_HEADER 20 ///< bytes of frame header
+
+#ifndef ADCSTREAM_MAXINFLIGHT
+#define ADCSTREAM_MAXINFLIGHT 32 ///< publishes awaiting PUBACK above which frames are held back
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    /**
+     * \brief Start streaming a channel.  The chip must not be read by anything
+     * else while it streams.
+     * @param id - sensor id, labels the metrics
+     * @param topic - topic suffix the frames are published to
+     * @param ch - channel, its data rate faster than rate
+     * @param lsb - volts of one code at the channel's gain
+     * @param rate - samples a second
+     * @param block - samples in a frame, at most ADCSTREAM_MAXBLOCK
+     * @param context - MQTT context woken when a block is full
+     * @return ADCSTREAM_SUCCESS, ADCSTREAM_FAILURE if no stream is free or
+     * the thread could not be started
+     */
+    extern int adcstream_start(const char *id, const char *topic, const ADS1X15_channel_t *ch,
+	    double lsb, int rate, int block, void *context);
+
+    /**
+     * \brief Stop every stream and wait for their threads.  Blocks not yet
+     * published are discarded.
+     */
+    extern void adcstream_stopAll(void);
+
+    /**
+     * \brief Publish the full blocks, oldest first.  While the broker is
+     * behind by ADCSTREAM_MAXINFLIGHT publishes the blocks are left waiting,
+     * and once both buffers of a channel are waiting new blocks are dropped
+     * and counted in adc_stream_dropped_total.  While disconnected the blocks
+     * are dropped.
+     * @param context - MQTT context
+     * @return number of frames published
+     */
+    extern int adcstream_publish(void *context);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* ADCSTREAM_H */
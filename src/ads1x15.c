@@ -0,0 +1,434 @@
+/*
+ * The MIT License
+ *
+ * Copyright 2017 Nick Ong <onichola@gmail.com>.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+/*
+ * File:   ads1x15.c
+ * Author: Nick Ong <onichola@gmail.com>
+ *
+ * The chips are driven through I2C_RDWR transfers addressed to each chip, so
+ * the bus is shared without I2C_SLAVE calls.  The driver remembers where each
+ * chip's register pointer is and what configuration it last wrote, and leaves
+ * both alone when a sweep does not need them changed.  A chip's lock is held
+ * for the whole of a burst, and a sweep holds every chip it reads until its
+ * last conversion is in, waits included, so nothing on another thread moves
+ * a chip's mux under them.  Chips a sweep does not read are not held.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <wiringPi.h>
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#ifdef HAVE_LINUX_I2C_DEV_H
+#include <sys/ioctl.h>
+#include <linux/i2c.h>
+#include <linux/i2c-dev.h>
+#endif
+
+#include "ads1x15.h"
+#include "debug.h"
+#include "metrics.h"
+
+#define REG_CONVERSION 0
+#define REG_CONFIG 1
+#define REG_LO_THRESH 2
+#define REG_HI_THRESH 3
+
+#define CONFIG_OS 0x8000 ///< starts a single conversion, reads back 1 when idle
+#define CONFIG_MUX(ch) ((0x4 | (ch)) << 12) ///< single ended input
+#define CONFIG_PGA(g) ((g) << 9)
+#define CONFIG_SINGLE 0x0100 ///< single shot mode, continuous when clear
+#define CONFIG_DR(r) ((r) << 5)
+#define CONFIG_RDY 0x0000 ///< comparator asserts ALERT/RDY after each conversion
+#define CONFIG_NORDY 0x0003 ///< comparator off, ALERT/RDY high impedance
+
+#define POLL_US 100 ///< microseconds between polls of a conversion
+
+const double ADS1X15_gain[8] = {6.144, 4.096, 2.048, 1.024, 0.512, 0.256, 0.256, 0.256};
+const int ADS1X15_rate[8] = {8, 16, 32, 64, 128, 250, 475, 860};
+
+typedef struct {
+    int addr; // i2c address
+    int pointer; // register the pointer is at, -1 if unknown
+    uint16_t config; // configuration last written, 0 if unknown
+    int rdypin; // pin ALERT/RDY was set up for, -1 if none
+    double valid; // metrics_now() once a continuous conversion has completed
+    int sweep[ADS1X15_CHANNELS]; // channels of the current sweep, indexes of ch[]
+    int count; // channels in the current sweep
+    pthread_mutex_t busy; // held from configuring the chip until its conversion is read
+} chip_t;
+
+static chip_t chips[ADS1X15_MAXCHIPS];
+static int nchips = 0;
+static int bus = -1;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER; ///< the chip table and each transfer
+static pthread_mutex_t sweepLock = PTHREAD_MUTEX_INITIALIZER; ///< one sweep at a time
+
+int
+ADS1X15_open(void) {
+#ifdef HAVE_LINUX_I2C_DEV_H
+    if (bus >= 0) return ADS1X15_SUCCESS;
+    if ((bus = open(ADS1X15_BUS, O_RDWR | O_CLOEXEC)) < 0) {
+	DBGLOG(DBG_TEMPSENSOR, DBG_ERROR, "ads1x15: Error opening %s: %s", ADS1X15_BUS, strerror(errno));
+	return errno == ENOENT ? ADS1X15_UNAVAILABLE : ADS1X15_FAILURE;
+    }
+    nchips = 0;
+    return ADS1X15_SUCCESS;
+#else
+    return ADS1X15_UNAVAILABLE;
+#endif
+}
+
+void
+ADS1X15_close(void) {
+    if (bus >= 0) close(bus);
+    bus = -1;
+    nchips = 0;
+}
+
+int
+ADS1X15_gainOf(double fsr) {
+    int g;
+
+    for (g = 0; g < 6; g++) {
+	if (fsr > ADS1X15_gain[g] * 0.999 && fsr < ADS1X15_gain[g] * 1.001) return g;
+    }
+    return -1;
+}
+
+int
+ADS1X15_rateOf(int sps) {
+    int r;
+
+    for (r = 0; r < 8; r++) {
+	if (ADS1X15_rate[r] >= sps) return r;
+    }
+    return -1;
+}
+
+/**
+ * Seconds a conversion takes at a rate, allowing for the 10% tolerance of
+ * the internal oscillator and the wake up from power down.
+ */
+static double
+conversionTime(int rate) {
+    return 1.1 / ADS1X15_rate[rate & 7] + 50e-6;
+}
+
+static void
+sleepFor(double seconds) {
+    struct timespec ts;
+
+    if (seconds <= 0) return;
+    ts.tv_sec = (time_t) seconds;
+    ts.tv_nsec = (long) ((seconds - ts.tv_sec) * 1e9);
+    nanosleep(&ts, NULL);
+}
+
+static int
+writeReg(chip_t *c, int reg, uint16_t value) {
+#ifdef HAVE_LINUX_I2C_DEV_H
+    uint8_t buf[3] = {reg, value >> 8, value & 0xff};
+    struct i2c_msg msg = {c->addr, 0, 3, buf};
+    struct i2c_rdwr_ioctl_data data = {&msg, 1};
+
+    int rc;
+
+    metrics_add(METRICS_ONCE(counter, "adc_i2c_transfers_total"), 1);
+    pthread_mutex_lock(&lock);
+    rc = ioctl(bus, I2C_RDWR, &data);
+    pthread_mutex_unlock(&lock);
+    if (rc != 1) {
+	c->pointer = -1;
+	DBGLOG(DBG_TEMPSENSOR, DBG_ERROR, "ads1x15: Error writing register %d of 0x%02x: %s", reg, c->addr, strerror(errno));
+	return ADS1X15_FAILURE;
+    }
+    c->pointer = reg;
+    return ADS1X15_SUCCESS;
+#else
+    return ADS1X15_FAILURE;
+#endif
+}
+
+/**
+ * Read a register, in a single transfer if the pointer is already there.
+ */
+static int
+readReg(chip_t *c, int reg, uint16_t *value) {
+#ifdef HAVE_LINUX_I2C_DEV_H
+    uint8_t r = reg;
+    uint8_t buf[2];
+    struct i2c_msg msgs[2];
+    struct i2c_rdwr_ioctl_data data;
+    int m = 0;
+    int rc;
+
+    if (c->pointer != reg) {
+	msgs[m].addr = c->addr;
+	msgs[m].flags = 0;
+	msgs[m].len = 1;
+	msgs[m++].buf = &r;
+    }
+    msgs[m].addr = c->addr;
+    msgs[m].flags = I2C_M_RD;
+    msgs[m].len = 2;
+    msgs[m++].buf = buf;
+    data.msgs = msgs;
+    data.nmsgs = m;
+    metrics_add(METRICS_ONCE(counter, "adc_i2c_transfers_total"), 1);
+    pthread_mutex_lock(&lock);
+    rc = ioctl(bus, I2C_RDWR, &data);
+    pthread_mutex_unlock(&lock);
+    if (rc != m) {
+	c->pointer = -1;
+	DBGLOG(DBG_TEMPSENSOR, DBG_ERROR, "ads1x15: Error reading register %d of 0x%02x: %s", reg, c->addr, strerror(errno));
+	return ADS1X15_FAILURE;
+    }
+    c->pointer = reg;
+    *value = (uint16_t) (buf[0] << 8 | buf[1]);
+    return ADS1X15_SUCCESS;
+#else
+    return ADS1X15_FAILURE;
+#endif
+}
+
+static chip_t *
+chipOf(int addr) {
+    chip_t *c = NULL;
+    int i;
+
+    pthread_mutex_lock(&lock);
+    for (i = 0; i < nchips; i++) {
+	if (chips[i].addr == addr) c = &chips[i];
+    }
+    if (c == NULL && nchips < ADS1X15_MAXCHIPS) {
+	c = &chips[nchips++];
+	memset(c, 0, sizeof (chip_t));
+	c->addr = addr;
+	c->pointer = -1;
+	c->rdypin = -1;
+	pthread_mutex_init(&c->busy, NULL);
+    }
+    pthread_mutex_unlock(&lock);
+    return c;
+}
+
+/**
+ * Chips in the table, which a stream's thread may add to during a sweep.
+ */
+static int
+chipCount(void) {
+    int n;
+
+    pthread_mutex_lock(&lock);
+    n = nchips;
+    pthread_mutex_unlock(&lock);
+    return n;
+}
+
+/**
+ * Point ALERT/RDY at conversion ready, a high threshold with its top bit set
+ * and a low one with it clear, the first time a pin is given for a chip.
+ */
+static int
+setupRdy(chip_t *c, int rdypin) {
+    if (rdypin < 0 || c->rdypin == rdypin) return ADS1X15_SUCCESS;
+    if (writeReg(c, REG_HI_THRESH, 0x8000) != ADS1X15_SUCCESS ||
+	    writeReg(c, REG_LO_THRESH, 0x0000) != ADS1X15_SUCCESS) return ADS1X15_FAILURE;
+    pinMode(rdypin, INPUT);
+    c->rdypin = rdypin;
+    return ADS1X15_SUCCESS;
+}
+
+static uint16_t
+configOf(const ADS1X15_channel_t *ch, int single) {
+    return CONFIG_MUX(ch->channel & 3) | CONFIG_PGA(ch->gain & 7) | CONFIG_DR(ch->rate & 7) |
+	    (single ? CONFIG_OS | CONFIG_SINGLE : 0) | (ch->rdypin >= 0 ? CONFIG_RDY : CONFIG_NORDY);
+}
+
+/**
+ * Wait for the single conversion started at start to finish, on the
+ * ALERT/RDY pin, which the chip pulls low, or on the OS bit.
+ */
+static int
+waitConversion(chip_t *c, const ADS1X15_channel_t *ch, double start) {
+    double limit = start + conversionTime(ch->rate) + ADS1X15_TIMEOUT * 1e-3;
+    uint16_t config;
+
+    for (;;) {
+	if (ch->rdypin >= 0) {
+	    if (digitalRead(ch->rdypin) == LOW) return ADS1X15_SUCCESS;
+	} else {
+	    if (readReg(c, REG_CONFIG, &config) != ADS1X15_SUCCESS) return ADS1X15_FAILURE;
+	    if (config & CONFIG_OS) return ADS1X15_SUCCESS;
+	}
+	if (metrics_now() > limit) break;
+	sleepFor(POLL_US * 1e-6);
+    }
+    DBGLOG(DBG_TEMPSENSOR, DBG_ERROR, "ads1x15: Conversion on 0x%02x channel %d timed out", c->addr, ch->channel);
+    metrics_add(METRICS_ONCE(counter, "adc_timeouts_total"), 1);
+    return ADS1X15_FAILURE;
+}
+
+static int
+readConversion(chip_t *c, int16_t *code) {
+    uint16_t value;
+
+    if (readReg(c, REG_CONVERSION, &value) != ADS1X15_SUCCESS) return ADS1X15_FAILURE;
+    *code = (int16_t) value;
+    return ADS1X15_SUCCESS;
+}
+
+int
+ADS1X15_burst(const ADS1X15_channel_t *ch, int16_t codes[], int n) {
+    double period = conversionTime(ch->rate);
+    uint16_t config = configOf(ch, 0);
+    chip_t *c;
+    int i = 0;
+
+    if (bus < 0 || (c = chipOf(ch->addr)) == NULL) return 0;
+    pthread_mutex_lock(&c->busy);
+    if (c->config != config) {
+	if (setupRdy(c, ch->rdypin) != ADS1X15_SUCCESS || writeReg(c, REG_CONFIG, config) != ADS1X15_SUCCESS) {
+	    c->config = 0;
+	    pthread_mutex_unlock(&c->busy);
+	    return 0;
+	}
+	c->config = config;
+	c->valid = metrics_now() + period;
+    }
+    for (i = 0; i < n; i++) {
+	sleepFor(c->valid - metrics_now());
+	if (readConversion(c, &codes[i]) != ADS1X15_SUCCESS) break;
+	c->valid = metrics_now() + period;
+    }
+    pthread_mutex_unlock(&c->busy);
+    return i;
+}
+
+int
+ADS1X15_scan(const ADS1X15_channel_t ch[], int n, int16_t codes[], int rcs[]) {
+    double started[ADS1X15_MAXCHIPS];
+    int held[ADS1X15_MAXCHIPS];
+    double start = metrics_now();
+    double wake;
+    int rounds = 0;
+    int rc = ADS1X15_SUCCESS;
+    int used, i, k, r;
+    chip_t *c;
+
+    pthread_mutex_lock(&sweepLock);
+    used = chipCount();
+    for (i = 0; i < used; i++) chips[i].count = 0;
+    for (i = 0; i < n; i++) {
+	codes[i] = 0;
+	rcs[i] = ADS1X15_FAILURE;
+	if (bus < 0 || (c = chipOf(ch[i].addr)) == NULL || c->count == ADS1X15_CHANNELS) {
+	    DBGLOG(DBG_TEMPSENSOR, DBG_ERROR, "ads1x15: Cannot read 0x%02x channel %d", ch[i].addr, ch[i].channel);
+	    rc = ADS1X15_FAILURE;
+	    continue;
+	}
+	c->sweep[c->count++] = i;
+	if (c->count > rounds) rounds = c->count;
+    }
+    // hold every chip swept, in table order, so a burst cannot move its mux
+    used = chipCount();
+    for (k = 0; k < used; k++) {
+	if ((held[k] = chips[k].count > 0)) pthread_mutex_lock(&chips[k].busy);
+    }
+
+    // a chip alone on its channel converts continuously and is read as is
+    for (k = 0; k < used; k++) {
+	const ADS1X15_channel_t *one;
+	uint16_t config;
+
+	c = &chips[k];
+	if (c->count != 1) continue;
+	one = &ch[c->sweep[0]];
+	config = configOf(one, 0);
+	if (c->config != config) {
+	    if (setupRdy(c, one->rdypin) != ADS1X15_SUCCESS || writeReg(c, REG_CONFIG, config) != ADS1X15_SUCCESS) {
+		c->config = 0;
+		c->count = 0;
+		continue;
+	    }
+	    c->config = config;
+	    c->valid = metrics_now() + conversionTime(one->rate);
+	}
+    }
+    for (k = 0; k < used; k++) {
+	c = &chips[k];
+	if (c->count != 1) continue;
+	sleepFor(c->valid - metrics_now());
+	i = c->sweep[0];
+	rcs[i] = readConversion(c, &codes[i]);
+    }
+
+    // the others convert a channel each round, the chips in parallel
+    for (r = 0; r < rounds; r++) {
+	wake = 0;
+	for (k = 0; k < used; k++) {
+	    c = &chips[k];
+	    started[k] = 0;
+	    if (c->count < 2 || r >= c->count) continue;
+	    i = c->sweep[r];
+	    if (setupRdy(c, ch[i].rdypin) != ADS1X15_SUCCESS || writeReg(c, REG_CONFIG, configOf(&ch[i], 1)) != ADS1X15_SUCCESS) {
+		c->config = 0;
+		continue;
+	    }
+	    c->config = configOf(&ch[i], 1) & ~CONFIG_OS;
+	    started[k] = metrics_now();
+	    if (wake == 0 || started[k] + 1.0 / ADS1X15_rate[ch[i].rate & 7] < wake)
+		wake = started[k] + 1.0 / ADS1X15_rate[ch[i].rate & 7];
+	}
+	if (wake == 0) continue;
+	sleepFor(wake - metrics_now());
+	for (k = 0; k < used; k++) {
+	    c = &chips[k];
+	    if (started[k] == 0) continue;
+	    i = c->sweep[r];
+	    if (waitConversion(c, &ch[i], started[k]) == ADS1X15_SUCCESS) rcs[i] = readConversion(c, &codes[i]);
+	}
+    }
+    for (k = 0; k < used; k++) {
+	if (held[k]) pthread_mutex_unlock(&chips[k].busy);
+    }
+    pthread_mutex_unlock(&sweepLock);
+
+    for (i = 0; i < n; i++) {
+	if (rcs[i] != ADS1X15_SUCCESS) rc = ADS1X15_FAILURE;
+    }
+    metrics_observe(METRICS_ONCE(histogram, "adc_sweep_seconds"), metrics_now() - start);
+    return rc;
+}
@@ -0,0 +1,142 @@
+/*
+ * The MIT License
+ *
+ * Copyright 2017 Nick Ong <onichola@gmail.com>.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+/*
+ * File:   ads1x15.h
+ * Author: Nick Ong <onichola@gmail.com>
+ *
+ * Native driver for ADS1115 analog to digital converters on the Linux i2c-dev
+ * interface.  Up to four chips share the bus, one at each address the ADDR
+ * pin selects, and every channel has its own gain and data rate.
+ */
+
+#ifndef ADS1X15_H
+#define ADS1X15_H
+
+#include <stdint.h>
+
+#ifndef ADS1X15_SUCCESS
+#define ADS1X15_SUCCESS 0 ///< success indicator
+#endif
+
+#ifndef ADS1X15_FAILURE
+#define ADS1X15_FAILURE -1 ///< failure indicator
+#endif
+
+#ifndef ADS1X15_UNAVAILABLE
+#define ADS1X15_UNAVAILABLE -2 ///< no i2c-dev interface, use wiringPi instead
+#endif
+
+#ifndef ADS1X15_BUS
+#define ADS1X15_BUS "/dev/i2c-1" ///< i2c bus the chips are on
+#endif
+
+#define ADS1X15_MAXCHIPS 4 ///< chips on one bus, addresses 0x48 to 0x4b
+#define ADS1X15_CHANNELS 4 ///< single ended inputs of a chip
+#define ADS1X15_TIMEOUT 50 ///< milliseconds past the nominal conversion time before giving up
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    typedef struct {
+        int addr; ///< i2c address of the chip
+        int channel; ///< single ended input [0-3]
+        int gain; ///< programmable gain, index of ADS1X15_gain
+        int rate; ///< data rate, index of ADS1X15_rate
+        int rdypin; ///< wiringPi pin wired to ALERT/RDY, -1 if none
+    } ADS1X15_channel_t;
+
+    /**
+     * \brief Full scale range in volts of a gain setting.
+     */
+    extern const double ADS1X15_gain[8];
+
+    /**
+     * \brief Samples a second of a data rate setting.
+     */
+    extern const int ADS1X15_rate[8];
+
+    /**
+     * \brief Open the i2c bus.  Safe to call again once open.
+     * @return ADS1X15_SUCCESS, ADS1X15_UNAVAILABLE if the kernel or build has
+     * no i2c-dev, ADS1X15_FAILURE if the bus could not be opened
+     */
+    extern int ADS1X15_open(void);
+
+    /**
+     * \brief Close the bus.  The chips are left as they are.
+     */
+    extern void ADS1X15_close(void);
+
+    /**
+     * \brief Gain setting for a full scale range.
+     * @param fsr - full scale range in volts, one of ADS1X15_gain
+     * @return the setting, -1 if no setting has that range
+     */
+    extern int ADS1X15_gainOf(double fsr);
+
+    /**
+     * \brief Data rate setting for a rate, the slowest one at least as fast.
+     * @param sps - samples a second
+     * @return the setting, -1 if faster than the chip goes
+     */
+    extern int ADS1X15_rateOf(int sps);
+
+    /**
+     * \brief Read a set of channels in one sweep.
+     *
+     * The chips convert in parallel.  A chip with one channel in the sweep is
+     * left in continuous mode, so that while the channel stays the same the
+     * next sweep is a single two byte read with no setup.  A chip with more
+     * channels converts them one after the other in single shot mode.  The
+     * end of a conversion is taken from the ALERT/RDY pin where one is wired,
+     * otherwise from the OS bit after the nominal conversion time.
+     *
+     * @param ch - channels to read
+     * @param n - number of channels
+     * @param codes - signed conversion results, n of them
+     * @param rcs - ADS1X15_SUCCESS or ADS1X15_FAILURE for each channel
+     * @return ADS1X15_SUCCESS if every channel was read
+     */
+    extern int ADS1X15_scan(const ADS1X15_channel_t ch[], int n, int16_t codes[], int rcs[]);
+
+    /**
+     * \brief Read successive conversions of one channel, the chip converting
+     * continuously, for oversampling.  Each read waits a little over one
+     * conversion so that no sample is read twice.  A sweep of the same chip
+     * waits for the burst to finish, and the other way round.
+     * @param ch - channel to read
+     * @param codes - signed conversion results
+     * @param n - conversions wanted
+     * @return number of conversions read
+     */
+    extern int ADS1X15_burst(const ADS1X15_channel_t *ch, int16_t codes[], int n);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* ADS1X15_H */
@@ -0,0 +1,420 @@
+/*
+ * The MIT License
+ *
+ * Copyright 2017 Nick Ong <onichola@gmail.com>.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * File:   bench.c
+ * Author: Nick Ong <onichola@gmail.com>
+ *
+ * Microbenchmarks of the work done for every sample: parsing the RAVEn XML
+ * and the DS18B20 w1_slave text, the thermistor conversion, its lookup table
+ * and the oversampling filters, the DHT22 bit decode and the JSON payload
+ * formats.  Run with make bench.  Each case runs for about BENCH_SECONDS and
+ * reports nanoseconds and heap allocations per operation.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <math.h>
+
+#include "raven.h"
+#include "ds18b20pi.h"
+#include "dht22.h"
+#include "tempsensor.h"
+#include "filter.h"
+#include "mqtt.h"
+
+#define BENCH_SECONDS 0.5
+
+// glibc's allocator, wrapped below to count allocations
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *p, size_t size);
+
+static uint64_t allocations = 0;
+
+void *
+malloc(size_t size) {
+    allocations++;
+    return __libc_malloc(size);
+}
+
+void *
+calloc(size_t n, size_t size) {
+    allocations++;
+    return __libc_calloc(n, size);
+}
+
+void *
+realloc(void *p, size_t size) {
+    allocations++;
+    return __libc_realloc(p, size);
+}
+
+// recorded from a RAVEn on an SDG&E meter
+static const char demandFrame[] =
+	"<InstantaneousDemand>\n"
+	"  <DeviceMacId>0xd8d5b9000000a1b2</DeviceMacId>\n"
+	"  <MeterMacId>0x00135003000c3d4e</MeterMacId>\n"
+	"  <TimeStamp>0x2087c1f4</TimeStamp>\n"
+	"  <Demand>0x0004b7</Demand>\n"
+	"  <Multiplier>0x00000001</Multiplier>\n"
+	"  <Divisor>0x000003e8</Divisor>\n"
+	"  <DigitsRight>0x03</DigitsRight>\n"
+	"  <DigitsLeft>0x0f</DigitsLeft>\n"
+	"  <SuppressLeadingZero>Y</SuppressLeadingZero>\n"
+	"</InstantaneousDemand>\n";
+
+static const char summationFrame[] =
+	"<CurrentSummationDelivered>\n"
+	"  <DeviceMacId>0xd8d5b9000000a1b2</DeviceMacId>\n"
+	"  <MeterMacId>0x00135003000c3d4e</MeterMacId>\n"
+	"  <TimeStamp>0x2087c1f9</TimeStamp>\n"
+	"  <SummationDelivered>0x0000000001a2b3c4</SummationDelivered>\n"
+	"  <SummationReceived>0x0000000000000000</SummationReceived>\n"
+	"  <Multiplier>0x00000001</Multiplier>\n"
+	"  <Divisor>0x000003e8</Divisor>\n"
+	"  <DigitsRight>0x01</DigitsRight>\n"
+	"  <DigitsLeft>0x06</DigitsLeft>\n"
+	"  <SuppressLeadingZero>Y</SuppressLeadingZero>\n"
+	"</CurrentSummationDelivered>\n";
+
+static const char w1Text[] =
+	"72 01 4b 46 7f ff 0e 10 57 : crc=57 YES\n"
+	"72 01 4b 46 7f ff 0e 10 57 t=23125\n";
+
+static const uint8_t dhtBits[5] = {0x02, 0x8c, 0x01, 0x5f, 0xee};
+
+#define BENCH_CODES 256 ///< ADC codes in a batch conversion
+#define BENCH_LUT_MAXERROR 0.05 ///< Celsius the lookup table may be off NtcR2T from -40C to 125C
+
+static tempsensor_port_t thermistor;
+static filter_t pipeline;
+static int codes[BENCH_CODES];
+static float temperatures[BENCH_CODES];
+static dht22_edge_t dhtEdges[DHT22_MAXEDGES];
+static int dhtEdgeCount = 0;
+static dht22_edge_t jitterEdges[DHT22_MAXEDGES];
+static int jitterEdgeCount = 0;
+static volatile double sink;
+static char frame[sizeof (summationFrame)];
+static mqtt_data_t message;
+static int64_t stamp = 1700000000123456LL;
+
+static void
+benchRavenCopy(void) {
+    memcpy(frame, demandFrame, sizeof (demandFrame));
+    sink = frame[0];
+}
+
+static void
+benchRavenDemand(void) {
+    raven_data_t data;
+
+    // the parse writes into the buffer, so it gets a fresh copy each time
+    memcpy(frame, demandFrame, sizeof (demandFrame));
+    RAVEn_parseXML(frame, &data);
+    sink = data.demand;
+}
+
+static void
+benchRavenOther(void) {
+    raven_data_t data;
+
+    memcpy(frame, summationFrame, sizeof (summationFrame));
+    sink = RAVEn_parseXML(frame, &data);
+}
+
+static void
+benchW1Parse(void) {
+    int m;
+
+    DS18B20PI_parse(w1Text, &m);
+    sink = m;
+}
+
+static void
+benchNtcR2T(void) {
+    sink = NtcR2T(10000.0 + sink * 1e-9, 1.413e-03, 2.385e-04, 9.588e-08);
+}
+
+static void
+benchNtcLookup(void) {
+    sink = tempsensor_code2T(&thermistor, 12000 + (int) sink);
+}
+
+static void
+benchNtcLookupBatch(void) {
+    tempsensor_code2TBatch(&thermistor, codes, temperatures, BENCH_CODES);
+    sink = temperatures[0];
+}
+
+static void
+benchFilterBatch(void) {
+    float out;
+
+    filter_run(&pipeline, temperatures, BENCH_CODES, &out);
+    sink = out;
+}
+
+static void
+benchDHT22Decode(void) {
+    dht22_data_t data;
+
+    DHT22_decode(dhtBits, 40, 0, &data);
+    sink = data.temperature;
+}
+
+static void
+benchDHT22DecodeEdges(void) {
+    dht22_data_t data;
+    uint8_t dat[5];
+
+    DHT22_decode(dat, DHT22_decodeEdges(dhtEdges, dhtEdgeCount, dat), 0, &data);
+    sink = data.temperature;
+}
+
+/**
+ * Add an edge to a DHT22 transfer.
+ */
+static void
+edge(dht22_edge_t edges[], int *n, uint32_t after, int rising) {
+    uint32_t t = *n > 0 ? edges[*n - 1].us : 0;
+
+    edges[*n].us = t + after;
+    edges[(*n)++].rising = rising;
+}
+
+/**
+ * Lay dhtBits out as the edges of a transfer, the start pulse and the
+ * response included.
+ */
+static void
+makeEdges(void) {
+    int i;
+
+    edge(dhtEdges, &dhtEdgeCount, 0, 0);
+    edge(dhtEdges, &dhtEdgeCount, 18000, 1);
+    edge(dhtEdges, &dhtEdgeCount, 30, 0);
+    edge(dhtEdges, &dhtEdgeCount, 80, 1);
+    edge(dhtEdges, &dhtEdgeCount, 80, 0);
+    for (i = 0; i < 40; i++) {
+	edge(dhtEdges, &dhtEdgeCount, 50, 1);
+	edge(dhtEdges, &dhtEdgeCount, dhtBits[i / 8] & (0x80 >> (i % 8)) ? 70 : 27, 0);
+    }
+    edge(dhtEdges, &dhtEdgeCount, 50, 1);
+}
+
+/**
+ * Lay dhtBits out as a transfer seen through a noisy line and a late
+ * scheduler: glitches before the start pulse, and high pulses spread to
+ * within a few microseconds of DHT22_ONE_US on either side.
+ */
+static void
+makeJitterEdges(void) {
+    int i;
+
+    edge(jitterEdges, &jitterEdgeCount, 0, 1);
+    edge(jitterEdges, &jitterEdgeCount, 3, 0);
+    edge(jitterEdges, &jitterEdgeCount, 40, 1);
+    edge(jitterEdges, &jitterEdgeCount, 2, 0);
+    edge(jitterEdges, &jitterEdgeCount, 18000, 1);
+    edge(jitterEdges, &jitterEdgeCount, 34, 0);
+    edge(jitterEdges, &jitterEdgeCount, 76, 1);
+    edge(jitterEdges, &jitterEdgeCount, 84, 0);
+    for (i = 0; i < 40; i++) {
+	edge(jitterEdges, &jitterEdgeCount, 45 + (i * 3) % 14, 1);
+	edge(jitterEdges, &jitterEdgeCount, dhtBits[i / 8] & (0x80 >> (i % 8)) ?
+		DHT22_ONE_US + 1 + (i * 7) % 24 : DHT22_ONE_US - 1 - (i * 5) % 24, 0);
+    }
+    edge(jitterEdges, &jitterEdgeCount, 50, 1);
+}
+
+/**
+ * Check that a transfer decodes to dhtBits.
+ * @return 0 if it does, -1 otherwise
+ */
+static int
+checkEdges(const char *name, const dht22_edge_t edges[], int n) {
+    uint8_t dat[5];
+    int bits = DHT22_decodeEdges(edges, n, dat);
+
+    if (bits != 40 || memcmp(dat, dhtBits, sizeof (dat)) != 0) {
+	fprintf(stderr, "%s: decoded %d bits %02x %02x %02x %02x %02x, expected 40 bits %02x %02x %02x %02x %02x\n",
+		name, bits, dat[0], dat[1], dat[2], dat[3], dat[4],
+		dhtBits[0], dhtBits[1], dhtBits[2], dhtBits[3], dhtBits[4]);
+	return -1;
+    }
+    return 0;
+}
+
+/**
+ * Check the lookup table of a port against NtcR2T over the thermistor's
+ * working range, and that codes of an open or shorted input convert to NAN.
+ * @return 0 if it is accurate, -1 otherwise
+ */
+static int
+checkTable(const tempsensor_port_t *port) {
+    double worst = 0, ref, err;
+    int at = 0;
+    int code;
+
+    for (code = 1; code < ADC_CODES; code++) {
+	ref = NtcR2T(tempsensor_code2R(port, code), port->A, port->B, port->C);
+	if (!(ref >= -40 && ref <= 125)) continue;
+	err = fabs(tempsensor_code2T(port, code) - ref);
+	if (isnan(err)) err = INFINITY;
+	if (err > worst) {
+	    worst = err;
+	    at = code;
+	}
+    }
+    if (worst > BENCH_LUT_MAXERROR) {
+	fprintf(stderr, "ntc lookup: off by %.4fC at code %d, expected at most %.4fC\n", worst, at, BENCH_LUT_MAXERROR);
+	return -1;
+    }
+    // a negative code, one below the first entry, or one past 0 ohms is not a reading
+    for (code = -1; code < ADC_CODES; code += code < 1 << TEMPSENSOR_LUT_SHIFT ? 1 : 16) {
+	if (code >= 1 << TEMPSENSOR_LUT_SHIFT && tempsensor_code2R(port, code) > 0) continue;
+	if (!isnan(tempsensor_code2T(port, code))) {
+	    fprintf(stderr, "ntc lookup: code %d of an open or shorted input converts to %.2fC\n",
+		    code, tempsensor_code2T(port, code));
+	    return -1;
+	}
+    }
+    return 0;
+}
+
+// the payload formats below are those written by the drivers
+
+static void
+benchPayloadDS18B20(void) {
+    snprintf(message.payload, sizeof (message.payload), "{\"timestamp\":%ld,\"timestamp_us\":%lld,\"value\":%.3f}",
+	    (long) (stamp / 1000000), (long long) stamp, 23.125);
+}
+
+static void
+benchPayloadDHT22(void) {
+    snprintf(message.payload, sizeof (message.payload), "{\"temperature\":{\"timestamp\":%ld,\"timestamp_us\":%lld,\"value\":%.3f}}",
+	    (long) (stamp / 1000000), (long long) stamp, 21.371);
+}
+
+static void
+benchPayloadDoorswitch(void) {
+    snprintf(message.payload, sizeof (message.payload), "{\"timestamp\":%ld,\"timestamp_us\":%lld,\"value\":\"%s\"}",
+	    (long) (stamp / 1000000), (long long) stamp, "opened");
+}
+
+static void
+benchPayloadTempsensor(void) {
+    snprintf(message.payload, sizeof (message.payload), "{\"timestamp\":%ld,\"timestamp_us\":%lld,\"value\":\"%.2f\"}",
+	    (long) (stamp / 1000000), (long long) stamp, -18.25);
+}
+
+static void
+benchPayloadRAVEn(void) {
+    snprintf(message.payload, sizeof (message.payload), "{\"timestamp\":%ld,\"timestamp_us\":%lld,\"meter_timestamp\":%u,\"value\":%.3f}",
+	    (long) (stamp / 1000000), (long long) stamp, 1492684180u, 1.207);
+}
+
+typedef struct {
+    const char *name;
+    void (*fn)(void);
+} bench_t;
+
+static const bench_t benches[] = {
+    {"raven_copy_frame", benchRavenCopy},
+    {"raven_parse_demand", benchRavenDemand},
+    {"raven_parse_other", benchRavenOther},
+    {"ds18b20_parse", benchW1Parse},
+    {"ntc_r2t", benchNtcR2T},
+    {"ntc_lookup", benchNtcLookup},
+    {"ntc_lookup_batch256", benchNtcLookupBatch},
+    {"filter_batch256", benchFilterBatch},
+    {"dht22_decode", benchDHT22Decode},
+    {"dht22_decode_edges", benchDHT22DecodeEdges},
+    {"payload_ds18b20", benchPayloadDS18B20},
+    {"payload_dht22", benchPayloadDHT22},
+    {"payload_doorswitch", benchPayloadDoorswitch},
+    {"payload_tempsensor", benchPayloadTempsensor},
+    {"payload_raven", benchPayloadRAVEn},
+};
+
+static double
+now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/**
+ * Run a case in growing batches until a batch takes BENCH_SECONDS.
+ */
+static void
+run(const bench_t *b) {
+    uint64_t n = 1;
+    uint64_t i;
+    uint64_t allocs;
+    double start, elapsed;
+
+    for (;;) {
+	allocs = allocations;
+	start = now();
+	for (i = 0; i < n; i++) b->fn();
+	elapsed = now() - start;
+	allocs = allocations - allocs;
+	if (elapsed >= BENCH_SECONDS) break;
+	// aim a little past the target so the next batch is the last
+	n = elapsed < BENCH_SECONDS / 100 ? n * 100 : (uint64_t) (n * BENCH_SECONDS * 1.2 / elapsed) + 1;
+    }
+    printf("%-22s %12llu %10.1f ns/op %6.2f allocs/op\n", b->name,
+	    (unsigned long long) n, elapsed * 1e9 / n, (double) allocs / n);
+}
+
+int
+main(int argc, char **argv) {
+    size_t i;
+
+    makeEdges();
+    makeJitterEdges();
+    if (checkEdges("dht22 edges", dhtEdges, dhtEdgeCount) != 0 ||
+	    checkEdges("dht22 jittered edges", jitterEdges, jitterEdgeCount) != 0)
+	return EXIT_FAILURE;
+    thermistor = tempsensor_createPort(2, ADC_I2C_ADDR, ADC_GAIN, ADC_DATARATE, -1, 1.413e-03, 2.385e-04, 9.588e-08, 0.0, "bench", "tempsensor", "bench", 60);
+    if (checkTable(&thermistor) != 0)
+	return EXIT_FAILURE;
+    for (i = 0; i < BENCH_CODES; i++) codes[i] = 8000 + (int) i * 64;
+    tempsensor_code2TBatch(&thermistor, codes, temperatures, BENCH_CODES);
+    filter_add(&pipeline, "decimate:4");
+    filter_add(&pipeline, "median:5");
+    filter_add(&pipeline, "ema:0.2");
+    for (i = 0; i < sizeof (benches) / sizeof (benches[0]); i++) {
+	if (argc > 1 && strstr(benches[i].name, argv[1]) == NULL) continue;
+	run(&benches[i]);
+    }
+    return 0;
+}
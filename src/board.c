@@ -0,0 +1,66 @@
+/*
+ * The MIT License
+ *
+ * Copyright 2017 Nick Ong <onichola@gmail.com>.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <wiringPi.h>
+
+#include <pthread.h>
+#include <sys/resource.h>
+
+#include "debug.h"
+#include "board.h"
+#include "capture.h"
+
+static pthread_once_t boardOnce = PTHREAD_ONCE_INIT;
+static int boardStatus = BOARD_FAILURE;
+
+static void
+board_setup() {
+    struct rlimit rt;
+
+    if (capture_replaying()) {
+        // the inputs come from a capture file, leave the hardware alone
+        boardStatus = BOARD_SUCCESS;
+        return;
+    }
+    DBGLOG(DBG_MAIN, DBG_INFO, "board: initializing WiringPi");
+    // main drops privileges once the drivers are initialized, the limit
+    // lets the bit-banged reads still go real time
+    if (getrlimit(RLIMIT_RTPRIO, &rt) == 0 && rt.rlim_cur < BOARD_RTPRIO) {
+        rt.rlim_cur = BOARD_RTPRIO;
+        if (rt.rlim_max < BOARD_RTPRIO) rt.rlim_max = BOARD_RTPRIO;
+        if (setrlimit(RLIMIT_RTPRIO, &rt) != 0) DBGLOG(DBG_MAIN, DBG_WARN, "board: unable to allow real-time priority");
+    }
+    if (wiringPiSetup() == -1) {
+        DBGLOG(DBG_MAIN, DBG_ERROR, "board: Error Failed to init WiringPi");
+        boardStatus = BOARD_FAILURE;
+    } else {
+        boardStatus = BOARD_SUCCESS;
+    }
+}
+
+int
+board_init() {
+    pthread_once(&boardOnce, board_setup);
+    return (boardStatus);
+}
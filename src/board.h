@@ -0,0 +1,63 @@
+/*
+ * The MIT License
+ *
+ * Copyright 2017 Nick Ong <onichola@gmail.com>.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * File:   board.h
+ * Author: Nick Ong <onichola@gmail.com>
+ *
+ * Set up shared by the drivers that use wiringPi.
+ */
+
+#ifndef BOARD_H
+#define BOARD_H
+
+#ifndef BOARD_SUCCESS
+#define BOARD_SUCCESS 0  ///< success indicator
+#endif
+
+#ifndef BOARD_FAILURE
+#define BOARD_FAILURE -1  ///< failure indicator
+#endif
+
+#define BOARD_RTPRIO 50 ///< SCHED_FIFO priority of timing critical reads
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    /**
+     * \brief Set up wiringPi.
+     *
+     * Safe to call from several drivers and threads, the set up runs once and
+     * every caller gets its result.  Also allows the process to run at
+     * BOARD_RTPRIO once the drivers have dropped their privileges.
+     * @return BOARD_SUCCESS if wiringPi is ready.
+     */
+    extern int board_init();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* BOARD_H */
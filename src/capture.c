@@ -0,0 +1,286 @@
+/*
+ * The MIT License
+ *
+ * Copyright 2017 Nick Ong <onichola@gmail.com>.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "debug.h"
+#include "capture.h"
+
+#define HEADER 12 ///< bytes in a record header
+
+typedef struct {
+    capture_kind_t kind; ///< kind of input
+    const char *id; ///< source id, not terminated
+    size_t idlen; ///< length of id
+    const unsigned char *data; ///< raw bytes
+    size_t len; ///< number of bytes
+    double t; ///< seconds since the capture started
+} capture_rec_t;
+
+typedef struct {
+    capture_kind_t kind; ///< kind of input
+    char id[64]; ///< source id
+    size_t next; ///< first record not yet looked at
+    int exhausted; ///< no records are left
+} capture_source_t;
+
+static pthread_mutex_t capLock = PTHREAD_MUTEX_INITIALIZER;
+static struct timespec capStart; ///< start of the capture or of the replay
+
+// recording
+static FILE *capFile = NULL;
+static time_t lastFlush;
+
+// replay
+static int replaying = 0;
+static double replaySpeed = 1;
+static unsigned char *replayBuf = NULL;
+static capture_rec_t *recs = NULL;
+static size_t nrecs = 0;
+static size_t taken = 0;
+static double lastTaken = 0; ///< elapsed() when a record was last taken
+static capture_source_t sources[CAPTURE_MAXSOURCES];
+static int nsources = 0;
+
+static double
+elapsed(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - capStart.tv_sec) + (now.tv_nsec - capStart.tv_nsec) * 1e-9;
+}
+
+int
+capture_open(const char *path) {
+    if ((capFile = fopen(path, "wb")) == NULL) {
+	DBGLOG(DBG_MAIN, DBG_ERROR, "capture: unable to create %s", path);
+	return CAPTURE_FAILURE;
+    }
+    setvbuf(capFile, NULL, _IOFBF, 65536);
+    fwrite(CAPTURE_MAGIC, 1, 8, capFile);
+    clock_gettime(CLOCK_MONOTONIC, &capStart);
+    lastFlush = time(NULL);
+    DBGLOG(DBG_MAIN, DBG_INFO, "capture: recording raw inputs to %s", path);
+    return CAPTURE_SUCCESS;
+}
+
+void
+capture_record(capture_kind_t kind, const char *id, const void *data, size_t len) {
+    unsigned char hdr[HEADER];
+    size_t idlen;
+    uint64_t us;
+    int i;
+
+    if (capFile == NULL) return;
+    idlen = strlen(id);
+    if (idlen > 255) idlen = 255;
+    if (len > 65535) len = 65535;
+    us = (uint64_t) (elapsed() * 1e6);
+    hdr[0] = kind;
+    hdr[1] = idlen;
+    hdr[2] = len & 0xff;
+    hdr[3] = len >> 8;
+    for (i = 0; i < 8; i++) hdr[4 + i] = (us >> (8 * i)) & 0xff;
+    pthread_mutex_lock(&capLock);
+    fwrite(hdr, 1, HEADER, capFile);
+    fwrite(id, 1, idlen, capFile);
+    fwrite(data, 1, len, capFile);
+    if (time(NULL) - lastFlush >= CAPTURE_FLUSH) {
+	fflush(capFile);
+	lastFlush = time(NULL);
+    }
+    pthread_mutex_unlock(&capLock);
+}
+
+/**
+ * Index the records of a loaded capture.
+ * @param buf - whole file
+ * @param size - bytes in buf
+ * @param out - receives the records, or NULL to only count them
+ * @return number of complete records
+ */
+static size_t
+indexRecords(const unsigned char *buf, size_t size, capture_rec_t *out) {
+    size_t pos = 8;
+    size_t n = 0;
+    size_t idlen, len;
+    uint64_t us;
+    int i;
+
+    while (pos + HEADER <= size) {
+	idlen = buf[pos + 1];
+	len = buf[pos + 2] | (buf[pos + 3] << 8);
+	if (pos + HEADER + idlen + len > size) break; // cut short while recording
+	if (out != NULL) {
+	    for (us = 0, i = 7; i >= 0; i--) us = (us << 8) | buf[pos + 4 + i];
+	    out[n].kind = (capture_kind_t) buf[pos];
+	    out[n].id = (const char *) buf + pos + HEADER;
+	    out[n].idlen = idlen;
+	    out[n].data = buf + pos + HEADER + idlen;
+	    out[n].len = len;
+	    out[n].t = us * 1e-6;
+	}
+	pos += HEADER + idlen + len;
+	n++;
+    }
+    return n;
+}
+
+int
+capture_replay(const char *path, double speed) {
+    FILE *fp;
+    long size;
+
+    if ((fp = fopen(path, "rb")) == NULL) {
+	DBGLOG(DBG_MAIN, DBG_ERROR, "capture: unable to open %s", path);
+	return CAPTURE_FAILURE;
+    }
+    fseek(fp, 0, SEEK_END);
+    size = ftell(fp);
+    rewind(fp);
+    if (size < 8 || (replayBuf = malloc(size)) == NULL ||
+	    fread(replayBuf, 1, size, fp) != (size_t) size || memcmp(replayBuf, CAPTURE_MAGIC, 8) != 0) {
+	DBGLOG(DBG_MAIN, DBG_ERROR, "capture: %s is not a capture file", path);
+	fclose(fp);
+	free(replayBuf);
+	replayBuf = NULL;
+	return CAPTURE_FAILURE;
+    }
+    fclose(fp);
+    nrecs = indexRecords(replayBuf, size, NULL);
+    if ((recs = malloc((nrecs + 1) * sizeof (recs[0]))) == NULL) {
+	free(replayBuf);
+	replayBuf = NULL;
+	return CAPTURE_FAILURE;
+    }
+    indexRecords(replayBuf, size, recs);
+    replaySpeed = speed;
+    replaying = 1;
+    clock_gettime(CLOCK_MONOTONIC, &capStart);
+    DBGLOG(DBG_MAIN, DBG_INFO, "capture: replaying %zu raw inputs from %s at speed %g", nrecs, path, speed);
+    return CAPTURE_SUCCESS;
+}
+
+int
+capture_replaying(void) {
+    return replaying;
+}
+
+static capture_source_t *
+source(capture_kind_t kind, const char *id) {
+    int i;
+
+    for (i = 0; i < nsources; i++) {
+	if (sources[i].kind == kind && strcmp(sources[i].id, id) == 0) return &sources[i];
+    }
+    if (nsources == CAPTURE_MAXSOURCES) return NULL;
+    sources[nsources].kind = kind;
+    snprintf(sources[nsources].id, sizeof (sources[nsources].id), "%s", id);
+    sources[nsources].next = 0;
+    sources[nsources].exhausted = 0;
+    return &sources[nsources++];
+}
+
+int
+capture_next(capture_kind_t kind, const char *id, void *data, size_t size, size_t *len, int block) {
+    capture_source_t *s;
+    capture_rec_t *r = NULL;
+    size_t idlen = strlen(id);
+    size_t i;
+    double due;
+
+    pthread_mutex_lock(&capLock);
+    if (!replaying || (s = source(kind, id)) == NULL || s->exhausted) {
+	pthread_mutex_unlock(&capLock);
+	return CAPTURE_FAILURE;
+    }
+    for (i = s->next; i < nrecs; i++) {
+	if (recs[i].kind == kind && recs[i].idlen == idlen && memcmp(recs[i].id, id, idlen) == 0) {
+	    r = &recs[i];
+	    break;
+	}
+    }
+    s->next = i;
+    if (r == NULL) {
+	s->exhausted = 1;
+	DBGLOG(DBG_MAIN, DBG_INFO, "capture: no more inputs for %s", id);
+	pthread_mutex_unlock(&capLock);
+	return CAPTURE_FAILURE;
+    }
+    due = replaySpeed > 0 ? r->t / replaySpeed - elapsed() : 0;
+    if (due > 0 && !block) {
+	pthread_mutex_unlock(&capLock);
+	return CAPTURE_FAILURE;
+    }
+    s->next = i + 1;
+    taken++;
+    lastTaken = elapsed();
+    *len = r->len < size ? r->len : size;
+    memcpy(data, r->data, *len);
+    pthread_mutex_unlock(&capLock);
+    if (due > 0) {
+	struct timespec ts;
+	ts.tv_sec = (time_t) due;
+	ts.tv_nsec = (long) ((due - ts.tv_sec) * 1e9);
+	nanosleep(&ts, NULL);
+    }
+    return CAPTURE_SUCCESS;
+}
+
+int
+capture_finished(void) {
+    int done;
+    int i;
+
+    if (!replaying) return 0;
+    pthread_mutex_lock(&capLock);
+    // every record taken, or every source the drivers asked for run dry
+    // and none taken for a while, a driver may still be initializing
+    done = taken == nrecs || (nsources > 0 && elapsed() - lastTaken >= CAPTURE_IDLE);
+    for (i = 0; i < nsources && taken < nrecs; i++) {
+	if (!sources[i].exhausted) done = 0;
+    }
+    pthread_mutex_unlock(&capLock);
+    return done;
+}
+
+void
+capture_close(void) {
+    pthread_mutex_lock(&capLock);
+    if (capFile != NULL) {
+	fclose(capFile);
+	capFile = NULL;
+    }
+    replaying = 0;
+    free(recs);
+    free(replayBuf);
+    recs = NULL;
+    replayBuf = NULL;
+    pthread_mutex_unlock(&capLock);
+}
@@ -0,0 +1,135 @@
+/*
+ * The MIT License
+ *
+ * Copyright 2017 Nick Ong <onichola@gmail.com>.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * File:   capture.h
+ * Author: Nick Ong <onichola@gmail.com>
+ *
+ * Record and replay of the raw sensor inputs.  In capture mode every input
+ * the drivers read from the hardware is appended to a binary file with the
+ * time it was read.  In replay mode the drivers take their inputs from such
+ * a file instead of the hardware, at the recorded pace or faster, so that a
+ * field problem can be reproduced and measured off the Pi.
+ *
+ * The file starts with CAPTURE_MAGIC, followed by records made of a 12 byte
+ * little endian header (kind, length of the source id, length of the data,
+ * microseconds since the capture started), the source id and the data.
+ */
+
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stddef.h>
+
+#ifndef CAPTURE_SUCCESS
+#define CAPTURE_SUCCESS 0  ///< success indicator
+#endif
+
+#ifndef CAPTURE_FAILURE
+#define CAPTURE_FAILURE -1  ///< failure indicator
+#endif
+
+#define CAPTURE_MAGIC "P2MCAP1\n" ///< first 8 bytes of a capture file
+#define CAPTURE_MAXSOURCES 128 ///< distinct sources followed during a replay
+#define CAPTURE_FLUSH 1 ///< seconds between flushes of the capture file
+#define CAPTURE_IDLE 5 ///< seconds without a record before a replay with sources left over ends
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    /** Kinds of raw input */
+    typedef enum {
+        CAPTURE_W1 = 1, ///< text of a DS18B20 w1_slave file
+        CAPTURE_ADC, ///< int code from analogRead
+        CAPTURE_GPIO, ///< int level from digitalRead
+        CAPTURE_DHT22, ///< uint8_t loop counts between DHT22 transitions
+        CAPTURE_SERIAL, ///< bytes read from a RAVEn serial port
+        CAPTURE_DHT22_EDGES ///< dht22_edge_t of a DHT22 transfer
+    } capture_kind_t;
+
+    /**
+     * \brief Start recording raw inputs to a file, replacing it.
+     * @param path - capture file
+     * @return CAPTURE_SUCCESS if the file was created
+     */
+    extern int capture_open(const char *path);
+
+    /**
+     * \brief Start replaying raw inputs from a file instead of the hardware.
+     * @param path - capture file
+     * @param speed - 1 for the recorded pace, 10 for ten times faster,
+     * 0 for as fast as possible
+     * @return CAPTURE_SUCCESS if the file was loaded
+     */
+    extern int capture_replay(const char *path, double speed);
+
+    /**
+     * \brief Inputs come from a replay, the hardware must not be touched.
+     */
+    extern int capture_replaying(void);
+
+    /**
+     * \brief Record one raw input if capturing, otherwise do nothing.
+     * @param kind - kind of input
+     * @param id - sensor id it was read for
+     * @param data - raw bytes
+     * @param len - number of bytes, at most 65535
+     */
+    extern void capture_record(capture_kind_t kind, const char *id, const void *data, size_t len);
+
+    /**
+     * \brief Take the next recorded input of a source during a replay.
+     *
+     * Each kind and id is a separate stream, read in order.  A record is not
+     * handed out before its recorded time, scaled by the replay speed.
+     * @param kind - kind of input
+     * @param id - sensor id
+     * @param data - receives the raw bytes
+     * @param size - size of data
+     * @param len - receives the number of bytes
+     * @param block - 1 to sleep until the next record is due, 0 to fail if
+     * it is not due yet, as a non blocking read would
+     * @return CAPTURE_SUCCESS if a record was taken
+     */
+    extern int capture_next(capture_kind_t kind, const char *id, void *data, size_t size,
+            size_t *len, int block);
+
+    /**
+     * \brief The replay is over: every record has been taken, or every
+     * source the drivers read from has run out of records and none was
+     * taken for CAPTURE_IDLE seconds.
+     */
+    extern int capture_finished(void);
+
+    /**
+     * \brief Flush and close the capture file, or free the replay.
+     */
+    extern void capture_close(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* CAPTURE_H */
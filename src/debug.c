@@ -35,96 +35,1055 @@
 /*																											*/
 /* ======================================================================================================== */
 
+/* Records are queued on a lock free ring and written in batches by a        */
+/* background thread through files that stay open.  Messages below the      */
+/* threshold of their module are never formatted, and in binary mode the    */
+/* arguments are recorded raw and formatted by pi2mqtt-logdecode later.     */
+/* Logs are written through large buffers flushed on an interval and are    */
+/* rotated by size and age, keeping a fixed number of generations.          */
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
+#include <stdint.h>
 #include <string.h>
+#include <ctype.h>
 #include <time.h>
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <unistd.h>
 #include "debug.h"
 
+extern char **environ;
+
+#define SITE_TEXT -1 ///< record holds formatted text
+
+typedef struct {
+    unsigned long seq; ///< ring position this slot is ready for, see queueRecord
+    time_t stamp; ///< time the record was queued
+    int runlog; ///< written to the runlog instead of the debug log
+    int site; ///< call site of raw arguments, SITE_TEXT for text
+    int level; ///< DBG_ERROR .. DBG_DEBUG
+    unsigned short len; ///< bytes of raw arguments
+    char text[DBGLOG_MAXLINE]; ///< message or raw arguments
+} dbglog_record_t;
+
+static const char *moduleNames[DBG_MODULE_COUNT] = {
+    "main", "mqtt", "raven", "ds18b20", "dht22", "doorswitch", "tempsensor",
+    "rules", "virtual"
+};
+static const char *levelNames[] = { "error", "warn", "info", "debug" };
+
+signed char dbgLevels[DBG_MODULE_COUNT] = { -1, -1, -1, -1, -1, -1, -1, -1, -1 };
+static signed char sLevels[DBG_MODULE_COUNT] = {
+    DBG_DEBUG, DBG_DEBUG, DBG_DEBUG, DBG_DEBUG, DBG_DEBUG, DBG_DEBUG, DBG_DEBUG,
+    DBG_DEBUG, DBG_DEBUG
+};
+
+typedef struct {
+    char path[255]; ///< file name, generations are path.1, path.2 ...
+    FILE *FH; ///< open file, NULL until first written
+    int binary; ///< starts with DBGLOG_MAGIC
+    long size; ///< bytes in the current generation
+    time_t opened; ///< when the current generation was started
+    pid_t gzip; ///< compressor of the last rotated generation, 0 if none
+} dbglog_file_t;
 
 static  char    sMyKey[32];
-static  char    sDebugLog[255];
+static  dbglog_file_t debugFile;
+static  dbglog_file_t runFile = { "./runlog" };
+static  long    sMaxSize = DBGLOG_MAXSIZE;
+static  long    sMaxAge = DBGLOG_MAXAGE;
+static  int     sGenerations = DBGLOG_GENERATIONS;
+static  int     sCompress = 0;
+static  int     sFlushInterval = DBGLOG_FLUSH;
 static  int     sDebug;
 static	int	sVerbose = 0;
+static	int	sOverflow = DBGLOG_DROP;
+static	int	sBinary = 0;
+
+static dbglog_record_t ring[DBGLOG_RING];
+static unsigned long ringHead; ///< next position claimed by a writer of records
+static unsigned long ringTail; ///< next position written out, writer thread only
+static unsigned long dropped; ///< records dropped because the ring was full
+
+// call sites by id, id 0 is WriteDBGLog in binary mode
+static dbglog_site_t textSite = { "%s", DBG_MAIN, DBG_INFO, 0, "s" };
+static dbglog_site_t *sites[DBGLOG_MAXSITES] = { &textSite };
+static int nsites = 1;
+static pthread_mutex_t sitesLock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned char siteDefined[DBGLOG_MAXSITES]; ///< format written to the log, writer only
+
+static time_t lastFlush; ///< writer only
+static int unflushed; ///< writes since lastFlush, writer only
+
+static pthread_t writer;
+static int writerRunning;
+static int writerIdle; ///< writer is waiting for records
+static int writerStop;
+static pthread_mutex_t writerLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t writerWake = PTHREAD_COND_INITIALIZER;
+
+/*--------------------------------------------------------------------------*/
+/* Little endian encoding of binary records, the same on the Pi and on the  */
+/* machine decoding the log.                                                */
+/*--------------------------------------------------------------------------*/
+static void
+put64(unsigned char *p, uint64_t v)
+{
+    int i;
+    for (i = 0; i < 8; i++)
+	p[i] = (unsigned char) (v >> (8 * i));
+}
+
+static uint64_t
+get64(const unsigned char *p)
+{
+    uint64_t v = 0;
+    int i;
+    for (i = 0; i < 8; i++)
+	v |= (uint64_t) p[i] << (8 * i);
+    return v;
+}
+
+static void
+put32(unsigned char *p, uint32_t v)
+{
+    int i;
+    for (i = 0; i < 4; i++)
+	p[i] = (unsigned char) (v >> (8 * i));
+}
+
+static uint32_t
+get32(const unsigned char *p)
+{
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t) p[3] << 24;
+}
+
+/*--------------------------------------------------------------------------*/
+/* One printf conversion.                                                   */
+/*--------------------------------------------------------------------------*/
+typedef struct {
+    const char *start; ///< at the '%'
+    const char *lenStart; ///< length modifier
+    const char *lenEnd; ///< conversion character
+    const char *end; ///< past the conversion character
+    int nstar; ///< '*' width and precision arguments
+    char kind; ///< argument kind, 0 for %%, '?' if not recordable
+} dbglog_spec_t;
+
+/*
+ * Argument kinds:
+ *   i int, l long, L unsigned long, q long long, Q unsigned long long,
+ *   z size_t, y ssize_t, d double, s string, p pointer, * width or precision
+ */
+static const char *
+nextSpec(const char *p, dbglog_spec_t *s)
+{
+    char conv;
+    size_t len;
+
+    while (*p && *p != '%')
+	p++;
+    if (*p == 0)
+	return NULL;
+    s->start = p++;
+    s->nstar = 0;
+    if (*p == '%') {
+	s->lenStart = s->lenEnd = p;
+	s->end = p + 1;
+	s->kind = 0;
+	return s->end;
+    }
+    while (*p && strchr("-+ #0'", *p))
+	p++;
+    if (*p == '*') {
+	s->nstar++;
+	p++;
+    } else {
+	while (isdigit((unsigned char) *p))
+	    p++;
+    }
+    if (*p == '.') {
+	p++;
+	if (*p == '*') {
+	    s->nstar++;
+	    p++;
+	} else {
+	    while (isdigit((unsigned char) *p))
+		p++;
+	}
+    }
+    s->lenStart = p;
+    while (*p && strchr("hlLqjzt", *p))
+	p++;
+    s->lenEnd = p;
+    conv = *p;
+    if (*p)
+	p++;
+    s->end = p;
+
+    len = s->lenEnd - s->lenStart;
+    s->kind = '?';
+    switch (conv) {
+	case 'd': case 'i':
+	case 'u': case 'o': case 'x': case 'X':
+	{
+	    int uns = conv != 'd' && conv != 'i';
+	    if (len == 0 || s->lenStart[0] == 'h')
+		s->kind = 'i';
+	    else if (len == 1 && s->lenStart[0] == 'l')
+		s->kind = uns ? 'L' : 'l';
+	    else if ((len == 2 && s->lenStart[0] == 'l') || s->lenStart[0] == 'q' || s->lenStart[0] == 'j')
+		s->kind = uns ? 'Q' : 'q';
+	    else if (s->lenStart[0] == 'z' || s->lenStart[0] == 't')
+		s->kind = uns ? 'z' : 'y';
+	    break;
+	}
+	case 'c':
+	    if (len == 0) s->kind = 'i';
+	    break;
+	case 'e': case 'E': case 'f': case 'F':
+	case 'g': case 'G': case 'a': case 'A':
+	    if (len == 0 || (len == 1 && s->lenStart[0] == 'l')) s->kind = 'd';
+	    break;
+	case 's':
+	    if (len == 0) s->kind = 's';
+	    break;
+	case 'p':
+	    s->kind = 'p';
+	    break;
+    }
+    return s->end;
+}
+
+int
+DBGLogSignature( const char *_Fmt, char *_Sig, size_t _SigLen )
+{
+    dbglog_spec_t spec;
+    const char *p = _Fmt;
+    size_t n = 0;
+    int i;
+
+    while ((p = nextSpec(p, &spec)) != NULL) {
+	if (spec.kind == 0)
+	    continue;
+	if (spec.kind == '?' || n + spec.nstar + 1 >= _SigLen)
+	    return -1;
+	for (i = 0; i < spec.nstar; i++)
+	    _Sig[n++] = '*';
+	_Sig[n++] = spec.kind;
+    }
+    _Sig[n] = 0;
+    return 0;
+}
+
+/*--------------------------------------------------------------------------*/
+/* Record the arguments of a site.  Returns the bytes used.                 */
+/*--------------------------------------------------------------------------*/
+static size_t
+encodeArgs(const char *_Sig, va_list ap, unsigned char *out, size_t outLen)
+{
+    size_t n = 0;
+    const char *str;
+    size_t len;
+    double d;
+    uint64_t v;
+
+    for (; *_Sig; _Sig++) {
+	if (*_Sig == '*' || *_Sig == 'i') {
+	    if (n + 4 > outLen) break;
+	    put32(out + n, (uint32_t) va_arg(ap, int));
+	    n += 4;
+	    continue;
+	}
+	if (*_Sig == 's') {
+	    str = va_arg(ap, const char *);
+	    if (str == NULL) str = "(null)";
+	    if (n + 2 > outLen) break;
+	    len = strlen(str);
+	    if (len > outLen - n - 2) len = outLen - n - 2;
+	    out[n] = (unsigned char) len;
+	    out[n + 1] = (unsigned char) (len >> 8);
+	    memcpy(out + n + 2, str, len);
+	    n += 2 + len;
+	    continue;
+	}
+	switch (*_Sig) {
+	    case 'l': v = (uint64_t) (int64_t) va_arg(ap, long); break;
+	    case 'L': v = va_arg(ap, unsigned long); break;
+	    case 'q': v = (uint64_t) va_arg(ap, long long); break;
+	    case 'Q': v = va_arg(ap, unsigned long long); break;
+	    case 'z': v = va_arg(ap, size_t); break;
+	    case 'y': v = (uint64_t) (int64_t) va_arg(ap, ptrdiff_t); break;
+	    case 'p': v = (uintptr_t) va_arg(ap, void *); break;
+	    case 'd':
+		d = va_arg(ap, double);
+		memcpy(&v, &d, sizeof (v));
+		break;
+	    default: v = 0; break;
+	}
+	if (n + 8 > outLen) break;
+	put64(out + n, v);
+	n += 8;
+    }
+    return n;
+}
+
+void
+DBGLogFormat( const char *_Fmt, const char *_Sig, const unsigned char *_Args,
+	size_t _Len, char *_Out, size_t _OutLen )
+{
+    dbglog_spec_t spec;
+    const char *p = _Fmt;
+    const char *lit = _Fmt;
+    char conv[32];
+    char str[DBGLOG_MAXLINE];
+    int star[2];
+    size_t n = 0;
+    size_t a = 0;
+    size_t len;
+    uint64_t v;
+    double d;
+    int i, w;
+
+    _Out[0] = 0;
+#define OUT_LEFT (n < _OutLen ? _OutLen - n : 0)
+#define OUT_PTR (_Out + (n < _OutLen ? n : _OutLen - 1))
+    while ((p = nextSpec(p, &spec)) != NULL) {
+	// text before the conversion
+	len = spec.start - lit;
+	w = snprintf(OUT_PTR, OUT_LEFT, "%.*s", (int) len, lit);
+	n += w > 0 ? w : 0;
+	lit = spec.end;
+	if (spec.kind == 0) {
+	    w = snprintf(OUT_PTR, OUT_LEFT, "%%");
+	    n += w > 0 ? w : 0;
+	    continue;
+	}
+	for (i = 0; i < spec.nstar && *_Sig == '*'; i++, _Sig++) {
+	    star[i] = a + 4 <= _Len ? (int32_t) get32(_Args + a) : 0;
+	    a += 4;
+	}
+	// the conversion with 64 bit integers, the recorded width
+	len = spec.lenStart - spec.start;
+	if (len > sizeof (conv) - 4) len = sizeof (conv) - 4;
+	memcpy(conv, spec.start, len);
+	if (strchr("lLqQzy", *_Sig)) {
+	    conv[len++] = 'l';
+	    conv[len++] = 'l';
+	} else if (*_Sig == 'i') {
+	    // keep h and hh, they narrow the int
+	    size_t ml = spec.lenEnd - spec.lenStart;
+	    if (len + ml < sizeof (conv) - 2) {
+		memcpy(conv + len, spec.lenStart, ml);
+		len += ml;
+	    }
+	}
+	conv[len++] = spec.lenEnd[0];
+	conv[len] = 0;
+
+	w = 0;
+	switch (*_Sig) {
+	    case 'i':
+		v = a + 4 <= _Len ? get32(_Args + a) : 0;
+		a += 4;
+		if (spec.nstar == 2) w = snprintf(OUT_PTR, OUT_LEFT, conv, star[0], star[1], (int32_t) v);
+		else if (spec.nstar == 1) w = snprintf(OUT_PTR, OUT_LEFT, conv, star[0], (int32_t) v);
+		else w = snprintf(OUT_PTR, OUT_LEFT, conv, (int32_t) v);
+		break;
+	    case 'l': case 'q': case 'y':
+	    case 'L': case 'Q': case 'z':
+		v = a + 8 <= _Len ? get64(_Args + a) : 0;
+		a += 8;
+		if (strchr("lqy", *_Sig)) {
+		    if (spec.nstar == 2) w = snprintf(OUT_PTR, OUT_LEFT, conv, star[0], star[1], (long long) v);
+		    else if (spec.nstar == 1) w = snprintf(OUT_PTR, OUT_LEFT, conv, star[0], (long long) v);
+		    else w = snprintf(OUT_PTR, OUT_LEFT, conv, (long long) v);
+		} else {
+		    if (spec.nstar == 2) w = snprintf(OUT_PTR, OUT_LEFT, conv, star[0], star[1], (unsigned long long) v);
+		    else if (spec.nstar == 1) w = snprintf(OUT_PTR, OUT_LEFT, conv, star[0], (unsigned long long) v);
+		    else w = snprintf(OUT_PTR, OUT_LEFT, conv, (unsigned long long) v);
+		}
+		break;
+	    case 'd':
+		v = a + 8 <= _Len ? get64(_Args + a) : 0;
+		a += 8;
+		memcpy(&d, &v, sizeof (d));
+		if (spec.nstar == 2) w = snprintf(OUT_PTR, OUT_LEFT, conv, star[0], star[1], d);
+		else if (spec.nstar == 1) w = snprintf(OUT_PTR, OUT_LEFT, conv, star[0], d);
+		else w = snprintf(OUT_PTR, OUT_LEFT, conv, d);
+		break;
+	    case 's':
+		len = a + 2 <= _Len ? (size_t) (_Args[a] | _Args[a + 1] << 8) : 0;
+		a += 2;
+		if (a + len > _Len) len = a < _Len ? _Len - a : 0;
+		if (len >= sizeof (str)) len = sizeof (str) - 1;
+		memcpy(str, _Args + a, len);
+		str[len] = 0;
+		a += len;
+		if (spec.nstar == 2) w = snprintf(OUT_PTR, OUT_LEFT, conv, star[0], star[1], str);
+		else if (spec.nstar == 1) w = snprintf(OUT_PTR, OUT_LEFT, conv, star[0], str);
+		else w = snprintf(OUT_PTR, OUT_LEFT, conv, str);
+		break;
+	    case 'p':
+		v = a + 8 <= _Len ? get64(_Args + a) : 0;
+		a += 8;
+		w = snprintf(OUT_PTR, OUT_LEFT, "0x%llx", (unsigned long long) v);
+		break;
+	}
+	n += w > 0 ? w : 0;
+	if (*_Sig) _Sig++;
+    }
+    snprintf(OUT_PTR, OUT_LEFT, "%s", lit);
+#undef OUT_LEFT
+#undef OUT_PTR
+}
+
+/*--------------------------------------------------------------------------*/
+/* Format and write one record.  Only ever called by one thread at a time.  */
+/*--------------------------------------------------------------------------*/
+static long
+writeFrame(FILE *FH, char kind, const dbglog_site_t *site, time_t stamp,
+	const void *payload, size_t len)
+{
+    unsigned char hdr[18];
+
+    hdr[0] = kind;
+    hdr[1] = site->module;
+    hdr[2] = site->level;
+    hdr[3] = 0;
+    put32(hdr + 4, site->id);
+    put64(hdr + 8, (uint64_t) (int64_t) stamp);
+    hdr[16] = (unsigned char) len;
+    hdr[17] = (unsigned char) (len >> 8);
+    fwrite(hdr, sizeof (hdr), 1, FH);
+    fwrite(payload, len, 1, FH);
+    return sizeof (hdr) + len;
+}
+
+static long
+writeBinary(FILE *FH, const dbglog_record_t *rec)
+{
+    const dbglog_site_t *site = sites[rec->site];
+    char def[DBGLOG_MAXLINE + DBGLOG_MAXARGS + 2];
+    size_t flen, slen;
+    long n = 0;
+
+    if (!siteDefined[rec->site]) {
+	flen = strlen(site->fmt);
+	slen = strlen(site->sig);
+	if (flen > DBGLOG_MAXLINE) flen = DBGLOG_MAXLINE;
+	memcpy(def, site->fmt, flen);
+	def[flen] = 0;
+	memcpy(def + flen + 1, site->sig, slen + 1);
+	n += writeFrame(FH, 'F', site, rec->stamp, def, flen + slen + 2);
+	siteDefined[rec->site] = 1;
+    }
+    return n + writeFrame(FH, 'M', site, rec->stamp, rec->text, rec->len);
+}
+
+/*--------------------------------------------------------------------------*/
+/* Time of the first record of a log, so that its age counts across         */
+/* restarts.  Returns now if there is none.                                 */
+/*--------------------------------------------------------------------------*/
+static time_t
+startedAt(const dbglog_file_t *f, time_t now)
+{
+    unsigned char hdr[18];
+    char    line[128];
+    struct  tm tm;
+    const char *p;
+    time_t  t = -1;
+    FILE    *FH;
+
+    if ((FH = fopen(f->path, "rb")) == NULL)
+	return now;
+    if (f->binary) {
+	if (fseek(FH, strlen(DBGLOG_MAGIC), SEEK_SET) == 0 && fread(hdr, sizeof (hdr), 1, FH) == 1)
+	    t = (time_t) (int64_t) get64(hdr + 8);
+    } else if (fgets(line, sizeof (line), FH) != NULL) {
+	// the stamp, YYYY/MM/DD hh:mm:ss, follows the key if there is one
+	for (p = line; strlen(p) >= 19 && t == -1; p++) {
+	    memset(&tm, 0, sizeof (tm));
+	    if (!isdigit((unsigned char) p[0]) || p[4] != '/' ||
+		    sscanf(p, "%d/%d/%d %d:%d:%d", &tm.tm_year, &tm.tm_mon, &tm.tm_mday,
+		    &tm.tm_hour, &tm.tm_min, &tm.tm_sec) != 6)
+		continue;
+	    tm.tm_year -= 1900;
+	    tm.tm_mon -= 1;
+	    tm.tm_isdst = -1;
+	    t = mktime(&tm);
+	}
+    }
+    fclose(FH);
+    return t > 0 && t <= now ? t : now;
+}
+
+/*--------------------------------------------------------------------------*/
+/* Start writing a log, appending to what is there.                         */
+/*--------------------------------------------------------------------------*/
+static int
+openLog(dbglog_file_t *f, time_t now)
+{
+    if ((f->FH = fopen(f->path, f->binary ? "ab" : "a")) == NULL)
+	return -1;
+    setvbuf(f->FH, NULL, _IOFBF, DBGLOG_BUFFER);
+    fseek(f->FH, 0, SEEK_END);
+    f->size = ftell(f->FH);
+    f->opened = f->size > (f->binary ? (long) strlen(DBGLOG_MAGIC) : 0) ? startedAt(f, now) : now;
+    if (f->binary) {
+	// formats are written again, ids may differ from an earlier run
+	memset(siteDefined, 0, sizeof (siteDefined));
+	if (f->size == 0) {
+	    fputs(DBGLOG_MAGIC, f->FH);
+	    f->size = strlen(DBGLOG_MAGIC);
+	}
+    }
+    return 0;
+}
+
+/*--------------------------------------------------------------------------*/
+/* Name of generation gen of a log, compressed or not.                      */
+/*--------------------------------------------------------------------------*/
+static void
+generationName(const dbglog_file_t *f, int gen, int gz, char *name, size_t len)
+{
+    snprintf(name, len, "%s.%d%s", f->path, gen, gz ? ".gz" : "");
+}
+
+/*--------------------------------------------------------------------------*/
+/* Close the current generation, shift the older ones and start a new one.  */
+/*--------------------------------------------------------------------------*/
+static void
+rotateLog(dbglog_file_t *f, time_t now)
+{
+    char from[300];
+    char to[300];
+    char *argv[4];
+    int gen, gz;
+
+    fclose(f->FH);
+    f->FH = NULL;
+    if (f->gzip > 0) {
+	// the last generation must be compressed before it moves
+	waitpid(f->gzip, NULL, 0);
+	f->gzip = 0;
+    }
+
+    if (sGenerations <= 0) {
+	unlink(f->path);
+    } else {
+	for (gz = 0; gz < 2; gz++) {
+	    generationName(f, sGenerations, gz, to, sizeof (to));
+	    unlink(to);
+	}
+	for (gen = sGenerations - 1; gen >= 1; gen--) {
+	    for (gz = 0; gz < 2; gz++) {
+		generationName(f, gen, gz, from, sizeof (from));
+		generationName(f, gen + 1, gz, to, sizeof (to));
+		rename(from, to);
+	    }
+	}
+	generationName(f, 1, 0, to, sizeof (to));
+	rename(f->path, to);
+	if (sCompress) {
+	    argv[0] = "gzip";
+	    argv[1] = "-f";
+	    argv[2] = to;
+	    argv[3] = NULL;
+	    if (posix_spawnp(&f->gzip, "gzip", NULL, NULL, argv, environ) != 0)
+		f->gzip = 0;
+	}
+    }
+    openLog(f, now);
+}
+
+/*--------------------------------------------------------------------------*/
+/* Get a log ready for the next record.  Returns its file or NULL.          */
+/*--------------------------------------------------------------------------*/
+static FILE *
+logFor(dbglog_file_t *f, time_t now)
+{
+    if (f->FH == NULL) {
+	if (openLog(f, now) != 0)
+	    return NULL;
+    } else if ((sMaxSize > 0 && f->size >= sMaxSize) ||
+	    (sMaxAge > 0 && now - f->opened >= sMaxAge && f->size > (f->binary ? (long) strlen(DBGLOG_MAGIC) : 0))) {
+	rotateLog(f, now);
+    }
+    return f->FH;
+}
+
+static void
+writeRecord(const dbglog_record_t *rec)
+{
+    static time_t   lastStamp = -1;
+    static struct   tm tm;
+    static char     text[DBGLOG_MAXLINE];
+    const char *str = rec->text;
+    FILE    *FH;
+    size_t  len;
+    int     w;
+
+    if (rec->stamp != lastStamp) {
+	localtime_r(&rec->stamp, &tm);
+	lastStamp = rec->stamp;
+    }
+
+    if (rec->site != SITE_TEXT && (sVerbose || !sBinary)) {
+	DBGLogFormat(sites[rec->site]->fmt, sites[rec->site]->sig,
+		(const unsigned char *) rec->text, rec->len, text, sizeof (text));
+	str = text;
+    }
+    len = strlen(str);
+
+    if (rec->runlog) {
+	if ((FH = logFor(&runFile, rec->stamp)) == NULL)
+	    return;
+	w = fprintf(FH, "%04d/%02d/%02d %02d:%02d:%02d ", tm.tm_year+1900, tm.tm_mon+1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec);
+	fputs(str, FH);
+	runFile.size += (w > 0 ? w : 0) + len;
+	if (len == 0 || str[len - 1] != '\n') {
+	    fputc('\n', FH);
+	    runFile.size++;
+	}
+	unflushed++;
+	return;
+    }
+
+    if (sDebug && (FH = logFor(&debugFile, rec->stamp)) != NULL) {
+	if (sBinary) {
+	    debugFile.size += writeBinary(FH, rec);
+	} else {
+	    w = fprintf(FH, "%s-%04d/%02d/%02d %02d:%02d:%02d ", sMyKey, tm.tm_year+1900, tm.tm_mon+1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec);
+	    fputs(str, FH);
+	    debugFile.size += (w > 0 ? w : 0) + len;
+	    if (len == 0 || str[len - 1] != '\n') {
+		fputc('\n', FH);
+		debugFile.size++;
+	    }
+	}
+	unflushed++;
+    }
+
+    if (sVerbose)
+	printf("%s-%04d/%02d/%02d %02d:%02d:%02d  %s\n", sMyKey, tm.tm_year+1900, tm.tm_mon+1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec, str);
+}
+
+/*--------------------------------------------------------------------------*/
+/* Write every record that is ready.  Returns the number written.           */
+/*--------------------------------------------------------------------------*/
+static int
+drainRing(void)
+{
+    dbglog_record_t *rec;
+    dbglog_record_t note;
+    unsigned long   lost;
+    time_t  now;
+    int     urgent = 0;
+    int     n = 0;
+
+    for (;;) {
+	rec = &ring[ringTail % DBGLOG_RING];
+	if (__atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE) != ringTail + 1)
+	    break;
+	writeRecord(rec);
+	if (rec->level == DBG_ERROR)
+	    urgent = 1;
+	__atomic_store_n(&rec->seq, ringTail + DBGLOG_RING, __ATOMIC_RELEASE);
+	ringTail++;
+	n++;
+    }
+
+    if ((lost = __atomic_exchange_n(&dropped, 0, __ATOMIC_RELAXED)) != 0) {
+	note.stamp = time(NULL);
+	note.runlog = 0;
+	note.level = DBG_WARN;
+	if (sBinary) {
+	    const char *str = "DBGLog - dropped messages, log ring full";
+	    note.site = 0;
+	    note.len = 2 + strlen(str);
+	    note.text[0] = (char) strlen(str);
+	    note.text[1] = 0;
+	    memcpy(note.text + 2, str, strlen(str));
+	} else {
+	    note.site = SITE_TEXT;
+	    snprintf(note.text, sizeof (note.text), "DBGLog - dropped %lu messages, log ring full", lost);
+	}
+	writeRecord(&note);
+	n++;
+    }
+
+    if (n > 0 && sVerbose)
+	fflush(stdout);
+
+    // write to the card in large pieces, errors go out at once
+    now = time(NULL);
+    if (unflushed > 0 && (urgent || now - lastFlush >= sFlushInterval || now < lastFlush)) {
+	if (debugFile.FH != NULL) fflush(debugFile.FH);
+	if (runFile.FH != NULL) fflush(runFile.FH);
+	unflushed = 0;
+	lastFlush = now;
+    }
+    return n;
+}
+
+static int
+ringEmpty(void)
+{
+    return __atomic_load_n(&ring[ringTail % DBGLOG_RING].seq, __ATOMIC_ACQUIRE) != ringTail + 1;
+}
+
+/*--------------------------------------------------------------------------*/
+/* Reap the compressor of a rotated log once it has finished.               */
+/*--------------------------------------------------------------------------*/
+static void
+reapGzip(dbglog_file_t *f)
+{
+    if (f->gzip > 0 && waitpid(f->gzip, NULL, WNOHANG) != 0)
+	f->gzip = 0;
+}
+
+/*--------------------------------------------------------------------------*/
+/*--------------------------------------------------------------------------*/
+static void *
+writerThread(void *arg)
+{
+    struct timespec until;
+
+    while (!__atomic_load_n(&writerStop, __ATOMIC_ACQUIRE)) {
+	if (drainRing() > 0)
+	    continue;
+	pthread_mutex_lock(&writerLock);
+	__atomic_store_n(&writerIdle, 1, __ATOMIC_SEQ_CST);
+	if (ringEmpty() && !__atomic_load_n(&writerStop, __ATOMIC_ACQUIRE)) {
+	    // the timeout covers a wake up lost between the check and the wait
+	    clock_gettime(CLOCK_REALTIME, &until);
+	    until.tv_nsec += DBGLOG_IDLE_MS * 1000000L;
+	    until.tv_sec += until.tv_nsec / 1000000000L;
+	    until.tv_nsec %= 1000000000L;
+	    pthread_cond_timedwait(&writerWake, &writerLock, &until);
+	}
+	__atomic_store_n(&writerIdle, 0, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&writerLock);
+	reapGzip(&debugFile);
+	reapGzip(&runFile);
+    }
+    drainRing();
+    return NULL;
+}
+
+/*--------------------------------------------------------------------------*/
+/* Claim a slot on the ring.  Returns NULL if the message is dropped.       */
+/*--------------------------------------------------------------------------*/
+static dbglog_record_t *
+claimRecord(unsigned long *_Pos)
+{
+    dbglog_record_t *rec;
+    unsigned long   pos;
+    long    diff;
+
+    pos = __atomic_load_n(&ringHead, __ATOMIC_RELAXED);
+    for (;;) {
+	rec = &ring[pos % DBGLOG_RING];
+	diff = (long) (__atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE) - pos);
+	if (diff == 0) {
+	    if (__atomic_compare_exchange_n(&ringHead, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		break;
+	} else if (diff < 0) {
+	    // full
+	    if (sOverflow == DBGLOG_DROP || !writerRunning) {
+		__atomic_add_fetch(&dropped, 1, __ATOMIC_RELAXED);
+		return NULL;
+	    }
+	    pthread_cond_signal(&writerWake);
+	    sched_yield();
+	    pos = __atomic_load_n(&ringHead, __ATOMIC_RELAXED);
+	} else {
+	    pos = __atomic_load_n(&ringHead, __ATOMIC_RELAXED);
+	}
+    }
+    rec->stamp = time(NULL);
+    *_Pos = pos;
+    return rec;
+}
+
+/*--------------------------------------------------------------------------*/
+/* Hand a filled slot to the writer.                                        */
+/*--------------------------------------------------------------------------*/
+static void
+commitRecord(dbglog_record_t *rec, unsigned long pos)
+{
+    __atomic_store_n(&rec->seq, pos + 1, __ATOMIC_RELEASE);
+
+    if (!writerRunning) {
+	// no writer thread, write in line
+	pthread_mutex_lock(&writerLock);
+	drainRing();
+	pthread_mutex_unlock(&writerLock);
+    } else if (__atomic_load_n(&writerIdle, __ATOMIC_SEQ_CST)) {
+	pthread_cond_signal(&writerWake);
+    }
+}
+
+/*--------------------------------------------------------------------------*/
+/* Give a site its id and argument kinds.  Returns 0 if it can be logged    */
+/* raw.                                                                     */
+/*--------------------------------------------------------------------------*/
+static int
+registerSite(dbglog_site_t *site)
+{
+    int id = __atomic_load_n(&site->id, __ATOMIC_ACQUIRE);
+
+    if (id != 0)
+	return id > 0 ? 0 : -1;
+    pthread_mutex_lock(&sitesLock);
+    if ((id = site->id) == 0) {
+	if (nsites >= DBGLOG_MAXSITES || DBGLogSignature(site->fmt, site->sig, sizeof (site->sig)) != 0) {
+	    id = -1;
+	} else {
+	    id = nsites;
+	    sites[nsites++] = site;
+	}
+	__atomic_store_n(&site->id, id, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&sitesLock);
+    return id > 0 ? 0 : -1;
+}
+
+static void
+queueRecord(const char *_Str, int _RunLog)
+{
+    dbglog_record_t *rec;
+    unsigned long   pos;
+    size_t  len;
+
+    if ((rec = claimRecord(&pos)) == NULL)
+	return;
+    rec->runlog = _RunLog;
+    rec->level = DBG_INFO;
+    if (sBinary && !_RunLog) {
+	len = strlen(_Str);
+	if (len > sizeof (rec->text) - 2) len = sizeof (rec->text) - 2;
+	rec->site = 0;
+	rec->len = 2 + len;
+	rec->text[0] = (char) len;
+	rec->text[1] = (char) (len >> 8);
+	memcpy(rec->text + 2, _Str, len);
+    } else {
+	rec->site = SITE_TEXT;
+	strncpy(rec->text, _Str, sizeof (rec->text) - 1);
+	rec->text[sizeof (rec->text) - 1] = 0;
+    }
+    commitRecord(rec, pos);
+}
+
+/*--------------------------------------------------------------------------*/
+/*--------------------------------------------------------------------------*/
+void
+DBGLogf( dbglog_site_t *_Site, const char *_Fmt, ... )
+{
+    dbglog_record_t *rec;
+    unsigned long   pos;
+    va_list ap;
+
+    if ((rec = claimRecord(&pos)) == NULL)
+	return;
+    rec->runlog = 0;
+    rec->level = _Site->level;
+    va_start(ap, _Fmt);
+    if (sBinary && registerSite(_Site) == 0) {
+	rec->site = _Site->id;
+	rec->len = encodeArgs(_Site->sig, ap, (unsigned char *) rec->text, sizeof (rec->text));
+    } else if (sBinary) {
+	// not recordable raw, send the text through the WriteDBGLog site
+	char text[DBGLOG_MAXLINE];
+	size_t len;
+	vsnprintf(text, sizeof (text), _Fmt, ap);
+	len = strlen(text);
+	if (len > sizeof (rec->text) - 2) len = sizeof (rec->text) - 2;
+	rec->site = 0;
+	rec->len = 2 + len;
+	rec->text[0] = (char) len;
+	rec->text[1] = (char) (len >> 8);
+	memcpy(rec->text + 2, text, len);
+    } else {
+	rec->site = SITE_TEXT;
+	vsnprintf(rec->text, sizeof (rec->text), _Fmt, ap);
+    }
+    va_end(ap);
+    commitRecord(rec, pos);
+}
 
 /*--------------------------------------------------------------------------*/
 /*--------------------------------------------------------------------------*/
 void
 InitDBGLog( char *_Key, char * _FileName, int _Debug, int _Verbose )
 {
+    unsigned long i;
 
-    strcpy( sMyKey, _Key );
-    strcpy( sDebugLog, _FileName );
+    strncpy( sMyKey, _Key, sizeof (sMyKey) - 1 );
+    strncpy( debugFile.path, _FileName, sizeof (debugFile.path) - 1 );
+    debugFile.binary = sBinary;
 	sVerbose = _Verbose;
     sDebug = _Debug;
 
+    for (i = 0; i < DBGLOG_RING; i++)
+	ring[i].seq = i;
+
+    lastFlush = time(NULL);
+    if (sDebug)
+	openLog(&debugFile, lastFlush);
+
+    if (sDebug || sVerbose) {
+	for (i = 0; i < DBG_MODULE_COUNT; i++)
+	    dbgLevels[i] = sLevels[i];
+    }
+
+    if (pthread_create(&writer, NULL, writerThread, NULL) == 0) {
+	writerRunning = 1;
+	atexit(CloseDBGLog);
+    }
 }
 
+/*--------------------------------------------------------------------------*/
+/*--------------------------------------------------------------------------*/
+void
+SetDBGLogOverflow( int _Policy )
+{
+    sOverflow = _Policy;
+}
 
 /*--------------------------------------------------------------------------*/
 /*--------------------------------------------------------------------------*/
 void
-WriteDBGLog( char *_Str )
+SetDBGLogRotation( long _MaxSize, long _MaxAge, int _Generations, int _Compress )
 {
-    FILE  *FH;
-    time_t  tt;
-    struct  tm      *tm;
-	char	header[512];
+    sMaxSize = _MaxSize;
+    sMaxAge = _MaxAge;
+    sGenerations = _Generations;
+    sCompress = _Compress;
+}
 
-	tt = time(NULL);
-	tm = localtime(&tt);
-	sprintf(header, "%s-%04d/%02d/%02d %02d:%02d:%02d ", sMyKey, tm->tm_year+1900, tm->tm_mon+1, tm->tm_mday, tm->tm_hour, tm->tm_min, tm->tm_sec);
+/*--------------------------------------------------------------------------*/
+/*--------------------------------------------------------------------------*/
+void
+SetDBGLogFlush( int _Seconds )
+{
+    sFlushInterval = _Seconds;
+}
 
+/*--------------------------------------------------------------------------*/
+/*--------------------------------------------------------------------------*/
+void
+SetDBGLogBinary( int _Binary )
+{
+    sBinary = _Binary;
+}
 
+/*--------------------------------------------------------------------------*/
+/*--------------------------------------------------------------------------*/
+void
+SetDBGLogLevel( int _Module, int _Level )
+{
+    int i;
 
-    if (sDebug)
-    {
-        FH = fopen(sDebugLog, "a+");
-        if (FH == NULL)
-        {
-            return;
-        } /* endif */
+    for (i = 0; i < DBG_MODULE_COUNT; i++) {
+	if (_Module != -1 && _Module != i)
+	    continue;
+	sLevels[i] = _Level;
+	if (sDebug || sVerbose)
+	    dbgLevels[i] = _Level;
+    }
+}
 
-        fputs( header, FH );
+/*--------------------------------------------------------------------------*/
+/*--------------------------------------------------------------------------*/
+int
+DBGLogModule( const char *_Name )
+{
+    int i;
 
-        fputs( _Str, FH );
-        
-        if ( _Str[ strlen( _Str) - 1] != '\n' )
-            fprintf( FH, "\n" );
-        
-        fclose(FH);
-    } /* endif */
+    for (i = 0; i < DBG_MODULE_COUNT; i++) {
+	if (strcmp(moduleNames[i], _Name) == 0)
+	    return i;
+    }
+    return -1;
+}
 
-	if ( sVerbose )
-		printf( "%s %s\n", header, _Str );
+/*--------------------------------------------------------------------------*/
+/*--------------------------------------------------------------------------*/
+int
+DBGLogLevel( const char *_Name )
+{
+    int i;
+
+    for (i = 0; i < (int) (sizeof (levelNames) / sizeof (levelNames[0])); i++) {
+	if (strcmp(levelNames[i], _Name) == 0)
+	    return i;
+    }
+    return -1;
+}
+
+/*--------------------------------------------------------------------------*/
+/*--------------------------------------------------------------------------*/
+const char *
+DBGLogModuleName( int _Module )
+{
+    return _Module >= 0 && _Module < DBG_MODULE_COUNT ? moduleNames[_Module] : "?";
+}
+
+/*--------------------------------------------------------------------------*/
+/*--------------------------------------------------------------------------*/
+const char *
+DBGLogLevelName( int _Level )
+{
+    return _Level >= 0 && _Level <= DBG_DEBUG ? levelNames[_Level] : "?";
 }
 
 /*--------------------------------------------------------------------------*/
 /*--------------------------------------------------------------------------*/
 void
-WriteRunLog( char *_Str )
-{
-    FILE  *FH;
-    time_t  tt;
-    struct  tm      *tm;
-    
-    FH = fopen("./runlog", "a+");
-    if (FH == NULL)
-    {
-        return;
-    } /* endif */
-    
-    tt = time(NULL);
-    tm = localtime(&tt);
-    fprintf(FH, "%04d/%02d/%02d %02d:%02d:%02d ", tm->tm_year+1900, tm->tm_mon+1, tm->tm_mday, tm->tm_hour, tm->tm_min, tm->tm_sec);
-    fputs( _Str, FH );
-    
-    if ( _Str[ strlen( _Str) - 1] != '\n' )
-        fprintf( FH, "\n" );
-    
-    fclose(FH);
+CloseDBGLog( void )
+{
+    if (writerRunning && !pthread_equal(pthread_self(), writer)) {
+	pthread_mutex_lock(&writerLock);
+	__atomic_store_n(&writerStop, 1, __ATOMIC_RELEASE);
+	pthread_cond_signal(&writerWake);
+	pthread_mutex_unlock(&writerLock);
+	pthread_join(writer, NULL);
+	writerRunning = 0;
+    }
+    if (debugFile.FH != NULL) {
+	fclose(debugFile.FH);
+	debugFile.FH = NULL;
+    }
+    if (runFile.FH != NULL) {
+	fclose(runFile.FH);
+	runFile.FH = NULL;
+    }
+}
+
+/*--------------------------------------------------------------------------*/
+/*--------------------------------------------------------------------------*/
+void
+WriteDBGLog( const char *_Str )
+{
+    if (!DBGLOG_ON(DBG_MAIN, DBG_INFO))
+	return;
+    queueRecord(_Str, 0);
+}
 
+/*--------------------------------------------------------------------------*/
+/*--------------------------------------------------------------------------*/
+void
+WriteRunLog( const char *_Str )
+{
+    queueRecord(_Str, 1);
 }
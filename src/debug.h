@@ -14,12 +14,199 @@
 #ifndef DEBUG_H
 #define DEBUG_H
 
+#include <stddef.h>
+
+#ifndef DBGLOG_RING
+#define DBGLOG_RING 256 ///< records queued before the overflow policy applies
+#endif
+
+#ifndef DBGLOG_MAXLINE
+#define DBGLOG_MAXLINE 512 ///< longest message kept, longer ones are truncated
+#endif
+
+#ifndef DBGLOG_IDLE_MS
+#define DBGLOG_IDLE_MS 200 ///< longest the writer sleeps with nothing queued
+#endif
+
+#ifndef DBGLOG_BUFFER
+#define DBGLOG_BUFFER 65536 ///< bytes gathered before a write to the card
+#endif
+
+#ifndef DBGLOG_FLUSH
+#define DBGLOG_FLUSH 5 ///< default seconds between flushes of the logs
+#endif
+
+#ifndef DBGLOG_MAXSIZE
+#define DBGLOG_MAXSIZE (1024L * 1024L) ///< default bytes before a log is rotated
+#endif
+
+#ifndef DBGLOG_MAXAGE
+#define DBGLOG_MAXAGE 86400L ///< default seconds before a log is rotated
+#endif
+
+#ifndef DBGLOG_GENERATIONS
+#define DBGLOG_GENERATIONS 3 ///< default rotated logs kept
+#endif
+
+#ifndef DBGLOG_MAXSITES
+#define DBGLOG_MAXSITES 1024 ///< distinct DBGLOG call sites in binary mode
+#endif
+
+#ifndef DBGLOG_MAXARGS
+#define DBGLOG_MAXARGS 16 ///< arguments of one DBGLOG call in binary mode
+#endif
+
+#define DBGLOG_DROP 0 ///< drop new messages while the ring is full
+#define DBGLOG_BLOCK 1 ///< wait for the writer while the ring is full
+
+#define DBGLOG_MAGIC "P2MLOG1\n" ///< first bytes of a binary debug log
+
+/* Levels, a message is kept when its level is at or below the threshold */
+#define DBG_ERROR 0
+#define DBG_WARN 1
+#define DBG_INFO 2
+#define DBG_DEBUG 3
+
+/* Modules with their own threshold */
+typedef enum {
+    DBG_MAIN,
+    DBG_MQTT,
+    DBG_RAVEN,
+    DBG_DS18B20,
+    DBG_DHT22,
+    DBG_DOORSWITCH,
+    DBG_TEMPSENSOR,
+    DBG_RULES,
+    DBG_VIRTUAL,
+    DBG_MODULE_COUNT
+} dbglog_module_t;
+
+/**
+ * One DBGLOG call site.  The id and argument kinds are filled in the first
+ * time it logs in binary mode.
+ */
+typedef struct {
+    const char *fmt; ///< printf format
+    unsigned char module; ///< dbglog_module_t
+    unsigned char level; ///< DBG_ERROR .. DBG_DEBUG
+    int id; ///< id in binary logs, 0 until first used
+    char sig[DBGLOG_MAXARGS + 1]; ///< kind of each argument
+} dbglog_site_t;
+
+/** Threshold of each module, -1 while logging is off */
+extern signed char dbgLevels[DBG_MODULE_COUNT];
+
+/** True if a message of this module and level would be kept */
+#define DBGLOG_ON(_Module, _Level) ((_Level) <= dbgLevels[_Module])
+
+/**
+ * Log a printf style message.  Nothing, not even the arguments, is
+ * evaluated unless the module threshold lets the level through.  In binary
+ * mode the arguments are recorded raw and formatted later.
+ */
+#define DBGLOG(_Module, _Level, ...) \
+    do { \
+	if (DBGLOG_ON(_Module, _Level)) { \
+	    static dbglog_site_t _dbgSite = { DBGLOG_FMT(__VA_ARGS__, ), _Module, _Level, 0, "" }; \
+	    DBGLogf(&_dbgSite, __VA_ARGS__); \
+	} \
+    } while (0)
+#define DBGLOG_FMT(_Fmt, ...) _Fmt
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+/**
+ * Open the debug log and start the writer thread.  Messages are queued
+ * by WriteDBGLog and written in batches in the background.
+ */
 void InitDBGLog( char *_Key, char * _FileName, int _Debug, int _Verbose );
-void WriteDBGLog( char *_Str );
+
+/**
+ * Choose what WriteDBGLog does when the ring is full, DBGLOG_DROP or
+ * DBGLOG_BLOCK.  Dropped messages are counted and reported in the log.
+ */
+void SetDBGLogOverflow( int _Policy );
+
+/**
+ * Write out everything queued, stop the writer and close the logs.  Also
+ * run at exit.
+ */
+void CloseDBGLog( void );
+
+/**
+ * Queue a message for the debug log.  Safe to call from any thread, never
+ * does file I/O itself once InitDBGLog has started the writer.
+ */
+void WriteDBGLog( const char *_Str );
+void WriteRunLog( const char *_Str );
+
+/**
+ * Back end of DBGLOG.  _Fmt is the site format again, passed so the
+ * compiler checks the arguments against it.
+ */
+void DBGLogf( dbglog_site_t *_Site, const char *_Fmt, ... )
+#ifdef __GNUC__
+    __attribute__ ((format (printf, 2, 3)))
+#endif
+    ;
+
+/**
+ * Write the debug log as binary records of format id and raw arguments,
+ * decoded later by pi2mqtt-logdecode.  Must be called before InitDBGLog.
+ */
+void SetDBGLogBinary( int _Binary );
+
+/**
+ * Rotate the debug log and the runlog once they reach _MaxSize bytes or
+ * have been written for _MaxAge seconds, 0 turns either check off.  The
+ * last _Generations logs are kept as file.1 (newest) to file.N, gzipped
+ * when _Compress is set.
+ */
+void SetDBGLogRotation( long _MaxSize, long _MaxAge, int _Generations, int _Compress );
+
+/**
+ * Flush the logs every _Seconds.  Until then writes are gathered in
+ * DBGLOG_BUFFER byte buffers.  Error messages are flushed at once.
+ */
+void SetDBGLogFlush( int _Seconds );
+
+/**
+ * Set the threshold of one module, or of all of them when _Module is -1.
+ */
+void SetDBGLogLevel( int _Module, int _Level );
+
+/** Module number from its name, -1 if unknown */
+int DBGLogModule( const char *_Name );
+
+/** Level number from its name, -1 if unknown */
+int DBGLogLevel( const char *_Name );
+
+/** Name of a module, "?" if unknown */
+const char *DBGLogModuleName( int _Module );
+
+/** Name of a level, "?" if unknown */
+const char *DBGLogLevelName( int _Level );
+
+/**
+ * Format raw arguments recorded in binary mode.
+ * @param _Fmt printf format of the site
+ * @param _Sig argument kinds of the site
+ * @param _Args recorded arguments
+ * @param _Len bytes in _Args
+ * @param _Out receives the text
+ * @param _OutLen size of _Out
+ */
+void DBGLogFormat( const char *_Fmt, const char *_Sig, const unsigned char *_Args,
+	size_t _Len, char *_Out, size_t _OutLen );
+
+/**
+ * Argument kinds of a format, as stored in dbglog_site_t.sig.
+ * @return 0 on success, -1 if the format uses conversions that cannot be
+ * recorded raw
+ */
+int DBGLogSignature( const char *_Fmt, char *_Sig, size_t _SigLen );
 
 #ifdef __cplusplus
 }
@@ -27,6 +27,9 @@
  * THE SOFTWARE.
  */
 
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
 
 #include <wiringPi.h>
 
@@ -36,14 +39,27 @@
 #include <sys/types.h>
 #include <string.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <errno.h>
+#ifdef HAVE_LINUX_GPIO_H
+#include <linux/gpio.h>
+#include <sys/ioctl.h>
+#include <poll.h>
+#endif
 
+#include "board.h"
+#include "capture.h"
 #include "debug.h"
+#include "metrics.h"
 #include "mqtt.h"
 #include "dht22.h"
+#include "trace.h"
 
 #define MAXTIMINGS 85
 
-static int dht22_dat[5] = {0, 0, 0, 0, 0};
 static int portpin;
 
 /**
@@ -54,12 +70,21 @@ static int portpin;
  * @return a configured port
  */
 dht22_port_t
-DHT22_create(int pin, const char *id, const char *topic, int isFahrenheit) {
+DHT22_create(int pin, const char *id, const char *topic, int isFahrenheit, int sampletime) {
     dht22_port_t port;
+    memset(&port, 0, sizeof (port));
     port.pin = pin;
+    port.sampletime = sampletime;
+    port.edgeFd = -1;
     strncpy(port.id, id, sizeof (port.id));
     strncpy(port.topic, topic, sizeof (port.topic));
     port.fahrenheitscale = isFahrenheit;
+    port.readSeconds = metrics_histogram("dht22_read_seconds", id);
+    port.readFailures = metrics_counter("dht22_read_failures_total", id);
+    port.timeouts = metrics_counter("dht22_timeouts_total", id);
+    port.checksumErrors = metrics_counter("dht22_checksum_errors_total", id);
+    port.retries = metrics_counter("dht22_retries_total", id);
+    port.successRatio = metrics_gauge("dht22_success_ratio", id);
     return (port);
 }
 
@@ -69,12 +94,165 @@ sizecvt(const int read) {
        < 256. However, they are returned as int() types. This is a safety function */
 
     if (read > 255 || read < 0) {
-        WriteDBGLog("dht22: Invalid data from wiringPi library\n");
+        DBGLOG(DBG_DHT22, DBG_ERROR, "dht22: Invalid data from wiringPi library\n");
         exit(EXIT_FAILURE);
     }
     return (uint8_t) read;
 }
 
+/**
+ * Turn the loop counts between transitions into data bits
+ * @param counters - loop counts, one per transition
+ * @param n - number of transitions seen
+ * @param dat - receives the 5 data bytes
+ * @return number of bits read
+ */
+static int
+counters2bits(const uint8_t counters[], int n, uint8_t dat[5]) {
+    int i, j = 0;
+
+    dat[0] = dat[1] = dat[2] = dat[3] = dat[4] = 0;
+    for (i = 0; i < n; i++) {
+        // ignore first 3 transitions
+        if ((i >= 4) && (i % 2 == 0) && j < 40) {
+            // shove each bit into the storage bytes
+            dat[j / 8] <<= 1;
+            if (counters[i] > 12)
+                dat[j / 8] |= 1;
+            j++;
+        }
+    }
+    return j;
+}
+
+int
+DHT22_decodeEdges(const dht22_edge_t edges[], int n, uint8_t dat[5]) {
+    uint32_t widths[DHT22_MAXEDGES];
+    int highs = 0;
+    int first, i, j;
+
+    // the level is high between a rising edge and the falling edge after it
+    for (i = 0; i + 1 < n && highs < DHT22_MAXEDGES; i++) {
+        if (edges[i].rising && !edges[i + 1].rising)
+            widths[highs++] = edges[i + 1].us - edges[i].us;
+    }
+    // the last 40 are the bits, before them are the start and the response
+    dat[0] = dat[1] = dat[2] = dat[3] = dat[4] = 0;
+    first = highs > 40 ? highs - 40 : 0;
+    for (i = first, j = 0; i < highs; i++, j++) {
+        dat[j / 8] <<= 1;
+        if (widths[i] > DHT22_ONE_US)
+            dat[j / 8] |= 1;
+    }
+    return j;
+}
+
+/**
+ * Ask the kernel for timestamped edges of the sensor's line through the GPIO
+ * character device.  The line is still driven through wiringPi for the start
+ * pulse, edge detection carries on regardless.
+ * @param port - sensor, edgeFd is set to the event descriptor or -2
+ */
+static void
+openEdges(dht22_port_t *port) {
+#ifdef HAVE_LINUX_GPIO_H
+    struct gpioevent_request req;
+    int chip;
+
+    port->edgeFd = -2;
+    if ((chip = open(DHT22_GPIOCHIP, O_RDONLY | O_CLOEXEC)) < 0) {
+        DBGLOG(DBG_DHT22, DBG_WARN, "dht22: no %s, %s is read by polling", DHT22_GPIOCHIP, port->id);
+        return;
+    }
+    memset(&req, 0, sizeof (req));
+    req.lineoffset = wpiPinToGpio(port->pin);
+    req.handleflags = GPIOHANDLE_REQUEST_INPUT;
+    req.eventflags = GPIOEVENT_REQUEST_BOTH_EDGES;
+    snprintf(req.consumer_label, sizeof (req.consumer_label), "pi2mqtt");
+    if (ioctl(chip, GPIO_GET_LINEEVENT_IOCTL, &req) < 0) {
+        DBGLOG(DBG_DHT22, DBG_WARN, "dht22: no edge events for %s, read by polling. 0x%0x - %s",
+                port->id, errno, strerror(errno));
+    } else {
+        fcntl(req.fd, F_SETFL, O_NONBLOCK);
+        port->edgeFd = req.fd;
+        DBGLOG(DBG_DHT22, DBG_INFO, "dht22: %s read from edge events of GPIO %d", port->id, req.lineoffset);
+    }
+    close(chip);
+#else
+    port->edgeFd = -2;
+#endif
+}
+
+void
+DHT22_closePort(dht22_port_t *port) {
+    if (port->edgeFd >= 0) close(port->edgeFd);
+    port->edgeFd = -1;
+}
+
+/**
+ * Throw away edges left from before a transfer.
+ * @param port - sensor with edge events
+ */
+static void
+drainEdges(const dht22_port_t *port) {
+    char buf[256];
+
+    while (read(port->edgeFd, buf, sizeof (buf)) > 0);
+}
+
+/**
+ * Collect the edges of one transfer from the kernel.
+ * @param port - sensor with edge events
+ * @param edges - receives the edges, times from the first
+ * @return number of edges
+ */
+static int
+readEdges(const dht22_port_t *port, dht22_edge_t edges[]) {
+    int n = 0;
+#ifdef HAVE_LINUX_GPIO_H
+    struct gpioevent_data ev[16];
+    struct pollfd pfd = {port->edgeFd, POLLIN, 0};
+    uint64_t t0 = 0;
+    ssize_t len;
+    int i;
+
+    // the transfer takes about 5 ms, a quiet line means it is over
+    while (n < DHT22_MAXEDGES && poll(&pfd, 1, DHT22_EDGE_TIMEOUT) > 0) {
+        if ((len = read(port->edgeFd, ev, sizeof (ev))) <= 0) break;
+        for (i = 0; i < len / (ssize_t) sizeof (ev[0]) && n < DHT22_MAXEDGES; i++, n++) {
+            if (n == 0) t0 = ev[i].timestamp;
+            edges[n].us = (ev[i].timestamp - t0) / 1000;
+            edges[n].rising = ev[i].id == GPIOEVENT_EVENT_RISING_EDGE;
+        }
+    }
+#endif
+    return n;
+}
+
+/**
+ * Run the calling thread at real-time priority, so that being preempted does
+ * not stretch the pulses it counts.
+ * @param policy - receives the policy to restore
+ * @param saved - receives the priority to restore
+ * @return 1 if the priority was raised
+ */
+static int
+enterRealtime(int *policy, struct sched_param *saved) {
+    static int warned = 0;
+    struct sched_param rt;
+
+    rt.sched_priority = BOARD_RTPRIO;
+    if (pthread_getschedparam(pthread_self(), policy, saved) != 0 ||
+            pthread_setschedparam(pthread_self(), SCHED_FIFO, &rt) != 0) {
+        if (!warned) {
+            DBGLOG(DBG_DHT22, DBG_WARN, "dht22: unable to read at real-time priority, reads may fail more often");
+            warned = 1;
+        }
+        return 0;
+    }
+    return 1;
+}
+
 /**
  * Read the DHT22 port and return the data
  * @param port
@@ -82,127 +260,179 @@ sizecvt(const int read) {
  * @return DHT22_SUCCESS if read was successful.
  */
 static int
-read_dht22_dat(dht22_port_t port, dht22_data_t *data) {
+read_dht22_dat(dht22_port_t *port, dht22_data_t *data) {
     uint8_t laststate = HIGH;
     uint8_t counter = 0;
-    uint8_t j = 0, i;
-    char buf[256];
+    uint8_t counters[MAXTIMINGS];
+    dht22_edge_t edges[DHT22_MAXEDGES];
+    uint8_t dat[5];
+    uint8_t i;
+    int j;
+    size_t n;
+    int policy;
+    int realtime;
+    struct sched_param saved;
+    double start = metrics_now();
     
-    snprintf(buf, sizeof (buf), "dht22: Reading from pin %d\n", port.pin);
-    WriteDBGLog(buf);
+    DBGLOG(DBG_DHT22, DBG_DEBUG, "dht22: Reading from pin %d\n", port->pin);
+    TRACE2(dht22_read_start, port->id, port->pin);
     
-    dht22_dat[0] = dht22_dat[1] = dht22_dat[2] = dht22_dat[3] = dht22_dat[4] = 0;
-
-    // pull pin down for 18 milliseconds
-    pinMode(port.pin, OUTPUT);
-    digitalWrite(port.pin, LOW);
-    delay(18);
-
-    // then pull it up for 40 microseconds
-    digitalWrite(port.pin, HIGH);
-    delayMicroseconds(20);
-
-    // prepare to read the pin
-    pinMode(port.pin, INPUT);
-
-    // detect change and read data
-    for (i = 0; i < MAXTIMINGS; i++) {
-        counter = 0;
-        while (digitalRead(port.pin) == laststate) {
-            counter++;
-            delayMicroseconds(1);
+    if (port->edgeFd == -1 && !capture_replaying()) openEdges(port);
+    if (capture_replaying()) {
+        data->timestamp = mqttTimeUs();
+        if (capture_next(CAPTURE_DHT22_EDGES, port->id, edges, sizeof (edges), &n, 1) == CAPTURE_SUCCESS) {
+            j = DHT22_decodeEdges(edges, n / sizeof (edges[0]), dat);
+        } else if (capture_next(CAPTURE_DHT22, port->id, counters, sizeof (counters), &n, 1) == CAPTURE_SUCCESS) {
+            i = n;
+            if (i > 0 && counters[i - 1] == 255) i--;
+            j = counters2bits(counters, i, dat);
+        } else {
+            return DHT22_FAILURE;
+        }
+    } else if (port->edgeFd >= 0) {
+        // the kernel times the edges, nothing to spin on
+        drainEdges(port);
+        pinMode(port->pin, OUTPUT);
+        digitalWrite(port->pin, LOW);
+        delay(18);
+        digitalWrite(port->pin, HIGH);
+        pinMode(port->pin, INPUT);
+        data->timestamp = mqttTimeUs();
+        n = readEdges(port, edges);
+        capture_record(CAPTURE_DHT22_EDGES, port->id, edges, n * sizeof (edges[0]));
+        j = DHT22_decodeEdges(edges, n, dat);
+    } else {
+        // keep the counts resident, a page fault would take longer than a bit
+        memset(counters, 0, sizeof (counters));
+        mlock(counters, sizeof (counters));
+
+        // pull pin down for 18 milliseconds
+        pinMode(port->pin, OUTPUT);
+        digitalWrite(port->pin, LOW);
+        delay(18);
+
+        realtime = enterRealtime(&policy, &saved);
+        // then pull it up for 40 microseconds
+        digitalWrite(port->pin, HIGH);
+        delayMicroseconds(20);
+
+        // prepare to read the pin
+        pinMode(port->pin, INPUT);
+        data->timestamp = mqttTimeUs();
+
+        // detect change and count how long each level lasts
+        for (i = 0; i < MAXTIMINGS; i++) {
+            counter = 0;
+            while (digitalRead(port->pin) == laststate) {
+                counter++;
+                delayMicroseconds(1);
+                if (counter == 255) {
+                    break;
+                }
+            }
+            laststate = digitalRead(port->pin);
+            counters[i] = counter;
             if (counter == 255) {
                 break;
             }
         }
-        laststate = digitalRead(port.pin);
-
-        if (counter == 255) {
-            WriteDBGLog("dht22: counter overflow");
-            break;
-        }
-
-        // ignore first 3 transitions
-        if ((i >= 4) && (i % 2 == 0)) {
-            // shove each bit into the storage bytes
-            dht22_dat[j / 8] <<= 1;
-            if (counter > 12)
-                dht22_dat[j / 8] |= 1;
-            j++;
+        if (realtime) pthread_setschedparam(pthread_self(), policy, &saved);
+        munlock(counters, sizeof (counters));
+        capture_record(CAPTURE_DHT22, port->id, counters, i < MAXTIMINGS ? i + 1 : i);
+        // the counts stop early on a timeout
+        if (i < MAXTIMINGS && counters[i] == 255) {
+            DBGLOG(DBG_DHT22, DBG_ERROR, "dht22: counter overflow");
+            metrics_add(port->timeouts, 1);
         }
+        j = counters2bits(counters, i, dat);
     }
 
-    snprintf(buf, sizeof (buf), "dht22: data read 0x%X 0x%X 0x%x 0x%x 0x%x\n", 
-            dht22_dat[0], dht22_dat[1], dht22_dat[2], dht22_dat[3], dht22_dat[4]);
-    WriteDBGLog(buf);
-    snprintf(buf, sizeof (buf), "dht22: Read %d bits\n", j);
-    WriteDBGLog(buf);
+    DBGLOG(DBG_DHT22, DBG_DEBUG, "dht22: data read 0x%X 0x%X 0x%x 0x%x 0x%x\n", 
+            dat[0], dat[1], dat[2], dat[3], dat[4]);
+    DBGLOG(DBG_DHT22, DBG_DEBUG, "dht22: Read %d bits\n", j);
+    TRACE2(dht22_read_end, port->id, j);
+    metrics_observe(port->readSeconds, metrics_now() - start);
     
-    // check we read 40 bits (8bit x 5 ) + verify checksum in the last byte
-    // print it out if data is good
-    if ((j >= 40) && (dht22_dat[4] == ((dht22_dat[0] + dht22_dat[1] + dht22_dat[2] + dht22_dat[3]) & 0xFF))) {
-        data->humidity = (float) dht22_dat[0] * 256 + (float) dht22_dat[1];
-        data->humidity /= 256.0;
-        data->temperature = (float) (dht22_dat[2] & 0x7F) + (float) dht22_dat[3] / 256;
-        if ((dht22_dat[2] & 0x80) != 0) data->temperature *= -1;
-        if (port.fahrenheitscale == 1) data->temperature = data->temperature * 9 / 5 + 32;
+    if (DHT22_decode(dat, j, port->fahrenheitscale, data) == DHT22_SUCCESS) {
         return DHT22_SUCCESS;
     } else {
+        if (j >= 40)
+            metrics_add(port->checksumErrors, 1);
+        metrics_add(port->readFailures, 1);
+        return DHT22_FAILURE;
+    }
+}
+
+int
+DHT22_decode(const uint8_t dat[5], int bits, int isFahrenheit, dht22_data_t *data) {
+    // check we read 40 bits (8bit x 5 ) + verify checksum in the last byte
+    if (bits < 40 || dat[4] != ((dat[0] + dat[1] + dat[2] + dat[3]) & 0xFF)) {
         return DHT22_FAILURE;
     }
+    data->humidity = (float) dat[0] * 256 + (float) dat[1];
+    data->humidity /= 256.0;
+    data->temperature = (float) (dat[2] & 0x7F) + (float) dat[3] / 256;
+    if ((dat[2] & 0x80) != 0) data->temperature *= -1;
+    if (isFahrenheit == 1) data->temperature = data->temperature * 9 / 5 + 32;
+    return DHT22_SUCCESS;
 }
 
 int
 DHT22_init(void* port) {
     int iErr = 0;
     int rc = DHT22_SUCCESS;
-    iErr = wiringPiSetup();
-    if (iErr == -1) {
-        WriteDBGLog("dht22 : Error Failed to init WiringPi");
-        rc = DHT22_FAILURE;
-    }
-    if (setuid(getuid()) < 0) {
-        WriteDBGLog("dht22 : Error Dropping privileges failed\n");
+    iErr = board_init();
+    if (iErr != BOARD_SUCCESS) {
+        DBGLOG(DBG_DHT22, DBG_ERROR, "dht22 : Error Failed to init WiringPi");
         rc = DHT22_FAILURE;
     }
+    // the GPIO chip may need the privileges main drops after the inits
+    if (port != NULL && !capture_replaying()) openEdges((dht22_port_t *) port);
     return (rc);
 }
 
 int
-DHT22_process_temperature(dht22_port_t dht22, mqtt_data_t* mdata) {
+DHT22_process_data(dht22_port_t *port, mqtt_data_t *temperature, mqtt_data_t *humidity) {
     dht22_data_t data;
+    int64_t now = mqttTimeUs();
+    int rc;
 
-    char dbgBuf[512];
-
-    WriteDBGLog("Starting to PROCESS dht22 input");
-    if ((read_dht22_dat(dht22, &data)) == DHT22_SUCCESS) {
-        snprintf(mdata->payload, sizeof (mdata->payload), "{\"temperature\":{\"timestamp\":%ld,\"value\":%.3f}}", data.timestamp, data.temperature);
-        snprintf(mdata->topic, sizeof (mdata->topic), "%s/temperature", dht22.topic);
-        snprintf(dbgBuf, sizeof (dbgBuf), "Topic %s Payload %s", mdata->topic, mdata->payload);
-        WriteDBGLog(dbgBuf);
-    } else {
-        WriteDBGLog("Failed to read dht22 sensor");
-        return (DHT22_FAILURE);
-    }
-    return (DHT22_SUCCESS);
-}
-
-int
-DHT22_process_humidity(dht22_port_t dht22, mqtt_data_t* mdata) {
-    dht22_data_t data;
-
-    char dbgBuf[512];
-
-    WriteDBGLog("Starting to PROCESS dht22 input");
-    if ((read_dht22_dat(dht22, &data)) == DHT22_SUCCESS) {
-        snprintf(mdata->payload, sizeof (mdata->payload), "{\"humidity\":{\"timestamp\":%ld,\"value\":%.3f}}", data.timestamp, data.humidity);
-        snprintf(mdata->topic, sizeof (mdata->topic), "%s/humidity", dht22.topic);
-        snprintf(dbgBuf, sizeof (dbgBuf), "Topic %s Payload %s", mdata->topic, mdata->payload);
-        WriteDBGLog(dbgBuf);
+    // closer reads get the previous frame or no answer at all
+    if (port->lastRead != 0 && now - port->lastRead < DHT22_MININTERVAL * 1000LL && !capture_replaying())
+        return DHT22_BUSY;
+    port->lastRead = now;
+    port->reads++;
+    DBGLOG(DBG_DHT22, DBG_DEBUG, "Starting to PROCESS dht22 input");
+    if ((rc = read_dht22_dat(port, &data)) == DHT22_SUCCESS) {
+        port->successes++;
+        port->failures = 0;
+        port->retrying = 0;
+        // both come from the same frame
+        snprintf(temperature->payload, sizeof (temperature->payload), "{\"temperature\":{\"timestamp\":%ld,\"timestamp_us\":%lld,\"value\":%.3f}}",
+                (long) (data.timestamp / 1000000), (long long) data.timestamp, data.temperature);
+        temperature->sampled = data.timestamp;
+        snprintf(temperature->topic, sizeof (temperature->topic), "%s/temperature", port->topic);
+        snprintf(temperature->sensor, sizeof (temperature->sensor), "%s/temperature", port->id);
+        temperature->value = data.temperature;
+        snprintf(humidity->payload, sizeof (humidity->payload), "{\"humidity\":{\"timestamp\":%ld,\"timestamp_us\":%lld,\"value\":%.3f}}",
+                (long) (data.timestamp / 1000000), (long long) data.timestamp, data.humidity);
+        humidity->sampled = data.timestamp;
+        snprintf(humidity->topic, sizeof (humidity->topic), "%s/humidity", port->topic);
+        snprintf(humidity->sensor, sizeof (humidity->sensor), "%s/humidity", port->id);
+        humidity->value = data.humidity;
+        DBGLOG(DBG_DHT22, DBG_DEBUG, "Topic %s Payload %s", temperature->topic, temperature->payload);
     } else {
-        WriteDBGLog("Failed to read dht22 sensor");
-        return (DHT22_FAILURE);
+        port->failures++;
+        port->retrying = port->failures <= DHT22_RETRIES;
+        if (port->retrying) {
+            DBGLOG(DBG_DHT22, DBG_WARN, "Failed to read dht22 sensor %s, retry %d", port->id, port->failures);
+            metrics_add(port->retries, 1);
+        } else {
+            DBGLOG(DBG_DHT22, DBG_ERROR, "Failed to read dht22 sensor %s", port->id);
+            port->failures = 0;
+        }
     }
-    return (DHT22_SUCCESS);
+    metrics_set(port->successRatio, (double) port->successes / port->reads);
+    return rc;
 }
 
@@ -32,6 +32,8 @@
 #ifndef DHT22_H
 #define DHT22_H
 
+#include <stdint.h>
+
 #ifndef DHT22_SUCCESS
 #define DHT22_SUCCESS 0
 #endif
@@ -40,6 +42,20 @@
 #define DHT22_FAILURE -1
 #endif
 
+#ifndef DHT22_BUSY
+#define DHT22_BUSY -2 ///< the sensor was read less than DHT22_MININTERVAL ago
+#endif
+
+#define DHT22_MININTERVAL 2000 ///< milliseconds the sensor needs between reads
+#define DHT22_RETRIES 3 ///< retries of a failed read before waiting for the next sample
+#define DHT22_GPIOCHIP "/dev/gpiochip0" ///< GPIO character device of the header pins
+#define DHT22_MAXEDGES 96 ///< edges kept of one transfer, 2 per bit and some for the start
+#define DHT22_EDGE_TIMEOUT 10 ///< milliseconds without an edge that end a transfer
+#define DHT22_ONE_US 48 ///< high pulses longer than this many microseconds are 1 bits
+
+#include "metrics.h"
+#include "mqtt.h"
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -49,12 +65,31 @@ extern "C" {
         char id[64]; // id of device
         char topic[128]; // root of topic, will concat Temp and Humidity
         int fahrenheitscale; // use fahrenheit
+        int sampletime; // time in seconds to sample this sensor
+        int64_t lastRead; // wall clock microseconds of the last read, 0 if none
+        int failures; // reads failed in a row
+        int retrying; // 1 if the last read failed and is to be retried
+        long reads; // reads attempted
+        long successes; // reads that passed the checksum
+        int edgeFd; // GPIO edge event descriptor, -1 not opened yet, -2 unavailable
+        metric_t *readSeconds; // metrics labelled with id, resolved when the port is created
+        metric_t *readFailures;
+        metric_t *timeouts;
+        metric_t *checksumErrors;
+        metric_t *retries;
+        metric_t *successRatio;
     } dht22_port_t;
 
+    /** One level change on the sensor's line */
+    typedef struct {
+        uint32_t us; // microseconds since the first edge of the transfer
+        uint8_t rising; // 1 for low to high, 0 for high to low
+    } dht22_edge_t;
+
     typedef struct {
         float temperature; // temperature
         float humidity; // humidity
-        time_t timestamp; // timestamp of data
+        int64_t timestamp; // wall clock microseconds of the read
     } dht22_data_t;
 
     /**
@@ -62,9 +97,12 @@ extern "C" {
      * @param pin - pin number
      * @param id - unique string identifier
      * @param topic - topic which this port will publish to mqtt
+     * @param isFahrenheit - 1 to publish Fahrenheit
+     * @param sampletime - seconds between reads
      * @return a configured port
      */
-    extern dht22_port_t DHT22_create(int pin, const char *id, const char *topic, int isFahrenheit);
+    extern dht22_port_t DHT22_create(int pin, const char *id, const char *topic, int isFahrenheit,
+            int sampletime);
 
     /**
      * Initialize the DHT22 - In this case, just set up the wiringPi.
@@ -73,20 +111,42 @@ extern "C" {
     extern int DHT22_init(void *port);
     
     /**
-     * Read the DHT22 temperature and provide the mqtt data
-     * @param dht22 - port of this dht22
-     * @param message - mqtt message 
-     * @return DHT22_SUCCESS if successful read, DHT22_FAIL otherwise
+     * Read the DHT22 once and provide the temperature and humidity of that
+     * frame.  A failed read sets retrying until DHT22_RETRIES reads in a row
+     * have failed.
+     * @param dht22 - port of this dht22, its read counts are updated
+     * @param temperature - mqtt message for the temperature
+     * @param humidity - mqtt message for the humidity
+     * @return DHT22_SUCCESS if successful read, DHT22_BUSY if the sensor is
+     * not ready for another read, DHT22_FAILURE otherwise
      */
-    extern int DHT22_process_temperature(dht22_port_t dht22, mqtt_data_t* message);
-   
+    extern int DHT22_process_data(dht22_port_t *dht22, mqtt_data_t *temperature, mqtt_data_t *humidity);
+
     /**
-     * Read the DHT22 humidity and provide the mqtt data
+     * Close the GPIO edge event descriptor of a port.
      * @param dht22 - port of this dht22
-     * @param message - mqtt message 
-     * @return DHT22_SUCCESS if successful read, DHT22_FAIL otherwise
      */
-    extern int DHT22_process_humidity(dht22_port_t dht22, mqtt_data_t* message);
+    extern void DHT22_closePort(dht22_port_t *dht22);
+
+    /**
+     * Decode a transfer from its edges.  Each bit is a high pulse, 26-28 us
+     * for a 0 and 70 us for a 1, and the bits are the last 40 high pulses.
+     * @param edges - edges of the transfer in time order
+     * @param n - number of edges
+     * @param dat - receives the 5 bytes, most significant bit first
+     * @return number of bits decoded
+     */
+    extern int DHT22_decodeEdges(const dht22_edge_t edges[], int n, uint8_t dat[5]);
+
+    /**
+     * Decode the bits read from a DHT22.
+     * @param dat - the 5 bytes shifted in, most significant bit first
+     * @param bits - number of bits read
+     * @param isFahrenheit - 1 to convert the temperature to Fahrenheit
+     * @param data - receives the temperature and humidity, timestamp is untouched
+     * @return DHT22_SUCCESS if 40 bits were read and the checksum matches
+     */
+    extern int DHT22_decode(const uint8_t dat[5], int bits, int isFahrenheit, dht22_data_t *data);
 
 #ifdef __cplusplus
 }
@@ -32,7 +32,10 @@
 #include <time.h>
 #include <unistd.h>
 
+#include "board.h"
+#include "capture.h"
 #include "debug.h"
+#include "metrics.h"
 #include "doorswitch.h"
 #include "mqtt.h"
 
@@ -46,10 +49,8 @@
 doorswitch_port_t
 doorswitch_createPort(int pin, const char *id, const char *topic, 
         const char* location, int sampletime, int sampleContinous) {
-    char dbgBuf[256];
     doorswitch_port_t port;
-    snprintf(dbgBuf, sizeof (dbgBuf), "Creating door switch %s pin %d at %s", id, pin, location);
-    WriteDBGLog(dbgBuf);    
+    DBGLOG(DBG_DOORSWITCH, DBG_INFO, "Creating door switch %s pin %d at %s", id, pin, location);
     port.pin = pin;
     port.state = -1;
     port.sampletime = sampletime;
@@ -57,6 +58,7 @@ doorswitch_createPort(int pin, const char *id, const char *topic,
     strncpy(port.id, id, sizeof (port.id));
     strncpy(port.topic, topic, sizeof (port.topic));
     strncpy(port.location, location, sizeof (port.location));
+    port.changes = metrics_counter("doorswitch_changes_total", id);
     return (port);
 }
 
@@ -64,14 +66,10 @@ int
 doorswitch_init() {
     int iErr = 0;
     int rc = DOORSWITCH_SUCCESS;
-    WriteDBGLog("initializing Door Switches");
-    iErr = wiringPiSetup();
-    if (iErr == -1) {
-        WriteDBGLog("doorswitch : Error Failed to init WiringPi");
-        rc = DOORSWITCH_FAILURE;
-    }
-    if (setuid(getuid()) < 0) {
-        WriteDBGLog("doorswitch : Error Dropping privileges failed\n");
+    DBGLOG(DBG_DOORSWITCH, DBG_INFO, "initializing Door Switches");
+    iErr = board_init();
+    if (iErr != BOARD_SUCCESS) {
+        DBGLOG(DBG_DOORSWITCH, DBG_ERROR, "doorswitch : Error Failed to init WiringPi");
         rc = DOORSWITCH_FAILURE;
     }
     return (rc);
@@ -79,30 +77,43 @@ doorswitch_init() {
 
 int
 ProcessDoorswitchData(doorswitch_port_t* port, mqtt_data_t* message) {
-    char dbgBuf[256];
     
     int rc = DOORSWITCH_FAILURE;
-    pinMode(port->pin, INPUT);
-    int data = digitalRead(port->pin);
+    int data;
+    size_t len;
+    if (capture_replaying()) {
+        if (capture_next(CAPTURE_GPIO, port->id, &data, sizeof (data), &len, 1) != CAPTURE_SUCCESS)
+            return rc;
+    } else {
+        pinMode(port->pin, INPUT);
+        data = digitalRead(port->pin);
+        capture_record(CAPTURE_GPIO, port->id, &data, sizeof (data));
+    }
+    int64_t sampled = mqttTimeUs();
     if (data != port->state) {
-        snprintf(dbgBuf, sizeof (dbgBuf), "Door %s changed to state %d", port->id, data);
-        WriteDBGLog(dbgBuf);
+        DBGLOG(DBG_DOORSWITCH, DBG_DEBUG, "Door %s changed to state %d", port->id, data);
+        metrics_add(port->changes, 1);
         port->state = data;
         snprintf(message->payload, sizeof (message->payload), 
-                "{\"timestamp\":%ld,\"value\":\"%s\"}",
-                time(NULL), data == 1 ? "opened" : "closed");
+                "{\"timestamp\":%ld,\"timestamp_us\":%lld,\"value\":\"%s\"}",
+                (long) (sampled / 1000000), (long long) sampled, data == 1 ? "opened" : "closed");
+        message->sampled = sampled;
         snprintf(message->topic, sizeof (message->topic), "%s/%s/%s",
                 port->id, port->location, port->topic);
+        strncpy(message->sensor, port->id, sizeof (message->sensor));
+        message->value = data;
         rc = DOORSWITCH_SUCCESS;
     } else if ( port->sampleContinuous == 1 ) {
-	snprintf(dbgBuf, sizeof (dbgBuf), "Door %s state %d", port->id, data);
-        WriteDBGLog(dbgBuf);
+	DBGLOG(DBG_DOORSWITCH, DBG_DEBUG, "Door %s state %d", port->id, data);
         port->state = data;
         snprintf(message->payload, sizeof (message->payload), 
-                "{\"timestamp\":%ld,\"value\":\"%s\"}",
-                time(NULL), data == 1 ? "opened" : "closed");
+                "{\"timestamp\":%ld,\"timestamp_us\":%lld,\"value\":\"%s\"}",
+                (long) (sampled / 1000000), (long long) sampled, data == 1 ? "opened" : "closed");
+        message->sampled = sampled;
         snprintf(message->topic, sizeof (message->topic), "%s/%s/%s",
                 port->id, port->location, port->topic);
+        strncpy(message->sensor, port->id, sizeof (message->sensor));
+        message->value = data;
         rc = DOORSWITCH_SUCCESS;
     }
     return rc;
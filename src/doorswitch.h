@@ -46,6 +46,7 @@
 extern "C" {
 #endif
 
+#include "metrics.h"
 #include "mqtt.h"
 
     typedef struct {
@@ -56,6 +57,7 @@ extern "C" {
         char topic[64]; ///< topic suffix used for publishing
         int sampletime; ///< sample time of this switch in seconds.
 	int sampleContinuous; ///< provide continuous updates
+	metric_t *changes; ///< doorswitch_changes_total of this port, resolved when it is created
     } doorswitch_port_t;
 
 
@@ -33,10 +33,17 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <dirent.h>
 
 #include "ds18b20pi.h"
+#include "capture.h"
 #include "debug.h"
+#include "metrics.h"
 #include "mqtt.h"
+#include "trace.h"
 
 int
 DS18B20PI_init() {
@@ -44,7 +51,7 @@ DS18B20PI_init() {
 }
 
 DS18B20PI_port_t
-DS18B20PI_createPort(const char *path, const char *id, const char *topic, const int sampletime, const char *location, const int isFahrenheit) {
+DS18B20PI_createPort(const char *path, const char *id, const char *topic, const int sampletime, const char *location, const int isFahrenheit, const int resolution) {
     DS18B20PI_port_t port;
     strncpy(port.id, id, sizeof (port.id));
     strncpy(port.path, path, sizeof (port.path));
@@ -52,66 +59,370 @@ DS18B20PI_createPort(const char *path, const char *id, const char *topic, const
     strncpy(port.location, location, sizeof (port.location));
     port.sampletime = sampletime;
     port.fahrenheitscale = isFahrenheit;
+    port.resolution = resolution;
+    port.bits = 0;
+    port.fd = -1;
+    port.discovered = 0;
+    // the discovery template has no id, and nothing to count
+    port.readSeconds = id[0] ? metrics_histogram("ds18b20_read_seconds", id) : NULL;
+    port.readFailures = id[0] ? metrics_counter("ds18b20_read_failures_total", id) : NULL;
+    port.crcErrors = id[0] ? metrics_counter("ds18b20_crc_errors_total", id) : NULL;
+    port.resolutionErrors = id[0] ? metrics_counter("ds18b20_resolution_errors_total", id) : NULL;
     return (port);
 }
 
+static int
+compareIds(const void *a, const void *b) {
+    return strcmp((const char *) a, (const char *) b);
+}
+
+int
+DS18B20PI_discover(const char *dir, char ids[][DS18B20PI_IDLEN], int max) {
+    // families handled by w1_therm: DS18S20, DS1822, DS18B20, DS1825, DS28EA00
+    static const char *families[] = {"10-", "22-", "28-", "3b-", "42-"};
+    DIR *d;
+    struct dirent *e;
+    int n = 0;
+    size_t f;
+
+    if ((d = opendir(dir)) == NULL) {
+        DBGLOG(DBG_DS18B20, DBG_ERROR, "Unable to scan %s. 0x%0x - %s", dir, errno, strerror(errno));
+        return DS18B20PI_FAILURE;
+    }
+    while ((e = readdir(d)) != NULL && n < max) {
+        for (f = 0; f < sizeof (families) / sizeof (families[0]); f++) {
+            if (strncmp(e->d_name, families[f], 3) == 0) {
+                snprintf(ids[n++], DS18B20PI_IDLEN, "%s", e->d_name);
+                break;
+            }
+        }
+    }
+    closedir(d);
+    // readdir order is arbitrary, keep the ports in a stable order
+    qsort(ids, n, DS18B20PI_IDLEN, compareIds);
+    return n;
+}
+
+int
+DS18B20PI_conversionTime(int bits) {
+    // 750 ms at 12 bits, halved for every bit less
+    if (bits < 9 || bits > 12) bits = 12;
+    return 750 >> (12 - bits);
+}
+
+int
+DS18B20PI_setResolution(DS18B20PI_port_t *port) {
+    char path[256];
+    FILE *fh;
+    int bits = 0;
+    int rc = DS18B20PI_FAILURE;
+
+    port->bits = 0;
+    if (port->resolution == 0 || capture_replaying()) return DS18B20PI_SUCCESS;
+    if (port->resolution < 9 || port->resolution > 12) {
+        DBGLOG(DBG_DS18B20, DBG_ERROR, "Resolution of %s must be 9 to 12 bits, not %d", port->id, port->resolution);
+        return DS18B20PI_FAILURE;
+    }
+    snprintf(path, sizeof (path), "%s/resolution", port->path);
+    if ((fh = fopen(path, "w")) != NULL) {
+        fprintf(fh, "%d\n", port->resolution);
+        if (fclose(fh) == 0) rc = DS18B20PI_SUCCESS;
+    }
+    if (rc != DS18B20PI_SUCCESS) {
+        DBGLOG(DBG_DS18B20, DBG_ERROR, "Unable to set the resolution of %s. 0x%0x - %s", port->id, errno, strerror(errno));
+        metrics_add(port->resolutionErrors, 1);
+        return DS18B20PI_FAILURE;
+    }
+    // read it back, some clones ignore the configuration register
+    if ((fh = fopen(path, "r")) != NULL) {
+        if (fscanf(fh, "%d", &bits) != 1) bits = 0;
+        fclose(fh);
+    }
+    if (bits != port->resolution) {
+        DBGLOG(DBG_DS18B20, DBG_ERROR, "%s runs at %d bits instead of %d", port->id, bits, port->resolution);
+        metrics_add(port->resolutionErrors, 1);
+        return DS18B20PI_FAILURE;
+    }
+    port->bits = bits;
+    DBGLOG(DBG_DS18B20, DBG_INFO, "%s set to %d bits, %d ms a conversion", port->id, bits, DS18B20PI_conversionTime(bits));
+    return DS18B20PI_SUCCESS;
+}
+
+/**
+ * Parse a whole number of millidegrees ending the text or its line
+ * @param p - first character
+ * @param value - receives the number
+ * @return DS18B20PI_SUCCESS if p holds nothing but the number
+ */
+static int
+parseMilli(const char *p, int *value) {
+    const char *digits;
+    int neg = 0;
+    int v = 0;
+
+    if (*p == '-') {
+        neg = 1;
+        p++;
+    }
+    for (digits = p; *p >= '0' && *p <= '9' && p - digits < 9; p++) {
+        v = v * 10 + (*p - '0');
+    }
+    if (p == digits || (*p != 0 && *p != '\n')) return DS18B20PI_FAILURE;
+    *value = neg ? -v : v;
+    return DS18B20PI_SUCCESS;
+}
+
+int
+DS18B20PI_parse(const char *text, int *millidegrees) {
+    const char *nl;
+    const char *t;
+
+    // the temperature attribute holds nothing but the number
+    if ((nl = strchr(text, '\n')) == NULL || nl[1] == 0) return parseMilli(text, millidegrees);
+    // line 1 of w1_slave ends with the CRC result, line 2 with t=<millidegrees>
+    if (nl - text < 3 || strncmp(nl - 3, "YES", 3) != 0) return DS18B20PI_CRCERROR;
+    if ((t = strstr(nl + 1, "t=")) == NULL) return DS18B20PI_FAILURE;
+    return parseMilli(t + 2, millidegrees);
+}
+
+/**
+ * Find the bulk conversion attribute of the bus master a probe hangs off
+ * @param port - probe
+ * @param path - receives the path of therm_bulk_read
+ * @param size - size of path
+ * @return DS18B20PI_SUCCESS if the master supports bulk conversion
+ */
+static int
+bulkPath(const DS18B20PI_port_t *port, char *path, size_t size) {
+    char dev[PATH_MAX];
+    char *slash;
+
+    // the device directory links into the directory of its master
+    if (realpath(port->path, dev) == NULL || (slash = strrchr(dev, '/')) == NULL)
+        return DS18B20PI_FAILURE;
+    *slash = 0;
+    snprintf(path, size, "%s/therm_bulk_read", dev);
+    return access(path, W_OK) == 0 ? DS18B20PI_SUCCESS : DS18B20PI_FAILURE;
+}
+
+/**
+ * Read the state of a bulk conversion
+ * @param path - therm_bulk_read of a master
+ * @return -1 while converting, 0 or 1 once done
+ */
+static int
+bulkState(const char *path) {
+    FILE *fh;
+    int state = 0;
+
+    if ((fh = fopen(path, "r")) == NULL) return 0;
+    if (fscanf(fh, "%d", &state) != 1) state = 0;
+    fclose(fh);
+    return state;
+}
+
 int
-DS18B20PI_process_data(DS18B20PI_port_t port, mqtt_data_t *message) {
+DS18B20PI_bulk_convert(DS18B20PI_port_t *const ports[], int n) {
+    char masters[DS18B20PI_MAXMASTERS][PATH_MAX];
+    char path[PATH_MAX];
+    int nmasters = 0;
+    int converting;
+    int fastest = DS18B20PI_conversionTime(12);
+    int slowest = 0;
+    int i, j, t;
+    FILE *fh;
+    struct timespec poll = {0, DS18B20PI_BULK_POLL * 1000000L};
+    struct timespec wait;
+    double start = metrics_now();
+
+    // the recorded w1_slave text already holds the conversions
+    if (capture_replaying()) return DS18B20PI_SUCCESS;
+    for (i = 0; i < n; i++) {
+        t = DS18B20PI_conversionTime(ports[i]->bits);
+        if (t < fastest) fastest = t;
+        if (t > slowest) slowest = t;
+        if (bulkPath(ports[i], path, sizeof (path)) != DS18B20PI_SUCCESS) continue;
+        for (j = 0; j < nmasters && strcmp(masters[j], path) != 0; j++);
+        if (j == nmasters && nmasters < DS18B20PI_MAXMASTERS)
+            strcpy(masters[nmasters++], path);
+    }
+    TRACE1(ds18b20_bulk_start, nmasters);
+    // every probe on a master starts converting at once
+    for (j = 0; j < nmasters; j++) {
+        int rc = -1;
+        if ((fh = fopen(masters[j], "w")) != NULL) {
+            rc = fputs("trigger\n", fh);
+            if (fclose(fh) != 0) rc = -1;
+        }
+        if (rc < 0) {
+            DBGLOG(DBG_DS18B20, DBG_WARN, "Unable to trigger bulk conversion on %s", masters[j]);
+            if (j != --nmasters) strcpy(masters[j], masters[nmasters]);
+            j--;
+        }
+    }
+    if (nmasters == 0) {
+        metrics_add(metrics_counter("ds18b20_bulk_failures_total", NULL), 1);
+        return DS18B20PI_FAILURE;
+    }
+    // none is done before the fastest probe, all should be by the slowest
+    wait.tv_sec = fastest / 1000;
+    wait.tv_nsec = (fastest % 1000) * 1000000L;
+    nanosleep(&wait, NULL);
+    for (;;) {
+        for (converting = 0, j = 0; j < nmasters; j++)
+            converting += bulkState(masters[j]) < 0;
+        if (converting == 0 || metrics_now() - start > slowest * DS18B20PI_BULK_SLACK / 1000.0) break;
+        nanosleep(&poll, NULL);
+    }
+    TRACE1(ds18b20_bulk_end, converting);
+    metrics_observe(metrics_histogram("ds18b20_bulk_seconds", NULL), metrics_now() - start);
+    DBGLOG(DBG_DS18B20, DBG_DEBUG, "Bulk conversion of %d probes on %d masters took %.3f s",
+            n, nmasters, metrics_now() - start);
+    return DS18B20PI_SUCCESS;
+}
+
+/**
+ * Read the text of a probe through its persistent descriptor, opening it on
+ * first use.  The newer temperature attribute is preferred to w1_slave, it
+ * skips formatting the scratchpad.
+ * @param port - probe
+ * @param buf - receives the text
+ * @param size - size of buf
+ * @return bytes read, -1 if the probe could not be read
+ */
+static ssize_t
+readProbe(DS18B20PI_port_t *port, char *buf, size_t size) {
+    char path[256];
+    ssize_t n;
+
+    if (port->fd < 0) {
+        snprintf(path, sizeof (path), "%s/temperature", port->path);
+        if ((port->fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+            snprintf(path, sizeof (path), "%s/w1_slave", port->path);
+            port->fd = open(path, O_RDONLY | O_CLOEXEC);
+        }
+        if (port->fd < 0) {
+            DBGLOG(DBG_DS18B20, DBG_ERROR, "open_port: Unable to open %s. 0x%0x - %s", path, errno, strerror(errno));
+            return -1;
+        }
+        DBGLOG(DBG_DS18B20, DBG_INFO, "Opened port [%s]", path);
+    }
+    // sysfs makes the attribute afresh, converting first, on a read from 0
+    if ((n = pread(port->fd, buf, size, 0)) < 0) {
+        DBGLOG(DBG_DS18B20, DBG_ERROR, "Unable to read %s. 0x%0x - %s", port->id, errno, strerror(errno));
+        // a bad CRC fails the read, otherwise the probe may have gone
+        if (errno != EIO) DS18B20PI_closePort(port);
+    }
+    return n;
+}
+
+void
+DS18B20PI_closePort(DS18B20PI_port_t *port) {
+    if (port->fd >= 0) {
+        close(port->fd);
+        port->fd = -1;
+    }
+}
+
+int
+DS18B20PI_process_data(DS18B20PI_port_t *port, mqtt_data_t *message) {
     int rc;
-    char *value;
-    char dbgBuf[1024];
     char readBuf[512];
-    char fullPath[512];
     float temp;
     int i;
-    FILE* fh;
+    size_t len;
+    ssize_t n;
+    int64_t sampled;
+    double start = metrics_now();
     
     rc = DS18B20PI_FAILURE;
-    snprintf(fullPath, sizeof (fullPath), "%s/w1_slave", port.path);
-    snprintf(dbgBuf, sizeof (dbgBuf), "Opening port [%s]", fullPath);
-    WriteDBGLog(dbgBuf);
-    // to read the ds18b20, you need to re-open the file
-    fh = fopen(fullPath, "r");
-    if (fh == NULL) {
-        snprintf(dbgBuf, sizeof (dbgBuf), "open_port: Unable to open %s. 0x%0x - %s\n", fullPath, errno, strerror(errno));
-        WriteDBGLog(dbgBuf);
-        perror(dbgBuf);
-    } else {
-        memset(readBuf, 0, sizeof ( readBuf));
-        if (fgets(readBuf, sizeof (readBuf), fh) > 0) {
-            if (strstr(readBuf, "YES") != NULL) {
-                if (fgets(readBuf, sizeof (readBuf), fh) > 0) {
-                    //Extract temp data an if Fahrenheit, convert
-                    if (strtok(readBuf, "\nt=") != NULL) {
-                        value = strtok(NULL, "\nt=");
-                        if (value != NULL && sscanf(value, "%d", &i) != 0) {
-                            if (port.fahrenheitscale == 1) {
-                                temp = i / 1000.0 * 9.0 / 5.0 + 32.0;
-                            } else {
-                                temp = i / 1000.0;
-                            }
-                            snprintf(message->payload, sizeof (message->payload), "{\"timestamp\":%ld,\"value\":%.3f}", time(NULL), temp);
-                            strncpy(message->topic, port.topic, sizeof (message->topic));
-                            snprintf(dbgBuf, sizeof (dbgBuf), "Set up payload to %s", message->payload);
-                            WriteDBGLog(dbgBuf);
-                            rc = DS18B20PI_SUCCESS;
-                        } else {
-                            WriteDBGLog("No temp scanned");
-                        }
-                    } else {
-                        WriteDBGLog("no number scanned");
-                    }
-                }
+    TRACE1(ds18b20_read_start, port->id);
+    if (capture_replaying()) {
+        // the recorded text stands in for the probe
+        if (capture_next(CAPTURE_W1, port->id, readBuf, sizeof (readBuf) - 1, &len, 1) != CAPTURE_SUCCESS) {
+            TRACE2(ds18b20_read_end, port->id, rc);
+            return (rc);
+        }
+        n = len;
+    } else if ((n = readProbe(port, readBuf, sizeof (readBuf) - 1)) >= 0) {
+        capture_record(CAPTURE_W1, port->id, readBuf, n);
+    }
+    sampled = mqttTimeUs();
+    if (n >= 0) {
+        readBuf[n] = 0;
+        if (n == 0) {
+            DBGLOG(DBG_DS18B20, DBG_WARN, "No data Read");
+        } else if ((rc = DS18B20PI_parse(readBuf, &i)) == DS18B20PI_SUCCESS) {
+            //if Fahrenheit, convert
+            if (port->fahrenheitscale == 1) {
+                temp = i / 1000.0 * 9.0 / 5.0 + 32.0;
             } else {
-                snprintf(dbgBuf, sizeof (dbgBuf), "Bad temp reading CRC Check failed on %s", readBuf);
-                WriteDBGLog(dbgBuf);
+                temp = i / 1000.0;
             }
+            snprintf(message->payload, sizeof (message->payload), "{\"timestamp\":%ld,\"timestamp_us\":%lld,\"value\":%.3f}",
+                    (long) (sampled / 1000000), (long long) sampled, temp);
+            message->sampled = sampled;
+            strncpy(message->topic, port->topic, sizeof (message->topic));
+            strncpy(message->sensor, port->id, sizeof (message->sensor));
+            message->value = temp;
+            DBGLOG(DBG_DS18B20, DBG_DEBUG, "Set up payload to %s", message->payload);
+        } else if (rc == DS18B20PI_CRCERROR) {
+            DBGLOG(DBG_DS18B20, DBG_ERROR, "Bad temp reading CRC Check failed on %s", readBuf);
+            metrics_add(port->crcErrors, 1);
+            rc = DS18B20PI_FAILURE;
         } else {
-            WriteDBGLog("No data Read");
+            DBGLOG(DBG_DS18B20, DBG_WARN, "No temp scanned");
         }
-        WriteDBGLog("Closing DS18B20 Port");
-        fclose(fh);
-        return (rc);
     }
+    TRACE2(ds18b20_read_end, port->id, rc);
+    metrics_observe(port->readSeconds, metrics_now() - start);
+    if (rc != DS18B20PI_SUCCESS)
+        metrics_add(port->readFailures, 1);
+    return (rc);
+}
+
+typedef struct {
+    DS18B20PI_port_t *const *ports; ///< probes to read
+    mqtt_data_t *messages; ///< one reading per probe
+    int *results; ///< one return code per probe
+    int n; ///< number of probes
+    int next; ///< next probe to take
+} batch_t;
+
+/**
+ * Worker of a batch, takes probes until none is left.
+ * @param arg batch_t
+ * @return NULL
+ */
+static void *
+batchWorker(void *arg) {
+    batch_t *batch = (batch_t *) arg;
+    int i;
+
+    while ((i = __atomic_fetch_add(&batch->next, 1, __ATOMIC_RELAXED)) < batch->n) {
+        batch->results[i] = DS18B20PI_process_data(batch->ports[i], &batch->messages[i]);
+    }
+    return NULL;
+}
+
+int
+DS18B20PI_process_batch(DS18B20PI_port_t *const ports[], int n, mqtt_data_t messages[], int results[]) {
+    batch_t batch = {ports, messages, results, n, 0};
+    pthread_t workers[DS18B20PI_WORKERS];
+    int started = 0;
+    int i, ok = 0;
+
+    // the master releases the bus while a probe converts, so reads overlap
+    for (i = 0; i < DS18B20PI_WORKERS && i < n - 1; i++) {
+        if (pthread_create(&workers[started], NULL, batchWorker, &batch) == 0) started++;
+    }
+    batchWorker(&batch);
+    for (i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    for (i = 0; i < n; i++) {
+        ok += results[i] == DS18B20PI_SUCCESS;
+    }
+    return ok;
 }
 
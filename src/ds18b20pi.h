@@ -42,19 +42,38 @@
 #define DS18B20PI_FAILURE -1
 #endif
 
+#ifndef DS18B20PI_CRCERROR
+#define DS18B20PI_CRCERROR -2 ///< the sensor reported a bad CRC
+#endif
+
+#define DS18B20PI_MAXMASTERS 8 ///< 1-wire bus masters converted in one bulk conversion
+#define DS18B20PI_BULK_POLL 10 ///< milliseconds between polls of a bulk conversion
+#define DS18B20PI_IDLEN 64 ///< size of a sensor id
+#define DS18B20PI_WORKERS 4 ///< threads reading a batch of probes besides the caller
+#define DS18B20PI_BULK_SLACK 2 ///< times the slowest conversion to wait for a bulk conversion
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+#include "metrics.h"
 #include "mqtt.h"
 
     typedef struct {
         char path[128]; // fully qualified path to device
-        char id[64]; // id of device
+        char id[DS18B20PI_IDLEN]; // id of device
         char topic[64]; // final topic to publish
         char location[64]; // location data
         int sampletime; // time in seconds to sample this sensor
         int fahrenheitscale; // 1 if Fahrenheit, 0 if Celsius 
+        int resolution; // bits to configure, 0 to leave the probe as it is
+        int bits; // resolution verified on the probe, 0 if unknown
+        int fd; // descriptor kept open on the probe, -1 if closed
+        int discovered; // 1 if found by DS18B20PI_discover rather than configured
+        metric_t *readSeconds; // metrics labelled with id, resolved when the port is created
+        metric_t *readFailures;
+        metric_t *crcErrors;
+        metric_t *resolutionErrors;
     } DS18B20PI_port_t;
 
     /**
@@ -65,11 +84,37 @@ extern "C" {
      * @param sampletime - in milliseconds
      * @param location - used for topic
      * @param isFahrenheit - determines scale of data
+     * @param resolution - 9 to 12 bits, 0 to leave the probe as it is
      * @return 
      */
     extern DS18B20PI_port_t DS18B20PI_createPort(const char *path, const char *id,
             const char *topic, const int sampletime, const char *location,
-            const int isFahrenheit);
+            const int isFahrenheit, const int resolution);
+
+    /**
+     * Apply the configured resolution through the w1 resolution attribute
+     * and read it back.
+     * @param port - probe, its bits are set to the verified resolution
+     * @return DS18B20PI_SUCCESS if the probe runs at the configured resolution
+     * or none is configured
+     */
+    extern int DS18B20PI_setResolution(DS18B20PI_port_t *port);
+
+    /**
+     * List the thermometers the w1 bus masters have found.
+     * @param dir - devices directory, normally /sys/bus/w1/devices
+     * @param ids - receives the device directory names, sorted
+     * @param max - size of ids
+     * @return number of thermometers, DS18B20PI_FAILURE if dir cannot be read
+     */
+    extern int DS18B20PI_discover(const char *dir, char ids[][DS18B20PI_IDLEN], int max);
+
+    /**
+     * Time a conversion takes.
+     * @param bits - resolution, 0 if unknown
+     * @return milliseconds, those of 12 bits if the resolution is unknown
+     */
+    extern int DS18B20PI_conversionTime(int bits);
     /**
      * Initial the DS18B20 port
      * @return This is a NULL function.  Just returns DS18B20PI_SUCCESS
@@ -78,11 +123,51 @@ extern "C" {
 
     /**
      * Process data from this ds18b20 sensor and return the data
-     * @param sensorPort to process
+     * @param sensorPort to process, its descriptor is opened on first use and
+     * kept open
      * @param message will contain the topic and payload for this sensor read
      * @return DS18B20PI_SUCCESS if successful, DS18B20PI_FAILURE otherwise
      */
-    extern int DS18B20PI_process_data(DS18B20PI_port_t port, mqtt_data_t *message);
+    extern int DS18B20PI_process_data(DS18B20PI_port_t *port, mqtt_data_t *message);
+
+    /**
+     * Process many sensors at once, spread over up to DS18B20PI_WORKERS
+     * threads besides the caller.
+     * @param ports - sensors to process
+     * @param n - number of sensors
+     * @param messages - receives one reading per sensor
+     * @param results - receives the return code of each sensor
+     * @return number of sensors read successfully
+     */
+    extern int DS18B20PI_process_batch(DS18B20PI_port_t *const ports[], int n,
+            mqtt_data_t messages[], int results[]);
+
+    /**
+     * Close the descriptor kept open on a sensor.
+     * @param port - sensor
+     */
+    extern void DS18B20PI_closePort(DS18B20PI_port_t *port);
+
+    /**
+     * Start one simultaneous conversion on every probe of the bus masters the
+     * given probes hang off, through the masters' therm_bulk_read attribute,
+     * and wait for it to finish.  Reading the probes afterwards returns the
+     * converted temperatures without a conversion of their own.
+     * @param ports - probes about to be read
+     * @param n - number of probes
+     * @return DS18B20PI_SUCCESS if a bulk conversion was made, DS18B20PI_FAILURE
+     * if no master supports it and each probe converts when it is read
+     */
+    extern int DS18B20PI_bulk_convert(DS18B20PI_port_t *const ports[], int n);
+
+    /**
+     * Parse the text of a w1_slave or temperature attribute.
+     * @param text - both lines of w1_slave, or the number in temperature
+     * @param millidegrees - receives the temperature in thousandths of a degree Celsius
+     * @return DS18B20PI_SUCCESS, DS18B20PI_CRCERROR if the sensor reported a bad
+     * CRC, DS18B20PI_FAILURE if there is no temperature
+     */
+    extern int DS18B20PI_parse(const char *text, int *millidegrees);
 
 #ifdef __cplusplus
 }
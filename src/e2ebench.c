@@ -0,0 +1,321 @@
+/*
+ * The MIT License
+ *
+ * Copyright 2017 Nick Ong <onichola@gmail.com>.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * File:   e2ebench.c
+ * Author: Nick Ong <onichola@gmail.com>
+ *
+ * End to end benchmark of the publish pipeline against stubbroker.  Simulated
+ * DS18B20 sensors, w1_slave files in a temporary directory, are read by the
+ * driver and published through mqttPublish and paho to the broker, and the
+ * PUBACKs are counted by onSend.  A sweep over sensor counts and reading
+ * rates reports the sustained throughput, the p50 and p99 latency from the
+ * read to the PUBACK, CPU use and resident memory.  The offline path,
+ * mqttSave, and the replay of the dump file on reconnect are measured last.
+ *
+ *   pi2mqtt-e2ebench [seconds per case]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <MQTTAsync.h>
+
+#include "ds18b20pi.h"
+#include "metrics.h"
+#include "mqtt.h"
+#include "stubbroker.h"
+
+#define E2E_SECONDS 2.0 ///< default length of each case
+#define E2E_WINDOW 1000 ///< publishes awaiting PUBACK before the producer waits
+#define E2E_OFFLINE 2000 ///< readings published while the broker is offline
+#define E2E_TIMEOUT 10.0 ///< seconds to wait for the broker or a drain
+
+static const int sensorCounts[] = {1, 8, 32};
+static const int rates[] = {10, 100, 1000, 0}; ///< readings a second, 0 as fast as possible
+
+static DS18B20PI_port_t ports[32];
+static char dir[] = "/tmp/pi2mqtt-e2ebench.XXXXXX";
+
+static double
+now(void) {
+    return metrics_now();
+}
+
+static void
+sleepUntil(double t) {
+    struct timespec ts;
+    double d = t - now();
+
+    if (d <= 0) return;
+    ts.tv_sec = (time_t) d;
+    ts.tv_nsec = (long) ((d - ts.tv_sec) * 1e9);
+    nanosleep(&ts, NULL);
+}
+
+/**
+ * Wait for a condition on a metric, up to E2E_TIMEOUT.
+ * @return 1 if it held in time
+ */
+static int
+waitFor(int (*cond)(void *), void *arg) {
+    double limit = now() + E2E_TIMEOUT;
+
+    while (!cond(arg)) {
+	if (now() > limit) return 0;
+	usleep(1000);
+    }
+    return 1;
+}
+
+static int
+isConnected(void *arg) {
+    return ((my_context_t *) arg)->connected == 1;
+}
+
+static int
+isDisconnected(void *arg) {
+    return ((my_context_t *) arg)->connected == 0;
+}
+
+static int
+isDrained(void *arg) {
+    return metrics_value(metrics_gauge("mqtt_inflight", NULL)) <= 0;
+}
+
+static int
+hasReceived(void *arg) {
+    return stubbroker_received() >= *(uint64_t *) arg;
+}
+
+/**
+ * Create the simulated sensors, one directory with a w1_slave file each.
+ */
+static int
+makeSensors(int n) {
+    char path[256];
+    FILE *fp;
+    int i;
+
+    if (mkdtemp(dir) == NULL) return -1;
+    for (i = 0; i < n; i++) {
+	char id[32];
+	snprintf(id, sizeof (id), "28-%012x", 0x516a4990 + i);
+	snprintf(path, sizeof (path), "%s/%s", dir, id);
+	if (mkdir(path, 0755) != 0) return -1;
+	ports[i] = DS18B20PI_createPort(path, id, "temp", 1, "bench", 0, 0);
+	snprintf(path, sizeof (path), "%s/%s/w1_slave", dir, id);
+	if ((fp = fopen(path, "w")) == NULL) return -1;
+	fprintf(fp, "72 01 4b 46 7f ff 0e 10 57 : crc=57 YES\n"
+		"72 01 4b 46 7f ff 0e 10 57 t=%d\n", 20000 + i * 125);
+	fclose(fp);
+    }
+    return 0;
+}
+
+static void
+removeSensors(int n) {
+    char path[256];
+    int i;
+
+    for (i = 0; i < n; i++) {
+	snprintf(path, sizeof (path), "%s/w1_slave", ports[i].path);
+	unlink(path);
+	rmdir(ports[i].path);
+    }
+    rmdir(dir);
+}
+
+static double
+cpuSeconds(void) {
+    struct rusage ru;
+
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec * 1e-6 +
+	    ru.ru_stime.tv_sec + ru.ru_stime.tv_usec * 1e-6;
+}
+
+/**
+ * Resident memory in kilobytes, now and at its peak.
+ */
+static void
+rss(long *current, long *peak) {
+    struct rusage ru;
+    long pages = 0;
+    FILE *fp;
+
+    if ((fp = fopen("/proc/self/statm", "r")) != NULL) {
+	if (fscanf(fp, "%*s %ld", &pages) != 1) pages = 0;
+	fclose(fp);
+    }
+    *current = pages * (sysconf(_SC_PAGESIZE) / 1024);
+    getrusage(RUSAGE_SELF, &ru);
+    *peak = ru.ru_maxrss;
+}
+
+/**
+ * Publish readings of n sensors at rate for seconds, then wait for the
+ * PUBACKs and report.
+ */
+static void
+runCase(my_context_t *c, int n, int rate, double seconds) {
+    mqtt_data_t message;
+    metric_t *latency = metrics_histogram("mqtt_sample_to_puback_seconds", NULL);
+    metric_t *inflight = metrics_gauge("mqtt_inflight", NULL);
+    uint64_t produced = 0;
+    double start, end, next, cpu, elapsed;
+    long current, peak;
+    char rateText[16];
+    int drained;
+
+    metrics_reset();
+    cpu = cpuSeconds();
+    start = now();
+    next = start;
+    end = start + seconds;
+    while (now() < end && !c->killed) {
+	if (rate > 0) {
+	    sleepUntil(next);
+	    next += 1.0 / rate;
+	}
+	while (metrics_value(inflight) >= E2E_WINDOW && now() < end)
+	    usleep(50);
+	if (DS18B20PI_process_data(&ports[produced % n], &message) == DS18B20PI_SUCCESS) {
+	    mqttPublish(c, &message);
+	    produced++;
+	}
+    }
+    drained = waitFor(isDrained, NULL);
+    elapsed = now() - start;
+    cpu = cpuSeconds() - cpu;
+    rss(&current, &peak);
+    snprintf(rateText, sizeof (rateText), rate > 0 ? "%d" : "max", rate);
+    printf("%7d %7s %10.0f %10.0f %9.3f %9.3f %6.1f%% %8ld %8ld%s\n", n, rateText,
+	    produced / seconds, metrics_value(metrics_counter("mqtt_confirmed_total", NULL)) / elapsed,
+	    metrics_quantile(latency, 0.5) * 1e3, metrics_quantile(latency, 0.99) * 1e3,
+	    100.0 * cpu / elapsed, current, peak, drained ? "" : " (not drained)");
+}
+
+/**
+ * Take the broker offline, publish E2E_OFFLINE readings so that they are
+ * saved to the dump file, then bring it back and time the replay.
+ */
+static void
+runOffline(my_context_t *c) {
+    mqtt_data_t message;
+    uint64_t target;
+    double start, saved, replayed;
+    int i;
+
+    stubbroker_online(0);
+    if (!waitFor(isDisconnected, c)) {
+	printf("offline: connection was not lost\n");
+	return;
+    }
+    metrics_reset();
+    start = now();
+    for (i = 0; i < E2E_OFFLINE; i++) {
+	if (DS18B20PI_process_data(&ports[i % 8], &message) == DS18B20PI_SUCCESS)
+	    mqttPublish(c, &message);
+    }
+    saved = now() - start;
+    printf("offline: %.0f readings saved at %.0f/s, dump file %.0f bytes\n",
+	    metrics_value(metrics_counter("mqtt_saved_total", NULL)),
+	    metrics_value(metrics_counter("mqtt_saved_total", NULL)) / saved,
+	    metrics_value(metrics_gauge("mqtt_dump_bytes", NULL)));
+
+    // the lost and reconnected manage messages travel with the replay, so
+    // the wait can end a message or two early
+    target = stubbroker_received() + (uint64_t) metrics_value(metrics_counter("mqtt_saved_total", NULL));
+    stubbroker_online(1);
+    if (!waitFor(isConnected, c)) {
+	printf("replay: did not reconnect\n");
+	return;
+    }
+    start = now();
+    if (!waitFor(hasReceived, &target)) {
+	printf("replay: broker did not receive every saved reading\n");
+	return;
+    }
+    replayed = now() - start;
+    waitFor(isDrained, NULL);
+    printf("replay: %.0f readings in %.1f ms, %.0f/s, reconnect took %.0f ms\n",
+	    (double) E2E_OFFLINE, replayed * 1e3, E2E_OFFLINE / replayed,
+	    metrics_quantile(metrics_histogram("mqtt_reconnect_seconds", NULL), 0.5) * 1e3);
+}
+
+int
+main(int argc, char **argv) {
+    my_context_t context = my_context_t_initializer;
+    mqtt_broker_t broker;
+    MQTTAsync client;
+    char address[64];
+    double seconds = argc > 1 ? atof(argv[1]) : E2E_SECONDS;
+    size_t s, r;
+    int port;
+
+    if (seconds <= 0) seconds = E2E_SECONDS;
+    if (makeSensors(32) != 0) {
+	perror("e2ebench: creating simulated sensors");
+	return EXIT_FAILURE;
+    }
+    if (stubbroker_start(&port) != STUBBROKER_SUCCESS) {
+	perror("e2ebench: starting the broker");
+	return EXIT_FAILURE;
+    }
+    snprintf(address, sizeof (address), "tcp://127.0.0.1:%d", port);
+    memset(&broker, 0, sizeof (broker));
+    broker.mqtthostaddr = address;
+    broker.mqttclientid = "pi2mqtt-e2ebench";
+    broker.mqtthome = "bench";
+    broker.mqttmanagementtopic = "bench/manage/+";
+    context.broker = &broker;
+    context.client = &client;
+    clock_gettime(CLOCK_MONOTONIC, &context.started);
+
+    if (MQTT_init(&context) != MQTT_SUCCESS || !waitFor(isConnected, &context)) {
+	fprintf(stderr, "e2ebench: no connection to the broker at %s\n", address);
+	return EXIT_FAILURE;
+    }
+    printf("%7s %7s %10s %10s %9s %9s %7s %8s %8s\n", "sensors", "rate",
+	    "sent/s", "acked/s", "p50 ms", "p99 ms", "cpu", "rss kB", "peak kB");
+    for (s = 0; s < sizeof (sensorCounts) / sizeof (sensorCounts[0]); s++) {
+	for (r = 0; r < sizeof (rates) / sizeof (rates[0]); r++) {
+	    runCase(&context, sensorCounts[s], rates[r], seconds);
+	}
+    }
+    runOffline(&context);
+
+    MQTTAsync_destroy(&client);
+    stubbroker_stop();
+    unlink(MQTT_DUMP_FILE);
+    removeSensors(32);
+    return context.killed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
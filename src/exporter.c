@@ -0,0 +1,210 @@
+/*
+ * The MIT License
+ *
+ * Copyright 2017 Nick Ong <onichola@gmail.com>.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "debug.h"
+#include "metrics.h"
+#include "exporter.h"
+
+static int listenFD = -1;
+static char unixPath[sizeof (((struct sockaddr_un *) 0)->sun_path)];
+static pthread_t listener;
+static int stopping = 0;
+
+/**
+ * Open a listening socket on a port, host:port or unix:path address.
+ * @return the socket, -1 on error
+ */
+static int
+openListener(const char *address) {
+    struct sockaddr_un sun;
+    struct sockaddr_in sin;
+    char host[64];
+    const char *colon;
+    int fd;
+    int on = 1;
+
+    if (strncmp(address, "unix:", 5) == 0) {
+	memset(&sun, 0, sizeof (sun));
+	sun.sun_family = AF_UNIX;
+	if (strlen(address + 5) >= sizeof (sun.sun_path)) return -1;
+	strcpy(sun.sun_path, address + 5);
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) return -1;
+	unlink(sun.sun_path);
+	if (bind(fd, (struct sockaddr *) &sun, sizeof (sun)) != 0 || listen(fd, 4) != 0) {
+	    close(fd);
+	    return -1;
+	}
+	strcpy(unixPath, sun.sun_path);
+    } else {
+	memset(&sin, 0, sizeof (sin));
+	sin.sin_family = AF_INET;
+	if ((colon = strrchr(address, ':')) != NULL) {
+	    snprintf(host, sizeof (host), "%.*s", (int) (colon - address), address);
+	    address = colon + 1;
+	} else {
+	    strcpy(host, "127.0.0.1");
+	}
+	if (inet_pton(AF_INET, host, &sin.sin_addr) != 1 || atoi(address) <= 0) return -1;
+	sin.sin_port = htons(atoi(address));
+	if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) return -1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof (on));
+	if (bind(fd, (struct sockaddr *) &sin, sizeof (sin)) != 0 || listen(fd, 4) != 0) {
+	    close(fd);
+	    return -1;
+	}
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    return fd;
+}
+
+/**
+ * Wait until a client socket is ready, bounded by the request deadline.
+ * @return 1 if ready, 0 on timeout or error
+ */
+static int
+waitClient(int fd, short events, int *remaining) {
+    struct pollfd pfd;
+    struct timespec start, end;
+    int rc;
+
+    pfd.fd = fd;
+    pfd.events = events;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    rc = poll(&pfd, 1, *remaining);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    *remaining -= (end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000;
+    return rc > 0 && *remaining > 0;
+}
+
+/**
+ * Answer one scrape.  The client has EXPORTER_TIMEOUT_MS for the whole
+ * exchange, so a stalled scraper cannot hold the listener.
+ */
+static void
+serveClient(int fd) {
+    char request[2048];
+    char header[160];
+    size_t used = 0;
+    ssize_t n;
+    char *body = NULL;
+    size_t bodyLen = 0;
+    const char *status = "200 OK";
+    FILE *fp;
+    int remaining = EXPORTER_TIMEOUT_MS;
+    size_t sent;
+    int hlen;
+
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    // read the request head, only the request line matters
+    while (used < sizeof (request) - 1) {
+	if (!waitClient(fd, POLLIN, &remaining)) return;
+	if ((n = read(fd, request + used, sizeof (request) - 1 - used)) <= 0) return;
+	used += n;
+	request[used] = 0;
+	if (strstr(request, "\r\n\r\n") != NULL || strstr(request, "\n\n") != NULL) break;
+    }
+    if ((fp = open_memstream(&body, &bodyLen)) == NULL) return;
+    if (strncmp(request, "GET /metrics ", 13) == 0 || strncmp(request, "GET / ", 6) == 0) {
+	metrics_prometheus(fp);
+    } else {
+	status = "404 Not Found";
+	fputs("not found, try /metrics\n", fp);
+    }
+    fclose(fp);
+    hlen = snprintf(header, sizeof (header),
+	    "HTTP/1.0 %s\r\nContent-Type: text/plain; version=0.0.4\r\n"
+	    "Content-Length: %zu\r\nConnection: close\r\n\r\n", status, bodyLen);
+    for (sent = 0; sent < (size_t) hlen + bodyLen;) {
+	if (!waitClient(fd, POLLOUT, &remaining)) break;
+	if (sent < (size_t) hlen) {
+	    n = send(fd, header + sent, hlen - sent, MSG_NOSIGNAL);
+	} else {
+	    n = send(fd, body + sent - hlen, bodyLen - (sent - hlen), MSG_NOSIGNAL);
+	}
+	if (n < 0 && errno != EAGAIN) break;
+	if (n > 0) sent += n;
+    }
+    free(body);
+}
+
+static void *
+listen_thread(void *arg) {
+    struct pollfd pfd;
+    int fd;
+
+    pfd.fd = listenFD;
+    pfd.events = POLLIN;
+    while (!__atomic_load_n(&stopping, __ATOMIC_RELAXED)) {
+	// wake up regularly to notice exporter_stop
+	if (poll(&pfd, 1, 500) <= 0) continue;
+	if ((fd = accept(listenFD, NULL, NULL)) < 0) continue;
+	metrics_add(metrics_counter("exporter_scrapes_total", NULL), 1);
+	serveClient(fd);
+	close(fd);
+    }
+    return NULL;
+}
+
+int
+exporter_start(const char *address) {
+    if (listenFD >= 0) return EXPORTER_FAILURE;
+    stopping = 0;
+    unixPath[0] = 0;
+    if ((listenFD = openListener(address)) < 0) {
+	DBGLOG(DBG_MAIN, DBG_ERROR, "exporter: unable to listen on %s - %s", address, strerror(errno));
+	return EXPORTER_FAILURE;
+    }
+    if (pthread_create(&listener, NULL, listen_thread, NULL) != 0) {
+	DBGLOG(DBG_MAIN, DBG_ERROR, "exporter: unable to start listener thread");
+	close(listenFD);
+	listenFD = -1;
+	return EXPORTER_FAILURE;
+    }
+    DBGLOG(DBG_MAIN, DBG_INFO, "exporter: serving metrics on %s", address);
+    return EXPORTER_SUCCESS;
+}
+
+void
+exporter_stop(void) {
+    if (listenFD < 0) return;
+    __atomic_store_n(&stopping, 1, __ATOMIC_RELAXED);
+    pthread_join(listener, NULL);
+    close(listenFD);
+    listenFD = -1;
+    if (unixPath[0] != 0) unlink(unixPath);
+}
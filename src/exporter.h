@@ -0,0 +1,73 @@
+/*
+ * The MIT License
+ *
+ * Copyright 2017 Nick Ong <onichola@gmail.com>.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * File:   exporter.h
+ * Author: Nick Ong <onichola@gmail.com>
+ *
+ * Serves the metrics registry to Prometheus over HTTP on a local TCP port or
+ * a Unix socket.  The listener runs on its own thread and only reads the
+ * registry, it never waits on the sensors or the broker.
+ */
+
+#ifndef EXPORTER_H
+#define EXPORTER_H
+
+#ifndef EXPORTER_SUCCESS
+#define EXPORTER_SUCCESS 0  ///< success indicator
+#endif
+
+#ifndef EXPORTER_FAILURE
+#define EXPORTER_FAILURE -1  ///< failure indicator
+#endif
+
+#define EXPORTER_TIMEOUT_MS 2000 ///< time allowed for a scrape request and response
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    /**
+     * \brief Start serving metrics.
+     *
+     * The address is a port, such as "9105", which listens on 127.0.0.1,
+     * a host and port, such as "0.0.0.0:9105", or a Unix socket path
+     * prefixed with "unix:", such as "unix:/run/pi2mqtt.sock".
+     * Only one listener is supported.
+     * @param address - where to listen
+     * @return EXPORTER_SUCCESS if listening
+     */
+    extern int exporter_start(const char *address);
+
+    /**
+     * \brief Stop serving metrics and wait for the listener thread.
+     * Does nothing if exporter_start did not succeed.
+     */
+    extern void exporter_stop(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* EXPORTER_H */
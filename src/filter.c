@@ -0,0 +1,157 @@
+/*
+ * The MIT License
+ *
+ * Copyright 2017 Nick Ong <onichola@gmail.com>.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+/*
+ * File:   filter.c
+ * Author: Nick Ong <onichola@gmail.com>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "filter.h"
+
+int
+filter_add(filter_t *f, const char *spec) {
+    filter_stage_t *s;
+    const char *arg = strchr(spec, ':');
+    char *end;
+    size_t len = arg != NULL ? (size_t) (arg - spec) : strlen(spec);
+
+    if (f->size == FILTER_MAXSTAGES || arg == NULL) return FILTER_FAILURE;
+    s = &f->stages[f->size];
+    memset(s, 0, sizeof (filter_stage_t));
+    if (len == 3 && strncmp(spec, "ema", len) == 0) {
+	s->kind = FILTER_EMA;
+	s->alpha = strtod(arg + 1, &end);
+	if (*end != '\0' || s->alpha <= 0 || s->alpha > 1) return FILTER_FAILURE;
+    } else {
+	if (len == 8 && strncmp(spec, "decimate", len) == 0) s->kind = FILTER_DECIMATE;
+	else if (len == 4 && strncmp(spec, "mean", len) == 0) s->kind = FILTER_MEAN;
+	else if (len == 6 && strncmp(spec, "median", len) == 0) s->kind = FILTER_MEDIAN;
+	else return FILTER_FAILURE;
+	s->n = (int) strtol(arg + 1, &end, 10);
+	if (*end != '\0' || s->n < 1) return FILTER_FAILURE;
+	if (s->kind != FILTER_DECIMATE && s->n > FILTER_WINDOW) return FILTER_FAILURE;
+    }
+    f->size++;
+    return FILTER_SUCCESS;
+}
+
+void
+filter_reset(filter_t *f) {
+    int i;
+
+    for (i = 0; i < f->size; i++) {
+	f->stages[i].head = 0;
+	f->stages[i].count = 0;
+	f->stages[i].acc = 0;
+    }
+}
+
+int
+filter_same(const filter_t *a, const filter_t *b) {
+    int i;
+
+    if (a->size != b->size) return 0;
+    for (i = 0; i < a->size; i++) {
+	if (a->stages[i].kind != b->stages[i].kind || a->stages[i].n != b->stages[i].n ||
+		a->stages[i].alpha != b->stages[i].alpha) return 0;
+    }
+    return 1;
+}
+
+/**
+ * Median of the ring, by insertion sort of a copy, the windows being short.
+ */
+static float
+median(const filter_stage_t *s) {
+    float v[FILTER_WINDOW];
+    float x;
+    int i, j;
+
+    for (i = 0; i < s->count; i++) {
+	x = s->ring[i];
+	for (j = i; j > 0 && v[j - 1] > x; j--) v[j] = v[j - 1];
+	v[j] = x;
+    }
+    return s->count & 1 ? v[s->count / 2] : (v[s->count / 2 - 1] + v[s->count / 2]) / 2;
+}
+
+/**
+ * Push a sample into a stage.
+ * @return 1 if the stage put out a value
+ */
+static int
+push(filter_stage_t *s, float x, float *y) {
+    switch (s->kind) {
+	case FILTER_DECIMATE:
+	    s->acc += x;
+	    if (++s->count < s->n) return 0;
+	    *y = (float) (s->acc / s->n);
+	    s->acc = 0;
+	    s->count = 0;
+	    return 1;
+	case FILTER_MEAN:
+	    // until the window fills the average is of the samples so far
+	    if (s->count == s->n) s->acc -= s->ring[s->head];
+	    else s->count++;
+	    s->ring[s->head] = x;
+	    s->acc += x;
+	    s->head = (s->head + 1) % s->n;
+	    *y = (float) (s->acc / s->count);
+	    return 1;
+	case FILTER_MEDIAN:
+	    if (s->count < s->n) s->count++;
+	    s->ring[s->head] = x;
+	    s->head = (s->head + 1) % s->n;
+	    *y = median(s);
+	    return 1;
+	case FILTER_EMA:
+	    if (s->count == 0) s->acc = x;
+	    else s->acc += s->alpha * (x - s->acc);
+	    s->count = 1;
+	    *y = (float) s->acc;
+	    return 1;
+    }
+    return 0;
+}
+
+int
+filter_run(filter_t *f, const float *in, int n, float *out) {
+    int produced = 0;
+    float x;
+    int i, k;
+
+    for (i = 0; i < n; i++) {
+	x = in[i];
+	for (k = 0; k < f->size && push(&f->stages[k], x, &x); k++);
+	if (k < f->size) continue;
+	*out = x;
+	produced++;
+    }
+    return produced;
+}
@@ -0,0 +1,111 @@
+/*
+ * The MIT License
+ *
+ * Copyright 2017 Nick Ong <onichola@gmail.com>.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+/*
+ * File:   filter.h
+ * Author: Nick Ong <onichola@gmail.com>
+ *
+ * Digital filters for oversampled analog inputs.  A pipeline is a short
+ * chain of stages, each on a fixed size ring buffer inside the filter, so
+ * that pushing samples through never allocates.
+ */
+
+#ifndef FILTER_H
+#define FILTER_H
+
+#ifndef FILTER_SUCCESS
+#define FILTER_SUCCESS 0 ///< success indicator
+#endif
+
+#ifndef FILTER_FAILURE
+#define FILTER_FAILURE -1 ///< failure indicator
+#endif
+
+#define FILTER_MAXSTAGES 4 ///< stages of one pipeline
+#define FILTER_WINDOW 32 ///< longest moving average or median window
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    typedef enum {
+        FILTER_DECIMATE, ///< average n samples into one, n times fewer out than in
+        FILTER_MEAN, ///< moving average of the last n samples
+        FILTER_MEDIAN, ///< median of the last n samples
+        FILTER_EMA ///< exponential moving average with weight alpha
+    } filter_kind_t;
+
+    typedef struct {
+        filter_kind_t kind; ///< what the stage does
+        int n; ///< decimation factor or window length
+        double alpha; ///< weight of a new sample in the EMA
+        float ring[FILTER_WINDOW]; ///< last samples, for the mean and median
+        int head; ///< next slot of the ring
+        int count; ///< samples in the ring, or taken towards a decimated one
+        double acc; ///< running sum of the ring or the decimation, or the EMA
+    } filter_stage_t;
+
+    typedef struct {
+        int size; ///< number of stages, 0 passes samples through
+        filter_stage_t stages[FILTER_MAXSTAGES]; ///< the stages in order
+    } filter_t;
+
+    /**
+     * \brief Append a stage to a pipeline.
+     * @param f - pipeline
+     * @param spec - "decimate:<n>", "mean:<n>", "median:<n>" or "ema:<alpha>"
+     * @return FILTER_SUCCESS, FILTER_FAILURE if the spec is not understood
+     * or the pipeline is full
+     */
+    extern int filter_add(filter_t *f, const char *spec);
+
+    /**
+     * \brief Forget the samples seen, keeping the stages.
+     * @param f - pipeline
+     */
+    extern void filter_reset(filter_t *f);
+
+    /**
+     * \brief Tell whether two pipelines have the same stages.
+     * @return 1 if they have
+     */
+    extern int filter_same(const filter_t *a, const filter_t *b);
+
+    /**
+     * \brief Push samples through the pipeline.
+     * @param f - pipeline
+     * @param in - samples
+     * @param n - number of samples
+     * @param out - last value to come out of the pipeline, left alone if
+     * none did
+     * @return number of values that came out, with decimation fewer than n
+     */
+    extern int filter_run(filter_t *f, const float *in, int n, float *out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* FILTER_H */
@@ -0,0 +1,139 @@
+/*
+ * The MIT License
+ *
+ * Copyright 2017 Nick Ong <onichola@gmail.com>.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * pi2mqtt-logdecode - print a debug log written with debugformat = "binary".
+ *
+ * The log is a magic line followed by frames of an 18 byte little endian
+ * header (kind, module, level, 0, 32 bit site id, 64 bit time, 16 bit
+ * length) and a payload.  An 'F' frame gives the format and argument kinds
+ * of a site the first time it appears, an 'M' frame the raw arguments of a
+ * message.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "debug.h"
+
+typedef struct {
+    char *fmt;
+    char *sig;
+} site_t;
+
+static site_t sites[DBGLOG_MAXSITES];
+
+int
+main(int argc, char** argv) {
+    unsigned char hdr[18];
+    unsigned char payload[65536];
+    char magic[sizeof (DBGLOG_MAGIC)];
+    char text[4096];
+    struct tm tm;
+    time_t stamp;
+    unsigned int id;
+    unsigned int len;
+    int module = -1;
+    int level = DBG_DEBUG;
+    FILE *fp;
+    int c;
+    int i;
+
+    while ((c = getopt(argc, argv, "m:l:h?")) != -1) {
+	switch (c) {
+	    case 'm':
+		if ((module = DBGLogModule(optarg)) < 0) {
+		    fprintf(stderr, "unknown module %s\n", optarg);
+		    exit(EXIT_FAILURE);
+		}
+		break;
+	    case 'l':
+		if ((level = DBGLogLevel(optarg)) < 0) {
+		    fprintf(stderr, "unknown level %s\n", optarg);
+		    exit(EXIT_FAILURE);
+		}
+		break;
+	    default:
+		printf("usage: pi2mqtt-logdecode [-m module] [-l level] [file]\n");
+		exit(c == 'h' || c == '?' ? EXIT_SUCCESS : EXIT_FAILURE);
+	}
+    }
+
+    if (optind < argc) {
+	if ((fp = fopen(argv[optind], "rb")) == NULL) {
+	    perror(argv[optind]);
+	    exit(EXIT_FAILURE);
+	}
+    } else {
+	fp = stdin;
+    }
+
+    if (fread(magic, 1, strlen(DBGLOG_MAGIC), fp) != strlen(DBGLOG_MAGIC) ||
+	    memcmp(magic, DBGLOG_MAGIC, strlen(DBGLOG_MAGIC)) != 0) {
+	fprintf(stderr, "not a binary pi2mqtt debug log\n");
+	exit(EXIT_FAILURE);
+    }
+
+    while (fread(hdr, sizeof (hdr), 1, fp) == 1) {
+	id = hdr[4] | hdr[5] << 8 | hdr[6] << 16 | (unsigned int) hdr[7] << 24;
+	stamp = 0;
+	for (i = 7; i >= 0; i--)
+	    stamp = (stamp << 8) | hdr[8 + i];
+	len = hdr[16] | hdr[17] << 8;
+	if (fread(payload, 1, len, fp) != len) {
+	    fprintf(stderr, "truncated record\n");
+	    break;
+	}
+	if (id >= DBGLOG_MAXSITES) {
+	    fprintf(stderr, "bad site id %u\n", id);
+	    break;
+	}
+	if (hdr[0] == 'F') {
+	    size_t flen = strnlen((char *) payload, len);
+	    free(sites[id].fmt);
+	    free(sites[id].sig);
+	    sites[id].fmt = strndup((char *) payload, flen);
+	    sites[id].sig = flen < len ? strndup((char *) payload + flen + 1, len - flen - 1) : strdup("");
+	    continue;
+	}
+	if (hdr[0] != 'M')
+	    continue;
+	if ((module >= 0 && hdr[1] != module) || hdr[2] > level)
+	    continue;
+	if (sites[id].fmt == NULL) {
+	    snprintf(text, sizeof (text), "<no format for site %u>", id);
+	} else {
+	    DBGLogFormat(sites[id].fmt, sites[id].sig, payload, len, text, sizeof (text));
+	}
+	localtime_r(&stamp, &tm);
+	printf("%04d/%02d/%02d %02d:%02d:%02d %s %s %s\n",
+		tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec,
+		DBGLogModuleName(hdr[1]), DBGLogLevelName(hdr[2]), text);
+    }
+    if (fp != stdin) fclose(fp);
+    return (EXIT_SUCCESS);
+}
@@ -37,15 +37,26 @@
 #include <time.h>
 #include <fcntl.h>
 #include <err.h>
+#include <fnmatch.h>
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
 #include <MQTTAsync.h>
 #include <confuse.h>
 #include "tempsensor.h"
+#include "adcstream.h"
 #include "ds18b20pi.h"
 #include "dht22.h"
 #include "raven.h"
 #include "doorswitch.h"
+#include "rules.h"
+#include "virtualsensor.h"
 #include "mqtt.h"
 #include "debug.h"
+#include "metrics.h"
+#include "exporter.h"
+#include "capture.h"
+#include "trace.h"
 
 #define STARTUP "\n\npi2mqtt - \nVersion 0.1 Mar 28, 2017\nRead sensors from RPI and publish data to mqtt\r\n\r\n"
 
@@ -53,6 +64,11 @@ typedef struct {
     int size; ///< number of ports
     DS18B20PI_port_t ports[MAXPORTS];
     long lastsample[MAXPORTS];
+    int bulk; ///< 1 to convert every probe due at once
+    int discoverInterval; ///< seconds between discoveries, 0 disables
+    long lastDiscover; ///< time of the last discovery
+    DS18B20PI_port_t discoverTemplate; ///< settings of discovered ports, path is the devices directory
+    char discoverTopic[64]; ///< topic of discovered ports, {id} is replaced by the id
 } ds18b20pi_ports_t;
 
 typedef struct {
@@ -63,6 +79,7 @@ typedef struct {
 typedef struct {
     int size;
     dht22_port_t ports[MAXPORTS];
+    long lastsample[MAXPORTS];
 } dht22_ports_t;
 
 typedef struct {
@@ -75,8 +92,35 @@ typedef struct {
     int size;
     tempsensor_port_t ports[MAXPORTS];
     long lastsample[MAXPORTS];
+    long lastOversample; ///< second the filters were last fed
+    int started; ///< 1 once the streaming and oversampling threads of these ports are started
 } tempsensor_ports_t;
 
+typedef struct {
+    ds18b20pi_ports_t ds18b20;
+    raven_ports_t raven;
+    dht22_ports_t dht22;
+    doorswitch_ports_t doorswitch;
+    tempsensor_ports_t tempsensor;
+} sensor_ports_t;
+
+typedef enum {
+    BUS_W1, ///< DS18B20 on the 1-wire bus
+    BUS_I2C, ///< thermistors on the ADS1115
+    BUS_GPIO, ///< door switches and DHT22
+    BUS_COUNT
+} sensor_bus_t;
+
+static const char *busNames[BUS_COUNT] = {"w1", "i2c", "gpio"};
+
+typedef struct {
+    const mqtt_read_request_t *req; ///< request being served
+    sensor_ports_t *ports; ///< all configured ports
+    sensor_bus_t bus; ///< bus this job reads
+    int size; ///< number of readings
+    mqtt_data_t results[MAXPORTS * 3]; ///< readings taken, on GPIO a door switch and two per DHT22
+} read_job_t;
+
 char *gApp = "pi2mqtt";
 
 char gTempDevLoc[128];
@@ -86,16 +130,24 @@ char gCmdBuffer[1024 * 5];
 int gCmdBufferLen;
 
 /**
- * 
- * @param config_filename
- * @return 
+ * Parse the configuration from a file or, if config_buf is given, from memory.
+ * @param config_filename file to parse when config_buf is NULL
+ * @param config_buf configuration text, or NULL
+ * @return parsed configuration.  A bad file is fatal, a bad buffer returns NULL.
  */
 static cfg_t *
-read_config(char config_filename[]) {
+read_config(const char config_filename[], const char *config_buf) {
     cfg_t *cfg;
     static cfg_opt_t tempsensor_opts[] = {
 	CFG_INT("pin", 4, CFGF_NONE),
 	CFG_INT("addr", 0x48, CFGF_NONE),
+	CFG_FLOAT("gain", ADC_GAIN, CFGF_NONE),
+	CFG_INT("datarate", ADC_DATARATE, CFGF_NONE),
+	CFG_INT("rdypin", -1, CFGF_NONE),
+	CFG_INT("oversample", 0, CFGF_NONE),
+	CFG_INT("stream", 0, CFGF_NONE),
+	CFG_INT("streamblock", 256, CFGF_NONE),
+	CFG_STR_LIST("filter", "{}", CFGF_NONE),
 	CFG_STR("A", "000e00", CFGF_NONE),
 	CFG_STR("B", "000e00", CFGF_NONE),
 	CFG_STR("C", "000e00", CFGF_NONE),
@@ -111,6 +163,16 @@ read_config(char config_filename[]) {
 	CFG_INT("sampletime", 5, CFGF_NONE),
 	CFG_STR("location", "location", CFGF_NONE),
 	CFG_INT("isfahrenheit", 1, CFGF_NONE),
+	CFG_INT("resolution", 0, CFGF_NONE),
+	CFG_END()
+    };
+    static cfg_opt_t w1discover_opts[] = {
+	CFG_INT("interval", 0, CFGF_NONE),
+	CFG_STR("address", "/sys/bus/w1/devices", CFGF_NONE),
+	CFG_STR("topic", "{id}/w1/temp", CFGF_NONE),
+	CFG_INT("sampletime", 5, CFGF_NONE),
+	CFG_INT("isfahrenheit", 1, CFGF_NONE),
+	CFG_INT("resolution", 0, CFGF_NONE),
 	CFG_END()
     };
     static cfg_opt_t raven_opts[] = {
@@ -123,6 +185,7 @@ read_config(char config_filename[]) {
 	CFG_INT("pin", 1, CFGF_NONE),
 	CFG_STR("mqttpubtopic", "temp", CFGF_NONE),
 	CFG_INT("isfahrenheit", 1, CFGF_NONE),
+	CFG_INT("sampletime", 5, CFGF_NONE),
 	CFG_END()
     };
     static cfg_opt_t doorswitch_opts[] = {
@@ -133,6 +196,22 @@ read_config(char config_filename[]) {
 	CFG_INT("samplecontinuous", 0, CFGF_NONE),
 	CFG_END()
     };
+    static cfg_opt_t rule_opts[] = {
+	CFG_STR("expr", "", CFGF_NONE),
+	CFG_STR("mqttpubtopic", "alarm", CFGF_NONE),
+	CFG_STR("location", "location", CFGF_NONE),
+	CFG_END()
+    };
+    static cfg_opt_t virtual_opts[] = {
+	CFG_STR("type", "dewpoint", CFGF_NONE),
+	CFG_STR_LIST("inputs", "{}", CFGF_NONE),
+	CFG_STR("mqttpubtopic", "virtual", CFGF_NONE),
+	CFG_STR("location", "location", CFGF_NONE),
+	CFG_INT("isfahrenheit", 1, CFGF_NONE),
+	CFG_INT("window", 3600, CFGF_NONE),
+	CFG_INT("sampletime", 0, CFGF_NONE),
+	CFG_END()
+    };
     static cfg_opt_t opts[] = {
 	CFG_STR("mqttbrokeraddress", "localhost", CFGF_NONE),
 	CFG_STR("mqttbrokeruid", 0, CFGF_NONE),
@@ -142,64 +221,131 @@ read_config(char config_filename[]) {
 	CFG_STR("clientid", "id", CFGF_NONE),
 	CFG_STR("debuglogfile", "./debug.log", CFGF_NONE),
 	CFG_INT("debugmode", 0, CFGF_NONE),
+	CFG_STR("debugoverflow", "drop", CFGF_NONE),
+	CFG_STR("debuglevel", "debug", CFGF_NONE),
+	CFG_STR_LIST("debugmodules", "{}", CFGF_NONE),
+	CFG_STR("debugformat", "text", CFGF_NONE),
+	CFG_INT("debugmaxsize", 1024, CFGF_NONE),
+	CFG_INT("debugmaxage", 86400, CFGF_NONE),
+	CFG_INT("debuggenerations", 3, CFGF_NONE),
+	CFG_INT("debugcompress", 0, CFGF_NONE),
+	CFG_INT("debugflush", 5, CFGF_NONE),
+	CFG_INT("ds18b20bulk", 1, CFGF_NONE),
+	CFG_INT("metricsinterval", 60, CFGF_NONE),
+	CFG_STR("metricslisten", "", CFGF_NONE),
+	CFG_STR("capturefile", "", CFGF_NONE),
+	CFG_STR("replayfile", "", CFGF_NONE),
+	CFG_FLOAT("replayspeed", 1.0, CFGF_NONE),
 	CFG_SEC("ds18b20", ds18b20_opts, CFGF_MULTI | CFGF_TITLE),
+	CFG_SEC("w1discover", w1discover_opts, CFGF_NONE),
 	CFG_SEC("RAVEn", raven_opts, CFGF_MULTI | CFGF_TITLE),
 	CFG_SEC("dht22", dht22_opts, CFGF_MULTI | CFGF_TITLE),
 	CFG_SEC("doorswitch", doorswitch_opts, CFGF_MULTI | CFGF_TITLE),
 	CFG_SEC("tempsensor", tempsensor_opts, CFGF_MULTI | CFGF_TITLE),
+	CFG_SEC("rule", rule_opts, CFGF_MULTI | CFGF_TITLE),
+	CFG_SEC("virtual", virtual_opts, CFGF_MULTI | CFGF_TITLE),
 	CFG_END()
     };
 
     cfg = cfg_init(opts, 0);
-    if (cfg_parse(cfg, config_filename) != CFG_SUCCESS) {
+    if (config_buf != NULL) {
+	if (cfg_parse_buf(cfg, config_buf) != CFG_SUCCESS) {
+	    cfg_free(cfg);
+	    return (NULL);
+	}
+    } else if (cfg_parse(cfg, config_filename) != CFG_SUCCESS) {
 	errx(1, "Failed parsing configuration!\n");
     }
     return (cfg);
 }
 
 /**
- * Load the initial parameters.
- * TODO: build a parser to read XML file at setup.
+ * Check the parts of a configuration that can fail to load, without
+ * changing anything that is running.
+ * @param config parsed configuration
+ * @return 0 if the configuration can be loaded, -1 otherwise
  */
-static void
-LoadINIParms(cfg_t **config, ds18b20pi_ports_t *sensors, raven_ports_t *raven, dht22_ports_t *dht22p,
-	doorswitch_ports_t *doorswitch, tempsensor_ports_t *tempsensor, mqtt_broker_t *broker, char configFile[]) {
-    int i;
+static int
+validateConfig(cfg_t *config) {
     cfg_t *scfg;
-    char buf[64];
+    int rc = 0;
+    int i;
+
+    for (i = 0; i < cfg_size(config, "rule"); i++) {
+	scfg = cfg_getnsec(config, "rule", i);
+	if (i >= RULES_MAXRULES || rules_check(cfg_getstr(scfg, "expr")) != RULES_SUCCESS) {
+	    DBGLOG(DBG_MAIN, DBG_ERROR, "validateConfig - bad rule %s", cfg_title(scfg));
+	    rc = -1;
+	}
+    }
+    for (i = 0; i < cfg_size(config, "virtual"); i++) {
+	scfg = cfg_getnsec(config, "virtual", i);
+	if (virtualsensor_check(cfg_getstr(scfg, "type"), cfg_size(scfg, "inputs")) != VIRTUALSENSOR_SUCCESS) {
+	    DBGLOG(DBG_MAIN, DBG_ERROR, "validateConfig - bad virtual sensor %s", cfg_title(scfg));
+	    rc = -1;
+	}
+    }
+    return rc;
+}
 
-    *config = read_config(configFile);
+/**
+ * Create the ports, rules and virtual sensors of a configuration.
+ * @param config parsed configuration
+ * @param ports receives the ports, must be empty
+ * @return 0 on success, -1 if a rule or virtual sensor failed to load
+ */
+static int
+loadPorts(cfg_t *config, sensor_ports_t *ports) {
+    int i;
+    int rc = 0;
+    cfg_t *scfg;
+    ds18b20pi_ports_t *sensors = &ports->ds18b20;
+    raven_ports_t *raven = &ports->raven;
+    dht22_ports_t *dht22p = &ports->dht22;
+    doorswitch_ports_t *doorswitch = &ports->doorswitch;
+    tempsensor_ports_t *tempsensor = &ports->tempsensor;
 
-    for (i = 0; i < cfg_size(*config, "ds18b20"); i++) {
+    sensors->bulk = cfg_getint(config, "ds18b20bulk");
+    scfg = cfg_getsec(config, "w1discover");
+    sensors->discoverInterval = cfg_getint(scfg, "interval");
+    sensors->lastDiscover = 0;
+    sensors->discoverTemplate = DS18B20PI_createPort(cfg_getstr(scfg, "address"), "", "",
+	    cfg_getint(scfg, "sampletime"), "", cfg_getint(scfg, "isfahrenheit"),
+	    cfg_getint(scfg, "resolution"));
+    snprintf(sensors->discoverTopic, sizeof (sensors->discoverTopic), "%s", cfg_getstr(scfg, "topic"));
+    for (i = 0; i < cfg_size(config, "ds18b20"); i++) {
 	if (i < MAXPORTS) {
-	    scfg = cfg_getnsec(*config, "ds18b20", i);
+	    scfg = cfg_getnsec(config, "ds18b20", i);
 	    sensors->ports[i] = DS18B20PI_createPort(cfg_getstr(scfg, "address"),
 		    cfg_title(scfg), cfg_getstr(scfg, "mqttpubtopic"),
 		    cfg_getint(scfg, "sampletime"),
 		    cfg_getstr(scfg, "location"),
-		    cfg_getint(scfg, "isfahrenheit"));
+		    cfg_getint(scfg, "isfahrenheit"),
+		    cfg_getint(scfg, "resolution"));
 	    sensors->lastsample[i] = 0;
 	    sensors->size++;
 	}
     }
-    for (i = 0; i < cfg_size(*config, "RAVEn"); i++) {
+    for (i = 0; i < cfg_size(config, "RAVEn"); i++) {
 	if (i < MAXPORTS) {
-	    scfg = cfg_getnsec(*config, "RAVEn", i);
+	    scfg = cfg_getnsec(config, "RAVEn", i);
 	    raven->ports[i] = RAVEn_create(cfg_getstr(scfg, "address"), cfg_title(scfg), cfg_getstr(scfg, "mqttpubtopic"), cfg_getstr(scfg, "location"));
 	    raven->size++;
 	}
     }
-    for (i = 0; i < cfg_size(*config, "dht22"); i++) {
+    for (i = 0; i < cfg_size(config, "dht22"); i++) {
 	if (i < MAXPORTS) {
-	    scfg = cfg_getnsec(*config, "dht22", i);
+	    scfg = cfg_getnsec(config, "dht22", i);
 	    dht22p->ports[i] = DHT22_create(cfg_getint(scfg, "pin"), cfg_title(scfg),
-		    cfg_getstr(scfg, "mqttpubtopic"), cfg_getint(scfg, "isfahrenheit"));
+		    cfg_getstr(scfg, "mqttpubtopic"), cfg_getint(scfg, "isfahrenheit"),
+		    cfg_getint(scfg, "sampletime"));
+	    dht22p->lastsample[i] = 0;
 	    dht22p->size++;
 	}
     }
-    for (i = 0; i < cfg_size(*config, "doorswitch"); i++) {
+    for (i = 0; i < cfg_size(config, "doorswitch"); i++) {
 	if (i < MAXPORTS) {
-	    scfg = cfg_getnsec(*config, "doorswitch", i);
+	    scfg = cfg_getnsec(config, "doorswitch", i);
 	    doorswitch->ports[i] = doorswitch_createPort(cfg_getint(scfg, "pin"),
 		    cfg_title(scfg), cfg_getstr(scfg, "mqttpubtopic"),
 		    cfg_getstr(scfg, "location"), cfg_getint(scfg, "sampletime"),
@@ -208,21 +354,89 @@ LoadINIParms(cfg_t **config, ds18b20pi_ports_t *sensors, raven_ports_t *raven, d
 	    doorswitch->lastsample[i] = 0;
 	}
     }
-    for (i = 0; i < cfg_size(*config, "tempsensor"); i++) {
+    for (i = 0; i < cfg_size(config, "tempsensor"); i++) {
 	if (i < MAXPORTS) {
-	    scfg = cfg_getnsec(*config, "tempsensor", i);
+	    scfg = cfg_getnsec(config, "tempsensor", i);
 	    double a, b, c;
 	    sscanf(cfg_getstr(scfg, "A"), "%lf", &a);
 	    sscanf(cfg_getstr(scfg, "B"), "%lf", &b);
 	    sscanf(cfg_getstr(scfg, "C"), "%lf", &c);
 	    tempsensor->ports[i] = tempsensor_createPort(
-		    cfg_getint(scfg, "pin"), a, b, c,
+		    cfg_getint(scfg, "pin"), cfg_getint(scfg, "addr"),
+		    cfg_getfloat(scfg, "gain"), cfg_getint(scfg, "datarate"),
+		    cfg_getint(scfg, "rdypin"), a, b, c,
 		    cfg_getfloat(scfg, "Rb"), cfg_title(scfg), cfg_getstr(scfg, "mqttpubtopic"),
 		    cfg_getstr(scfg, "location"), cfg_getint(scfg, "sampletime"));
+	    const char *stages[FILTER_MAXSTAGES];
+	    int j, nstages = cfg_size(scfg, "filter");
+	    if (nstages > FILTER_MAXSTAGES) {
+		warnx("tempsensor %s has more than %d filter stages", cfg_title(scfg), FILTER_MAXSTAGES);
+		nstages = FILTER_MAXSTAGES;
+	    }
+	    for (j = 0; j < nstages; j++) stages[j] = cfg_getnstr(scfg, "filter", j);
+	    if (tempsensor_setFilter(&tempsensor->ports[i], cfg_getint(scfg, "oversample"),
+		    stages, nstages) != TEMPSENSOR_SUCCESS) {
+		warnx("Invalid filter for tempsensor %s!", cfg_title(scfg));
+	    }
+	    if (tempsensor_setStream(&tempsensor->ports[i], cfg_getint(scfg, "stream"),
+		    cfg_getint(scfg, "streamblock")) != TEMPSENSOR_SUCCESS) {
+		warnx("Cannot stream tempsensor %s!", cfg_title(scfg));
+	    }
 	    tempsensor->size++;
 	    tempsensor->lastsample[i] = 0;
 	}
     }
+    // a stream converts continuously on a thread of its own, so its ADC
+    // cannot also be swept or oversampled for another sensor
+    for (i = 0; i < tempsensor->size; i++) {
+	int j;
+	for (j = 0; j < tempsensor->size && tempsensor->ports[i].stream > 0; j++) {
+	    if (j != i && tempsensor->ports[j].addr == tempsensor->ports[i].addr) {
+		warnx("Cannot stream tempsensor %s, its ADC is shared with %s!",
+			tempsensor->ports[i].id, tempsensor->ports[j].id);
+		tempsensor_setStream(&tempsensor->ports[i], 0, 1);
+	    }
+	}
+    }
+    rules_clear();
+    for (i = 0; i < cfg_size(config, "rule"); i++) {
+	scfg = cfg_getnsec(config, "rule", i);
+	if (rules_add(cfg_title(scfg), cfg_getstr(scfg, "expr"),
+		cfg_getstr(scfg, "mqttpubtopic"), cfg_getstr(scfg, "location")) != RULES_SUCCESS) {
+	    warnx("Failed compiling rule %s!", cfg_title(scfg));
+	    rc = -1;
+	}
+    }
+    virtualsensor_clear();
+    for (i = 0; i < cfg_size(config, "virtual"); i++) {
+	const char *inputs[VIRTUALSENSOR_MAXINPUTS];
+	int j, ninputs;
+	scfg = cfg_getnsec(config, "virtual", i);
+	ninputs = cfg_size(scfg, "inputs");
+	for (j = 0; j < ninputs && j < VIRTUALSENSOR_MAXINPUTS; j++) {
+	    inputs[j] = cfg_getnstr(scfg, "inputs", j);
+	}
+	if (virtualsensor_add(cfg_title(scfg), cfg_getstr(scfg, "type"), inputs, ninputs,
+		cfg_getstr(scfg, "mqttpubtopic"), cfg_getstr(scfg, "location"),
+		cfg_getint(scfg, "isfahrenheit"), cfg_getint(scfg, "window"),
+		cfg_getint(scfg, "sampletime")) != VIRTUALSENSOR_SUCCESS) {
+	    warnx("Failed creating virtual sensor %s!", cfg_title(scfg));
+	    rc = -1;
+	}
+    }
+    return rc;
+}
+
+/**
+ * Load the initial parameters.
+ */
+static void
+LoadINIParms(cfg_t **config, sensor_ports_t *ports, mqtt_broker_t *broker, char configFile[]) {
+    *config = read_config(configFile, NULL);
+    if (loadPorts(*config, ports) != 0) {
+	errx(1, "Failed loading configuration!\n");
+    }
+
     broker->mqtthostaddr = cfg_getstr(*config, "mqttbrokeraddress");
     broker->mqttclientid = cfg_getstr(*config, "clientid");
     broker->mqttuid = cfg_getstr(*config, "mqttbrokeruid");
@@ -232,31 +446,837 @@ LoadINIParms(cfg_t **config, ds18b20pi_ports_t *sensors, raven_ports_t *raven, d
 
 }
 
+/**
+ * Set the debug log thresholds from debuglevel and the module=level entries
+ * of debugmodules.
+ */
+static void
+setLogLevels(cfg_t *cfg) {
+    char name[32];
+    const char *entry;
+    const char *eq;
+    int level;
+    int module;
+    int i;
+
+    if ((level = DBGLogLevel(cfg_getstr(cfg, "debuglevel"))) < 0) {
+	warnx("Unknown debuglevel %s", cfg_getstr(cfg, "debuglevel"));
+	level = DBG_DEBUG;
+    }
+    SetDBGLogLevel(-1, level);
+    for (i = 0; i < cfg_size(cfg, "debugmodules"); i++) {
+	entry = cfg_getnstr(cfg, "debugmodules", i);
+	if ((eq = strchr(entry, '=')) == NULL || eq - entry >= (int) sizeof (name)) {
+	    warnx("debugmodules entry %s is not module=level", entry);
+	    continue;
+	}
+	snprintf(name, sizeof (name), "%.*s", (int) (eq - entry), entry);
+	if ((module = DBGLogModule(name)) < 0 || (level = DBGLogLevel(eq + 1)) < 0) {
+	    warnx("debugmodules entry %s has an unknown module or level", entry);
+	    continue;
+	}
+	SetDBGLogLevel(module, level);
+    }
+}
+
+/**
+ * Publish a sensor reading.  Local rules see the reading first so that any
+ * alarm it raises goes out ahead of it.  Virtual sensors derived from the
+ * reading are then published the same way.
+ * @param context MQTT context
+ * @param message reading to publish
+ * @param depth number of virtual sensors between this reading and a real one
+ */
+static void
+publishReading(my_context_t *context, mqtt_data_t *message, int depth) {
+    // room for a message from every rule, or from every virtual sensor
+    mqtt_data_t out[RULES_MAXRULES > VIRTUALSENSOR_MAX ? RULES_MAXRULES : VIRTUALSENSOR_MAX];
+    int i, n;
+
+    n = rules_update(message, out, sizeof (out) / sizeof (out[0]));
+    for (i = 0; i < n; i++) {
+	mqttPublish(context, &out[i]);
+    }
+    mqttPublish(context, message);
+    if (depth < 4) {
+	n = virtualsensor_update(message, out, sizeof (out) / sizeof (out[0]));
+	for (i = 0; i < n; i++) {
+	    publishReading(context, &out[i], depth + 1);
+	}
+    }
+}
+
+/**
+ * Publish the metrics registry on metrics/<part>.  The registry is split over
+ * as many messages as needed to keep each within MQTT_MAXPAYLOAD.  Nothing is
+ * published while disconnected, stale metrics are not worth saving.
+ * @param context MQTT context
+ */
+static void
+publishMetrics(my_context_t *context) {
+    mqtt_data_t message;
+    int cursor = 0;
+    int part;
+
+    if (context->connected != 1) return;
+    for (part = 0; metrics_json(&cursor, time(NULL), message.payload, sizeof (message.payload)) > 0; part++) {
+	snprintf(message.topic, sizeof (message.topic), "metrics/%d", part);
+	message.sensor[0] = 0;
+	mqttPublish(context, &message);
+    }
+}
+
+/**
+ * Expand a topic template.
+ * @param out receives the topic
+ * @param size size of out
+ * @param tmpl template, {id} stands for the sensor id
+ * @param id sensor id
+ */
+static void
+expandTopic(char *out, size_t size, const char *tmpl, const char *id) {
+    size_t n = 0;
+
+    while (*tmpl != 0 && n + 1 < size) {
+	if (strncmp(tmpl, "{id}", 4) == 0) {
+	    n += snprintf(out + n, size - n, "%s", id);
+	    if (n >= size) n = size - 1;
+	    tmpl += 4;
+	} else {
+	    out[n++] = *tmpl++;
+	}
+    }
+    out[n] = 0;
+}
+
+/**
+ * Bring the discovered DS18B20 ports in line with the thermometers on the
+ * bus.  Ports configured by hand are left alone, present or not.  The list
+ * is only scanned here, once every discovery interval.
+ * @param sensors DS18B20 ports
+ */
+static void
+discoverDS18B20(ds18b20pi_ports_t *sensors) {
+    static char ids[MAXPORTS][DS18B20PI_IDLEN];
+    const DS18B20PI_port_t *tmpl = &sensors->discoverTemplate;
+    DS18B20PI_port_t *port;
+    char path[256];
+    int discovered = 0;
+    int n, i, j, k;
+
+    sensors->lastDiscover = time(NULL);
+    if ((n = DS18B20PI_discover(tmpl->path, ids, MAXPORTS)) < 0) return;
+    for (i = 0; i < sensors->size; i++) {
+	if (!sensors->ports[i].discovered) continue;
+	for (j = 0; j < n && strcmp(ids[j], sensors->ports[i].id) != 0; j++);
+	if (j < n) {
+	    discovered++;
+	    continue;
+	}
+	DBGLOG(DBG_MAIN, DBG_INFO, "DS18B20 %s has gone", sensors->ports[i].id);
+	DS18B20PI_closePort(&sensors->ports[i]);
+	for (k = i + 1; k < sensors->size; k++) {
+	    sensors->ports[k - 1] = sensors->ports[k];
+	    sensors->lastsample[k - 1] = sensors->lastsample[k];
+	}
+	sensors->size--;
+	i--;
+    }
+    for (j = 0; j < n; j++) {
+	snprintf(path, sizeof (path), "%s/%s", tmpl->path, ids[j]);
+	for (i = 0; i < sensors->size; i++) {
+	    if (strcmp(sensors->ports[i].id, ids[j]) == 0 || strcmp(sensors->ports[i].path, path) == 0) break;
+	}
+	if (i < sensors->size) continue;
+	if (sensors->size == MAXPORTS) {
+	    DBGLOG(DBG_MAIN, DBG_WARN, "DS18B20 %s discovered but all %d ports are taken", ids[j], MAXPORTS);
+	    break;
+	}
+	port = &sensors->ports[sensors->size];
+	*port = DS18B20PI_createPort(path, ids[j], "", tmpl->sampletime, "",
+		tmpl->fahrenheitscale, tmpl->resolution);
+	expandTopic(port->topic, sizeof (port->topic), sensors->discoverTopic, ids[j]);
+	port->discovered = 1;
+	DS18B20PI_setResolution(port);
+	sensors->lastsample[sensors->size++] = 0;
+	discovered++;
+	DBGLOG(DBG_MAIN, DBG_INFO, "DS18B20 %s discovered, publishing on %s", port->id, port->topic);
+    }
+    metrics_set(metrics_gauge("ds18b20_discovered", NULL), discovered);
+}
+
+/**
+ * Count time spent sampling a bus.  The rate of bus_busy_seconds_total is the
+ * utilization of the bus.
+ * @param bus bus that was sampled
+ * @param start metrics_now() when sampling started
+ */
+static void
+busTime(sensor_bus_t bus, double start) {
+    static metric_t *busy[BUS_COUNT];
+    metric_t *m = __atomic_load_n(&busy[bus], __ATOMIC_RELAXED);
+
+    // read jobs time their buses on threads of their own
+    if (m == NULL) __atomic_store_n(&busy[bus], m = metrics_counter("bus_busy_seconds_total", busNames[bus]), __ATOMIC_RELAXED);
+    metrics_add(m, metrics_now() - start);
+}
+
+/**
+ * Read every sensor on one bus whose id matches the request.  Runs on its own
+ * thread so that the buses are sampled in parallel.
+ * @param arg read_job_t to fill
+ * @return NULL
+ */
+static void *
+readJob(void *arg) {
+    read_job_t *job = (read_job_t *) arg;
+    sensor_ports_t *p = job->ports;
+    const char *pattern = job->req->pattern;
+    mqtt_data_t *out;
+    DS18B20PI_port_t *due[MAXPORTS];
+    tempsensor_port_t *scan[MAXPORTS];
+    int rcs[MAXPORTS];
+    double start = metrics_now();
+    int room = sizeof (job->results) / sizeof (job->results[0]);
+    int i, n;
+
+    job->size = 0;
+    switch (job->bus) {
+	case BUS_W1:
+	    for (i = 0, n = 0; i < p->ds18b20.size; i++) {
+		if (fnmatch(pattern, p->ds18b20.ports[i].id, 0) == 0) due[n++] = &p->ds18b20.ports[i];
+	    }
+	    if (p->ds18b20.bulk && n > 1) DS18B20PI_bulk_convert(due, n);
+	    DS18B20PI_process_batch(due, n, job->results, rcs);
+	    for (i = 0; i < n; i++) {
+		if (rcs[i] != DS18B20PI_SUCCESS) continue;
+		if (job->size != i) job->results[job->size] = job->results[i];
+		job->size++;
+	    }
+	    break;
+	case BUS_I2C:
+	    for (i = 0, n = 0; i < p->tempsensor.size; i++) {
+		if (fnmatch(pattern, p->tempsensor.ports[i].id, 0) == 0) scan[n++] = &p->tempsensor.ports[i];
+	    }
+	    tempsensor_scan(scan, n);
+	    for (i = 0; i < n && job->size < room; i++) {
+		out = &job->results[job->size];
+		if (ProcessTempsensorData(scan[i], out) == TEMPSENSOR_SUCCESS) job->size++;
+	    }
+	    break;
+	case BUS_GPIO:
+	    for (i = 0; i < p->doorswitch.size && job->size < room; i++) {
+		// report the state even if unchanged, and leave change
+		// detection to the regular sample
+		doorswitch_port_t port = p->doorswitch.ports[i];
+		if (fnmatch(pattern, port.id, 0) != 0) continue;
+		port.sampleContinuous = 1;
+		out = &job->results[job->size];
+		if (ProcessDoorswitchData(&port, out) == DOORSWITCH_SUCCESS) job->size++;
+	    }
+	    for (i = 0; i < p->dht22.size && job->size + 2 <= room; i++) {
+		struct timespec wait = {0, 100000000L};
+		int rc;
+		if (fnmatch(pattern, p->dht22.ports[i].id, 0) != 0) continue;
+		out = &job->results[job->size];
+		// a requested read waits out the sensor's minimum interval
+		while ((rc = DHT22_process_data(&p->dht22.ports[i], out, out + 1)) == DHT22_BUSY) {
+		    nanosleep(&wait, NULL);
+		}
+		if (rc == DHT22_SUCCESS) job->size += 2;
+	    }
+	    break;
+	default:
+	    break;
+    }
+    busTime(job->bus, start);
+    return NULL;
+}
+
+/**
+ * Count the sensors on a bus whose id matches a pattern.
+ */
+static int
+busMatches(sensor_ports_t *p, sensor_bus_t bus, const char *pattern) {
+    int i, n = 0;
+
+    switch (bus) {
+	case BUS_W1:
+	    for (i = 0; i < p->ds18b20.size; i++) n += fnmatch(pattern, p->ds18b20.ports[i].id, 0) == 0;
+	    break;
+	case BUS_I2C:
+	    for (i = 0; i < p->tempsensor.size; i++) n += fnmatch(pattern, p->tempsensor.ports[i].id, 0) == 0;
+	    break;
+	case BUS_GPIO:
+	    for (i = 0; i < p->doorswitch.size; i++) n += fnmatch(pattern, p->doorswitch.ports[i].id, 0) == 0;
+	    for (i = 0; i < p->dht22.size; i++) n += fnmatch(pattern, p->dht22.ports[i].id, 0) == 0;
+	    break;
+	default:
+	    break;
+    }
+    return n;
+}
+
+/**
+ * Serve a targeted read.  Only the matching sensors are sampled, one thread
+ * per bus, and each reading is published on response/<correlation> followed
+ * by a summary carrying the count and the time since the request arrived.
+ * RAVEn meters push their data and cannot be sampled on demand.
+ * @param context MQTT context
+ * @param ports all configured ports
+ * @param req request to serve
+ */
+static void
+processReadRequest(my_context_t *context, sensor_ports_t *ports, const mqtt_read_request_t *req) {
+    static read_job_t jobs[BUS_COUNT];
+    pthread_t threads[BUS_COUNT];
+    int started[BUS_COUNT];
+    int nbus = 0;
+    int count = 0;
+    struct timespec done;
+    mqtt_data_t data;
+    int b, i;
+
+    // the responses are not readings, so no sensor or sample time
+    memset(&data, 0, sizeof (data));
+    for (b = 0; b < BUS_COUNT; b++) {
+	jobs[b].req = req;
+	jobs[b].ports = ports;
+	jobs[b].bus = (sensor_bus_t) b;
+	jobs[b].size = 0;
+	started[b] = 0;
+	if (busMatches(ports, jobs[b].bus, req->pattern) > 0) nbus++;
+    }
+    for (b = 0; b < BUS_COUNT; b++) {
+	if (busMatches(ports, jobs[b].bus, req->pattern) == 0) continue;
+	if (nbus == 1 || pthread_create(&threads[b], NULL, readJob, &jobs[b]) != 0) {
+	    readJob(&jobs[b]);
+	} else {
+	    started[b] = 1;
+	}
+    }
+    for (b = 0; b < BUS_COUNT; b++) {
+	if (started[b]) pthread_join(threads[b], NULL);
+	for (i = 0; i < jobs[b].size; i++) {
+	    mqtt_data_t *r = &jobs[b].results[i];
+	    snprintf(data.payload, sizeof (data.payload),
+		    "{\"correlation\":\"%s\",\"sensor\":\"%s\",\"topic\":\"%s\",\"reading\":%s}",
+		    req->correlation, r->sensor, r->topic, r->payload);
+	    snprintf(data.topic, sizeof (data.topic), "response/%s", req->correlation);
+	    mqttPublish(context, &data);
+	    count++;
+	}
+    }
+    clock_gettime(CLOCK_MONOTONIC, &done);
+    snprintf(data.payload, sizeof (data.payload),
+	    "{\"timestamp\":%ld,\"correlation\":\"%s\",\"pattern\":\"%s\",\"count\":%d,\"elapsed_ms\":%ld}",
+	    time(NULL), req->correlation, req->pattern, count,
+	    (done.tv_sec - req->received.tv_sec) * 1000L + (done.tv_nsec - req->received.tv_nsec) / 1000000L);
+    snprintf(data.topic, sizeof (data.topic), "response/%s", req->correlation);
+    mqttPublish(context, &data);
+}
+
+/**
+ * Find a port by id in an array of any port type.
+ * @param ports first port
+ * @param stride size of one port
+ * @param idoff offset of the id in a port
+ * @param size number of ports
+ * @param id id to find
+ * @return index of the port, -1 if not found
+ */
+static int
+findPort(const void *ports, size_t stride, size_t idoff, int size, const char *id) {
+    int i;
+    for (i = 0; i < size; i++) {
+	if (strcmp((const char *) ports + i * stride + idoff, id) == 0) return i;
+    }
+    return -1;
+}
+
+#define FIND_PORT(set, key) findPort((set).ports, sizeof ((set).ports[0]), \
+	(const char *) (set).ports[0].id - (const char *) &(set).ports[0], (set).size, key)
+
+static int
+sameDS18B20(const DS18B20PI_port_t *a, const DS18B20PI_port_t *b) {
+    return strcmp(a->path, b->path) == 0 && strcmp(a->topic, b->topic) == 0 &&
+	    strcmp(a->location, b->location) == 0 && a->sampletime == b->sampletime &&
+	    a->fahrenheitscale == b->fahrenheitscale && a->resolution == b->resolution;
+}
+
+static int
+sameRAVEn(const raven_t *a, const raven_t *b) {
+    return strcmp(a->path, b->path) == 0 && strcmp(a->topic, b->topic) == 0 &&
+	    strcmp(a->location, b->location) == 0;
+}
+
+static int
+sameDHT22(const dht22_port_t *a, const dht22_port_t *b) {
+    return a->pin == b->pin && strcmp(a->topic, b->topic) == 0 &&
+	    a->fahrenheitscale == b->fahrenheitscale && a->sampletime == b->sampletime;
+}
+
+static int
+sameDoorswitch(const doorswitch_port_t *a, const doorswitch_port_t *b) {
+    return a->pin == b->pin && strcmp(a->topic, b->topic) == 0 &&
+	    strcmp(a->location, b->location) == 0 && a->sampletime == b->sampletime &&
+	    a->sampleContinuous == b->sampleContinuous;
+}
+
+static int
+sameTempsensor(const tempsensor_port_t *a, const tempsensor_port_t *b) {
+    return a->pin == b->pin && a->addr == b->addr && a->gain == b->gain &&
+	    a->rate == b->rate && a->rdypin == b->rdypin && a->A == b->A && a->B == b->B && a->C == b->C &&
+	    a->Rb == b->Rb && strcmp(a->topic, b->topic) == 0 &&
+	    strcmp(a->location, b->location) == 0 && a->sampletime == b->sampletime &&
+	    a->oversample == b->oversample && filter_same(&a->filter, &b->filter) &&
+	    a->stream == b->stream && a->streamblock == b->streamblock;
+}
+
+/**
+ * Write the configuration file so that it is either the old or the new one,
+ * never a partial write.  The previous file is kept as <file>.bak.
+ * @param configFile configuration file
+ * @param text new configuration
+ * @return 0 on success, -1 otherwise
+ */
+static int
+writeConfig(const char *configFile, const char *text) {
+    char tmp[512];
+    char bak[512];
+    FILE *fp;
+
+    snprintf(tmp, sizeof (tmp), "%s.tmp", configFile);
+    snprintf(bak, sizeof (bak), "%s.bak", configFile);
+    if ((fp = fopen(tmp, "w")) == NULL) {
+	perror("main.c->writeConfig");
+	return -1;
+    }
+    if (fputs(text, fp) == EOF || fflush(fp) != 0 || fsync(fileno(fp)) != 0) {
+	perror("main.c->writeConfig");
+	fclose(fp);
+	unlink(tmp);
+	return -1;
+    }
+    fclose(fp);
+    unlink(bak);
+    if (link(configFile, bak) != 0) {
+	DBGLOG(DBG_MAIN, DBG_WARN, "writeConfig - unable to backup configFile");
+    }
+    if (rename(tmp, configFile) != 0) {
+	perror("main.c->writeConfig");
+	unlink(tmp);
+	return -1;
+    }
+    return 0;
+}
+
+static int
+sameString(const char *a, const char *b) {
+    if (a == NULL || b == NULL) return a == b;
+    return strcmp(a, b) == 0;
+}
+
+/**
+ * Apply a configuration received by /update without restarting.  The new
+ * configuration is parsed and validated in memory, then diffed against the
+ * running ports: ports whose id is kept carry over their schedule and state,
+ * new ones start at once and removed ones stop.  Broker settings cannot change
+ * under a live session and take effect at the next start.
+ * @param context MQTT context
+ * @param ports running ports, updated in place
+ * @param text new configuration
+ * @param received monotonic time the update arrived
+ */
+static void
+applyUpdate(my_context_t *context, sensor_ports_t *ports, const char *text,
+	const struct timespec *received) {
+    static sensor_ports_t next;
+    mqtt_broker_t *broker = context->broker;
+    int added = 0, removed = 0, changed = 0, unchanged = 0;
+    int restart;
+    struct timespec done;
+    mqtt_data_t data;
+    cfg_t *cfg;
+    int i, j;
+
+    snprintf(data.topic, sizeof (data.topic), "%s", "manage");
+    data.sensor[0] = 0;
+    if ((cfg = read_config(NULL, text)) == NULL || validateConfig(cfg) != 0) {
+	DBGLOG(DBG_MAIN, DBG_ERROR, "applyUpdate - configuration rejected");
+	snprintf(data.payload, sizeof (data.payload),
+		"{\"timestamp\":%ld,\"system\":\"update rejected\"}", time(NULL));
+	mqttPublish(context, &data);
+	if (cfg != NULL) cfg_free(cfg);
+	return;
+    }
+    // load before saving, so a configuration that only partly loads is
+    // neither applied nor kept
+    memset(&next, 0, sizeof (next));
+    if (loadPorts(cfg, &next) != 0) {
+	DBGLOG(DBG_MAIN, DBG_ERROR, "applyUpdate - configuration failed to load");
+	rules_revert();
+	virtualsensor_revert();
+	snprintf(data.payload, sizeof (data.payload),
+		"{\"timestamp\":%ld,\"system\":\"update rejected\"}", time(NULL));
+	mqttPublish(context, &data);
+	cfg_free(cfg);
+	return;
+    }
+    if (writeConfig(context->configFile, text) != 0) {
+	DBGLOG(DBG_MAIN, DBG_ERROR, "applyUpdate - unable to write configFile");
+	rules_revert();
+	virtualsensor_revert();
+	snprintf(data.payload, sizeof (data.payload),
+		"{\"timestamp\":%ld,\"system\":\"update not saved\"}", time(NULL));
+	mqttPublish(context, &data);
+	cfg_free(cfg);
+	return;
+    }
+
+    for (i = 0; i < next.ds18b20.size; i++) {
+	if ((j = FIND_PORT(ports->ds18b20, next.ds18b20.ports[i].id)) < 0) {
+	    added++;
+	    DS18B20PI_setResolution(&next.ds18b20.ports[i]);
+	    continue;
+	}
+	next.ds18b20.lastsample[i] = ports->ds18b20.lastsample[j];
+	if (strcmp(ports->ds18b20.ports[j].path, next.ds18b20.ports[i].path) == 0) {
+	    // keep the open descriptor
+	    next.ds18b20.ports[i].fd = ports->ds18b20.ports[j].fd;
+	    ports->ds18b20.ports[j].fd = -1;
+	}
+	if (sameDS18B20(&ports->ds18b20.ports[j], &next.ds18b20.ports[i])) {
+	    unchanged++;
+	    next.ds18b20.ports[i].bits = ports->ds18b20.ports[j].bits;
+	} else {
+	    changed++;
+	    DS18B20PI_setResolution(&next.ds18b20.ports[i]);
+	}
+    }
+    for (j = 0; j < ports->ds18b20.size; j++) {
+	// discovered ports come back at the next discovery, uncounted
+	if (ports->ds18b20.ports[j].discovered && FIND_PORT(next.ds18b20, ports->ds18b20.ports[j].id) < 0) removed--;
+	DS18B20PI_closePort(&ports->ds18b20.ports[j]);
+    }
+    if (ports->ds18b20.size == 0 && next.ds18b20.size > 0) DS18B20PI_init();
+
+    for (i = 0; i < next.raven.size; i++) {
+	j = FIND_PORT(ports->raven, next.raven.ports[i].id);
+	if (j >= 0 && strcmp(ports->raven.ports[j].path, next.raven.ports[i].path) == 0) {
+	    // keep the open port
+	    if (sameRAVEn(&ports->raven.ports[j], &next.raven.ports[i])) unchanged++;
+	    else changed++;
+	    next.raven.ports[i].FD = ports->raven.ports[j].FD;
+	    next.raven.ports[i].FH = ports->raven.ports[j].FH;
+	    ports->raven.ports[j].FH = NULL;
+	    continue;
+	}
+	if (RAVEn_openPort(&next.raven.ports[i]) != RAVEN_PASS) {
+	    DBGLOG(DBG_MAIN, DBG_ERROR, "applyUpdate - Error opening RAVEn Port");
+	    next.raven.ports[i--] = next.raven.ports[--next.raven.size];
+	    continue;
+	}
+	RAVEn_sendCmd(next.raven.ports[i], "initialize");
+	if (j >= 0) changed++;
+	else added++;
+    }
+    for (j = 0; j < ports->raven.size; j++) {
+	if (ports->raven.ports[j].FH != NULL) {
+	    RAVEn_closePort(ports->raven.ports[j]);
+	}
+    }
+
+    for (i = 0; i < next.dht22.size; i++) {
+	if ((j = FIND_PORT(ports->dht22, next.dht22.ports[i].id)) < 0) {
+	    added++;
+	    continue;
+	}
+	next.dht22.lastsample[i] = ports->dht22.lastsample[j];
+	if (ports->dht22.ports[j].pin == next.dht22.ports[i].pin) {
+	    // same sensor, keep its minimum interval and success rate
+	    next.dht22.ports[i].lastRead = ports->dht22.ports[j].lastRead;
+	    next.dht22.ports[i].edgeFd = ports->dht22.ports[j].edgeFd;
+	    ports->dht22.ports[j].edgeFd = -1;
+	    next.dht22.ports[i].reads = ports->dht22.ports[j].reads;
+	    next.dht22.ports[i].successes = ports->dht22.ports[j].successes;
+	}
+	if (sameDHT22(&ports->dht22.ports[j], &next.dht22.ports[i])) unchanged++;
+	else changed++;
+    }
+    for (j = 0; j < ports->dht22.size; j++) {
+	DHT22_closePort(&ports->dht22.ports[j]);
+    }
+    if (ports->dht22.size == 0 && next.dht22.size > 0) DHT22_init(NULL);
+
+    for (i = 0; i < next.doorswitch.size; i++) {
+	if ((j = FIND_PORT(ports->doorswitch, next.doorswitch.ports[i].id)) < 0) {
+	    added++;
+	    continue;
+	}
+	next.doorswitch.lastsample[i] = ports->doorswitch.lastsample[j];
+	if (ports->doorswitch.ports[j].pin == next.doorswitch.ports[i].pin) {
+	    next.doorswitch.ports[i].state = ports->doorswitch.ports[j].state;
+	}
+	if (sameDoorswitch(&ports->doorswitch.ports[j], &next.doorswitch.ports[i])) unchanged++;
+	else changed++;
+    }
+    if (ports->doorswitch.size == 0 && next.doorswitch.size > 0) doorswitch_init();
+
+    // the threads follow the ports they sample, and the main loop starts
+    // them again; the filters they feed are copied once they are stopped
+    if (ports->tempsensor.started) {
+	tempsensor_stopStreams();
+	tempsensor_stopOversampling();
+    }
+    next.tempsensor.started = 0;
+    for (i = 0; i < next.tempsensor.size; i++) {
+	if ((j = FIND_PORT(ports->tempsensor, next.tempsensor.ports[i].id)) < 0) {
+	    added++;
+	    continue;
+	}
+	next.tempsensor.lastsample[i] = ports->tempsensor.lastsample[j];
+	if (sameTempsensor(&ports->tempsensor.ports[j], &next.tempsensor.ports[i])) {
+	    // the filter goes on from where it was
+	    next.tempsensor.ports[i].filter = ports->tempsensor.ports[j].filter;
+	    next.tempsensor.ports[i].filtered = ports->tempsensor.ports[j].filtered;
+	    next.tempsensor.ports[i].filteredAt = ports->tempsensor.ports[j].filteredAt;
+	    unchanged++;
+	} else changed++;
+    }
+    if (ports->tempsensor.size == 0 && next.tempsensor.size > 0) tempsensor_init();
+    next.tempsensor.lastOversample = ports->tempsensor.lastOversample;
+
+    removed += ports->ds18b20.size + ports->raven.size + ports->dht22.size +
+	    ports->doorswitch.size + ports->tempsensor.size - changed - unchanged;
+    *ports = next;
+
+    restart = !sameString(broker->mqtthostaddr, cfg_getstr(cfg, "mqttbrokeraddress")) ||
+	    !sameString(broker->mqttclientid, cfg_getstr(cfg, "clientid")) ||
+	    !sameString(broker->mqttuid, cfg_getstr(cfg, "mqttbrokeruid")) ||
+	    !sameString(broker->mqttpasswd, cfg_getstr(cfg, "mqttbrokerpwd")) ||
+	    !sameString(broker->mqtthome, cfg_getstr(cfg, "home")) ||
+	    !sameString(broker->mqttmanagementtopic, cfg_getstr(cfg, "mqttsubtopic"));
+    cfg_free(cfg);
+
+    clock_gettime(CLOCK_MONOTONIC, &done);
+    snprintf(data.payload, sizeof (data.payload),
+	    "{\"timestamp\":%ld,\"system\":\"update applied\",\"added\":%d,\"removed\":%d,"
+	    "\"changed\":%d,\"unchanged\":%d,\"restartrequired\":%d,\"elapsed_ms\":%ld}",
+	    time(NULL), added, removed, changed, unchanged, restart,
+	    (done.tv_sec - received->tv_sec) * 1000L + (done.tv_nsec - received->tv_nsec) / 1000000L);
+    DBGLOG(DBG_MAIN, DBG_INFO, "%s", data.payload);
+    mqttPublish(context, &data);
+}
+
+typedef enum {
+    INIT_RAVEN,
+    INIT_DHT22,
+    INIT_DS18B20,
+    INIT_DOORSWITCH,
+    INIT_TEMPSENSOR,
+    INIT_COUNT
+} init_type_t;
+
+typedef struct {
+    const char *name; ///< subsystem name for logging
+    int (*init)(sensor_ports_t *ports); ///< returns 0 when ready
+    sensor_ports_t *ports; ///< ports to initialize
+    my_context_t *context; ///< woken when the subsystem is ready
+    pthread_t thread; ///< thread running init
+    int started; ///< thread was created
+    int ready; ///< set once init succeeded, read with __atomic_load_n
+    int failed; ///< set if init failed, read with __atomic_load_n
+} init_job_t;
+
+static int
+initRAVEn(sensor_ports_t *ports) {
+    int i;
+
+    for (i = 0; i < ports->raven.size; i++) {
+	if (RAVEn_openPort(&ports->raven.ports[i]) != RAVEN_PASS) {
+	    DBGLOG(DBG_MAIN, DBG_ERROR, "Error opening RAVEn Port");
+	    return -1;
+	}
+	RAVEn_sendCmd(ports->raven.ports[i], "initialize");
+    }
+    return 0;
+}
+
+static int
+initDHT22(sensor_ports_t *ports) {
+    int i;
+
+    for (i = 0; i < ports->dht22.size; i++) {
+	if (DHT22_init(&ports->dht22.ports[i]) != DHT22_SUCCESS) {
+	    DBGLOG(DBG_MAIN, DBG_ERROR, "Error opening DHT22 sensor");
+	    return -1;
+	}
+    }
+    return 0;
+}
+
+static int
+initDS18B20(sensor_ports_t *ports) {
+    int i;
+
+    if (DS18B20PI_init() != DS18B20PI_SUCCESS) {
+	DBGLOG(DBG_MAIN, DBG_ERROR, "Error initializing DS18B20");
+	return -1;
+    }
+    // a probe left at another resolution still reads, only slower
+    for (i = 0; i < ports->ds18b20.size; i++) {
+	DS18B20PI_setResolution(&ports->ds18b20.ports[i]);
+    }
+    return 0;
+}
+
+static int
+initDoorswitch(sensor_ports_t *ports) {
+    if (doorswitch_init() != DOORSWITCH_SUCCESS) {
+	DBGLOG(DBG_MAIN, DBG_ERROR, "Error initializing Door Switches");
+	return -1;
+    }
+    return 0;
+}
+
+static int
+initTempsensor(sensor_ports_t *ports) {
+    if (tempsensor_init() != TEMPSENSOR_SUCCESS) {
+	DBGLOG(DBG_MAIN, DBG_ERROR, "Error initializing tempsensor");
+	return -1;
+    }
+    return 0;
+}
+
+/**
+ * Initialize one subsystem.  A failure ends the program as it always has,
+ * success lets the main loop start sampling that subsystem straight away.
+ */
+static void *
+initJob(void *arg) {
+    init_job_t *job = (init_job_t *) arg;
+    struct timespec start, done;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (job->init(job->ports) != 0) {
+	// the main thread exits, with the other inits and MQTT shut down
+	DBGLOG(DBG_MAIN, DBG_ERROR, "startup - %s failed", job->name);
+	__atomic_store_n(&job->failed, 1, __ATOMIC_RELEASE);
+	mqttWake(job->context);
+	return NULL;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &done);
+    DBGLOG(DBG_MAIN, DBG_INFO, "startup - %s ready in %ld ms", job->name,
+	    (done.tv_sec - start.tv_sec) * 1000L + (done.tv_nsec - start.tv_nsec) / 1000000L);
+    __atomic_store_n(&job->ready, 1, __ATOMIC_RELEASE);
+    mqttWake(job->context);
+    return NULL;
+}
+
+/**
+ * Start initializing every configured subsystem in parallel.  Subsystems
+ * with no ports are ready at once.
+ */
+static void
+startInit(my_context_t *context, sensor_ports_t *ports, init_job_t jobs[INIT_COUNT]) {
+    static const struct {
+	const char *name;
+	int (*init)(sensor_ports_t *ports);
+    } kinds[INIT_COUNT] = {
+	[INIT_RAVEN] = { "RAVEn", initRAVEn },
+	[INIT_DHT22] = { "DHT22", initDHT22 },
+	[INIT_DS18B20] = { "DS18B20", initDS18B20 },
+	[INIT_DOORSWITCH] = { "doorswitch", initDoorswitch },
+	[INIT_TEMPSENSOR] = { "tempsensor", initTempsensor },
+    };
+    int sizes[INIT_COUNT];
+    int i;
+
+    sizes[INIT_RAVEN] = ports->raven.size;
+    sizes[INIT_DHT22] = ports->dht22.size;
+    sizes[INIT_DS18B20] = ports->ds18b20.size;
+    sizes[INIT_DOORSWITCH] = ports->doorswitch.size;
+    sizes[INIT_TEMPSENSOR] = ports->tempsensor.size;
+    for (i = 0; i < INIT_COUNT; i++) {
+	jobs[i].name = kinds[i].name;
+	jobs[i].init = kinds[i].init;
+	jobs[i].ports = ports;
+	jobs[i].context = context;
+	jobs[i].started = 0;
+	jobs[i].failed = 0;
+	jobs[i].ready = sizes[i] == 0;
+	if (sizes[i] == 0) continue;
+	if (pthread_create(&jobs[i].thread, NULL, initJob, &jobs[i]) == 0) {
+	    jobs[i].started = 1;
+	} else {
+	    // no thread to spare, initialize in line
+	    initJob(&jobs[i]);
+	}
+    }
+}
+
+/**
+ * Give up root, once every init has opened what needed it.  The inits run
+ * in parallel, so none of them can drop privileges on its own.
+ * @return 0 on success, -1 otherwise
+ */
+static int
+dropPrivileges(void) {
+    if (setuid(getuid()) < 0) {
+	DBGLOG(DBG_MAIN, DBG_ERROR, "startup - Error dropping privileges");
+	return -1;
+    }
+    return 0;
+}
+
+static int
+initReady(init_job_t *job) {
+    return __atomic_load_n(&job->ready, __ATOMIC_ACQUIRE);
+}
+
 int
 main(int argc, char** argv) {
     int c;
     int i;
+    int n;
     int cntr;
-    ds18b20pi_ports_t ds18b20_ports;
-    raven_ports_t raven_ports;
-    dht22_ports_t dht22_ports;
-    doorswitch_ports_t doorswitch_ports;
-    tempsensor_ports_t tempsensor_ports;
+    sensor_ports_t ports;
+    mqtt_read_request_t request;
+    char *update;
+    struct timespec updated;
     mqtt_broker_t mqtt_broker;
     MQTTAsync mqtt_client;
     my_context_t my_context = my_context_t_initializer;
     my_context_t *context;
     mqtt_data_t message;
+    mqtt_data_t pending[8];
+    DS18B20PI_port_t *due[MAXPORTS];
+    tempsensor_port_t *scan[MAXPORTS];
+    mqtt_data_t batch[MAXPORTS];
+    int rcs[MAXPORTS];
+    init_job_t init[INIT_COUNT];
+    int allReady;
+    int initFailed = 0;
+    int privilegesDropped = 0;
     struct timespec delay;
+    long metricsInterval;
+    long lastMetrics;
+    double loopStart;
+    double busStart;
+
+    clock_gettime(CLOCK_MONOTONIC, &my_context.started);
 
     delay.tv_nsec = 1000000;
     delay.tv_sec = 1;
 
-    ds18b20_ports.size = 0;
-    raven_ports.size = 0;
-    dht22_ports.size = 0;
-    doorswitch_ports.size = 0;
-    tempsensor_ports.size = 0;
+    ports.ds18b20.size = 0;
+    ports.raven.size = 0;
+    ports.dht22.size = 0;
+    ports.doorswitch.size = 0;
+    ports.tempsensor.size = 0;
+    ports.tempsensor.lastOversample = 0;
+    ports.tempsensor.started = 0;
 
     cfg_t *cfg = 0;
     int verbose = 0;
@@ -284,10 +1304,16 @@ main(int argc, char** argv) {
 	}
     }
 
-    LoadINIParms(&cfg, &ds18b20_ports, &raven_ports, &dht22_ports, &doorswitch_ports, &tempsensor_ports, &mqtt_broker, configFile); // Initialize ports.
+    LoadINIParms(&cfg, &ports, &mqtt_broker, configFile); // Initialize ports.
 
+    SetDBGLogOverflow(strcmp(cfg_getstr(cfg, "debugoverflow"), "block") == 0 ? DBGLOG_BLOCK : DBGLOG_DROP);
+    SetDBGLogBinary(strcmp(cfg_getstr(cfg, "debugformat"), "binary") == 0);
+    setLogLevels(cfg);
+    SetDBGLogRotation(cfg_getint(cfg, "debugmaxsize") * 1024L, cfg_getint(cfg, "debugmaxage"),
+	    cfg_getint(cfg, "debuggenerations"), cfg_getint(cfg, "debugcompress"));
+    SetDBGLogFlush(cfg_getint(cfg, "debugflush"));
     InitDBGLog("pi2MQTT", cfg_getstr(cfg, "debuglogfile"), cfg_getint(cfg, "debugmode"), verbose);
-    WriteDBGLog(STARTUP);
+    DBGLOG(DBG_MAIN, DBG_INFO, "%s", STARTUP);
 
     my_context.broker = &mqtt_broker;
     my_context.client = &mqtt_client;
@@ -299,113 +1325,192 @@ main(int argc, char** argv) {
 	exit(EXIT_FAILURE);
     }
 
-    //Wait for connection
-    nanosleep(&delay,NULL);
-    cntr = 0;
-
-    //Initialize all ports.
-    for (i = 0; i < raven_ports.size; i++) {
-	if (RAVEn_openPort(&raven_ports.ports[i]) != RAVEN_PASS) {
-	    WriteDBGLog("Error opening RAVEn Port");
+    // the drivers check for a replay while they initialize
+    if (cfg_getstr(cfg, "replayfile")[0] != 0) {
+	if (capture_replay(cfg_getstr(cfg, "replayfile"), cfg_getfloat(cfg, "replayspeed")) != CAPTURE_SUCCESS) {
 	    exit(EXIT_FAILURE);
 	}
-	RAVEn_sendCmd(raven_ports.ports[i], "initialize");
+	// the recorded times pace the reads, not the sample times
+	delay.tv_sec = 0;
+    } else if (cfg_getstr(cfg, "capturefile")[0] != 0) {
+	capture_open(cfg_getstr(cfg, "capturefile"));
     }
 
-    for (i = 0; i < dht22_ports.size; i++) {
-	if (DHT22_init(&dht22_ports.ports[i]) != DHT22_SUCCESS) {
-	    WriteDBGLog("Error opening DHT22 sensor");
-	    exit(EXIT_FAILURE);
-	}
+    // Sensors start while the broker connection comes up, readings taken
+    // before it is up are held by mqttPublish.
+    cntr = 5;
+    startInit(context, &ports, init);
+    metricsInterval = cfg_getint(cfg, "metricsinterval");
+    lastMetrics = time(NULL);
+    if (cfg_getstr(cfg, "metricslisten")[0] != 0) {
+	exporter_start(cfg_getstr(cfg, "metricslisten"));
     }
 
-    if (ds18b20_ports.size > 0) {
-	if (DS18B20PI_init() != DS18B20PI_SUCCESS) {
-	    WriteDBGLog("Error initializing DS18B20");
-	    exit(EXIT_FAILURE);
+    while (!context->killed && !context->reboot) {
+	loopStart = metrics_now();
+	TRACE1(loop_tick, cntr);
+	allReady = 1;
+	for (i = 0; i < INIT_COUNT; i++) {
+	    if (__atomic_load_n(&init[i].failed, __ATOMIC_ACQUIRE)) initFailed = 1;
+	    if (!initReady(&init[i])) allReady = 0;
 	}
-    }
-
-    if (doorswitch_ports.size > 0) {
-	if (doorswitch_init() != DOORSWITCH_SUCCESS) {
-	    WriteDBGLog("Error initializing Door Switches");
-	    exit(EXIT_FAILURE);
+	if (allReady && !privilegesDropped) {
+	    privilegesDropped = 1;
+	    if (dropPrivileges() != 0) initFailed = 1;
 	}
-    }
-
-    if (tempsensor_ports.size > 0) {
-	if (tempsensor_init() != TEMPSENSOR_SUCCESS) {
-	    WriteDBGLog("Error initializing tempsensor");
-	    exit(EXIT_FAILURE);
+	if (initFailed) break;
+	// updates and read requests touch every subsystem, wait for all of them
+	if (allReady && (update = mqttTakeUpdate(context, &updated)) != NULL) {
+	    applyUpdate(context, &ports, update, &updated);
+	    free(update);
 	}
-    }
-
-    while (!context->killed && !context->reboot) {
-	for (i = 0; i < ds18b20_ports.size; i++) {
+	while (allReady && mqttTakeReadRequest(context, &request)) {
+	    processReadRequest(context, &ports, &request);
+	}
+	busStart = metrics_now();
+	if (initReady(&init[INIT_DS18B20]) && ports.ds18b20.discoverInterval > 0 &&
+		time(NULL) - ports.ds18b20.lastDiscover >= ports.ds18b20.discoverInterval) {
+	    discoverDS18B20(&ports.ds18b20);
+	}
+	n = 0;
+	for (i = 0; initReady(&init[INIT_DS18B20]) && i < ports.ds18b20.size; i++) {
 	    long t = time(NULL);
-	    if (t - ds18b20_ports.lastsample[i] >= (long) ds18b20_ports.ports[i].sampletime || context->readData != 0) {
-		ds18b20_ports.lastsample[i] = t;
-		if (DS18B20PI_process_data(ds18b20_ports.ports[i], &message) == DS18B20PI_SUCCESS) {
-		    mqttPublish(context, &message);
-		} else {
-		    WriteDBGLog("Failed to read temperature sensor");
-		}
-
+	    if (t - ports.ds18b20.lastsample[i] >= (long) ports.ds18b20.ports[i].sampletime || context->readData != 0) {
+		ports.ds18b20.lastsample[i] = t;
+		due[n++] = &ports.ds18b20.ports[i];
+	    }
+	}
+	// one conversion for all of them instead of one per probe
+	if (ports.ds18b20.bulk && n > 1) DS18B20PI_bulk_convert(due, n);
+	DS18B20PI_process_batch(due, n, batch, rcs);
+	for (i = 0; i < n; i++) {
+	    if (rcs[i] == DS18B20PI_SUCCESS) {
+		publishReading(context, &batch[i], 0);
+	    } else {
+		DBGLOG(DBG_MAIN, DBG_WARN, "Failed to read temperature sensor %s", due[i]->id);
 	    }
 	}
+	busTime(BUS_W1, busStart);
 	// process door switches
-	for (i = 0; i < doorswitch_ports.size; i++) {
+	busStart = metrics_now();
+	for (i = 0; initReady(&init[INIT_DOORSWITCH]) && i < ports.doorswitch.size; i++) {
 	    long t = time(NULL);
-	    if (t - doorswitch_ports.lastsample[i] >= (long) doorswitch_ports.ports[i].sampletime || context->readData != 0) {
-		doorswitch_ports.lastsample[i] = t;
-		if (ProcessDoorswitchData(&doorswitch_ports.ports[i], &message) == DOORSWITCH_SUCCESS) {
-		    mqttPublish(context, &message);
+	    if (t - ports.doorswitch.lastsample[i] >= (long) ports.doorswitch.ports[i].sampletime || context->readData != 0) {
+		ports.doorswitch.lastsample[i] = t;
+		if (ProcessDoorswitchData(&ports.doorswitch.ports[i], &message) == DOORSWITCH_SUCCESS) {
+		    publishReading(context, &message, 0);
 		};
 	    }
 	}
 
+	busTime(BUS_GPIO, busStart);
+
 	// process tempsensors
-	for (i = 0; i < tempsensor_ports.size; i++) {
+	busStart = metrics_now();
+	// oversampling and streamed sensors are sampled on threads of their
+	// own, or oversampled here every second without them, and the others
+	// due are read in one sweep of the ADCs
+	for (i = 0, n = 0; initReady(&init[INIT_TEMPSENSOR]) && i < ports.tempsensor.size; i++) {
+	    scan[n++] = &ports.tempsensor.ports[i];
+	}
+	if (time(NULL) != ports.tempsensor.lastOversample || capture_replaying()) {
+	    ports.tempsensor.lastOversample = time(NULL);
+	    tempsensor_oversample(scan, n);
+	}
+	if (n > 0 && !ports.tempsensor.started) {
+	    tempsensor_startStreams(ports.tempsensor.ports, ports.tempsensor.size, context);
+	    tempsensor_startOversampling(ports.tempsensor.ports, ports.tempsensor.size);
+	    ports.tempsensor.started = 1;
+	}
+	adcstream_publish(context);
+	for (i = 0, n = 0; initReady(&init[INIT_TEMPSENSOR]) && i < ports.tempsensor.size; i++) {
 	    long t = time(NULL);
-	    if (t - tempsensor_ports.lastsample[i] >= (long) tempsensor_ports.ports[i].sampletime || context->readData != 0) {
-		tempsensor_ports.lastsample[i] = t;
-		if (ProcessTempsensorData(&tempsensor_ports.ports[i], &message) == TEMPSENSOR_SUCCESS) {
-		    mqttPublish(context, &message);
-		};
+	    if (t - ports.tempsensor.lastsample[i] >= (long) ports.tempsensor.ports[i].sampletime || context->readData != 0) {
+		ports.tempsensor.lastsample[i] = t;
+		scan[n++] = &ports.tempsensor.ports[i];
 	    }
 	}
+	tempsensor_scan(scan, n);
+	for (i = 0; i < n; i++) {
+	    if (ProcessTempsensorData(scan[i], &message) == TEMPSENSOR_SUCCESS) {
+		publishReading(context, &message, 0);
+	    };
+	}
 
-	if (5 <= cntr) {
-	    // process dht22
-	    for (i = 0; i < dht22_ports.size; i++) {
-		if (DHT22_process_temperature(dht22_ports.ports[i], &message) == DHT22_SUCCESS) {
-		    mqttPublish(context, &message);
-		};
+	busTime(BUS_I2C, busStart);
+
+	busStart = metrics_now();
+	for (i = 0; initReady(&init[INIT_DHT22]) && i < ports.dht22.size; i++) {
+	    dht22_port_t *dht = &ports.dht22.ports[i];
+	    long t = time(NULL);
+	    // a failed read is retried as soon as the sensor allows
+	    if (t - ports.dht22.lastsample[i] >= (long) dht->sampletime || dht->retrying || context->readData != 0) {
+		int retry = dht->retrying;
+		int rc = DHT22_process_data(dht, &batch[0], &batch[1]);
+		if (rc == DHT22_BUSY) continue;
+		if (!retry) ports.dht22.lastsample[i] = t;
+		if (rc == DHT22_SUCCESS) {
+		    publishReading(context, &batch[0], 0);
+		    publishReading(context, &batch[1], 0);
+		}
 	    }
-	    cntr = 0;
 	}
+	busTime(BUS_GPIO, busStart);
 
-	for (i = 0; i < raven_ports.size; i++) {
-	    if (ProcessRAVEnData(raven_ports.ports[i], &message) == RAVEN_PASS) {
-		mqttPublish(context, &message);
+	for (i = 0; initReady(&init[INIT_RAVEN]) && i < ports.raven.size; i++) {
+	    if (ProcessRAVEnData(ports.raven.ports[i], &message) == RAVEN_PASS) {
+		publishReading(context, &message, 0);
 	    }
 	}
+	n = rules_tick(time(NULL), pending, sizeof (pending) / sizeof (pending[0]));
+	for (i = 0; i < n; i++) {
+	    mqttPublish(context, &pending[i]);
+	}
+	n = virtualsensor_tick(time(NULL), pending, sizeof (pending) / sizeof (pending[0]));
+	for (i = 0; i < n; i++) {
+	    publishReading(context, &pending[i], 1);
+	}
+	if (metricsInterval > 0 && time(NULL) - lastMetrics >= metricsInterval) {
+	    lastMetrics = time(NULL);
+	    publishMetrics(context);
+	}
 	cntr++;
-	context->readData = 0;  // Should be a one time shot.
-	nanosleep(&delay, NULL);
+	context->readData = capture_replaying();  // Should be a one time shot.
+	if (capture_replaying() && capture_finished()) {
+	    DBGLOG(DBG_MAIN, DBG_INFO, "Replay finished");
+	    context->killed = 1;
+	}
+	metrics_observe(metrics_histogram("loop_seconds", NULL), metrics_now() - loopStart);
+	mqttWait(context, &delay);
 
     } // end while not reboot or finished
 
+    for (i = 0; i < INIT_COUNT; i++) {
+	if (init[i].started) pthread_join(init[i].thread, NULL);
+    }
+    exporter_stop();
+    capture_close();
+    if (ports.tempsensor.started) {
+	tempsensor_stopStreams();
+	tempsensor_stopOversampling();
+    }
     
-    for (i = 0; i < raven_ports.size; i++) {
-	RAVEn_closePort(raven_ports.ports[i]);
+    for (i = 0; i < ports.raven.size; i++) {
+	RAVEn_closePort(ports.raven.ports[i]);
+    }
+    for (i = 0; i < ports.ds18b20.size; i++) {
+	DS18B20PI_closePort(&ports.ds18b20.ports[i]);
+    }
+    for (i = 0; i < ports.dht22.size; i++) {
+	DHT22_closePort(&ports.dht22.ports[i]);
     }
 
-    WriteDBGLog("Closing mqttClient");
+    DBGLOG(DBG_MAIN, DBG_INFO, "Closing mqttClient");
     MQTTAsync_destroy(&mqtt_client);
+    CloseDBGLog();
     
     if (context->reboot == 1) {
 	system("sudo reboot");
     }
-    return (EXIT_SUCCESS);
+    return (initFailed ? EXIT_FAILURE : EXIT_SUCCESS);
 }
@@ -0,0 +1,368 @@
+/*
+ * The MIT License
+ *
+ * Copyright 2017 Nick Ong <onichola@gmail.com>.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "debug.h"
+#include "metrics.h"
+#include "mqtt.h"
+
+typedef enum {
+    METRIC_COUNTER,
+    METRIC_GAUGE,
+    METRIC_HISTOGRAM
+} metric_type_t;
+
+struct metric {
+    char name[48]; ///< metric name
+    char label[64]; ///< label value, empty if none
+    metric_type_t type; ///< kind of metric
+    uint64_t count; ///< number of histogram observations
+    uint64_t value; ///< bits of the counter or gauge value, or of the histogram sum
+    uint64_t buckets[METRICS_BUCKETS + 1]; ///< histogram observations per bucket
+};
+
+// upper bounds of the histogram buckets in seconds
+static const double bounds[METRICS_BUCKETS] = {
+    0.00001, 0.000025, 0.00005, 0.0001, 0.00025, 0.0005, 0.001,
+    0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1.0, 2.5, 5.0, 10.0
+};
+
+static struct metric registry[METRICS_MAX];
+static int nmetrics = 0; ///< slots below this are complete, read with acquire
+static pthread_mutex_t registerLock = PTHREAD_MUTEX_INITIALIZER;
+static int full = 0; ///< set once the registry has turned a metric away
+
+static uint64_t
+bits(double d) {
+    uint64_t u;
+    memcpy(&u, &d, sizeof (u));
+    return u;
+}
+
+static double
+number(uint64_t u) {
+    double d;
+    memcpy(&d, &u, sizeof (d));
+    return d;
+}
+
+/**
+ * Add to a double held as bits.
+ */
+static void
+addDouble(uint64_t *p, double n) {
+    uint64_t old = __atomic_load_n(p, __ATOMIC_RELAXED);
+
+    while (!__atomic_compare_exchange_n(p, &old, bits(number(old) + n), 1,
+	    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+	;
+}
+
+static metric_t *
+find(const char *name, const char *label, int n) {
+    int i;
+
+    for (i = 0; i < n; i++) {
+	if (strcmp(registry[i].name, name) == 0 && strcmp(registry[i].label, label) == 0)
+	    return &registry[i];
+    }
+    return NULL;
+}
+
+static metric_t *
+lookup(const char *name, const char *label, metric_type_t type) {
+    metric_t *m;
+    int n;
+
+    if (label == NULL) label = "";
+    if ((m = find(name, label, __atomic_load_n(&nmetrics, __ATOMIC_ACQUIRE))) != NULL)
+	return m;
+
+    pthread_mutex_lock(&registerLock);
+    n = nmetrics;
+    if ((m = find(name, label, n)) == NULL && n < METRICS_MAX) {
+	m = &registry[n];
+	memset(m, 0, sizeof (*m));
+	strncpy(m->name, name, sizeof (m->name) - 1);
+	strncpy(m->label, label, sizeof (m->label) - 1);
+	m->type = type;
+	__atomic_store_n(&nmetrics, n + 1, __ATOMIC_RELEASE);
+    } else if (m == NULL && !full) {
+	full = 1;
+	DBGLOG(DBG_MAIN, DBG_WARN, "metrics - registry full at %d, %s{%s} and later metrics are not recorded",
+		METRICS_MAX, name, label);
+    }
+    pthread_mutex_unlock(&registerLock);
+    return m;
+}
+
+metric_t *
+metrics_counter(const char *name, const char *label) {
+    return lookup(name, label, METRIC_COUNTER);
+}
+
+metric_t *
+metrics_gauge(const char *name, const char *label) {
+    return lookup(name, label, METRIC_GAUGE);
+}
+
+metric_t *
+metrics_histogram(const char *name, const char *label) {
+    return lookup(name, label, METRIC_HISTOGRAM);
+}
+
+void
+metrics_add(metric_t *m, double n) {
+    if (m == NULL) return;
+    addDouble(&m->value, n);
+}
+
+void
+metrics_set(metric_t *m, double v) {
+    if (m == NULL) return;
+    __atomic_store_n(&m->value, bits(v), __ATOMIC_RELAXED);
+}
+
+void
+metrics_observe(metric_t *m, double seconds) {
+    int b;
+
+    if (m == NULL) return;
+    for (b = 0; b < METRICS_BUCKETS && seconds > bounds[b]; b++)
+	;
+    __atomic_add_fetch(&m->buckets[b], 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&m->count, 1, __ATOMIC_RELAXED);
+    addDouble(&m->value, seconds);
+}
+
+double
+metrics_value(metric_t *m) {
+    if (m == NULL) return 0;
+    if (m->type == METRIC_HISTOGRAM) return __atomic_load_n(&m->count, __ATOMIC_RELAXED);
+    return number(__atomic_load_n(&m->value, __ATOMIC_RELAXED));
+}
+
+void
+metrics_reset(void) {
+    int n = __atomic_load_n(&nmetrics, __ATOMIC_ACQUIRE);
+    int i, b;
+
+    for (i = 0; i < n; i++) {
+	__atomic_store_n(&registry[i].count, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&registry[i].value, bits(0), __ATOMIC_RELAXED);
+	for (b = 0; b <= METRICS_BUCKETS; b++)
+	    __atomic_store_n(&registry[i].buckets[b], 0, __ATOMIC_RELAXED);
+    }
+}
+
+double
+metrics_now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/**
+ * Estimate a quantile from the buckets, interpolating inside the bucket.
+ */
+static double
+quantile(const metric_t *m, double q) {
+    uint64_t counts[METRICS_BUCKETS + 1];
+    uint64_t total = 0;
+    uint64_t seen = 0;
+    double rank;
+    double lo;
+    int b;
+
+    for (b = 0; b <= METRICS_BUCKETS; b++) {
+	counts[b] = __atomic_load_n(&m->buckets[b], __ATOMIC_RELAXED);
+	total += counts[b];
+    }
+    if (total == 0) return 0;
+    rank = q * total;
+    for (b = 0; b <= METRICS_BUCKETS; b++) {
+	if (seen + counts[b] >= rank && counts[b] > 0) {
+	    if (b == METRICS_BUCKETS) return bounds[METRICS_BUCKETS - 1];
+	    lo = b == 0 ? 0 : bounds[b - 1];
+	    return lo + (bounds[b] - lo) * (rank - seen) / counts[b];
+	}
+	seen += counts[b];
+    }
+    return bounds[METRICS_BUCKETS - 1];
+}
+
+/**
+ * Write one metric as a JSON member.
+ * @return characters written, or len or more if it did not fit
+ */
+static int
+member(const metric_t *m, char *buf, size_t len) {
+    char key[128];
+
+    if (m->label[0] != 0) {
+	snprintf(key, sizeof (key), "%s/%s", m->name, m->label);
+    } else {
+	snprintf(key, sizeof (key), "%s", m->name);
+    }
+    switch (m->type) {
+	case METRIC_COUNTER:
+	case METRIC_GAUGE:
+	    return snprintf(buf, len, "\"%s\":%.10g", key,
+		    number(__atomic_load_n(&m->value, __ATOMIC_RELAXED)));
+	case METRIC_HISTOGRAM:
+	    return snprintf(buf, len, "\"%s\":{\"n\":%llu,\"sum\":%.6g,\"p50\":%.3g,\"p99\":%.3g}", key,
+		    (unsigned long long) __atomic_load_n(&m->count, __ATOMIC_RELAXED),
+		    number(__atomic_load_n(&m->value, __ATOMIC_RELAXED)),
+		    quantile(m, 0.50), quantile(m, 0.99));
+    }
+    return 0;
+}
+
+int
+metrics_json(int *cursor, long now, char *buf, size_t len) {
+    int n = __atomic_load_n(&nmetrics, __ATOMIC_ACQUIRE);
+    int written = 0;
+    size_t used;
+    int w;
+
+    used = snprintf(buf, len, "{\"timestamp\":%ld,\"metrics\":{", now);
+    if (used + 3 > len) return 0;
+    while (*cursor < n) {
+	// room for a comma and the closing braces
+	w = member(&registry[*cursor], buf + used + (written ? 1 : 0),
+		len - used - (written ? 1 : 0) - 2);
+	if (w < 0 || used + (written ? 1 : 0) + w + 2 >= len) {
+	    if (written == 0) {
+		// too big for any document
+		(*cursor)++;
+		continue;
+	    }
+	    break;
+	}
+	if (written) buf[used++] = ',';
+	used += w;
+	written++;
+	(*cursor)++;
+    }
+    snprintf(buf + used, len - used, "}}");
+    return written;
+}
+
+/**
+ * Write a label value with the escapes of the text exposition format.
+ */
+static void
+promLabel(FILE *fp, const char *label) {
+    for (; *label; label++) {
+	if (*label == '\\' || *label == '"') {
+	    fputc('\\', fp);
+	    fputc(*label, fp);
+	} else if (*label == '\n') {
+	    fputs("\\n", fp);
+	} else {
+	    fputc(*label, fp);
+	}
+    }
+}
+
+/**
+ * Write the samples of one metric.
+ */
+static void
+promSamples(FILE *fp, const metric_t *m) {
+    uint64_t cumulative = 0;
+    int b;
+
+    if (m->type != METRIC_HISTOGRAM) {
+	fprintf(fp, "pi2mqtt_%s", m->name);
+	if (m->label[0] != 0) {
+	    fputs("{id=\"", fp);
+	    promLabel(fp, m->label);
+	    fputs("\"}", fp);
+	}
+	fprintf(fp, " %.15g\n", number(__atomic_load_n(&m->value, __ATOMIC_RELAXED)));
+	return;
+    }
+    for (b = 0; b <= METRICS_BUCKETS; b++) {
+	cumulative += __atomic_load_n(&m->buckets[b], __ATOMIC_RELAXED);
+	fprintf(fp, "pi2mqtt_%s_bucket{", m->name);
+	if (m->label[0] != 0) {
+	    fputs("id=\"", fp);
+	    promLabel(fp, m->label);
+	    fputs("\",", fp);
+	}
+	if (b < METRICS_BUCKETS) {
+	    fprintf(fp, "le=\"%g\"} %llu\n", bounds[b], (unsigned long long) cumulative);
+	} else {
+	    fprintf(fp, "le=\"+Inf\"} %llu\n", (unsigned long long) cumulative);
+	}
+    }
+    fprintf(fp, "pi2mqtt_%s_sum", m->name);
+    if (m->label[0] != 0) {
+	fputs("{id=\"", fp);
+	promLabel(fp, m->label);
+	fputs("\"}", fp);
+    }
+    fprintf(fp, " %.9g\n", number(__atomic_load_n(&m->value, __ATOMIC_RELAXED)));
+    // the count is the +Inf bucket so that the two always agree
+    fprintf(fp, "pi2mqtt_%s_count", m->name);
+    if (m->label[0] != 0) {
+	fputs("{id=\"", fp);
+	promLabel(fp, m->label);
+	fputs("\"}", fp);
+    }
+    fprintf(fp, " %llu\n", (unsigned long long) cumulative);
+}
+
+void
+metrics_prometheus(FILE *fp) {
+    static const char *types[] = {"counter", "gauge", "histogram"};
+    int n = __atomic_load_n(&nmetrics, __ATOMIC_ACQUIRE);
+    int i, j;
+
+    // samples of one name must follow a single TYPE line, but the registry
+    // is in order of first use, so gather each name on its first appearance
+    for (i = 0; i < n; i++) {
+	for (j = 0; j < i && strcmp(registry[j].name, registry[i].name) != 0; j++)
+	    ;
+	if (j < i) continue;
+	fprintf(fp, "# TYPE pi2mqtt_%s %s\n", registry[i].name, types[registry[i].type]);
+	for (j = i; j < n; j++) {
+	    if (strcmp(registry[j].name, registry[i].name) == 0)
+		promSamples(fp, &registry[j]);
+	}
+    }
+}
+
+double
+metrics_quantile(metric_t *m, double q) {
+    if (m == NULL || m->type != METRIC_HISTOGRAM) return 0;
+    return quantile(m, q);
+}
@@ -0,0 +1,167 @@
+/*
+ * The MIT License
+ *
+ * Copyright 2017 Nick Ong <onichola@gmail.com>.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * File:   metrics.h
+ * Author: Nick Ong <onichola@gmail.com>
+ *
+ * Registry of counters, gauges and histograms describing the daemon itself.
+ * Updates are single atomic operations and never take a lock, so drivers
+ * and the MQTT callbacks can record from any thread.  Registering a metric
+ * takes a lock the first time only.
+ */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+#ifndef METRICS_UNLABELLED
+#define METRICS_UNLABELLED 96 ///< metrics without a label, such as mqtt_published_total
+#endif
+
+#ifndef METRICS_PERPORT
+#define METRICS_PERPORT 24 ///< labelled metrics one port of each kind may register
+#endif
+
+#ifndef METRICS_MAX
+#define METRICS_MAX (METRICS_UNLABELLED + METRICS_PERPORT * MAXPORTS) ///< distinct metrics, counting each label separately
+#endif
+
+#define METRICS_BUCKETS 19 ///< histogram buckets, plus one for larger values
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    typedef struct metric metric_t;
+
+    /**
+     * \brief Resolve an unlabelled metric once per call site.
+     * Hot paths use this instead of looking the name up on every update.
+     * @param kind - counter, gauge or histogram
+     * @param name - metric name
+     * @return the metric, or NULL if the registry is full
+     */
+#define METRICS_ONCE(kind, name) __extension__ ({ \
+	static metric_t *_once; \
+	metric_t *_m = __atomic_load_n(&_once, __ATOMIC_RELAXED); \
+	if (_m == NULL) \
+	    __atomic_store_n(&_once, _m = metrics_##kind(name, NULL), __ATOMIC_RELAXED); \
+	_m; \
+    })
+
+    /**
+     * \brief Find or register a counter.
+     * @param name - metric name, such as mqtt_published_total
+     * @param label - sensor id or other label, or NULL
+     * @return the counter, or NULL if the registry is full
+     */
+    extern metric_t *metrics_counter(const char *name, const char *label);
+
+    /**
+     * \brief Find or register a gauge.
+     * @param name - metric name
+     * @param label - label, or NULL
+     * @return the gauge, or NULL if the registry is full
+     */
+    extern metric_t *metrics_gauge(const char *name, const char *label);
+
+    /**
+     * \brief Find or register a histogram of durations in seconds.
+     * Buckets run from 10 us to 10 s.
+     * @param name - metric name, such as ds18b20_read_seconds
+     * @param label - label, or NULL
+     * @return the histogram, or NULL if the registry is full
+     */
+    extern metric_t *metrics_histogram(const char *name, const char *label);
+
+    /**
+     * \brief Add to a counter, or to a gauge.  NULL is ignored.
+     */
+    extern void metrics_add(metric_t *m, double n);
+
+    /**
+     * \brief Set a gauge.  NULL is ignored.
+     */
+    extern void metrics_set(metric_t *m, double v);
+
+    /**
+     * \brief Record one duration in a histogram.  NULL is ignored.
+     */
+    extern void metrics_observe(metric_t *m, double seconds);
+
+    /**
+     * \brief Current value of a counter or gauge, or the number of
+     * observations of a histogram.  0 for NULL.
+     */
+    extern double metrics_value(metric_t *m);
+
+    /**
+     * \brief Estimate a quantile of a histogram from its buckets.
+     * @param m - histogram
+     * @param q - quantile, 0.5 for the median
+     * @return seconds, 0 if there are no observations
+     */
+    extern double metrics_quantile(metric_t *m, double q);
+
+    /**
+     * \brief Zero every metric, keeping the registrations.  Updates racing
+     * with the reset may be kept or lost.
+     */
+    extern void metrics_reset(void);
+
+    /**
+     * \brief Monotonic time in seconds, for timing with metrics_observe.
+     */
+    extern double metrics_now(void);
+
+    /**
+     * \brief Write the registry as a compact JSON document.
+     *
+     * Writes as many metrics as fit in len, starting at *cursor, and moves
+     * *cursor past them.  Call again with the same cursor for the rest.
+     * Histograms are written as {"n":count,"sum":seconds,"p50":s,"p99":s}.
+     *
+     * @param cursor - first metric to write, 0 to start
+     * @param now - timestamp of the document
+     * @param buf - receives the document
+     * @param len - size of buf
+     * @return number of metrics written, 0 when none are left
+     */
+    extern int metrics_json(int *cursor, long now, char *buf, size_t len);
+
+    /**
+     * \brief Write the registry in the Prometheus text exposition format.
+     * Names are prefixed with pi2mqtt_ and the label is written as id.
+     * @param fp - stream to write to
+     */
+    extern void metrics_prometheus(FILE *fp);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* METRICS_H */
@@ -28,20 +28,124 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <pthread.h>
 #include "mqtt.h"
 #include "debug.h"
+#include "metrics.h"
+#include "trace.h"
 
 #define QOS          1
 #define TIMEOUT      10000L
 
 static char* dumpFilename = MQTT_DUMP_FILE;
 
+// messages published before the first connection
+static pthread_mutex_t pendingLock = PTHREAD_MUTEX_INITIALIZER;
+static mqtt_data_t pending[MQTT_MAXPENDING];
+static int npending = 0;
+static int flushed = 0; ///< pending has been sent, buffer no more
+static int firstReading = 0; ///< first sensor reading has been sent
+static double lostAt = 0; ///< metrics_now() when the connection was last lost
+
+// publishes awaiting PUBACK, slot token % MQTT_MAXTRACE
+typedef struct {
+    MQTTAsync_token token; ///< token of the publish, 0 if free
+    int64_t sampled; ///< wall clock microseconds of the hardware read
+    double sent; ///< metrics_now() when sendMessage returned
+} mqtt_trace_t;
+
+static pthread_mutex_t traceLock = PTHREAD_MUTEX_INITIALIZER;
+static mqtt_trace_t traces[MQTT_MAXTRACE];
+
+static int sendMessage(my_context_t *c, mqtt_data_t *message, const void *binary, int len);
+
+/**
+ * Hold a message until the first connection.
+ * @param c context
+ * @param message message to hold
+ * @return 1 if held, 0 if the caller should send or save it
+ */
+static int
+holdPending(my_context_t *c, const mqtt_data_t *message) {
+    int held = 0;
+
+    pthread_mutex_lock(&pendingLock);
+    if (!flushed && c->connected != 1 && npending < MQTT_MAXPENDING) {
+	pending[npending++] = *message;
+	held = 1;
+	metrics_set(METRICS_ONCE(gauge, "mqtt_held"), npending);
+    }
+    pthread_mutex_unlock(&pendingLock);
+    return held;
+}
+
+/**
+ * Send the messages held before the first connection.  Nothing is held once
+ * this has run, so the buffer can be read without the lock afterwards.
+ * @param c context
+ */
+static void
+flushPending(my_context_t *c) {
+    int n;
+    int i;
+
+    pthread_mutex_lock(&pendingLock);
+    n = npending;
+    npending = 0;
+    flushed = 1;
+    pthread_mutex_unlock(&pendingLock);
+    metrics_set(METRICS_ONCE(gauge, "mqtt_held"), 0);
+    if (n == 0) return;
+    DBGLOG(DBG_MQTT, DBG_INFO, "flushPending - sending %d messages held before connecting", n);
+    for (i = 0; i < n; i++) {
+	// keep the time the message was queued, not the time it was flushed
+	sendMessage(c, &pending[i], NULL, 0);
+    }
+}
+
+/**
+ * Report the time from start up to the first sensor reading sent.
+ * @param c context
+ */
+static void
+reportFirstReading(my_context_t *c) {
+    struct timespec now;
+    mqtt_data_t data;
+    long ms;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    ms = (now.tv_sec - c->started.tv_sec) * 1000L +
+	    (now.tv_nsec - c->started.tv_nsec) / 1000000L;
+    snprintf(data.payload, sizeof (data.payload),
+	    "{\"timestamp\":%ld,\"system\":\"startup\",\"first_reading_ms\":%ld}",
+	    time(NULL), ms);
+    snprintf(data.topic, sizeof (data.topic), "%s", "manage");
+    data.sensor[0] = 0;
+    DBGLOG(DBG_MQTT, DBG_INFO, "%s", data.payload);
+    mqttPublish(c, &data);
+}
+
 static void
 onConnectFailure(void* context, MQTTAsync_failureData* response) {
-    char buf[256];
     my_context_t *c = (my_context_t *) context;
-    snprintf(buf, sizeof (buf), "Connect failed, rc %d", response ? response->code : 0);
-    WriteDBGLog(buf);
+    DBGLOG(DBG_MQTT, DBG_ERROR, "Connect failed, rc %d", response ? response->code : 0);
+}
+
+/**
+ * Subscribe to the management topic.  A management topic ending in a single
+ * level wildcard would not match read/<sensor-id>, so that is subscribed too.
+ * @param c context
+ */
+static void
+subscribeManagement(my_context_t *c) {
+    char topic[MQTT_MAXTOPIC];
+    size_t len = strlen(c->broker->mqttmanagementtopic);
+
+    mqttSub(c, c->broker->mqttmanagementtopic);
+    if (len > 0 && c->broker->mqttmanagementtopic[len - 1] == '+') {
+	snprintf(topic, sizeof (topic), "%.*sread/+", (int) (len - 1), c->broker->mqttmanagementtopic);
+	mqttSub(c, topic);
+    }
 }
 
 static void
@@ -49,20 +153,25 @@ onConnect(void* context, MQTTAsync_successData* response) {
     my_context_t *c = (my_context_t *) context;
     mqtt_data_t data;
 
+    pthread_mutex_lock(&pendingLock);
     c->connected = 1;
-    WriteDBGLog("Successful connection");
-    mqttSub(c, c->broker->mqttmanagementtopic);
+    pthread_mutex_unlock(&pendingLock);
+    DBGLOG(DBG_MQTT, DBG_INFO, "Successful connection");
+    metrics_set(METRICS_ONCE(gauge, "mqtt_connected"), 1);
+    subscribeManagement(c);
 
     snprintf(data.payload, sizeof (data.payload),
 	    "{\"timestamp\":%ld,\"status\":\"connected\"}", time(NULL));
     snprintf(data.topic, sizeof (data.topic), "%s", "manage");
+    data.sensor[0] = 0;
     mqttPublish(c, &data);
+    flushPending(c);
 
 }
 
 void
 onSubscribe(void* context, MQTTAsync_successData* response) {
-    WriteDBGLog("Subscribe succeeded\n");
+    DBGLOG(DBG_MQTT, DBG_INFO, "Subscribe succeeded\n");
 }
 
 static void
@@ -72,39 +181,48 @@ onReconnect(void* context, char* response) {
     char buf[1024];
     mqtt_data_t data;
 
-    WriteDBGLog("onReconnect - entry");
+    DBGLOG(DBG_MQTT, DBG_INFO, "onReconnect - entry");
 
     // connected = 0 is first time through, not a reconnect.
     if (c->connected == 0) {
+	pthread_mutex_lock(&pendingLock);
 	c->connected = 1;
-	WriteDBGLog("onReconnect - Successful reconnection");
-	mqttSub(c, c->broker->mqttmanagementtopic);
+	pthread_mutex_unlock(&pendingLock);
+	DBGLOG(DBG_MQTT, DBG_INFO, "onReconnect - Successful reconnection");
+	metrics_add(METRICS_ONCE(counter, "mqtt_reconnects_total"), 1);
+	metrics_set(METRICS_ONCE(gauge, "mqtt_connected"), 1);
+	if (lostAt != 0)
+	    metrics_observe(METRICS_ONCE(histogram, "mqtt_reconnect_seconds"), metrics_now() - lostAt);
+	subscribeManagement(c);
+	flushPending(c);
 	if ((fp = fopen(dumpFilename, "r")) != NULL) {
+	    TRACE0(mqtt_replay_start);
 	    while (fgets(buf, sizeof (buf), fp) != NULL) {
 		sscanf(buf, "%s\n", data.topic);
 		fgets(buf, sizeof (buf), fp);
 		sscanf(buf, "%s\n", data.payload);
-		snprintf(buf, sizeof (buf), "publishing %s to %s", data.payload, data.topic);
-		WriteDBGLog(buf);
+		data.sensor[0] = 0;
+		TRACE1(mqtt_replay, data.topic);
+		DBGLOG(DBG_MQTT, DBG_DEBUG, "publishing %s to %s", data.payload, data.topic);
 		mqttPublish(c, &data);
 	    }
 	    fclose(fp);
+	    TRACE0(mqtt_replay_end);
 	} else {
 	    perror("mqtt.c->onReconnect");
 	}
 	snprintf(data.payload, sizeof (data.payload),
 		"{\"timestamp\":%ld,\"connection\":\"reconnected\"}", time(NULL));
 	snprintf(data.topic, sizeof (data.topic), "%s", "manage");
+	data.sensor[0] = 0;
 	mqttPublish(c, &data);
     }
 }
 
 static void
 onSubscribeFailure(void* context, MQTTAsync_failureData* response) {
-    char buf[128];
     my_context_t *c = (my_context_t *) context;
-    snprintf(buf, sizeof (buf), "Subscribe failed, rc %d", response ? response->code : 0);
-    WriteDBGLog(buf);
+    DBGLOG(DBG_MQTT, DBG_ERROR, "Subscribe failed, rc %d", response ? response->code : 0);
     c->killed = 1;
 }
 
@@ -112,28 +230,167 @@ static void
 onConnLost(void *context, char *cause) {
     my_context_t* c = (my_context_t *) context;
     FILE *fp;
-    char buf[1024];
     mqtt_data_t data;
     MQTTAsync_connectOptions conn_opts = MQTTAsync_connectOptions_initializer;
     int rc;
 
     c->connected = 0;
-    snprintf(buf, 64, "onConnlost - Broker connection lost. Cause: %s", cause);
-    WriteDBGLog(buf);
+    DBGLOG(DBG_MQTT, DBG_WARN, "onConnlost - Broker connection lost. Cause: %s", cause);
+    metrics_add(METRICS_ONCE(counter, "mqtt_connections_lost_total"), 1);
+    metrics_set(METRICS_ONCE(gauge, "mqtt_connected"), 0);
+    lostAt = metrics_now();
     if ((fp = fopen(dumpFilename, "w")) == NULL) {
 	perror("mqtt.c->onConnLost");
     } else {
 	fclose(fp);
+	metrics_set(METRICS_ONCE(gauge, "mqtt_dump_bytes"), 0);
     }
 
     // Let the broker know when the connection was lost
     snprintf(data.payload, sizeof (data.payload),
 	    "{\"timestamp\":%ld,\"connection\":\"lost\"}", time(NULL));
     snprintf(data.topic, sizeof (data.topic), "%s", "manage");
+    data.sensor[0] = 0;
     mqttPublish(c, &data);
 
 }
 
+/**
+ * Split a management topic into its command and argument.  The command is
+ * the level following the management topic prefix, so that
+ * <prefix>/read/<sensor-id> is the read command on sensor-id.
+ * @param c context
+ * @param topicName topic, modified in place
+ * @param arg receives the remaining levels, or NULL
+ * @return the command
+ */
+static char *
+managementCommand(my_context_t *c, char *topicName, char **arg) {
+    size_t plen = strcspn(c->broker->mqttmanagementtopic, "+#");
+    char *key = topicName;
+    char *token;
+
+    *arg = NULL;
+    if (plen > 0 && strncmp(topicName, c->broker->mqttmanagementtopic, plen) == 0
+	    && topicName[plen] != 0) {
+	key = topicName + plen;
+	if ((*arg = strchr(key, '/')) != NULL) {
+	    *(*arg)++ = 0;
+	}
+    } else {
+	token = strtok(topicName, "/");
+	while (token != NULL) {
+	    key = token;
+	    token = strtok(NULL, "/");
+	}
+    }
+    return key;
+}
+
+/**
+ * Queue a targeted read for the main loop.  The message payload, if any, is
+ * the correlation id of the response.
+ * @param c context
+ * @param pattern glob of sensor ids
+ * @param message message that requested the read
+ */
+static void
+queueReadRequest(my_context_t *c, const char *pattern, MQTTAsync_message *message) {
+    static unsigned int sequence = 0;
+    mqtt_read_request_t *req;
+    mqtt_data_t data;
+    int i, n;
+
+    pthread_mutex_lock(&c->lock);
+    if (c->nreads >= MQTT_MAXREADS) {
+	pthread_mutex_unlock(&c->lock);
+	DBGLOG(DBG_MQTT, DBG_WARN, "onMsgArrvd - read request queue full");
+	snprintf(data.payload, sizeof (data.payload),
+		"{\"timestamp\":%ld,\"system\":\"read request dropped\"}", time(NULL));
+	snprintf(data.topic, sizeof (data.topic), "%s", "manage");
+	data.sensor[0] = 0;
+	mqttPublish(c, &data);
+	return;
+    }
+    req = &c->reads[c->nreads];
+    strncpy(req->pattern, pattern, sizeof (req->pattern) - 1);
+    req->pattern[sizeof (req->pattern) - 1] = 0;
+    // correlation ids end up in a topic, keep only characters safe there
+    for (i = 0, n = 0; i < message->payloadlen && n < (int) sizeof (req->correlation) - 1; i++) {
+	char ch = ((char *) message->payload)[i];
+	if (ch > ' ' && ch < 0x7f && ch != '+' && ch != '#' && ch != '/' && ch != '"' && ch != '\\') {
+	    req->correlation[n++] = ch;
+	}
+    }
+    req->correlation[n] = 0;
+    if (n == 0) {
+	snprintf(req->correlation, sizeof (req->correlation), "read%u", ++sequence);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &req->received);
+    c->nreads++;
+    pthread_cond_signal(&c->wake);
+    pthread_mutex_unlock(&c->lock);
+}
+
+int
+mqttTakeReadRequest(void *context, mqtt_read_request_t *request) {
+    my_context_t *c = (my_context_t *) context;
+    int rc = 0;
+
+    pthread_mutex_lock(&c->lock);
+    if (c->nreads > 0) {
+	*request = c->reads[0];
+	memmove(&c->reads[0], &c->reads[1], (c->nreads - 1) * sizeof (c->reads[0]));
+	c->nreads--;
+	rc = 1;
+    }
+    pthread_mutex_unlock(&c->lock);
+    return rc;
+}
+
+char *
+mqttTakeUpdate(void *context, struct timespec *received) {
+    my_context_t *c = (my_context_t *) context;
+    char *update;
+
+    pthread_mutex_lock(&c->lock);
+    update = c->update;
+    *received = c->updated;
+    c->update = NULL;
+    pthread_mutex_unlock(&c->lock);
+    return update;
+}
+
+void
+mqttWait(void *context, const struct timespec *delay) {
+    my_context_t *c = (my_context_t *) context;
+    struct timespec until;
+
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_sec += delay->tv_sec;
+    until.tv_nsec += delay->tv_nsec;
+    if (until.tv_nsec >= 1000000000L) {
+	until.tv_sec++;
+	until.tv_nsec -= 1000000000L;
+    }
+    pthread_mutex_lock(&c->lock);
+    if (c->nreads == 0 && c->update == NULL && !c->nudged) {
+	pthread_cond_timedwait(&c->wake, &c->lock, &until);
+    }
+    c->nudged = 0;
+    pthread_mutex_unlock(&c->lock);
+}
+
+void
+mqttWake(void *context) {
+    my_context_t *c = (my_context_t *) context;
+
+    pthread_mutex_lock(&c->lock);
+    c->nudged = 1;
+    pthread_cond_signal(&c->wake);
+    pthread_mutex_unlock(&c->lock);
+}
+
 /**
  * 
  * @param context
@@ -144,71 +401,68 @@ onConnLost(void *context, char *cause) {
  */
 static int
 onMsgArrvd(void *context, char* topicName, int topicLen, MQTTAsync_message *message) {
-    char buf[128];
-    FILE *fp;
     my_context_t *c = (my_context_t *) context;
-    int i;
     char* payloadptr;
     mqtt_data_t data;
 
-    snprintf(buf, sizeof (buf), "onMsgArrvd - Message arrived on topic: %s", topicName);
-    WriteDBGLog(buf);
+    DBGLOG(DBG_MQTT, DBG_DEBUG, "onMsgArrvd - Message arrived on topic: %s", topicName);
 
-    char *token = strtok(topicName, "/");
-    char *key;
-    while (token != NULL) {
-	key = token;
-	token = strtok(NULL, "/");
-    }
+    char *arg;
+    char *key = managementCommand(c, topicName, &arg);
 
     if (strcmp(key, "kill") == 0) {
 	c->killed = 1;
-	WriteDBGLog("onMsgArrvd - pi2mqtt killed");
+	DBGLOG(DBG_MQTT, DBG_INFO, "onMsgArrvd - pi2mqtt killed");
 	snprintf(data.payload, sizeof (data.payload),
 		"{\"timestamp\":%ld,\"system\":\"kill requested\"}", time(NULL));
 	snprintf(data.topic, sizeof (data.topic), "%s", "manage");
+	data.sensor[0] = 0;
 	mqttPublish(c, &data);
     }
 
     if (strcmp(key, "update") == 0) {
-	snprintf(buf, sizeof (buf), "%s.bak", c->configFile);
-	if (rename(c->configFile, buf) == 0) {
-	    if ((fp = fopen(c->configFile, "w")) != NULL) {
-		payloadptr = message->payload;
-		for (i = 0; i < message->payloadlen; i++) {
-		    fputc(*payloadptr, fp);
-		    payloadptr++;
-		}
-		fclose(fp);
-		c->reboot = 1;
-		WriteDBGLog("onMsgArrvd - updated configuration file");
-		snprintf(data.payload, sizeof (data.payload),
-			"{\"timestamp\":%ld,\"system\":\"update\"}", time(NULL));
-		snprintf(data.topic, sizeof (data.topic), "%s", "manage");
-		mqttPublish(c, &data);
-	    } else {
-		perror("mqtt.c->onMsgArrvd");
-	    }
+	// parsed and applied by the main loop, a newer update replaces an
+	// unapplied one
+	if ((payloadptr = malloc(message->payloadlen + 1)) != NULL) {
+	    memcpy(payloadptr, message->payload, message->payloadlen);
+	    payloadptr[message->payloadlen] = 0;
+	    pthread_mutex_lock(&c->lock);
+	    free(c->update);
+	    c->update = payloadptr;
+	    clock_gettime(CLOCK_MONOTONIC, &c->updated);
+	    pthread_cond_signal(&c->wake);
+	    pthread_mutex_unlock(&c->lock);
+	    DBGLOG(DBG_MQTT, DBG_INFO, "onMsgArrvd - configuration update received");
+	    snprintf(data.payload, sizeof (data.payload),
+		    "{\"timestamp\":%ld,\"system\":\"update\"}", time(NULL));
+	    snprintf(data.topic, sizeof (data.topic), "%s", "manage");
+	    data.sensor[0] = 0;
+	    mqttPublish(c, &data);
 	} else {
-	    WriteDBGLog("onMsgArrvd - unable to backup configFile");
+	    perror("mqtt.c->onMsgArrvd");
 	}
     }
 
     if (strcmp(key, "reboot") == 0) {
 	c->reboot = 1;
-	WriteDBGLog("onMsgArrvd - reboot requested");
+	DBGLOG(DBG_MQTT, DBG_INFO, "onMsgArrvd - reboot requested");
 	snprintf(data.payload, sizeof (data.payload),
 		"{\"timestamp\":%ld,\"system\":\"reboot requested\"}", time(NULL));
 	snprintf(data.topic, sizeof (data.topic), "%s", "manage");
+	data.sensor[0] = 0;
 	mqttPublish(c, &data);
     }
 
-    if (strcmp(key, "read") == 0) {
+    if (strcmp(key, "read") == 0 && arg != NULL && *arg != 0) {
+	DBGLOG(DBG_MQTT, DBG_DEBUG, "onMsgArrvd - targeted read of %s requested", arg);
+	queueReadRequest(c, arg, message);
+    } else if (strcmp(key, "read") == 0) {
 	c->readData = 1;
-	WriteDBGLog("onMsgArrvd - instant read requested");
+	DBGLOG(DBG_MQTT, DBG_DEBUG, "onMsgArrvd - instant read requested");
 	snprintf(data.payload, sizeof (data.payload),
 		"{\"timestamp\":%ld,\"system\":\"read requested\"}", time(NULL));
 	snprintf(data.topic, sizeof (data.topic), "%s", "manage");
+	data.sensor[0] = 0;
 	mqttPublish(c, &data);
     }
     MQTTAsync_freeMessage(&message);
@@ -219,100 +473,180 @@ onMsgArrvd(void *context, char* topicName, int topicLen, MQTTAsync_message *mess
 void
 onSend(void *context, MQTTAsync_successData* response) {
     my_context_t *c = (my_context_t *) context;
-    char buf[128];
-    snprintf(buf, sizeof (buf), "onSend - Message with token value %d delivery confirmed", response->token);
-    WriteDBGLog(buf);
+    mqtt_trace_t trace;
+    double now = metrics_now();
+
+    DBGLOG(DBG_MQTT, DBG_DEBUG, "onSend - Message with token value %d delivery confirmed", response->token);
+    TRACE1(mqtt_puback, response->token);
+    pthread_mutex_lock(&traceLock);
+    trace = traces[response->token % MQTT_MAXTRACE];
+    if (trace.token == response->token) traces[response->token % MQTT_MAXTRACE].token = 0;
+    pthread_mutex_unlock(&traceLock);
+    // a PUBACK faster than the slot was filled, or a slot reused, is not traced
+    if (trace.token == response->token) {
+	metrics_observe(METRICS_ONCE(histogram, "mqtt_send_to_puback_seconds"), now - trace.sent);
+	if (trace.sampled != 0)
+	    metrics_observe(METRICS_ONCE(histogram, "mqtt_sample_to_puback_seconds"),
+		(mqttTimeUs() - trace.sampled) / 1e6);
+    }
+    metrics_add(METRICS_ONCE(counter, "mqtt_confirmed_total"), 1);
+    metrics_add(METRICS_ONCE(gauge, "mqtt_inflight"), -1);
+}
+
+static void
+onSendFailure(void *context, MQTTAsync_failureData* response) {
+    DBGLOG(DBG_MQTT, DBG_WARN, "onSendFailure - Message with token value %d not delivered, rc %d",
+	    response ? response->token : 0, response ? response->code : 0);
+    TRACE1(mqtt_send_failed, response ? response->token : 0);
+    metrics_add(METRICS_ONCE(counter, "mqtt_delivery_failures_total"), 1);
+    metrics_add(METRICS_ONCE(gauge, "mqtt_inflight"), -1);
 }
 
 void
 mqttSave(void *context, const mqtt_data_t msg) {
     my_context_t *c = (my_context_t *) context;
     FILE *fp;
-    char buf[256];
 
     if ((fp = fopen(dumpFilename, "a")) == NULL) {
-	snprintf(buf, sizeof (buf), "mqttSave - error opening persistence file %s", dumpFilename);
-	WriteDBGLog(buf);
+	DBGLOG(DBG_MQTT, DBG_ERROR, "mqttSave - error opening persistence file %s", dumpFilename);
 	perror("mqtt.c->mqttSave");
 	return;
     }
-    snprintf(buf, sizeof (buf), "mqttSave - Saving topic %s/%s message %s to file", c->broker->mqtthome, msg.topic, msg.payload);
-    WriteDBGLog(buf);
+    DBGLOG(DBG_MQTT, DBG_INFO, "mqttSave - Saving topic %s/%s message %s to file", c->broker->mqtthome, msg.topic, msg.payload);
+    TRACE1(mqtt_save, msg.topic);
     fprintf(fp, "%s\n", msg.topic);
     fprintf(fp, "%s\n", msg.payload);
+    metrics_set(METRICS_ONCE(gauge, "mqtt_dump_bytes"), ftell(fp));
+    metrics_add(METRICS_ONCE(counter, "mqtt_saved_total"), 1);
     fclose(fp);
 }
 
 void
 mqttSub(void *context, const char *topic) {
-    char buf[512];
     my_context_t *c = (my_context_t *) context;
     MQTTAsync_responseOptions opts = MQTTAsync_responseOptions_initializer;
     int rc;
     if (c->connected == 1) {
-	snprintf(buf, sizeof (buf), "mqttSub - Subscribing to topic %s for client %s using QoS %d",
+	DBGLOG(DBG_MQTT, DBG_INFO, "mqttSub - Subscribing to topic %s for client %s using QoS %d",
 		topic, c->broker->mqttclientid, QOS);
-	WriteDBGLog(buf);
 	opts.onFailure = onSubscribeFailure;
 	opts.onSuccess = onSubscribe;
 	opts.context = c;
 
 	if ((rc = MQTTAsync_subscribe(*c->client, topic, QOS, &opts)) != MQTTASYNC_SUCCESS) {
-	    char buf[256];
-	    snprintf(buf, sizeof (buf), "Failed to start subscribe, return code %d", rc);
-	    WriteDBGLog(buf);
+	    DBGLOG(DBG_MQTT, DBG_ERROR, "Failed to start subscribe, return code %d", rc);
 	    exit(MQTTASYNC_FAILURE);
 	}
     } else {
-	WriteDBGLog("MQTT_sub not connected");
+	DBGLOG(DBG_MQTT, DBG_WARN, "MQTT_sub not connected");
     }
 }
 
 /**
- * 
- * @param mqttClient
- * @param payload
- * @param topic
- * @return 
+ * Send a message queued at message->queued, or hold or save it while
+ * disconnected.  A binary payload is dropped while disconnected, the dump
+ * file being text.
+ * @param c context
+ * @param message message to send
+ * @param binary payload to send instead of message->payload, or NULL
+ * @param len bytes of the binary payload
+ * @return MQTT_SUCCESS unless the send could not be started or a binary
+ * payload was dropped
  */
-int
-mqttPublish(void *context, mqtt_data_t *message) {
+static int
+sendMessage(my_context_t *c, mqtt_data_t *message, const void *binary, int len) {
     MQTTAsync_token token;
-    my_context_t *c = (my_context_t *) context;
+    mqtt_trace_t *trace;
+    double sent;
     char buf[256];
-    snprintf(buf, sizeof (buf), "mqttPublish - %s to %s/%s Connected %d", message->payload, 
+    DBGLOG(DBG_MQTT, DBG_DEBUG, "mqttPublish - %s to %s/%s Connected %d", message->payload, 
 	    c->broker->mqtthome, message->topic, c->connected);
-    WriteDBGLog(buf);
     if (c->connected == 1) {
 	MQTTAsync_responseOptions opts = MQTTAsync_responseOptions_initializer;
 	MQTTAsync_message pubmsg = MQTTAsync_message_initializer;
 
 	opts.onSuccess = onSend;
+	opts.onFailure = onSendFailure;
 	opts.context = c;
-	pubmsg.payload = message->payload;
-	pubmsg.payloadlen = strlen(message->payload);
+	pubmsg.payload = binary != NULL ? (void *) binary : message->payload;
+	pubmsg.payloadlen = binary != NULL ? len : (int) strlen(message->payload);
 	pubmsg.qos = QOS;
 	pubmsg.retained = 1;
 	token = 0;
 
 	snprintf(buf, sizeof (buf), "%s/%s", c->broker->mqtthome, message->topic);
 	if ((token = MQTTAsync_sendMessage(*c->client, buf, &pubmsg, &opts)) != MQTTASYNC_SUCCESS) {
-	    snprintf(buf, sizeof (buf), "mqttPublish - Failed to start sendMessage, return code %d\n", token);
-	    WriteDBGLog(buf);
+	    DBGLOG(DBG_MQTT, DBG_ERROR, "mqttPublish - Failed to start sendMessage, return code %d\n", token);
+	    metrics_add(METRICS_ONCE(counter, "mqtt_publish_errors_total"), 1);
 	    c->killed = 1;
 	    return (MQTT_FAILURE);
 	}
+	sent = metrics_now();
+	TRACE2(mqtt_send, message->topic, opts.token);
+	metrics_add(METRICS_ONCE(counter, "mqtt_published_total"), 1);
+	metrics_add(METRICS_ONCE(gauge, "mqtt_inflight"), 1);
+	metrics_observe(METRICS_ONCE(histogram, "mqtt_queue_to_send_seconds"), sent - message->queued);
+	if (opts.token != 0) {
+	    pthread_mutex_lock(&traceLock);
+	    trace = &traces[opts.token % MQTT_MAXTRACE];
+	    trace->token = opts.token;
+	    trace->sampled = message->sensor[0] != 0 ? message->sampled : 0;
+	    trace->sent = sent;
+	    pthread_mutex_unlock(&traceLock);
+	}
+	if (message->sensor[0] != 0 && !__atomic_exchange_n(&firstReading, 1, __ATOMIC_RELAXED)) {
+	    reportFirstReading(c);
+	}
 
-    } else {
+    } else if (binary != NULL) {
+	metrics_add(METRICS_ONCE(counter, "mqtt_binary_dropped_total"), 1);
+	return (MQTT_FAILURE);
+    } else if (!holdPending(c, message)) {
 	
 	mqttSave(c, *message);
     }
     return (MQTT_SUCCESS);
 }
 
+/**
+ * 
+ * @param mqttClient
+ * @param payload
+ * @param topic
+ * @return 
+ */
+int
+mqttPublish(void *context, mqtt_data_t *message) {
+    my_context_t *c = (my_context_t *) context;
+
+    message->queued = metrics_now();
+    TRACE3(mqtt_publish, message->topic, message->sensor, c->connected);
+    if (message->sensor[0] != 0 && message->sampled != 0) {
+	metrics_observe(METRICS_ONCE(histogram, "mqtt_sample_to_queue_seconds"),
+		(mqttTimeUs() - message->sampled) / 1e6);
+    }
+    return sendMessage(c, message, NULL, 0);
+}
+
+int
+mqttPublishBinary(void *context, mqtt_data_t *message, const void *payload, int len) {
+    my_context_t *c = (my_context_t *) context;
+
+    message->queued = metrics_now();
+    TRACE3(mqtt_publish, message->topic, message->sensor, c->connected);
+    return sendMessage(c, message, payload, len);
+}
+
+int64_t
+mqttTimeUs(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
 int
 MQTT_init(void* context) {
-    char buf[512];
     int rc;
 
     my_context_t *c = (my_context_t *) context;
@@ -324,14 +658,12 @@ MQTT_init(void* context) {
     MQTTAsync_willOptions lwt_opts = MQTTAsync_willOptions_initializer;
 
     rc = MQTT_SUCCESS;
-    snprintf(buf, sizeof (buf), "MQTT_init - create MQTT Client at %s uid %s password: %s",
+    DBGLOG(DBG_MQTT, DBG_INFO, "MQTT_init - create MQTT Client at %s uid %s password: %s",
 	    c->broker->mqtthostaddr, c->broker->mqttuid, c->broker->mqttpasswd);
-    WriteDBGLog(buf);
     if (MQTTAsync_create(c->client, c->broker->mqtthostaddr, c->broker->mqttclientid,
 	    MQTTCLIENT_PERSISTENCE_NONE, NULL) != MQTTASYNC_SUCCESS) {
-	snprintf(buf, sizeof (buf), "Could not create MQTT Client at %s uid %s password: %s",
+	DBGLOG(DBG_MQTT, DBG_ERROR, "Could not create MQTT Client at %s uid %s password: %s",
 		c->broker->mqtthostaddr, c->broker->mqttuid, c->broker->mqttpasswd);
-	WriteDBGLog(buf);
 	c->connected = 0;
 	rc = MQTT_FAILURE;
     } else {
@@ -355,13 +687,10 @@ MQTT_init(void* context) {
 	
 	if (c->broker->mqttpasswd != 0) conn_opts.password = c->broker->mqttpasswd;
 	if (c->broker->mqttuid != 0) conn_opts.username = c->broker->mqttuid;
-	snprintf(buf, sizeof (buf), "MQTT_init - Attempting to connect to %s %s", conn_opts.username, conn_opts.password);
-	WriteDBGLog(buf);
+	DBGLOG(DBG_MQTT, DBG_INFO, "MQTT_init - Attempting to connect to %s %s", conn_opts.username, conn_opts.password);
 	if ((rc = (MQTTAsync_connect(*c->client, &conn_opts))) != MQTTASYNC_SUCCESS) {
-	    snprintf(buf, sizeof (buf),
-		    "Failed to start connect user: %s, password: %s return code %d",
+	    DBGLOG(DBG_MQTT, DBG_ERROR, "Failed to start connect user: %s, password: %s return code %d",
 		    conn_opts.username, conn_opts.password, rc);
-	    WriteDBGLog(buf);
 	    exit(MQTT_FAILURE);
 	}
 	rc = MQTT_SUCCESS;
@@ -15,10 +15,14 @@
 #define MQTT_H
 
 #include <MQTTAsync.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
 
 #define MAXPORTS 32
 #define MQTT_MAXPAYLOAD 512
 #define MQTT_MAXTOPIC 512
+#define MQTT_MAXREADS 8
 
 #ifndef MQTT_SUCCESS
 #define MQTT_SUCCESS 0
@@ -28,6 +32,14 @@
 #define MQTT_FAILURE -1
 #endif
 
+#ifndef MQTT_MAXPENDING
+#define MQTT_MAXPENDING 64 ///< messages held in memory until the first connection
+#endif
+
+#ifndef MQTT_MAXTRACE
+#define MQTT_MAXTRACE 128 ///< publishes awaiting PUBACK whose latency is traced
+#endif
+
 #ifndef MQTT_DUMP_FILE
 #define MQTT_DUMP_FILE "/var/tmp/pi2mqtt/dump"
 #endif
@@ -44,6 +56,12 @@ extern "C" {
 	char* mqttmanagementtopic; ///< subscription topic for management
     } mqtt_broker_t;
 
+    typedef struct {
+        char pattern[64]; ///< glob of sensor ids to read
+        char correlation[64]; ///< correlation id echoed on the response topic
+        struct timespec received; ///< monotonic time the request arrived
+    } mqtt_read_request_t;
+
     typedef struct {
         int killed; ///< flag to kill loop
 	int reboot; ///< flag to reboot system program
@@ -52,13 +70,25 @@ extern "C" {
         MQTTAsync* client; ///< the current client.
         mqtt_broker_t* broker; ///< the current broker information.
 	char *configFile; ///< configuration file use at boot
+	pthread_mutex_t lock; ///< protects the read request queue
+	pthread_cond_t wake; ///< signalled when a request is queued
+	int nreads; ///< number of queued read requests
+	mqtt_read_request_t reads[MQTT_MAXREADS]; ///< queued targeted read requests
+	char *update; ///< configuration received by /update and not yet applied
+	struct timespec updated; ///< monotonic time the update arrived
+	int nudged; ///< set by mqttWake to end the current mqttWait early
+	struct timespec started; ///< monotonic time the program started
     } my_context_t;
     
-#define my_context_t_initializer { 0, 0, 0, 0, NULL, NULL, NULL }
+#define my_context_t_initializer { 0, 0, 0, 0, NULL, NULL, NULL, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0 }
     
     typedef struct {
         char payload[MQTT_MAXPAYLOAD];  ///< payload for publishing
         char topic[MQTT_MAXTOPIC]; ///< mqtt publishing topic
+        char sensor[64]; ///< id of the sensor that produced the reading, empty otherwise
+        double value; ///< numeric value of the reading for local consumers
+        int64_t sampled; ///< wall clock microseconds of the hardware read, used only when sensor is set
+        double queued; ///< monotonic seconds mqttPublish took the message, set by mqttPublish
     } mqtt_data_t;
 
     /**
@@ -70,11 +100,67 @@ extern "C" {
     
     /**
      * This routine has the MQTT client pointed to in context publish a message
+     *
+     * Messages published before the first connection are held in memory and
+     * sent once connected, later ones are saved to the dump file while
+     * disconnected.
+     *
+     * Sensor readings are traced from the hardware read to the PUBACK in the
+     * mqtt_sample_to_queue, mqtt_queue_to_send, mqtt_send_to_puback and
+     * mqtt_sample_to_puback latency histograms.
      * @param context MQTT context used that contains the client for this session
      * @param message to publish
      * @return 
      */
     extern int mqttPublish(void* context, mqtt_data_t* message);
+
+    /**
+     * Publish a binary payload, as mqttPublish does a text one.  The payload
+     * is copied before the call returns.  While disconnected it is dropped
+     * rather than held or saved to the dump file.
+     * @param context MQTT context
+     * @param message topic, sensor and sample time, its payload is unused
+     * @param payload bytes to publish
+     * @param len number of bytes
+     * @return MQTT_SUCCESS, MQTT_FAILURE if the payload was not sent
+     */
+    extern int mqttPublishBinary(void* context, mqtt_data_t* message, const void* payload, int len);
+
+    /**
+     * Take the oldest targeted read request queued by the management topic.
+     * @param context MQTT context
+     * @param request receives the request
+     * @return 1 if a request was taken, 0 if the queue is empty
+     */
+    extern int mqttTakeReadRequest(void* context, mqtt_read_request_t* request);
+
+    /**
+     * Take the configuration received by the last /update, if any.
+     * @param context MQTT context
+     * @param received receives the monotonic time the update arrived
+     * @return configuration text to be freed by the caller, or NULL
+     */
+    extern char* mqttTakeUpdate(void* context, struct timespec* received);
+
+    /**
+     * Sleep for delay, returning early if a management request is queued.
+     * @param context MQTT context
+     * @param delay time to sleep
+     */
+    extern void mqttWait(void* context, const struct timespec* delay);
+
+    /**
+     * End the current or next mqttWait early.
+     * @param context MQTT context
+     */
+    extern void mqttWake(void* context);
+    /**
+     * Wall clock time in microseconds, for stamping readings at the hardware
+     * read.
+     * @return microseconds since the epoch
+     */
+    extern int64_t mqttTimeUs(void);
+
     extern int MQTT_init(void* context);
 
 #ifdef __cplusplus
@@ -32,25 +32,28 @@
 #include <time.h>
 #include <fcntl.h>
 #include "raven.h"
+#include "capture.h"
 #include "debug.h"
+#include "metrics.h"
 #include "mqtt.h"
+#include "trace.h"
 
 static char xmlBuf[10 * 1024];
 
 int
 RAVEn_sendCmd(raven_t rvn, char const *cmd) {
     int len;
-    char buf[256];
     char cmdbuffer[1024];
     int cmdlen;
 
     if (strlen(cmd) > sizeof (cmdbuffer))
         return (RAVEN_FAIL);
+    if (capture_replaying())
+        return (RAVEN_PASS);
     cmdlen = snprintf(cmdbuffer, sizeof (cmdbuffer), "<Command>\r\n  <Name>%s</Name>\r\n</Command>\r\n", cmd);
     len = write(rvn.FD, cmdbuffer, cmdlen);
     if (len != cmdlen) {
-        snprintf(buf, sizeof (buf), "RAVEn: Error writing Command to RAVEn port, length %d != %d", len, cmdlen);
-        WriteDBGLog(buf);
+        DBGLOG(DBG_RAVEN, DBG_ERROR, "RAVEn: Error writing Command to RAVEn port, length %d != %d", len, cmdlen);
         return ( RAVEN_FAIL);
     }
     return ( RAVEN_PASS);
@@ -63,6 +66,9 @@ RAVEn_create(const char *path, const char *id, const char *topic, const char *lo
     strncpy(raven.id, id, sizeof (raven.id));
     strncpy(raven.topic, topic, sizeof (raven.topic));
     strncpy(raven.location, location, sizeof (raven.location));
+    raven.parseSeconds = metrics_histogram("raven_parse_seconds", id);
+    raven.messages = metrics_counter("raven_messages_total", id);
+    raven.overflows = metrics_counter("raven_overflows_total", id);
     return raven;
 }
 
@@ -70,43 +76,68 @@ int
 RAVEn_openPort(raven_t *rvn) {
     char buf[128];
 
-    snprintf(buf, sizeof (buf), "RAVEn: Opening port [%s]", rvn->path);
-    WriteDBGLog(buf);
+    if (capture_replaying()) {
+        // the serial input comes from the capture file
+        rvn->FD = -1;
+        rvn->FH = NULL;
+        return (RAVEN_PASS);
+    }
+    DBGLOG(DBG_RAVEN, DBG_INFO, "RAVEn: Opening port [%s]", rvn->path);
     rvn->FD = open(rvn->path, O_RDWR);
     fcntl(rvn->FD, F_SETFL, FNDELAY); // Set to non blocking.
     if (rvn->FD == -1) // if open is unsuccessful
     {
         snprintf(buf, sizeof (buf), "RAVEn open_port: Unable to open %s. 0x%0x - %s\n", rvn->path, errno, strerror(errno));
-        WriteDBGLog(buf);
+        DBGLOG(DBG_RAVEN, DBG_ERROR, "%s", buf);
         perror(buf);
         return ( RAVEN_FAIL);
     } else {
         rvn->FH = fdopen(rvn->FD, "r");
         if (rvn->FH == NULL) {
             snprintf(buf, sizeof (buf), "RAVEn open_port: Unable to open %s. 0x%0x - %s\n", rvn->path, errno, strerror(errno));
-            WriteDBGLog(buf);
+            DBGLOG(DBG_RAVEN, DBG_ERROR, "%s", buf);
             perror(buf);
             return ( RAVEN_FAIL);
         }
-        WriteDBGLog("RAVEn: Port is open, both File Descriptor and File Handle");
+        DBGLOG(DBG_RAVEN, DBG_INFO, "RAVEn: Port is open, both File Descriptor and File Handle");
     }
     return (RAVEN_PASS);
 } //open_port
 
 void
 RAVEn_closePort(raven_t rvn) {
-    WriteDBGLog("RAVEn: Closing Port");
-    fclose(rvn.FH);
-    close(rvn.FD);
+    DBGLOG(DBG_RAVEN, DBG_INFO, "RAVEn: Closing Port");
+    if (rvn.FH != NULL) {
+        fclose(rvn.FH);
+        close(rvn.FD);
+    }
 }
 
 /**
- * 
- * @param buffer
- * @param data_ptr
- * @return RAVEN_PASS if there was a match and data is good, RAVEN_FAIL otherwise.
+ * Read the next chunk of the serial port, up to a newline
+ * @param rvn - port
+ * @param buf - receives the text
+ * @param size - size of buf
+ * @return 1 if something was read, 0 if nothing is waiting
  */
 static int
+readSerial(const raven_t *rvn, char *buf, size_t size) {
+    size_t len;
+
+    if (capture_replaying()) {
+        // non blocking, like the port itself
+        if (capture_next(CAPTURE_SERIAL, rvn->id, buf, size - 1, &len, 0) != CAPTURE_SUCCESS)
+            return 0;
+        buf[len] = 0;
+        return 1;
+    }
+    if (fgets(buf, size, rvn->FH) == NULL)
+        return 0;
+    capture_record(CAPTURE_SERIAL, rvn->id, buf, strlen(buf));
+    return 1;
+}
+
+int
 RAVEn_parseXML(char buffer[], raven_data_t *data_ptr) {
     char* p;
     int demand;
@@ -114,7 +145,6 @@ RAVEn_parseXML(char buffer[], raven_data_t *data_ptr) {
     uint multiplier;
     uint divisor;
     uint timestamp;
-    char buf[128];
 
     p = strtok(buffer, "<>\n");
     if (strcmp(p, "InstantaneousDemand") == 0) {
@@ -138,8 +168,7 @@ RAVEn_parseXML(char buffer[], raven_data_t *data_ptr) {
         }
         demand = demand_u;
         if (demand >= 2^23) demand = demand - 2^24;
-        snprintf(buf, sizeof (buf), "demandu 0x%x demand %d, multiplier %d, divisor %d", demand_u, demand, multiplier, divisor);
-        WriteDBGLog(buf);
+        DBGLOG(DBG_RAVEN, DBG_DEBUG, "demandu 0x%x demand %d, multiplier %d, divisor %d", demand_u, demand, multiplier, divisor);
         data_ptr->demand = (double) demand * (double) multiplier / (double) divisor;
         return RAVEN_PASS;
     } else {
@@ -154,17 +183,19 @@ ProcessRAVEnData(raven_t rvn, mqtt_data_t *message) {
     char readBuf[32];
 
     int xmlBufLen;
+    int64_t sampled;
     raven_data_t rvnData;
 
     retval = RAVEN_FAIL;
     xmlBufLen = 0;
     memset(readBuf, 0, sizeof ( readBuf));
-    while (fgets(readBuf, sizeof (readBuf), rvn.FH) > 0) {
+    while (readSerial(&rvn, readBuf, sizeof (readBuf))) {
         rblen = strlen(readBuf);
         /* If Current buffer size + new Buffer being added is over the total buffer size BAD overflow */
         if ((xmlBufLen + rblen) > 10 * 1024) {
-            WriteDBGLog("RAVEn: Error BUFFER OVERFLOW");
-            WriteDBGLog(xmlBuf);
+            DBGLOG(DBG_RAVEN, DBG_ERROR, "RAVEn: Error BUFFER OVERFLOW");
+            metrics_add(rvn.overflows, 1);
+            DBGLOG(DBG_RAVEN, DBG_DEBUG, "%s", xmlBuf);
             break;
         } else {
             strncat(xmlBuf, readBuf, sizeof (xmlBuf));
@@ -173,11 +204,24 @@ ProcessRAVEnData(raven_t rvn, mqtt_data_t *message) {
             /* Since I'm not really parsing XML, I am assuming the Rainforest dongle is spitting out its specific XML */
             /* They always add two space for XML inbetween the start and stop So the closing XML will always be </    */
             if (strncmp(readBuf, "</", 2) == 0) {
-                WriteDBGLog("Starting to PROCESS RAVEn input");
-                //                WriteDBGLog(xmlBuf);
-                if (RAVEn_parseXML(xmlBuf, &rvnData) == RAVEN_PASS) {
-                    snprintf(message->payload, sizeof (message->payload), "{\"timestamp\":%u,\"value\":%.3f}", time(NULL), rvnData.demand);
+                sampled = mqttTimeUs();
+                rvnData.timestamp = 0;
+                DBGLOG(DBG_RAVEN, DBG_DEBUG, "Starting to PROCESS RAVEn input");
+                //                DBGLOG(DBG_RAVEN, DBG_DEBUG, "%s", xmlBuf);
+                double start = metrics_now();
+                TRACE2(raven_parse_start, rvn.id, xmlBufLen);
+                int parsed = RAVEn_parseXML(xmlBuf, &rvnData);
+                TRACE2(raven_parse_end, rvn.id, parsed);
+                metrics_observe(rvn.parseSeconds, metrics_now() - start);
+                metrics_add(rvn.messages, 1);
+                if (parsed == RAVEN_PASS) {
+                    // meter_timestamp is the meter's own clock, 0 if it sent none
+                    snprintf(message->payload, sizeof (message->payload), "{\"timestamp\":%ld,\"timestamp_us\":%lld,\"meter_timestamp\":%u,\"value\":%.3f}",
+                            (long) (sampled / 1000000), (long long) sampled, rvnData.timestamp, rvnData.demand);
+                    message->sampled = sampled;
                     snprintf(message->topic, sizeof (message->topic), "%s/%s/%s", rvn.id, rvn.location, rvn.topic);
+                    strncpy(message->sensor, rvn.id, sizeof (message->sensor));
+                    message->value = rvnData.demand;
                     retval = RAVEN_PASS;
                     break;
                 }
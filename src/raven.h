@@ -22,6 +22,7 @@
 #define RAVEN_FAIL -1
 #endif
 
+#include "metrics.h"
 #include "mqtt.h"
 
 #ifdef __cplusplus
@@ -35,6 +36,9 @@ extern "C" {
         char id[64]; // id of device
         char location[64]; ///< value of location for topic.  prefer non spaces
         char topic[64]; ///< final layer of topic of data sent. 
+        metric_t *parseSeconds; ///< metrics labelled with id, resolved when the port is created
+        metric_t *messages;
+        metric_t *overflows;
     } raven_t;
 
     typedef struct {
@@ -76,6 +80,14 @@ extern "C" {
      */
     extern void RAVEn_closePort(raven_t rvn);
 
+    /**
+     * Parse one XML fragment from the RAVEn.
+     * @param buffer - fragment, modified by the parse
+     * @param data_ptr - receives the demand and meter timestamp
+     * @return RAVEN_PASS if it was an InstantaneousDemand, RAVEN_FAIL otherwise.
+     */
+    extern int RAVEn_parseXML(char buffer[], raven_data_t *data_ptr);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,516 @@
+/*
+ * The MIT License
+ *
+ * Copyright 2017 Nick Ong <onichola@gmail.com>.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <math.h>
+
+#include "debug.h"
+#include "mqtt.h"
+#include "rules.h"
+
+#define RULES_STACK 16
+#define TRUTH(x) ((x) != 0 && !isnan(x))
+
+enum {
+    OP_LOAD, ///< push latest value of source arg
+    OP_CONST, ///< push constant k
+    OP_LT,
+    OP_LE,
+    OP_GT,
+    OP_GE,
+    OP_EQ,
+    OP_NE,
+    OP_AND,
+    OP_OR,
+    OP_NOT
+};
+
+typedef struct {
+    uint8_t op; ///< opcode
+    uint8_t arg; ///< source slot for OP_LOAD
+    double k; ///< constant for OP_CONST
+} rule_insn_t;
+
+typedef struct {
+    char id[64]; ///< id of rule
+    char location[64]; ///< location of this rule
+    char topic[64]; ///< topic suffix used for publishing
+    char expr[128]; ///< source expression, echoed in the alarm
+    rule_insn_t code[RULES_MAXCODE]; ///< compiled expression
+    int ncode; ///< number of instructions
+    int depth; ///< stack depth needed by code
+    long hold; ///< seconds condition must hold before alarming
+    int active; ///< condition is currently true
+    int fired; ///< alarm has been published
+    time_t since; ///< time condition became true
+} rule_t;
+
+typedef struct {
+    char name[64]; ///< sensor id as found in mqtt_data_t.sensor
+    double value; ///< latest value, NAN until a reading has been seen
+    uint64_t rules; ///< bit mask of rules referencing this source
+} rule_source_t;
+
+typedef struct {
+    const char *p; ///< current position in expression
+    rule_t *rule; ///< rule being compiled
+    int sp; ///< simulated stack depth
+    int err; ///< set on first error
+    int dry; ///< check syntax only, do not register sources
+} rule_parser_t;
+
+static rule_t rules[RULES_MAXRULES];
+static int nrules = 0;
+static rule_source_t sources[RULES_MAXSOURCES];
+static int nsources = 0;
+
+// tables before the last rules_clear, so a reload keeps alarm state
+static rule_t prevrules[RULES_MAXRULES];
+static int nprevrules = 0;
+static rule_source_t prevsources[RULES_MAXSOURCES];
+static int nprevsources = 0;
+
+static int
+source_find(const char *name) {
+    int i;
+    for (i = 0; i < nsources; i++) {
+        if (strcmp(sources[i].name, name) == 0) return i;
+    }
+    return -1;
+}
+
+static int
+source_register(const char *name) {
+    int i = source_find(name);
+    int j;
+    if (i >= 0) return i;
+    if (nsources >= RULES_MAXSOURCES) return -1;
+    i = nsources++;
+    strncpy(sources[i].name, name, sizeof (sources[i].name) - 1);
+    sources[i].name[sizeof (sources[i].name) - 1] = 0;
+    sources[i].value = NAN;
+    sources[i].rules = 0;
+    for (j = 0; j < nprevsources; j++) {
+        if (strcmp(prevsources[j].name, name) == 0) {
+            sources[i].value = prevsources[j].value;
+            break;
+        }
+    }
+    return i;
+}
+
+static void
+skip_ws(rule_parser_t *ps) {
+    while (isspace((unsigned char) *ps->p)) ps->p++;
+}
+
+/**
+ * Match a keyword or punctuation at the current position.
+ * Alphabetic keywords must not run into an identifier.
+ */
+static int
+accept(rule_parser_t *ps, const char *tok) {
+    size_t n = strlen(tok);
+    skip_ws(ps);
+    if (strncmp(ps->p, tok, n) != 0) return 0;
+    if (isalpha((unsigned char) tok[0]) && ps->p[n] != 0 &&
+            (isalnum((unsigned char) ps->p[n]) || strchr("_-/.", ps->p[n]) != NULL))
+        return 0;
+    ps->p += n;
+    return 1;
+}
+
+static void
+emit(rule_parser_t *ps, int op, int arg, double k) {
+    rule_t *r = ps->rule;
+    if (ps->err) return;
+    if (r->ncode >= RULES_MAXCODE) {
+        ps->err = 1;
+        return;
+    }
+    r->code[r->ncode].op = op;
+    r->code[r->ncode].arg = arg;
+    r->code[r->ncode].k = k;
+    r->ncode++;
+    if (op == OP_LOAD || op == OP_CONST) {
+        if (++ps->sp > r->depth) r->depth = ps->sp;
+    } else if (op != OP_NOT) {
+        ps->sp--;
+    }
+}
+
+static void parse_or(rule_parser_t *ps);
+
+static void
+parse_operand(rule_parser_t *ps) {
+    char name[64];
+    size_t n = 0;
+    char *end;
+    double k;
+    int slot;
+
+    skip_ws(ps);
+    if (accept(ps, "opened") || accept(ps, "on")) {
+        emit(ps, OP_CONST, 0, 1.0);
+        return;
+    }
+    if (accept(ps, "closed") || accept(ps, "off")) {
+        emit(ps, OP_CONST, 0, 0.0);
+        return;
+    }
+    if (isdigit((unsigned char) ps->p[0]) || ps->p[0] == '.' ||
+            ((ps->p[0] == '-' || ps->p[0] == '+') &&
+            (isdigit((unsigned char) ps->p[1]) || ps->p[1] == '.'))) {
+        k = strtod(ps->p, &end);
+        if (end == ps->p) {
+            ps->err = 1;
+            return;
+        }
+        ps->p = end;
+        emit(ps, OP_CONST, 0, k);
+        return;
+    }
+    if (*ps->p == '\'' || *ps->p == '"') {
+        char q = *ps->p++;
+        while (*ps->p && *ps->p != q && n < sizeof (name) - 1) name[n++] = *ps->p++;
+        if (*ps->p != q) {
+            ps->err = 1;
+            return;
+        }
+        ps->p++;
+    } else if (isalpha((unsigned char) *ps->p) || *ps->p == '_') {
+        while ((isalnum((unsigned char) *ps->p) || strchr("_-/.", *ps->p) != NULL)
+                && *ps->p && n < sizeof (name) - 1)
+            name[n++] = *ps->p++;
+    } else {
+        ps->err = 1;
+        return;
+    }
+    name[n] = 0;
+    if (ps->dry) {
+        emit(ps, OP_LOAD, 0, 0.0);
+        return;
+    }
+    if ((slot = source_register(name)) < 0) {
+        ps->err = 1;
+        return;
+    }
+    sources[slot].rules |= (uint64_t) 1 << (ps->rule - rules);
+    emit(ps, OP_LOAD, slot, 0.0);
+}
+
+static void
+parse_unary(rule_parser_t *ps) {
+    if (ps->err) return;
+    if (accept(ps, "!") || accept(ps, "not")) {
+        parse_unary(ps);
+        emit(ps, OP_NOT, 0, 0.0);
+        return;
+    }
+    if (accept(ps, "(")) {
+        parse_or(ps);
+        if (!accept(ps, ")")) ps->err = 1;
+        return;
+    }
+    parse_operand(ps);
+    if (accept(ps, "<=")) {
+        parse_operand(ps);
+        emit(ps, OP_LE, 0, 0.0);
+    } else if (accept(ps, ">=")) {
+        parse_operand(ps);
+        emit(ps, OP_GE, 0, 0.0);
+    } else if (accept(ps, "==")) {
+        parse_operand(ps);
+        emit(ps, OP_EQ, 0, 0.0);
+    } else if (accept(ps, "!=")) {
+        parse_operand(ps);
+        emit(ps, OP_NE, 0, 0.0);
+    } else if (accept(ps, "<")) {
+        parse_operand(ps);
+        emit(ps, OP_LT, 0, 0.0);
+    } else if (accept(ps, ">")) {
+        parse_operand(ps);
+        emit(ps, OP_GT, 0, 0.0);
+    }
+}
+
+static void
+parse_and(rule_parser_t *ps) {
+    parse_unary(ps);
+    while (!ps->err && (accept(ps, "&&") || accept(ps, "and"))) {
+        parse_unary(ps);
+        emit(ps, OP_AND, 0, 0.0);
+    }
+}
+
+static void
+parse_or(rule_parser_t *ps) {
+    parse_and(ps);
+    while (!ps->err && (accept(ps, "||") || accept(ps, "or"))) {
+        parse_and(ps);
+        emit(ps, OP_OR, 0, 0.0);
+    }
+}
+
+static void
+parse_duration(rule_parser_t *ps) {
+    char *end;
+    double d;
+
+    skip_ws(ps);
+    d = strtod(ps->p, &end);
+    if (end == ps->p || d < 0) {
+        ps->err = 1;
+        return;
+    }
+    ps->p = end;
+    switch (*ps->p) {
+        case 'd': d *= 24;
+            /* fall through */
+        case 'h': d *= 60;
+            /* fall through */
+        case 'm': d *= 60;
+            /* fall through */
+        case 's': ps->p++;
+            break;
+        default:
+            break;
+    }
+    ps->rule->hold = (long) d;
+}
+
+/**
+ * Run the compiled expression against the latest readings.
+ * @return non zero if the condition holds.  A sensor that has not reported
+ * yet reads as NAN, so any comparison against it is false.
+ */
+static int
+rule_eval(const rule_t *r) {
+    double stack[RULES_STACK];
+    const rule_insn_t *pc = r->code;
+    const rule_insn_t *end = r->code + r->ncode;
+    int sp = 0;
+
+    for (; pc < end; pc++) {
+        switch (pc->op) {
+            case OP_LOAD:
+                stack[sp++] = sources[pc->arg].value;
+                break;
+            case OP_CONST:
+                stack[sp++] = pc->k;
+                break;
+            case OP_LT: sp--;
+                stack[sp - 1] = stack[sp - 1] < stack[sp];
+                break;
+            case OP_LE: sp--;
+                stack[sp - 1] = stack[sp - 1] <= stack[sp];
+                break;
+            case OP_GT: sp--;
+                stack[sp - 1] = stack[sp - 1] > stack[sp];
+                break;
+            case OP_GE: sp--;
+                stack[sp - 1] = stack[sp - 1] >= stack[sp];
+                break;
+            case OP_EQ: sp--;
+                stack[sp - 1] = stack[sp - 1] == stack[sp];
+                break;
+            case OP_NE: sp--;
+                stack[sp - 1] = !isnan(stack[sp - 1]) && !isnan(stack[sp]) &&
+                        stack[sp - 1] != stack[sp];
+                break;
+            case OP_AND: sp--;
+                stack[sp - 1] = TRUTH(stack[sp - 1]) && TRUTH(stack[sp]);
+                break;
+            case OP_OR: sp--;
+                stack[sp - 1] = TRUTH(stack[sp - 1]) || TRUTH(stack[sp]);
+                break;
+            case OP_NOT:
+                stack[sp - 1] = !TRUTH(stack[sp - 1]);
+                break;
+        }
+    }
+    return sp > 0 && TRUTH(stack[sp - 1]);
+}
+
+static void
+rule_message(const rule_t *r, const char *state, time_t now, mqtt_data_t *message) {
+    snprintf(message->payload, sizeof (message->payload),
+            "{\"timestamp\":%ld,\"state\":\"%s\",\"rule\":\"%s\"}",
+            (long) now, state, r->expr);
+    snprintf(message->topic, sizeof (message->topic), "%s/%s/%s",
+            r->id, r->location, r->topic);
+    message->sensor[0] = 0;
+}
+
+/**
+ * Advance the alarm state machine of a rule.
+ * @return 1 if a message was written, 0 otherwise.
+ */
+static int
+rule_step(rule_t *r, int cond, time_t now, mqtt_data_t *message) {
+    if (cond && !r->active) {
+        r->active = 1;
+        r->since = now;
+    } else if (!cond && r->active) {
+        r->active = 0;
+        if (r->fired) {
+            r->fired = 0;
+            rule_message(r, "cleared", now, message);
+            return 1;
+        }
+    }
+    if (r->active && !r->fired && now - r->since >= r->hold) {
+        r->fired = 1;
+        rule_message(r, "alarm", now, message);
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Compile expr into r.
+ * @return the unparsed remainder of expr on error, NULL on success
+ */
+static const char *
+rule_compile(rule_t *r, const char *expr, int dry) {
+    rule_parser_t ps;
+
+    ps.p = expr;
+    ps.rule = r;
+    ps.sp = 0;
+    ps.err = 0;
+    ps.dry = dry;
+    parse_or(&ps);
+    if (!ps.err && accept(&ps, "for")) parse_duration(&ps);
+    skip_ws(&ps);
+    if (ps.err || *ps.p != 0 || ps.sp != 1 || r->depth > RULES_STACK) {
+        return ps.p;
+    }
+    return NULL;
+}
+
+int
+rules_check(const char *expr) {
+    rule_t r;
+
+    memset(&r, 0, sizeof (r));
+    return rule_compile(&r, expr, 1) == NULL ? RULES_SUCCESS : RULES_FAILURE;
+}
+
+int
+rules_add(const char *id, const char *expr, const char *topic, const char *location) {
+    const char *err;
+    rule_t *r;
+    int registered = nsources;
+    int i;
+
+    if (nrules >= RULES_MAXRULES) {
+        DBGLOG(DBG_RULES, DBG_ERROR, "rules: Error too many rules");
+        return (RULES_FAILURE);
+    }
+    r = &rules[nrules];
+    memset(r, 0, sizeof (*r));
+    strncpy(r->id, id, sizeof (r->id) - 1);
+    strncpy(r->expr, expr, sizeof (r->expr) - 1);
+    strncpy(r->topic, topic, sizeof (r->topic) - 1);
+    strncpy(r->location, location, sizeof (r->location) - 1);
+
+    if ((err = rule_compile(r, expr, 0)) != NULL) {
+        DBGLOG(DBG_RULES, DBG_ERROR, "rules: Error compiling rule %s at \"%s\"", id, err);
+        // the sources only this rule registered are given back
+        nsources = registered;
+        for (i = 0; i < nsources; i++) sources[i].rules &= ~((uint64_t) 1 << nrules);
+        return (RULES_FAILURE);
+    }
+    for (i = 0; i < nprevrules; i++) {
+        if (strcmp(prevrules[i].id, r->id) == 0 && strcmp(prevrules[i].expr, r->expr) == 0) {
+            r->active = prevrules[i].active;
+            r->fired = prevrules[i].fired;
+            r->since = prevrules[i].since;
+            break;
+        }
+    }
+    DBGLOG(DBG_RULES, DBG_INFO, "rules: Compiled rule %s \"%s\" to %d instructions, hold %lds",
+            id, expr, r->ncode, r->hold);
+    nrules++;
+    return (RULES_SUCCESS);
+}
+
+void
+rules_clear() {
+    memcpy(prevrules, rules, nrules * sizeof (rules[0]));
+    nprevrules = nrules;
+    memcpy(prevsources, sources, nsources * sizeof (sources[0]));
+    nprevsources = nsources;
+    nrules = 0;
+    nsources = 0;
+}
+
+void
+rules_revert() {
+    memcpy(rules, prevrules, nprevrules * sizeof (rules[0]));
+    nrules = nprevrules;
+    memcpy(sources, prevsources, nprevsources * sizeof (sources[0]));
+    nsources = nprevsources;
+}
+
+int
+rules_update(const mqtt_data_t *reading, mqtt_data_t *alarms, int maxalarms) {
+    mqtt_data_t spare;
+    uint64_t mask;
+    time_t now;
+    int n = 0;
+    int i;
+
+    if (reading->sensor[0] == 0 || (i = source_find(reading->sensor)) < 0)
+        return 0;
+    sources[i].value = reading->value;
+    now = time(NULL);
+    // every rule is stepped so its state follows the reading, even once
+    // alarms no longer has room for its message
+    for (mask = sources[i].rules; mask != 0; mask &= mask - 1) {
+        rule_t *r = &rules[__builtin_ctzll(mask)];
+        if (!rule_step(r, rule_eval(r), now, n < maxalarms ? &alarms[n] : &spare)) continue;
+        if (n < maxalarms) n++;
+        else DBGLOG(DBG_RULES, DBG_WARN, "rules: No room for a message of rule %s, dropped %s", r->id, spare.payload);
+    }
+    return n;
+}
+
+int
+rules_tick(time_t now, mqtt_data_t *alarms, int maxalarms) {
+    int n = 0;
+    int i;
+
+    for (i = 0; i < nrules && n < maxalarms; i++) {
+        if (rules[i].active && !rules[i].fired)
+            n += rule_step(&rules[i], 1, now, &alarms[n]);
+    }
+    return n;
+}
@@ -0,0 +1,139 @@
+/*
+ * The MIT License
+ *
+ * Copyright 2017 Nick Ong <onichola@gmail.com>.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * File:   rules.h
+ * Author: Nick Ong <onichola@gmail.com>
+ *
+ * Local rules engine.  Rules are expressions over the latest reading of each
+ * sensor, such as "freezer1 > -10 for 5m" or "door1 == opened for 10m".  They
+ * are compiled to a small stack bytecode when the configuration is loaded and
+ * evaluated on every new reading without allocating.
+ */
+
+#ifndef RULES_H
+#define RULES_H
+
+#ifndef RULES_SUCCESS
+#define RULES_SUCCESS 0  ///< success indicator
+#endif
+
+#ifndef RULES_FAILURE
+#define RULES_FAILURE -1  ///< failure indicator
+#endif
+
+#ifndef RULES_MAXRULES
+#define RULES_MAXRULES 64 ///< maximum number of rules
+#endif
+
+#ifndef RULES_MAXSOURCES
+#define RULES_MAXSOURCES 128 ///< maximum number of distinct sensors referenced
+#endif
+
+#ifndef RULES_MAXCODE
+#define RULES_MAXCODE 32 ///< maximum number of instructions in a rule
+#endif
+
+#include <time.h>
+#include "mqtt.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    /**
+     * \brief Add a rule to the engine
+     *
+     * Compiles the expression and registers every sensor it references.
+     * Grammar:
+     *   rule    := or [ "for" duration ]
+     *   or      := and { ("||" | "or") and }
+     *   and     := unary { ("&&" | "and") unary }
+     *   unary   := ("!" | "not") unary | "(" or ")" | operand [ relop operand ]
+     *   operand := number | sensor | 'sensor' | opened | closed | on | off
+     *   relop   := < <= > >= == !=
+     *   duration := number [ s | m | h | d ]
+     *
+     * @param id - unique string identifier, used in the alarm topic
+     * @param expr - rule expression
+     * @param topic - suffix topic which alarms will publish to mqtt
+     * @param location - location for this rule
+     * @return RULES_SUCCESS if the rule compiled, RULES_FAILURE otherwise.
+     */
+    extern int rules_add(const char *id, const char *expr, const char *topic,
+            const char *location);
+
+    /**
+     * \brief Check that an expression compiles, without adding it.
+     * @param expr - rule expression
+     * @return RULES_SUCCESS if the rule compiles, RULES_FAILURE otherwise.
+     */
+    extern int rules_check(const char *expr);
+
+    /**
+     * \brief Remove every rule and every recorded reading.
+     *
+     * Rules added afterwards with the same id and expression, and sensors
+     * referenced again, carry over their alarm state and latest value.
+     */
+    extern void rules_clear();
+
+    /**
+     * \brief Put back the rules removed by the last rules_clear, with their
+     * state, dropping any added since.
+     */
+    extern void rules_revert();
+
+    /**
+     * \brief Feed a new reading to the engine.
+     *
+     * Records the reading and re-evaluates every rule that references it.
+     * Alarms raised or cleared are written to alarms, at most one per rule,
+     * and any that do not fit are logged and dropped.
+     *
+     * @param reading - reading just produced by a driver
+     * @param alarms - array to receive alarm messages
+     * @param maxalarms - size of alarms
+     * @return number of alarm messages written
+     */
+    extern int rules_update(const mqtt_data_t *reading, mqtt_data_t *alarms, int maxalarms);
+
+    /**
+     * \brief Check the hold time of rules whose condition is already true.
+     *
+     * Needed for "for" clauses on sensors that only report on change, such as
+     * door switches.
+     *
+     * @param now - current time
+     * @param alarms - array to receive alarm messages
+     * @param maxalarms - size of alarms
+     * @return number of alarm messages written
+     */
+    extern int rules_tick(time_t now, mqtt_data_t *alarms, int maxalarms);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* RULES_H */
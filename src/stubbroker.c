@@ -0,0 +1,279 @@
+/*
+ * The MIT License
+ *
+ * Copyright 2017 Nick Ong <onichola@gmail.com>.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "stubbroker.h"
+
+#define BUFSIZE 65536
+
+typedef struct {
+    int fd; ///< socket, -1 if the slot is free
+    size_t used; ///< bytes waiting in buf
+    unsigned char buf[BUFSIZE]; ///< bytes read and not yet parsed
+} client_t;
+
+static int listenFD = -1;
+static pthread_t brokerThread;
+static int stopping = 0;
+static int online = 1;
+static uint64_t received = 0;
+static uint64_t connects = 0;
+static client_t clients[STUBBROKER_MAXCLIENTS];
+
+static void
+reply(client_t *cl, const unsigned char *pkt, size_t len) {
+    size_t sent = 0;
+    ssize_t n;
+
+    while (sent < len) {
+	if ((n = write(cl->fd, pkt + sent, len - sent)) <= 0) {
+	    if (n < 0 && errno == EINTR) continue;
+	    return;
+	}
+	sent += n;
+    }
+}
+
+/**
+ * Handle one complete packet.
+ * @return 0 to keep the connection, -1 to close it
+ */
+static int
+packet(client_t *cl, unsigned char type, const unsigned char *body, size_t len) {
+    unsigned char ack[64];
+    size_t topicLen;
+    size_t i, n;
+
+    switch (type >> 4) {
+	case 1: // CONNECT
+	    ack[0] = 0x20; ack[1] = 2; ack[2] = 0; ack[3] = 0;
+	    reply(cl, ack, 4);
+	    break;
+	case 3: // PUBLISH
+	    __atomic_add_fetch(&received, 1, __ATOMIC_RELAXED);
+	    if (((type >> 1) & 3) == 0) break;
+	    if (len < 2) return -1;
+	    topicLen = (body[0] << 8) | body[1];
+	    if (len < 4 + topicLen) return -1;
+	    // PUBACK for QoS 1, PUBREC for QoS 2
+	    ack[0] = ((type >> 1) & 3) == 1 ? 0x40 : 0x50;
+	    ack[1] = 2;
+	    ack[2] = body[2 + topicLen];
+	    ack[3] = body[3 + topicLen];
+	    reply(cl, ack, 4);
+	    break;
+	case 6: // PUBREL
+	    if (len < 2) return -1;
+	    ack[0] = 0x70; ack[1] = 2; ack[2] = body[0]; ack[3] = body[1];
+	    reply(cl, ack, 4);
+	    break;
+	case 8: // SUBSCRIBE, grant QoS 1 or less to each topic
+	    if (len < 2) return -1;
+	    ack[0] = 0x90;
+	    ack[2] = body[0];
+	    ack[3] = body[1];
+	    for (i = 2, n = 0; i + 2 < len && n < sizeof (ack) - 4; n++) {
+		topicLen = (body[i] << 8) | body[i + 1];
+		i += 2 + topicLen;
+		if (i >= len) return -1;
+		ack[4 + n] = body[i] > 1 ? 1 : body[i];
+		i++;
+	    }
+	    ack[1] = 2 + n;
+	    reply(cl, ack, 4 + n);
+	    break;
+	case 10: // UNSUBSCRIBE
+	    if (len < 2) return -1;
+	    ack[0] = 0xb0; ack[1] = 2; ack[2] = body[0]; ack[3] = body[1];
+	    reply(cl, ack, 4);
+	    break;
+	case 12: // PINGREQ
+	    ack[0] = 0xd0; ack[1] = 0;
+	    reply(cl, ack, 2);
+	    break;
+	case 14: // DISCONNECT
+	    return -1;
+	default:
+	    break;
+    }
+    return 0;
+}
+
+/**
+ * Handle every complete packet in the client buffer.
+ * @return 0 to keep the connection, -1 to close it
+ */
+static int
+parse(client_t *cl) {
+    size_t pos = 0;
+    size_t len;
+    size_t hdr;
+    int shift;
+
+    for (;;) {
+	if (cl->used - pos < 2) break;
+	// remaining length, 7 bits a byte
+	len = 0;
+	shift = 0;
+	for (hdr = 1; hdr < 5; hdr++) {
+	    if (pos + hdr >= cl->used) return 0;
+	    len |= (size_t) (cl->buf[pos + hdr] & 0x7f) << shift;
+	    shift += 7;
+	    if ((cl->buf[pos + hdr] & 0x80) == 0) break;
+	}
+	if (hdr == 5 || 1 + hdr + len > sizeof (cl->buf)) return -1;
+	if (pos + 1 + hdr + len > cl->used) break;
+	if (packet(cl, cl->buf[pos], cl->buf + pos + 1 + hdr, len) != 0) return -1;
+	pos += 1 + hdr + len;
+    }
+    memmove(cl->buf, cl->buf + pos, cl->used - pos);
+    cl->used -= pos;
+    return 0;
+}
+
+static void
+closeClient(client_t *cl) {
+    close(cl->fd);
+    cl->fd = -1;
+    cl->used = 0;
+}
+
+static void *
+broker_thread(void *arg) {
+    struct pollfd pfd[STUBBROKER_MAXCLIENTS + 1];
+    client_t *slot[STUBBROKER_MAXCLIENTS + 1];
+    int nfd;
+    int fd;
+    int on = 1;
+    ssize_t n;
+    int i;
+
+    while (!__atomic_load_n(&stopping, __ATOMIC_RELAXED)) {
+	pfd[0].fd = listenFD;
+	pfd[0].events = POLLIN;
+	nfd = 1;
+	for (i = 0; i < STUBBROKER_MAXCLIENTS; i++) {
+	    if (clients[i].fd < 0) continue;
+	    if (!__atomic_load_n(&online, __ATOMIC_RELAXED)) {
+		closeClient(&clients[i]);
+		continue;
+	    }
+	    pfd[nfd].fd = clients[i].fd;
+	    pfd[nfd].events = POLLIN;
+	    slot[nfd++] = &clients[i];
+	}
+	if (poll(pfd, nfd, 100) <= 0) continue;
+	if (pfd[0].revents & POLLIN) {
+	    if ((fd = accept(listenFD, NULL, NULL)) >= 0) {
+		for (i = 0; i < STUBBROKER_MAXCLIENTS && clients[i].fd >= 0; i++)
+		    ;
+		if (i == STUBBROKER_MAXCLIENTS || !__atomic_load_n(&online, __ATOMIC_RELAXED)) {
+		    close(fd);
+		} else {
+		    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof (on));
+		    clients[i].fd = fd;
+		    clients[i].used = 0;
+		    __atomic_add_fetch(&connects, 1, __ATOMIC_RELAXED);
+		}
+	    }
+	}
+	for (i = 1; i < nfd; i++) {
+	    client_t *cl = slot[i];
+	    if ((pfd[i].revents & (POLLIN | POLLHUP | POLLERR)) == 0) continue;
+	    n = read(cl->fd, cl->buf + cl->used, sizeof (cl->buf) - cl->used);
+	    if (n <= 0) {
+		closeClient(cl);
+		continue;
+	    }
+	    cl->used += n;
+	    if (parse(cl) != 0) closeClient(cl);
+	}
+    }
+    return NULL;
+}
+
+int
+stubbroker_start(int *port) {
+    struct sockaddr_in sin;
+    socklen_t len = sizeof (sin);
+    int i;
+
+    for (i = 0; i < STUBBROKER_MAXCLIENTS; i++) clients[i].fd = -1;
+    memset(&sin, 0, sizeof (sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if ((listenFD = socket(AF_INET, SOCK_STREAM, 0)) < 0) return STUBBROKER_FAILURE;
+    if (bind(listenFD, (struct sockaddr *) &sin, sizeof (sin)) != 0 || listen(listenFD, 8) != 0 ||
+	    getsockname(listenFD, (struct sockaddr *) &sin, &len) != 0) {
+	close(listenFD);
+	return STUBBROKER_FAILURE;
+    }
+    *port = ntohs(sin.sin_port);
+    stopping = 0;
+    if (pthread_create(&brokerThread, NULL, broker_thread, NULL) != 0) {
+	close(listenFD);
+	return STUBBROKER_FAILURE;
+    }
+    return STUBBROKER_SUCCESS;
+}
+
+void
+stubbroker_online(int on) {
+    __atomic_store_n(&online, on, __ATOMIC_RELAXED);
+}
+
+uint64_t
+stubbroker_received(void) {
+    return __atomic_load_n(&received, __ATOMIC_RELAXED);
+}
+
+uint64_t
+stubbroker_connects(void) {
+    return __atomic_load_n(&connects, __ATOMIC_RELAXED);
+}
+
+void
+stubbroker_stop(void) {
+    int i;
+
+    __atomic_store_n(&stopping, 1, __ATOMIC_RELAXED);
+    pthread_join(brokerThread, NULL);
+    for (i = 0; i < STUBBROKER_MAXCLIENTS; i++) {
+	if (clients[i].fd >= 0) closeClient(&clients[i]);
+    }
+    close(listenFD);
+}
@@ -0,0 +1,86 @@
+/*
+ * The MIT License
+ *
+ * Copyright 2017 Nick Ong <onichola@gmail.com>.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * File:   stubbroker.h
+ * Author: Nick Ong <onichola@gmail.com>
+ *
+ * A minimal MQTT 3.1.1 broker for the end to end benchmark.  It listens on
+ * the loopback interface, acknowledges CONNECT, SUBSCRIBE, QoS 1 PUBLISH and
+ * PINGREQ, and counts what it receives.  Messages are not forwarded.
+ */
+
+#ifndef STUBBROKER_H
+#define STUBBROKER_H
+
+#include <stdint.h>
+
+#ifndef STUBBROKER_SUCCESS
+#define STUBBROKER_SUCCESS 0  ///< success indicator
+#endif
+
+#ifndef STUBBROKER_FAILURE
+#define STUBBROKER_FAILURE -1  ///< failure indicator
+#endif
+
+#define STUBBROKER_MAXCLIENTS 8 ///< simultaneous connections
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    /**
+     * \brief Start the broker on a thread.
+     * @param port - receives the port it listens on, chosen by the system
+     * @return STUBBROKER_SUCCESS if listening
+     */
+    extern int stubbroker_start(int *port);
+
+    /**
+     * \brief Take the broker offline or back online.  Going offline closes
+     * every connection and refuses new ones until back online.
+     * @param online - 0 for offline, 1 for online
+     */
+    extern void stubbroker_online(int online);
+
+    /**
+     * \brief Number of PUBLISH packets received since start.
+     */
+    extern uint64_t stubbroker_received(void);
+
+    /**
+     * \brief Number of client connections accepted since start.
+     */
+    extern uint64_t stubbroker_connects(void);
+
+    /**
+     * \brief Stop the broker and close every connection.
+     */
+    extern void stubbroker_stop(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* STUBBROKER_H */
@@ -33,10 +33,29 @@
 #include <unistd.h>
 #include <time.h>
 #include <math.h>
+#include <pthread.h>
 
+#include "ads1x15.h"
+#include "adcstream.h"
+#include "board.h"
+#include "capture.h"
 #include "debug.h"
+#include "metrics.h"
 #include "tempsensor.h"
 #include "mqtt.h"
+#include "trace.h"
+
+static int native = 0; ///< 1 if the ADCs are read through ads1x15 rather than wiringPi
+
+typedef struct {
+    int active; // thread running
+    int stop; // set to end the thread
+    pthread_t thread;
+    tempsensor_port_t *port;
+} oversampler_t;
+
+static oversampler_t oversamplers[MAXPORTS];
+static pthread_mutex_t filteredLock = PTHREAD_MUTEX_INITIALIZER; ///< filtered and filteredAt of the ports
 
 /**
  * Return a new port
@@ -49,6 +68,10 @@
 tempsensor_port_t
 tempsensor_createPort(
 	const int pin,
+	const int addr,
+	const double gain,
+	const int datarate,
+	const int rdypin,
 	const double A,
 	const double B,
 	const double C,
@@ -57,11 +80,22 @@ tempsensor_createPort(
 	const char *topic,
 	const char* location,
 	int sampletime) {
-    char dbgBuf[256];
     tempsensor_port_t port;
-    snprintf(dbgBuf, sizeof (dbgBuf), "Creating door switch %s pin %d at %s", id, pin, location);
-    WriteDBGLog(dbgBuf);
+    DBGLOG(DBG_TEMPSENSOR, DBG_INFO, "Creating door switch %s pin %d at %s", id, pin, location);
+    memset(&port, 0, sizeof (port));
     port.pin = pin;
+    port.addr = addr;
+    if ((port.gain = ADS1X15_gainOf(gain)) < 0) {
+	DBGLOG(DBG_TEMPSENSOR, DBG_ERROR, "tempsensor: %s gain %.3f is not one of the ADC's, using %.3f", id, gain, ADC_GAIN);
+	port.gain = ADS1X15_gainOf(ADC_GAIN);
+    }
+    if ((port.rate = ADS1X15_rateOf(datarate)) < 0) {
+	DBGLOG(DBG_TEMPSENSOR, DBG_ERROR, "tempsensor: %s datarate %d is faster than the ADC, using 860", id, datarate);
+	port.rate = ADS1X15_rateOf(860);
+    }
+    port.datarate = port.rate;
+    port.rdypin = rdypin;
+    port.lsb = ADS1X15_gain[port.gain] / ADC_CODES;
     port.sampletime = sampletime;
     port.A = A;
     port.B = B;
@@ -70,6 +104,10 @@ tempsensor_createPort(
     strncpy(port.id, id, sizeof (port.id));
     strncpy(port.topic, topic, sizeof (port.topic));
     strncpy(port.location, location, sizeof (port.location));
+    port.readSeconds = metrics_histogram("tempsensor_read_seconds", id);
+    port.oversamples = metrics_counter("tempsensor_oversamples_total", id);
+    port.nonfinite = metrics_counter("tempsensor_nonfinite_samples_total", id);
+    tempsensor_buildTable(&port);
     return (port);
 }
 
@@ -77,18 +115,17 @@ int
 tempsensor_init() {
     int iErr = 0;
     int rc = TEMPSENSOR_SUCCESS;
-    WriteDBGLog("initializing ADC for tempsensor");
-    iErr = wiringPiSetup();
-    if (iErr == -1) {
-	WriteDBGLog("tempsensor : Error Failed to init WiringPi");
-	rc = TEMPSENSOR_FAILURE;
-    }
-    if (setuid(getuid()) < 0) {
-	WriteDBGLog("tempsensor : Error Dropping privileges failed\n");
+    DBGLOG(DBG_TEMPSENSOR, DBG_INFO, "initializing ADC for tempsensor");
+    iErr = board_init();
+    if (iErr != BOARD_SUCCESS) {
+	DBGLOG(DBG_TEMPSENSOR, DBG_ERROR, "tempsensor : Error Failed to init WiringPi");
 	rc = TEMPSENSOR_FAILURE;
     }
-    if (ads1115Setup(ADC_BASE, ADC_I2C_ADDR) == FALSE) {
-	WriteDBGLog("tempsensor : Error initializing ads1115 ADC\n");
+    // the bus is opened before main drops privileges
+    native = !capture_replaying() && ADS1X15_open() == ADS1X15_SUCCESS;
+    if (!native && !capture_replaying()) DBGLOG(DBG_TEMPSENSOR, DBG_WARN, "tempsensor: No i2c-dev, reading the ADC at 0x%02x through wiringPi", ADC_I2C_ADDR);
+    if (!native && !capture_replaying() && ads1115Setup(ADC_BASE, ADC_I2C_ADDR) == FALSE) {
+	DBGLOG(DBG_TEMPSENSOR, DBG_ERROR, "tempsensor : Error initializing ads1115 ADC\n");
 	rc = TEMPSENSOR_FAILURE;
     }
     return (rc);
@@ -96,9 +133,6 @@ tempsensor_init() {
 
 double
 NtcR2T(double r, double A, double B, double C) {
-    char dbgBuf[512];
-    snprintf(dbgBuf, sizeof (dbgBuf), "tempsensor: Calculating temp A %e, B %e, C %e, R %.4f", A, B, C, r);
-    WriteDBGLog(dbgBuf);
     double lr = log(r);
     double B1 = B * lr;
     double plr = pow(lr, 3.0);
@@ -109,34 +143,433 @@ NtcR2T(double r, double A, double B, double C) {
     return t;
 }
 
+/**
+ * Thermistor resistance for an ADC code, assumes 10kohm to ground for v.
+ */
+double
+tempsensor_code2R(const tempsensor_port_t* port, int code) {
+    return 33000.0 / (code * port->lsb) - 10000.0 - port->Rb;
+}
+
+void
+tempsensor_buildTable(tempsensor_port_t* port) {
+    double r;
+    int i;
+
+    DBGLOG(DBG_TEMPSENSOR, DBG_DEBUG, "tempsensor: Building table of %s, A %e, B %e, C %e, Rb %.4f",
+	    port->id, port->A, port->B, port->C, port->Rb);
+    for (i = 0; i < TEMPSENSOR_LUT_SIZE; i++) {
+	r = tempsensor_code2R(port, i << TEMPSENSOR_LUT_SHIFT);
+	// code 0 is an open input and the codes past 0 ohms a short, which
+	// would come out near absolute zero.  Their entries are NAN, and so
+	// is anything interpolated from them.
+	port->lut[i] = r > 0 && isfinite(r) ? (float) NtcR2T(r, port->A, port->B, port->C) : NAN;
+    }
+}
+
+/**
+ * Interpolate between the two entries either side of a code.  Branch free
+ * so that the batch loop vectorizes.
+ */
+static inline float
+lookup(const float* lut, int code) {
+    int c = code < 0 ? 0 : code > ADC_CODES - 1 ? ADC_CODES - 1 : code;
+    int i = c >> TEMPSENSOR_LUT_SHIFT;
+    float f = (c & ((1 << TEMPSENSOR_LUT_SHIFT) - 1)) * (1.0f / (1 << TEMPSENSOR_LUT_SHIFT));
+
+    return lut[i] + f * (lut[i + 1] - lut[i]);
+}
+
+double
+tempsensor_code2T(const tempsensor_port_t* port, int code) {
+    return lookup(port->lut, code);
+}
+
+void
+tempsensor_code2TBatch(const tempsensor_port_t* port, const int* restrict codes, float* restrict t, int n) {
+    const float* lut = port->lut;
+    int i;
+
+    for (i = 0; i < n; i++) t[i] = lookup(lut, codes[i]);
+}
+
+/**
+ * Set the ADC's data rate to the configured one, raised to what oversampling
+ * and streaming need.  Both have been checked to be within the ADC's rates.
+ */
+static void
+setRate(tempsensor_port_t* port) {
+    int needed;
+
+    port->rate = port->datarate;
+    // each burst holds the chip, so convert fast enough for the second's to take half of it
+    if (port->oversample > 0 &&
+	    (needed = ADS1X15_rateOf(2 * (port->oversample + port->oversample / 10 + 1))) > port->rate)
+	port->rate = needed;
+    // every read has to find a new conversion, allowing for the oscillator
+    if (port->stream > 0 && (needed = ADS1X15_rateOf(port->stream + port->stream / 10 + 1)) > port->rate)
+	port->rate = needed;
+}
+
+int
+tempsensor_setFilter(tempsensor_port_t* port, int oversample, const char *const stages[], int n) {
+    int rc = TEMPSENSOR_SUCCESS;
+    int most;
+    int i;
+
+    memset(&port->filter, 0, sizeof (port->filter));
+    port->filteredAt = 0;
+    port->oversample = oversample < 0 ? 0 : oversample > TEMPSENSOR_MAXBURST ? TEMPSENSOR_MAXBURST : oversample;
+    if (port->oversample > 0 && ADS1X15_rateOf(2 * (port->oversample + port->oversample / 10 + 1)) < 0) {
+	most = ADS1X15_rate[7] / 2 * 10 / 11 - 1;
+	DBGLOG(DBG_TEMPSENSOR, DBG_WARN, "tempsensor: %s oversamples %d times a second, not %d",
+		port->id, most, port->oversample);
+	port->oversample = most;
+    }
+    setRate(port);
+    for (i = 0; i < n; i++) {
+	if (filter_add(&port->filter, stages[i]) != FILTER_SUCCESS) {
+	    DBGLOG(DBG_TEMPSENSOR, DBG_ERROR, "tempsensor: %s filter stage %s is not valid", port->id, stages[i]);
+	    rc = TEMPSENSOR_FAILURE;
+	}
+    }
+    return rc;
+}
+
+int
+tempsensor_setStream(tempsensor_port_t* port, int rate, int block) {
+    int rc = TEMPSENSOR_SUCCESS;
+
+    port->stream = rate < 0 ? 0 : rate;
+    port->streamblock = block < 1 ? 1 : block > ADCSTREAM_MAXBLOCK ? ADCSTREAM_MAXBLOCK : block;
+    if (port->stream > 0 && ADS1X15_rateOf(port->stream + port->stream / 10 + 1) < 0) {
+	DBGLOG(DBG_TEMPSENSOR, DBG_ERROR, "tempsensor: %s cannot stream %d samples a second", port->id, port->stream);
+	port->stream = 0;
+	rc = TEMPSENSOR_FAILURE;
+    }
+    setRate(port);
+    return rc;
+}
+
+int
+tempsensor_startStreams(tempsensor_port_t ports[], int n, void* context) {
+    ADS1X15_channel_t ch;
+    char topic[MQTT_MAXTOPIC];
+    int started = 0;
+    int i;
+
+    for (i = 0; i < n; i++) {
+	if (ports[i].stream <= 0) continue;
+	if (!native) {
+	    DBGLOG(DBG_TEMPSENSOR, DBG_ERROR, "tempsensor: %s needs i2c-dev to stream", ports[i].id);
+	    continue;
+	}
+	ch.addr = ports[i].addr;
+	ch.channel = ports[i].pin;
+	ch.gain = ports[i].gain;
+	ch.rate = ports[i].rate;
+	ch.rdypin = ports[i].rdypin;
+	snprintf(topic, sizeof (topic), "%s/%s/%s/stream", ports[i].id, ports[i].location, ports[i].topic);
+	if (adcstream_start(ports[i].id, topic, &ch, ports[i].lsb, ports[i].stream, ports[i].streamblock,
+		context) == ADCSTREAM_SUCCESS) started++;
+    }
+    return started;
+}
+
+void
+tempsensor_stopStreams(void) {
+    adcstream_stopAll();
+}
+
+/**
+ * Read successive codes of one port.
+ * @return number of codes read
+ */
+static int
+readBurst(tempsensor_port_t* port, int codes[], int n) {
+    int16_t raw[TEMPSENSOR_MAXBURST];
+    ADS1X15_channel_t ch;
+    size_t len;
+    int i;
+
+    if (capture_replaying()) {
+	for (i = 0; i < n; i++) {
+	    if (capture_next(CAPTURE_ADC, port->id, &codes[i], sizeof (codes[i]), &len, 1) != CAPTURE_SUCCESS) break;
+	}
+	return i;
+    }
+    if (native) {
+	ch.addr = port->addr;
+	ch.channel = port->pin;
+	ch.gain = port->gain;
+	ch.rate = port->rate;
+	ch.rdypin = port->rdypin;
+	n = ADS1X15_burst(&ch, raw, n);
+	for (i = 0; i < n; i++) codes[i] = raw[i];
+    } else {
+	if (port->addr != ADC_I2C_ADDR) return 0;
+	digitalWrite(ADC_BASE, port->gain);
+	digitalWrite(ADC_BASE + 1, port->rate);
+	for (i = 0; i < n; i++) codes[i] = analogRead(ADC_BASE + port->pin);
+    }
+    for (i = 0; i < n; i++) capture_record(CAPTURE_ADC, port->id, &codes[i], sizeof (codes[i]));
+    return n;
+}
+
+/**
+ * Convert a burst of codes and push them through the port's filter.
+ */
+static void
+feedFilter(tempsensor_port_t* port, const int codes[], int got) {
+    float t[TEMPSENSOR_MAXBURST];
+    float filtered;
+    int j, finite;
+
+    metrics_add(port->oversamples, got);
+    if (got < port->oversample) {
+	DBGLOG(DBG_TEMPSENSOR, DBG_WARN, "tempsensor: %s took %d of %d samples", port->id, got, port->oversample);
+    }
+    tempsensor_code2TBatch(port, codes, t, got);
+    // a code outside the table has no temperature, and would stay in the filter's sums for good
+    for (j = 0, finite = 0; j < got; j++) {
+	if (isfinite(t[j])) t[finite++] = t[j];
+    }
+    if (finite < got) {
+	metrics_add(port->nonfinite, got - finite);
+    }
+    if (filter_run(&port->filter, t, finite, &filtered) > 0) {
+	pthread_mutex_lock(&filteredLock);
+	port->filtered = filtered;
+	port->filteredAt = mqttTimeUs();
+	pthread_mutex_unlock(&filteredLock);
+    }
+}
+
+static void
+sleepUntil(double t) {
+    struct timespec ts;
+    double d = t - metrics_now();
+
+    if (d <= 0) return;
+    ts.tv_sec = (time_t) d;
+    ts.tv_nsec = (long) ((d - ts.tv_sec) * 1e9);
+    nanosleep(&ts, NULL);
+}
+
+/**
+ * Oversample a port every second, in TEMPSENSOR_CHUNKS bursts spread over
+ * the second so that a sweep of the same chip waits for one burst at most.
+ */
+static void *
+oversampler(void *arg) {
+    oversampler_t *o = (oversampler_t *) arg;
+    tempsensor_port_t* port = o->port;
+    int codes[TEMPSENSOR_MAXBURST];
+    double next = metrics_now();
+    double busy, start;
+    int k, want, got;
+
+    while (!__atomic_load_n(&o->stop, __ATOMIC_ACQUIRE)) {
+	busy = 0;
+	got = 0;
+	TRACE2(tempsensor_read_start, port->id, port->pin);
+	for (k = 0; k < TEMPSENSOR_CHUNKS && !__atomic_load_n(&o->stop, __ATOMIC_ACQUIRE); k++) {
+	    sleepUntil(next + (double) k / TEMPSENSOR_CHUNKS);
+	    want = port->oversample * (k + 1) / TEMPSENSOR_CHUNKS - port->oversample * k / TEMPSENSOR_CHUNKS;
+	    if (want == 0) continue;
+	    start = metrics_now();
+	    got += readBurst(port, codes + got, want);
+	    busy += metrics_now() - start;
+	}
+	TRACE2(tempsensor_read_end, port->id, got);
+	if (k < TEMPSENSOR_CHUNKS) break;
+	metrics_observe(port->readSeconds, busy);
+	feedFilter(port, codes, got);
+	next += 1;
+	// a second that overran is not caught up on
+	if (next < metrics_now()) next = metrics_now();
+	sleepUntil(next);
+    }
+    return NULL;
+}
+
+int
+tempsensor_startOversampling(tempsensor_port_t ports[], int n) {
+    oversampler_t *o;
+    int started = 0;
+    int i, k;
+
+    if (!native || capture_replaying()) return 0;
+    for (i = 0; i < n; i++) {
+	if (ports[i].oversample <= 0 || ports[i].stream > 0) continue;
+	for (k = 0, o = NULL; k < MAXPORTS && o == NULL; k++) {
+	    if (!oversamplers[k].active) o = &oversamplers[k];
+	}
+	if (o == NULL) break;
+	memset(o, 0, sizeof (oversampler_t));
+	o->port = &ports[i];
+	if (pthread_create(&o->thread, NULL, oversampler, o) != 0) {
+	    DBGLOG(DBG_TEMPSENSOR, DBG_ERROR, "tempsensor: Cannot start the oversampling thread of %s", ports[i].id);
+	    continue;
+	}
+	o->active = 1;
+	started++;
+	DBGLOG(DBG_TEMPSENSOR, DBG_INFO, "tempsensor: Oversampling %s %d times a second", ports[i].id, ports[i].oversample);
+    }
+    return started;
+}
+
+void
+tempsensor_stopOversampling(void) {
+    int i;
+
+    for (i = 0; i < MAXPORTS; i++) {
+	if (!oversamplers[i].active) continue;
+	__atomic_store_n(&oversamplers[i].stop, 1, __ATOMIC_RELEASE);
+	pthread_join(oversamplers[i].thread, NULL);
+	oversamplers[i].active = 0;
+    }
+}
+
+void
+tempsensor_oversample(tempsensor_port_t *const ports[], int n) {
+    int codes[TEMPSENSOR_MAXBURST];
+    tempsensor_port_t* port;
+    double start;
+    int i, got;
+
+    // the native driver oversamples on threads of its own
+    if (native && !capture_replaying()) return;
+    for (i = 0; i < n; i++) {
+	port = ports[i];
+	if (port->oversample <= 0 || port->stream > 0) continue;
+	start = metrics_now();
+	TRACE2(tempsensor_read_start, port->id, port->pin);
+	got = readBurst(port, codes, port->oversample);
+	TRACE2(tempsensor_read_end, port->id, got);
+	metrics_observe(port->readSeconds, metrics_now() - start);
+	feedFilter(port, codes, got);
+    }
+}
+
+int
+tempsensor_scan(tempsensor_port_t *const ports[], int n) {
+    ADS1X15_channel_t ch[MAXPORTS];
+    tempsensor_port_t *due[MAXPORTS];
+    int16_t codes[MAXPORTS];
+    int rcs[MAXPORTS];
+    double start = metrics_now();
+    int64_t sampled;
+    int i, m, scanned = 0;
+
+    // replayed and wiringPi reads are made one port at a time
+    if (!native || capture_replaying()) return 0;
+    if (n > MAXPORTS) n = MAXPORTS;
+    for (i = 0, m = 0; i < n; i++) {
+	if (ports[i]->oversample > 0 || ports[i]->stream > 0) continue;
+	due[m++] = ports[i];
+    }
+    ports = due;
+    n = m;
+    for (i = 0; i < n; i++) {
+	ch[i].addr = ports[i]->addr;
+	ch[i].channel = ports[i]->pin;
+	ch[i].gain = ports[i]->gain;
+	ch[i].rate = ports[i]->rate;
+	ch[i].rdypin = ports[i]->rdypin;
+	TRACE2(tempsensor_read_start, ports[i]->id, ports[i]->pin);
+    }
+    ADS1X15_scan(ch, n, codes, rcs);
+    sampled = mqttTimeUs();
+    for (i = 0; i < n; i++) {
+	TRACE2(tempsensor_read_end, ports[i]->id, codes[i]);
+	if (rcs[i] != ADS1X15_SUCCESS) continue;
+	ports[i]->code = codes[i];
+	ports[i]->sampled = sampled;
+	ports[i]->scanned = 1;
+	capture_record(CAPTURE_ADC, ports[i]->id, &ports[i]->code, sizeof (ports[i]->code));
+	metrics_observe(ports[i]->readSeconds, metrics_now() - start);
+	scanned++;
+    }
+    return scanned;
+}
+
+/**
+ * Read the code of one port, from the capture being replayed, through
+ * wiringPi, or as a sweep of its own.
+ */
+static int
+readCode(tempsensor_port_t* port) {
+    int p = ADC_BASE + port->pin;
+    double start = metrics_now();
+
+    if (native && !capture_replaying()) {
+	return tempsensor_scan(&port, 1) == 1 ? TEMPSENSOR_SUCCESS : TEMPSENSOR_FAILURE;
+    }
+    DBGLOG(DBG_TEMPSENSOR, DBG_DEBUG, "tempsensor: Reading ADC port %d", p);
+    TRACE2(tempsensor_read_start, port->id, p);
+    if (capture_replaying()) {
+	size_t len;
+	if (capture_next(CAPTURE_ADC, port->id, &port->code, sizeof (port->code), &len, 1) != CAPTURE_SUCCESS)
+	    return TEMPSENSOR_FAILURE;
+    } else {
+	if (port->addr != ADC_I2C_ADDR) {
+	    DBGLOG(DBG_TEMPSENSOR, DBG_ERROR, "tempsensor: %s is on 0x%02x, wiringPi only reads 0x%02x", port->id, port->addr, ADC_I2C_ADDR);
+	    return TEMPSENSOR_FAILURE;
+	}
+	// wiringPi takes the gain and data rate settings on its first two pins
+	digitalWrite(ADC_BASE, port->gain);
+	digitalWrite(ADC_BASE + 1, port->rate);
+	port->code = analogRead(p);
+	capture_record(CAPTURE_ADC, port->id, &port->code, sizeof (port->code));
+    }
+    port->sampled = mqttTimeUs();
+    TRACE2(tempsensor_read_end, port->id, port->code);
+    metrics_observe(port->readSeconds, metrics_now() - start);
+    return TEMPSENSOR_SUCCESS;
+}
+
 int
 ProcessTempsensorData(tempsensor_port_t* port, mqtt_data_t* message) {
-    char dbgBuf[512];
 
     int rc = TEMPSENSOR_FAILURE;
-    int p = ADC_BASE + port->pin;
-    snprintf(dbgBuf, sizeof (dbgBuf), "tempsensor: Reading ADC port %d", p);
-    WriteDBGLog(dbgBuf);
-    int data = analogRead(p);
-    snprintf(dbgBuf, sizeof (dbgBuf), "tempsensor: Reading ADC value 0x%04x or %d", data, data);
-    WriteDBGLog(dbgBuf);
-
-    // Get resistance value assumes 10kohm to ground for v
-    double v = data * ADC_LSB;
-    double R = 33000.0 / v - 10000.0 - port->Rb;
-    
-    double t = NtcR2T(R, port->A, port->B, port->C);
-    double tF = t * 9.0 / 5.0 + 32.0;
-    snprintf(dbgBuf, sizeof (dbgBuf),
-	    "tempsensor: data = %d, ADC voltage = %.4f, Resistance = %.4f, temp = %.2fC or %.2fF", data, v, R, t, tF);
-    WriteDBGLog(dbgBuf);
+    int64_t sampled;
+    double t;
+    if (port->stream > 0) {
+	// streamed ports publish frames only
+	return rc;
+    } else if (port->oversample > 0) {
+	// the filter has been fed once a second, its output is published
+	pthread_mutex_lock(&filteredLock);
+	t = port->filtered;
+	sampled = port->filteredAt;
+	pthread_mutex_unlock(&filteredLock);
+	if (sampled == 0) return rc;
+	DBGLOG(DBG_TEMPSENSOR, DBG_DEBUG, "tempsensor: filtered temp = %.2fC or %.2fF", t, t * 9.0 / 5.0 + 32.0);
+    } else {
+	if (!port->scanned && readCode(port) != TEMPSENSOR_SUCCESS) return rc;
+	port->scanned = 0;
+	int data = port->code;
+	sampled = port->sampled;
+	DBGLOG(DBG_TEMPSENSOR, DBG_DEBUG, "tempsensor: Reading ADC value 0x%04x or %d", data, data);
+
+	t = tempsensor_code2T(port, data);
+	DBGLOG(DBG_TEMPSENSOR, DBG_DEBUG, "tempsensor: data = %d, ADC voltage = %.4f, Resistance = %.4f, temp = %.2fC or %.2fF",
+		data, data * port->lsb, tempsensor_code2R(port, data), t, t * 9.0 / 5.0 + 32.0);
+	if (isnan(t)) {
+	    DBGLOG(DBG_TEMPSENSOR, DBG_WARN, "tempsensor: %s code %d is outside the table, the input is open or shorted",
+		    port->id, data);
+	    return rc;
+	}
+    }
     snprintf(message->payload, sizeof (message->payload),
-	    "{\"timestamp\":%ld,\"value\":\"%.2f\"}",
-	    time(NULL), t);
+	    "{\"timestamp\":%ld,\"timestamp_us\":%lld,\"value\":\"%.2f\"}",
+	    (long) (sampled / 1000000), (long long) sampled, t);
+    message->sampled = sampled;
     snprintf(message->topic, sizeof (message->topic), "%s/%s/%s",
 	    port->id, port->location, port->topic);
+    strncpy(message->sensor, port->id, sizeof (message->sensor));
+    message->value = t;
     rc = TEMPSENSOR_SUCCESS;
     return rc;
 }
-
-
@@ -52,14 +52,49 @@
 #define ADC_LSB 125e-06  ///< LSB for ADC calculation
 #endif
 
+#ifndef ADC_GAIN
+#define ADC_GAIN 4.096 ///< default full scale range of the ADC in volts
+#endif
+
+#ifndef ADC_DATARATE
+#define ADC_DATARATE 128 ///< default samples a second of the ADC
+#endif
+
+#ifndef ADC_CODES
+#define ADC_CODES 32768 ///< positive codes of the ADC
+#endif
+
+#ifndef TEMPSENSOR_LUT_SHIFT
+#define TEMPSENSOR_LUT_SHIFT 4 ///< log2 of the ADC codes between lookup table entries
+#endif
+
+#define TEMPSENSOR_LUT_SIZE ((ADC_CODES >> TEMPSENSOR_LUT_SHIFT) + 1) ///< entries of the lookup table
+
+#ifndef TEMPSENSOR_MAXBURST
+#define TEMPSENSOR_MAXBURST 256 ///< most samples taken in one second when oversampling
+#endif
+
+#ifndef TEMPSENSOR_CHUNKS
+#define TEMPSENSOR_CHUNKS 10 ///< bursts a second's oversamples are taken in, spread over the second
+#endif
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+    #include <stdint.h>
+    #include "filter.h"
+    #include "metrics.h"
     #include "mqtt.h"
 
     typedef struct {
         int pin; ///< pin number of a2d this port is attached [0-4]]
+	int addr; ///< i2c address of the ADC
+	int gain; ///< gain setting of the ADC, index of ADS1X15_gain
+	int rate; ///< data rate setting of the ADC, index of ADS1X15_rate
+	int datarate; ///< configured data rate, the least rate is raised from
+	int rdypin; ///< wiringPi pin wired to the ADC's ALERT/RDY, -1 if none
+	double lsb; ///< volts of one ADC code at this gain
 	double A; ///< Parameter for Steinhart Hart equation
 	double B; ///< Parameter for Steinhart Hart equation
 	double C; ///< Parameter for Steinhart Hart equation
@@ -68,12 +103,29 @@ extern "C" {
         char location[64]; ///< location of this tempsensor
         char topic[64]; ///< topic suffix used for publishing
         int sampletime; ///< sample time of this switch in seconds.
+	float lut[TEMPSENSOR_LUT_SIZE]; ///< temperature in Celsius every 1 << TEMPSENSOR_LUT_SHIFT ADC codes, NAN where there is none
+	int code; ///< ADC code of the last sweep
+	int64_t sampled; ///< microseconds since the epoch when code was read
+	int scanned; ///< 1 if code is waiting to be processed
+	int oversample; ///< samples taken each second and filtered, 0 for a single read at sampletime
+	filter_t filter; ///< filter pipeline the oversamples go through
+	float filtered; ///< last temperature out of the filter, under the lock of tempsensor.c when oversampled on a thread
+	int64_t filteredAt; ///< microseconds since the epoch of the last sample into filtered, 0 if none yet
+	int stream; ///< samples a second streamed as binary frames, 0 if not streamed
+	int streamblock; ///< samples in a streamed frame
+	metric_t *readSeconds; ///< metrics labelled with id, resolved when the port is created
+	metric_t *oversamples;
+	metric_t *nonfinite;
     } tempsensor_port_t;
 
 
     /**
      * \brief Create a new door switch port
      * @param pin - a2d pin number [0-4]
+     * @param addr - i2c address of the ADC
+     * @param gain - full scale range in volts, 6.144, 4.096, 2.048, 1.024, 0.512 or 0.256
+     * @param datarate - samples a second, rounded up to one the ADC supports
+     * @param rdypin - wiringPi pin wired to ALERT/RDY, -1 if none
      * @param A; ///< Parameter for Steinhart Hart equation
      * @param B; ///< Parameter for Steinhart Hart equation
      * @param C; ///< Parameter for Steinhart Hart equation
@@ -82,9 +134,10 @@ extern "C" {
      * @param topic - suffix topic which this port will publish to mqtt
      * @param location - location for this port
      * @param sampletime - sample time in seconds
-     * @return a configured port
+     * @return a configured port, its lookup table built
      */
-    extern tempsensor_port_t tempsensor_createPort(const int pin,  
+    extern tempsensor_port_t tempsensor_createPort(const int pin,
+	    const int addr, const double gain, const int datarate, const int rdypin,
 	    const double A, const double B, const double C, const double Rb, const char* id,
             const char* topic, const char* location, int sampletime);
 
@@ -96,7 +149,81 @@ extern "C" {
     extern int tempsensor_init();
 
     /**
-     * \brief Process door switch port data.
+     * \brief Set a port to oversample through a filter pipeline.  The ADC's
+     * data rate is raised if needed to take the samples in half a second.
+     * @param port - port to set
+     * @param oversample - samples a second, at most TEMPSENSOR_MAXBURST, 0 for none
+     * @param stages - stage specs as filter_add takes them
+     * @param n - number of stages
+     * @return TEMPSENSOR_SUCCESS, TEMPSENSOR_FAILURE if a stage was rejected
+     */
+    extern int tempsensor_setFilter(tempsensor_port_t* port, int oversample, const char *const stages[], int n);
+
+    /**
+     * \brief Set a port to stream blocks of samples instead of publishing
+     * readings.  The ADC's data rate is raised if needed to convert faster
+     * than the port is sampled, and lowered again when a port stops streaming.
+     * @param port - port to set
+     * @param rate - samples a second, 0 not to stream
+     * @param block - samples in a frame, at most ADCSTREAM_MAXBLOCK
+     * @return TEMPSENSOR_SUCCESS, TEMPSENSOR_FAILURE if the ADC cannot
+     * convert fast enough
+     */
+    extern int tempsensor_setStream(tempsensor_port_t* port, int rate, int block);
+
+    /**
+     * \brief Start the streams of the ports set to stream.  They need the
+     * native driver and a chip of their own.
+     * @param ports - ports, those not streaming are skipped
+     * @param n - number of ports
+     * @param context - MQTT context the frames are published on
+     * @return number of streams started
+     */
+    extern int tempsensor_startStreams(tempsensor_port_t ports[], int n, void* context);
+
+    /**
+     * \brief Stop every stream.
+     */
+    extern void tempsensor_stopStreams(void);
+
+    /**
+     * \brief Start a thread for each oversampling port, which feeds the
+     * port's filter every second.  The threads need the native driver and are
+     * not started while a capture is replayed; tempsensor_oversample feeds
+     * the filters then.  The ports must stay put until the threads are
+     * stopped.
+     * @param ports - ports, those not oversampling are skipped
+     * @param n - number of ports
+     * @return number of threads started
+     */
+    extern int tempsensor_startOversampling(tempsensor_port_t ports[], int n);
+
+    /**
+     * \brief Stop every oversampling thread.
+     */
+    extern void tempsensor_stopOversampling(void);
+
+    /**
+     * \brief Take a second's worth of samples of every oversampling port and
+     * push them through its filter, where no thread of
+     * tempsensor_startOversampling does.  Called once a second.
+     * @param ports - ports, those not oversampling are skipped
+     * @param n - number of ports
+     */
+    extern void tempsensor_oversample(tempsensor_port_t *const ports[], int n);
+
+    /**
+     * \brief Read every given port in one sweep of the ADCs, for
+     * ProcessTempsensorData to publish without a read of its own.
+     * @param ports - ports due
+     * @param n - number of ports
+     * @return number of ports read
+     */
+    extern int tempsensor_scan(tempsensor_port_t *const ports[], int n);
+
+    /**
+     * \brief Process door switch port data.  An oversampling port publishes
+     * the last filtered value instead of reading.
      * 
      * Read state of the door switch.  If it changed, notify calling function and
      * place data into the message.  This will also change the state of the port
@@ -108,6 +235,51 @@ extern "C" {
      */
     extern int ProcessTempsensorData(tempsensor_port_t* port, mqtt_data_t* message);
 
+    /**
+     * \brief Convert a thermistor resistance to a temperature.
+     * @param r - resistance in ohms
+     * @param A - Steinhart Hart coefficient
+     * @param B - Steinhart Hart coefficient
+     * @param C - Steinhart Hart coefficient
+     * @return temperature in Celsius
+     */
+    extern double NtcR2T(double r, double A, double B, double C);
+
+    /**
+     * \brief Fill the lookup table of a port from its coefficients and bias
+     * resistor.  Between entries the temperature is interpolated linearly,
+     * within 0.05C from -40C to 125C.  Codes whose resistance is not
+     * positive and finite, an open or shorted input, and the codes
+     * interpolated from them convert to NAN.
+     * @param port - port to build the table of
+     */
+    extern void tempsensor_buildTable(tempsensor_port_t* port);
+
+    /**
+     * \brief Convert an ADC code to a temperature through the lookup table.
+     * @param port - port the code was read from
+     * @param code - ADC code
+     * @return temperature in Celsius, NAN for an open or shorted input
+     */
+    extern double tempsensor_code2T(const tempsensor_port_t* port, int code);
+
+    /**
+     * \brief Thermistor resistance for an ADC code.
+     * @param port - port the code was read from
+     * @param code - ADC code
+     * @return resistance in ohms
+     */
+    extern double tempsensor_code2R(const tempsensor_port_t* port, int code);
+
+    /**
+     * \brief Convert a buffer of ADC codes, as tempsensor_code2T does for one.
+     * @param port - port the codes were read from
+     * @param codes - ADC codes
+     * @param t - temperatures in Celsius, n of them
+     * @param n - number of codes
+     */
+    extern void tempsensor_code2TBatch(const tempsensor_port_t* port, const int* codes, float* t, int n);
+
 #ifdef __cplusplus
 }
 #endif
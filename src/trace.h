@@ -0,0 +1,81 @@
+/*
+ * The MIT License
+ *
+ * Copyright 2017 Nick Ong <onichola@gmail.com>.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * File:   trace.h
+ * Author: Nick Ong <onichola@gmail.com>
+ *
+ * Static tracepoints (USDT) for perf and bpftrace, in the pi2mqtt provider.
+ * They are compiled in with ./configure --enable-usdt, which needs sys/sdt.h
+ * (systemtap-sdt-dev), and are a single nop each until a tracer attaches.
+ * Otherwise the macros expand to nothing and their arguments are not
+ * evaluated.
+ *
+ *   $ sudo bpftrace -e 'usdt:/usr/local/bin/pi2mqtt:pi2mqtt:ds18b20_read_end
+ *       { printf("%s rc %d\n", str(arg0), arg1); }'
+ *
+ * Probes and their arguments:
+ *   loop_tick(cntr)                        start of each pass of the main loop
+ *   ds18b20_read_start(id)                 DS18B20PI_process_data
+ *   ds18b20_read_end(id, rc)
+ *   ds18b20_bulk_start(masters)            DS18B20PI_bulk_convert
+ *   ds18b20_bulk_end(still converting)
+ *   dht22_read_start(id, pin)              read_dht22_dat
+ *   dht22_read_end(id, bits)
+ *   tempsensor_read_start(id, adc pin)     analogRead in ProcessTempsensorData
+ *   tempsensor_read_end(id, raw value)
+ *   raven_parse_start(id, length)          RAVEn_parseXML
+ *   raven_parse_end(id, rc)
+ *   mqtt_publish(topic, sensor, connected) mqttPublish
+ *   mqtt_send(topic, token)                send started
+ *   mqtt_puback(token)                     onSend
+ *   mqtt_send_failed(token)
+ *   mqtt_save(topic)                       mqttSave while disconnected
+ *   mqtt_replay_start()                    replay of the dump file on reconnect
+ *   mqtt_replay(topic)
+ *   mqtt_replay_end()
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef HAVE_USDT
+#include <sys/sdt.h>
+
+#define TRACE0(name) DTRACE_PROBE(pi2mqtt, name)
+#define TRACE1(name, a) DTRACE_PROBE1(pi2mqtt, name, a)
+#define TRACE2(name, a, b) DTRACE_PROBE2(pi2mqtt, name, a, b)
+#define TRACE3(name, a, b, c) DTRACE_PROBE3(pi2mqtt, name, a, b, c)
+#else
+#define TRACE0(name) do { } while (0)
+#define TRACE1(name, a) do { } while (0)
+#define TRACE2(name, a, b) do { } while (0)
+#define TRACE3(name, a, b, c) do { } while (0)
+#endif
+
+#endif /* TRACE_H */
@@ -0,0 +1,264 @@
+/*
+ * The MIT License
+ *
+ * Copyright 2017 Nick Ong <onichola@gmail.com>.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <math.h>
+
+#include "debug.h"
+#include "mqtt.h"
+#include "virtualsensor.h"
+
+typedef enum {
+    VS_DEWPOINT,
+    VS_ENERGY,
+    VS_DUTYCYCLE
+} virtualsensor_type_t;
+
+typedef struct {
+    char id[64]; ///< id of sensor
+    char location[64]; ///< location of this sensor
+    char topic[64]; ///< topic suffix used for publishing
+    char inputs[VIRTUALSENSOR_MAXINPUTS][64]; ///< sensor ids of inputs
+    int ninputs; ///< number of inputs
+    virtualsensor_type_t type; ///< derivation
+    int fahrenheitscale; ///< dewpoint input and output in Fahrenheit
+    double window; ///< dutycycle averaging window in seconds
+    int sampletime; ///< periodic publish interval, 0 for input driven only
+    time_t lastsample; ///< time of last periodic publish
+    double in[VIRTUALSENSOR_MAXINPUTS]; ///< latest input values, NAN until seen
+    double last; ///< time of previous input in seconds, 0 before first
+    double value; ///< current output, NAN until defined
+} virtualsensor_t;
+
+static virtualsensor_t vsensors[VIRTUALSENSOR_MAX];
+static int nvsensors = 0;
+
+// sensors before the last virtualsensor_clear, so a reload keeps state
+static virtualsensor_t prevvsensors[VIRTUALSENSOR_MAX];
+static int nprevvsensors = 0;
+
+static int
+type_of(const char *type, virtualsensor_type_t *t, int *ninputs) {
+    if (strcmp(type, "dewpoint") == 0) {
+        *t = VS_DEWPOINT;
+        *ninputs = 2;
+    } else if (strcmp(type, "energy") == 0) {
+        *t = VS_ENERGY;
+        *ninputs = 1;
+    } else if (strcmp(type, "dutycycle") == 0) {
+        *t = VS_DUTYCYCLE;
+        *ninputs = 1;
+    } else {
+        return (VIRTUALSENSOR_FAILURE);
+    }
+    return (VIRTUALSENSOR_SUCCESS);
+}
+
+static double
+now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/**
+ * Magnus formula dew point.
+ */
+static double
+dewpoint(double t, double rh, int fahrenheit) {
+    const double b = 17.62;
+    const double c = 243.12;
+    double g;
+
+    if (fahrenheit) t = (t - 32.0) * 5.0 / 9.0;
+    if (rh <= 0) return NAN;
+    g = log(rh / 100.0) + b * t / (c + t);
+    t = c * g / (b - g);
+    return fahrenheit ? t * 9.0 / 5.0 + 32.0 : t;
+}
+
+/**
+ * Bring the output up to time now using the inputs held since the previous
+ * update.
+ */
+static void
+advance(virtualsensor_t *vs, double now) {
+    double dt = vs->last > 0 ? now - vs->last : 0;
+
+    switch (vs->type) {
+        case VS_DEWPOINT:
+            vs->value = dewpoint(vs->in[0], vs->in[1], vs->fahrenheitscale);
+            break;
+        case VS_ENERGY:
+            // kW held over dt seconds
+            if (!isnan(vs->in[0])) {
+                if (isnan(vs->value)) vs->value = 0;
+                vs->value += vs->in[0] * dt / 3600.0;
+            }
+            break;
+        case VS_DUTYCYCLE:
+            // time weighted exponential average of the on state
+            if (!isnan(vs->in[0])) {
+                double on = vs->in[0] != 0 ? 100.0 : 0.0;
+                if (isnan(vs->value)) {
+                    vs->value = on;
+                } else {
+                    vs->value += (1.0 - exp(-dt / vs->window)) * (on - vs->value);
+                }
+            }
+            break;
+    }
+    vs->last = now;
+}
+
+/**
+ * Write the value of a virtual sensor.
+ * @param sampled wall clock microseconds of the input reading it derives from
+ */
+static void
+publish(virtualsensor_t *vs, int64_t sampled, mqtt_data_t *message) {
+    snprintf(message->payload, sizeof (message->payload),
+            "{\"timestamp\":%ld,\"timestamp_us\":%lld,\"value\":%.3f}",
+            (long) (sampled / 1000000), (long long) sampled, vs->value);
+    message->sampled = sampled;
+    snprintf(message->topic, sizeof (message->topic), "%s/%s/%s",
+            vs->id, vs->location, vs->topic);
+    strncpy(message->sensor, vs->id, sizeof (message->sensor));
+    message->value = vs->value;
+}
+
+int
+virtualsensor_add(const char *id, const char *type, const char *inputs[], int ninputs,
+        const char *topic, const char *location, int isFahrenheit, int window, int sampletime) {
+    virtualsensor_t *vs;
+    int need;
+    int i;
+
+    if (nvsensors >= VIRTUALSENSOR_MAX) {
+        DBGLOG(DBG_VIRTUAL, DBG_ERROR, "virtualsensor: Error too many virtual sensors");
+        return (VIRTUALSENSOR_FAILURE);
+    }
+    vs = &vsensors[nvsensors];
+    memset(vs, 0, sizeof (*vs));
+    if (type_of(type, &vs->type, &need) != VIRTUALSENSOR_SUCCESS) {
+        DBGLOG(DBG_VIRTUAL, DBG_ERROR, "virtualsensor: Error unknown type %s for %s", type, id);
+        return (VIRTUALSENSOR_FAILURE);
+    }
+    if (ninputs != need) {
+        DBGLOG(DBG_VIRTUAL, DBG_ERROR, "virtualsensor: Error %s needs %d inputs, got %d", id, need, ninputs);
+        return (VIRTUALSENSOR_FAILURE);
+    }
+    strncpy(vs->id, id, sizeof (vs->id) - 1);
+    strncpy(vs->topic, topic, sizeof (vs->topic) - 1);
+    strncpy(vs->location, location, sizeof (vs->location) - 1);
+    for (i = 0; i < ninputs; i++) {
+        strncpy(vs->inputs[i], inputs[i], sizeof (vs->inputs[i]) - 1);
+        vs->in[i] = NAN;
+    }
+    vs->ninputs = ninputs;
+    vs->fahrenheitscale = isFahrenheit;
+    vs->window = window > 0 ? window : 3600;
+    vs->sampletime = sampletime;
+    vs->value = NAN;
+    for (i = 0; i < nprevvsensors; i++) {
+        virtualsensor_t *prev = &prevvsensors[i];
+        if (strcmp(prev->id, vs->id) == 0 && prev->type == vs->type &&
+                memcmp(prev->inputs, vs->inputs, sizeof (vs->inputs)) == 0) {
+            memcpy(vs->in, prev->in, sizeof (vs->in));
+            vs->last = prev->last;
+            vs->value = prev->value;
+            vs->lastsample = prev->lastsample;
+            break;
+        }
+    }
+    DBGLOG(DBG_VIRTUAL, DBG_INFO, "virtualsensor: Creating %s %s from %s", type, id, inputs[0]);
+    nvsensors++;
+    return (VIRTUALSENSOR_SUCCESS);
+}
+
+int
+virtualsensor_check(const char *type, int ninputs) {
+    virtualsensor_type_t t;
+    int need;
+
+    if (type_of(type, &t, &need) != VIRTUALSENSOR_SUCCESS || need != ninputs)
+        return (VIRTUALSENSOR_FAILURE);
+    return (VIRTUALSENSOR_SUCCESS);
+}
+
+void
+virtualsensor_clear() {
+    memcpy(prevvsensors, vsensors, nvsensors * sizeof (vsensors[0]));
+    nprevvsensors = nvsensors;
+    nvsensors = 0;
+}
+
+void
+virtualsensor_revert() {
+    memcpy(vsensors, prevvsensors, nprevvsensors * sizeof (vsensors[0]));
+    nvsensors = nprevvsensors;
+}
+
+int
+virtualsensor_update(const mqtt_data_t *reading, mqtt_data_t *out, int maxout) {
+    double now;
+    int n = 0;
+    int i, j;
+
+    if (reading->sensor[0] == 0) return 0;
+    now = now_seconds();
+    for (i = 0; i < nvsensors; i++) {
+        virtualsensor_t *vs = &vsensors[i];
+        for (j = 0; j < vs->ninputs; j++) {
+            if (strcmp(vs->inputs[j], reading->sensor) == 0) break;
+        }
+        if (j == vs->ninputs) continue;
+        // integrate the held value up to now before taking the new one
+        advance(vs, now);
+        vs->in[j] = reading->value;
+        if (vs->type == VS_DEWPOINT) advance(vs, now);
+        if (isnan(vs->value)) continue;
+        if (n < maxout) publish(vs, reading->sampled, &out[n++]);
+        else DBGLOG(DBG_VIRTUAL, DBG_WARN, "virtualsensor: No room to publish %s", vs->id);
+    }
+    return n;
+}
+
+int
+virtualsensor_tick(time_t now, mqtt_data_t *out, int maxout) {
+    int n = 0;
+    int i;
+
+    for (i = 0; i < nvsensors && n < maxout; i++) {
+        virtualsensor_t *vs = &vsensors[i];
+        if (vs->sampletime <= 0 || now - vs->lastsample < vs->sampletime) continue;
+        vs->lastsample = now;
+        advance(vs, now_seconds());
+        if (!isnan(vs->value)) publish(vs, mqttTimeUs(), &out[n++]);
+    }
+    return n;
+}
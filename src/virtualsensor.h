@@ -0,0 +1,130 @@
+/*
+ * The MIT License
+ *
+ * Copyright 2017 Nick Ong <onichola@gmail.com>.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * File:   virtualsensor.h
+ * Author: Nick Ong <onichola@gmail.com>
+ *
+ * Virtual sensors publish channels derived from the readings of real sensors.
+ * Each one keeps a few values of state and is updated in O(1) per input.
+ */
+
+#ifndef VIRTUALSENSOR_H
+#define VIRTUALSENSOR_H
+
+#ifndef VIRTUALSENSOR_SUCCESS
+#define VIRTUALSENSOR_SUCCESS 0  ///< success indicator
+#endif
+
+#ifndef VIRTUALSENSOR_FAILURE
+#define VIRTUALSENSOR_FAILURE -1  ///< failure indicator
+#endif
+
+#ifndef VIRTUALSENSOR_MAXINPUTS
+#define VIRTUALSENSOR_MAXINPUTS 2 ///< maximum inputs of one virtual sensor
+#endif
+
+#ifndef VIRTUALSENSOR_MAX
+#define VIRTUALSENSOR_MAX 32 ///< maximum number of virtual sensors
+#endif
+
+#include <time.h>
+#include "mqtt.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    /**
+     * \brief Add a virtual sensor.
+     *
+     * Supported types:
+     *   dewpoint  - inputs temperature, humidity (%RH).  Output in the scale of
+     *               the input temperature.
+     *   energy    - input demand in kW.  Output cumulative kWh.
+     *   dutycycle - input switch state.  Output percent of time on, averaged
+     *               over window seconds.
+     *
+     * @param id - unique string identifier, also the sensor id of the output
+     * @param type - one of dewpoint, energy or dutycycle
+     * @param inputs - sensor ids of the inputs
+     * @param ninputs - number of inputs
+     * @param topic - suffix topic which this sensor will publish to mqtt
+     * @param location - location for this sensor
+     * @param isFahrenheit - dewpoint temperature input is in Fahrenheit
+     * @param window - dutycycle averaging window in seconds
+     * @param sampletime - if non zero, also publish every sampletime seconds
+     * @return VIRTUALSENSOR_SUCCESS if the sensor was added.
+     */
+    extern int virtualsensor_add(const char *id, const char *type,
+            const char *inputs[], int ninputs, const char *topic,
+            const char *location, int isFahrenheit, int window, int sampletime);
+
+    /**
+     * \brief Check a virtual sensor definition without adding it.
+     * @param type - one of dewpoint, energy or dutycycle
+     * @param ninputs - number of inputs
+     * @return VIRTUALSENSOR_SUCCESS if the definition is valid.
+     */
+    extern int virtualsensor_check(const char *type, int ninputs);
+
+    /**
+     * \brief Remove every virtual sensor.
+     *
+     * Sensors added afterwards with the same id, type and inputs carry over
+     * their state, so cumulative values survive a reload.
+     */
+    extern void virtualsensor_clear();
+
+    /**
+     * \brief Put back the virtual sensors removed by the last
+     * virtualsensor_clear, dropping any added since.
+     */
+    extern void virtualsensor_revert();
+
+    /**
+     * \brief Feed a new reading to the virtual sensors that use it.
+     * Every one is updated, and readings that do not fit in out are logged
+     * and dropped.
+     * @param reading - reading just produced
+     * @param out - array to receive derived readings
+     * @param maxout - size of out
+     * @return number of derived readings written
+     */
+    extern int virtualsensor_update(const mqtt_data_t *reading, mqtt_data_t *out, int maxout);
+
+    /**
+     * \brief Publish virtual sensors that are due on their sampletime.
+     * @param now - current time
+     * @param out - array to receive derived readings
+     * @param maxout - size of out
+     * @return number of derived readings written
+     */
+    extern int virtualsensor_tick(time_t now, mqtt_data_t *out, int maxout);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* VIRTUALSENSOR_H */